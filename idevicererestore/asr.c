@@ -26,10 +26,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
 #include <libimobiledevice/libimobiledevice.h>
 #include <openssl/sha.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #include "asr.h"
+#include "thread.h"
+#include "hash.h"
 #include "idevicerestore.h"
 #include "common.h"
 
@@ -42,6 +50,45 @@
 #define ASR_PAYLOAD_PACKET_SIZE 1450
 #define ASR_CHECKSUM_CHUNK_SIZE 131072
 
+/* a peer closing a socket transport is reported as a send error */
+#ifdef MSG_NOSIGNAL
+#define ASR_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define ASR_SEND_FLAGS 0
+#endif
+
+static int asr_receive_initiate(asr_client_t asr_loc) {
+	plist_t data = NULL;
+	asr_loc->checksum_chunks = 0;
+	if (asr_receive(asr_loc, &data) < 0) {
+		error("ERROR: Unable to receive data from ASR\n");
+		plist_free(data);
+		return -1;
+	}
+	plist_t node;
+	node = plist_dict_get_item(data, "Command");
+	if (node && (plist_get_node_type(node) == PLIST_STRING)) {
+		char* strval = NULL;
+		plist_get_string_val(node, &strval);
+		if (strval && (strcmp(strval, "Initiate") != 0)) {
+			error("ERROR: unexpected ASR plist received:\n");
+			debug_plist(data);
+			free(strval);
+			plist_free(data);
+			return -1;
+		}
+		free(strval);
+	}
+
+	node = plist_dict_get_item(data, "Checksum Chunks");
+	if (node && (plist_get_node_type(node) == PLIST_BOOLEAN)) {
+		plist_get_bool_val(node, &(asr_loc->checksum_chunks));
+	}
+	plist_free(data);
+
+	return 0;
+}
+
 int asr_open_with_timeout(idevice_t device, asr_client_t* asr) {
 	int i = 0;
 	int attempts = 10;
@@ -73,35 +120,41 @@ int asr_open_with_timeout(idevice_t device, asr_client_t* asr) {
 	asr_client_t asr_loc = (asr_client_t)malloc(sizeof(struct asr_client));
 	memset(asr_loc, '\0', sizeof(struct asr_client));
 	asr_loc->connection = connection;
+	asr_loc->fd = -1;
 
 	/* receive Initiate command message */
-	plist_t data = NULL;
-	asr_loc->checksum_chunks = 0;
-	if (asr_receive(asr_loc, &data) < 0) {
-		error("ERROR: Unable to receive data from ASR\n");
+	if (asr_receive_initiate(asr_loc) < 0) {
 		asr_free(asr_loc);
-		plist_free(data);
 		return -1;
 	}
-	plist_t node;
-	node = plist_dict_get_item(data, "Command");
-	if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-		char* strval = NULL;
-		plist_get_string_val(node, &strval);
-		if (strval && (strcmp(strval, "Initiate") != 0)) {
-			error("ERROR: unexpected ASR plist received:\n");
-			debug_plist(data);
-			plist_free(data);
-			asr_free(asr_loc);
-			return -1;
-		}
+
+	*asr = asr_loc;
+
+	return 0;
+}
+
+int asr_open_fd(int fd, asr_client_t* asr) {
+	*asr = NULL;
+
+	if (fd < 0) {
+		return -1;
 	}
 
-	node = plist_dict_get_item(data, "Checksum Chunks");
-	if (node && (plist_get_node_type(node) == PLIST_BOOLEAN)) {
-		plist_get_bool_val(node, &(asr_loc->checksum_chunks));
+	asr_client_t asr_loc = (asr_client_t)malloc(sizeof(struct asr_client));
+	if (asr_loc == NULL) {
+		return -1;
+	}
+	memset(asr_loc, '\0', sizeof(struct asr_client));
+	asr_loc->fd = fd;
+#ifdef SO_NOSIGPIPE
+	int nosigpipe = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+
+	if (asr_receive_initiate(asr_loc) < 0) {
+		asr_free(asr_loc);
+		return -1;
 	}
-	plist_free(data);
 
 	*asr = asr_loc;
 
@@ -132,7 +185,13 @@ int asr_receive(asr_client_t asr, plist_t* data) {
 	}
 	memset(buffer, '\0', ASR_BUFFER_SIZE);
 
-	device_error = idevice_connection_receive(asr->connection, buffer, ASR_BUFFER_SIZE, &size);
+	if (asr->connection == NULL) {
+		ssize_t count = recv(asr->fd, buffer, ASR_BUFFER_SIZE, 0);
+		device_error = (count > 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+		size = (count > 0) ? (uint32_t)count : 0;
+	} else {
+		device_error = idevice_connection_receive(asr->connection, buffer, ASR_BUFFER_SIZE, &size);
+	}
 	if (device_error != IDEVICE_E_SUCCESS) {
 		error("ERROR: Unable to receive data from ASR\n");
 		free(buffer);
@@ -169,7 +228,18 @@ int asr_send_buffer(asr_client_t asr, const char* data, uint32_t size) {
 	uint32_t bytes = 0;
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 
-	device_error = idevice_connection_send(asr->connection, data, size, &bytes);
+	if (asr->connection == NULL) {
+		while (bytes < size) {
+			ssize_t count = send(asr->fd, data + bytes, size - bytes, ASR_SEND_FLAGS);
+			if (count <= 0) {
+				device_error = IDEVICE_E_UNKNOWN_ERROR;
+				break;
+			}
+			bytes += (uint32_t)count;
+		}
+	} else {
+		device_error = idevice_connection_send(asr->connection, data, size, &bytes);
+	}
 	if (device_error != IDEVICE_E_SUCCESS || bytes != size) {
 		error("ERROR: Unable to send data to ASR. Sent %u of %u bytes.\n", bytes, size);
 		return -1;
@@ -183,14 +253,17 @@ void asr_free(asr_client_t asr) {
 		if (asr->connection != NULL) {
 			idevice_disconnect(asr->connection);
 			asr->connection = NULL;
+		} else if (asr->fd >= 0) {
+			close(asr->fd);
+			asr->fd = -1;
 		}
+		free(asr->oob_buffer);
 		free(asr);
 		asr = NULL;
 	}
 }
 
-int asr_perform_validation(asr_client_t asr, const char* filesystem) {
-	FILE* file = NULL;
+int asr_perform_validation(asr_client_t asr, ipsw_file_handle_t file) {
 	uint64_t length = 0;
 	char* command = NULL;
 	plist_t node = NULL;
@@ -199,14 +272,11 @@ int asr_perform_validation(asr_client_t asr, const char* filesystem) {
 	plist_t payload_info = NULL;
 	int attempts = 0;
 
-	file = fopen(filesystem, "rb");
 	if (file == NULL) {
 		return -1;
 	}
 
-	fseeko(file, 0, SEEK_END);
-	length = ftello(file);
-	fseeko(file, 0, SEEK_SET);
+	length = ipsw_file_size(file);
 
 	payload_info = plist_new_dict();
 	plist_dict_set_item(payload_info, "Port", plist_new_uint(1));
@@ -257,15 +327,21 @@ int asr_perform_validation(asr_client_t asr, const char* filesystem) {
 		if (!strcmp(command, "OOBData")) {
 			int ret = asr_handle_oob_data_request(asr, packet, file);
 			plist_free(packet);
+			free(command);
+			command = NULL;
 			if (ret < 0)
 				return ret;
 		} else if(!strcmp(command, "Payload")) {
 			plist_free(packet);
+			free(command);
+			debug("Validation served %u OOB requests, " FMT_qu " bytes\n",
+			      asr->oob_requests, (long long unsigned int)asr->oob_bytes);
 			break;
 
 		} else {
 			error("ERROR: Unknown command received from ASR\n");
 			plist_free(packet);
+			free(command);
 			return -1;
 		}
 	}
@@ -273,7 +349,7 @@ int asr_perform_validation(asr_client_t asr, const char* filesystem) {
 	return 0;
 }
 
-int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file) {
+int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, ipsw_file_handle_t file) {
 	char* oob_data = NULL;
 	uint64_t oob_offset = 0;
 	uint64_t oob_length = 0;
@@ -294,128 +370,359 @@ int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file) {
 	}
 	plist_get_uint_val(oob_offset_node, &oob_offset);
 
-	oob_data = (char*) malloc(oob_length);
-	if (oob_data == NULL) {
-		error("ERROR: Out of memory\n");
+	if (oob_offset > ipsw_file_size(file) || oob_length > ipsw_file_size(file) - oob_offset) {
+		error("ERROR: OOB data request out of range (offset " FMT_qu ", length " FMT_qu ")\n",
+		      (long long unsigned int)oob_offset, (long long unsigned int)oob_length);
 		return -1;
 	}
 
-	fseeko(file, oob_offset, SEEK_SET);
-	if (fread(oob_data, 1, oob_length, file) != oob_length) {
-		error("ERROR: Unable to read OOB data from filesystem offset: %s\n",
-		      strerror(errno));
-		free(oob_data);
-		return -1;
+	const unsigned char* map = ipsw_file_get_mapping(file);
+	if (map) {
+		// serve the request straight from the mapped filesystem
+		oob_data = (char*)map + oob_offset;
+	} else {
+		if (oob_length > asr->oob_buffer_size) {
+			char* newbuf = (char*) realloc(asr->oob_buffer, oob_length);
+			if (newbuf == NULL) {
+				error("ERROR: Out of memory\n");
+				return -1;
+			}
+			asr->oob_buffer = newbuf;
+			asr->oob_buffer_size = (uint32_t)oob_length;
+		}
+		oob_data = asr->oob_buffer;
+
+		if (ipsw_file_seek(file, oob_offset) < 0 || ipsw_file_read(file, oob_data, oob_length) != (int64_t)oob_length) {
+			error("ERROR: Unable to read OOB data from filesystem offset: %s\n",
+			      strerror(errno));
+			return -1;
+		}
 	}
 
 	if (asr_send_buffer(asr, oob_data, (uint32_t)oob_length) < 0) {
 		error("ERROR: Unable to send OOB data to ASR\n");
-		free(oob_data);
 		return -1;
 	}
-	free(oob_data);
+
+	asr->oob_requests++;
+	asr->oob_bytes += oob_length;
+	debug("Sent OOB data: offset " FMT_qu ", length " FMT_qu "\n",
+	      (long long unsigned int)oob_offset, (long long unsigned int)oob_length);
+
 	return 0;
 }
 
-int asr_send_payload(asr_client_t asr, const char* filesystem) {
-	char data[ASR_PAYLOAD_PACKET_SIZE];
-	FILE* file = NULL;
-	off_t i, length, bytes = 0;
-	double progress = 0;
+/* Filesystem payload is streamed through a ring of large buffers: a reader
+ * thread fills slots from disk, a hasher thread computes the checksum of
+ * every ASR_CHECKSUM_CHUNK_SIZE chunk in a filled slot and the calling thread
+ * sends the slot in ASR_PAYLOAD_PACKET_SIZE packets. Slot size is a multiple
+ * of the checksum chunk size so a chunk never spans two slots. */
+#define ASR_RING_CHUNKS_PER_SLOT 8
+#define ASR_RING_SLOT_SIZE (ASR_CHECKSUM_CHUNK_SIZE * ASR_RING_CHUNKS_PER_SLOT)
+#define ASR_RING_ALIGNMENT 4096
+
+enum {
+	ASR_SLOT_FREE = 0,
+	ASR_SLOT_READ,
+	ASR_SLOT_READY
+};
+
+struct asr_ring_slot {
+	unsigned char* buffer;
+	const unsigned char* data;
+	uint32_t size;
+	int state;
+	unsigned char checksum[ASR_RING_CHUNKS_PER_SLOT][SHA_DIGEST_LENGTH];
+};
+
+struct asr_pipeline {
+	asr_client_t asr;
+	ipsw_file_handle_t file;
+	const unsigned char* map;
+	uint64_t length;
+	uint64_t num_slots;
+	int depth;
+	struct asr_ring_slot* ring;
+	mutex_t lock;
+	cond_t cond;
+	int failed;
+};
+
+void asr_set_ring_depth(asr_client_t asr, int depth)
+{
+	if (!asr) {
+		return;
+	}
+	if (depth > ASR_RING_MAX_DEPTH) {
+		depth = ASR_RING_MAX_DEPTH;
+	}
+	asr->ring_depth = (depth > 0) ? depth : ASR_RING_DEFAULT_DEPTH;
+}
 
-	file = fopen(filesystem, "rb");
-	if (file == NULL) {
-		error("ERROR: Unable to open filesystem image %s: %s\n",
-		      filesystem, strerror(errno));
-		return -1;
+static unsigned char* asr_ring_alloc(size_t size)
+{
+#ifdef WIN32
+	return (unsigned char*)_aligned_malloc(size, ASR_RING_ALIGNMENT);
+#else
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, ASR_RING_ALIGNMENT, size) != 0) {
+		return NULL;
 	}
+	return (unsigned char*)ptr;
+#endif
+}
 
-	fseeko(file, 0, SEEK_END);
-	length = ftello(file);
-	fseeko(file, 0, SEEK_SET);
+static void asr_ring_free(unsigned char* ptr)
+{
+#ifdef WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
 
-	int chunk = 0;
-	int add_checksum = 0;
+/* waits until the given slot reaches state, returns -1 if the pipeline failed */
+static int asr_pipeline_wait_slot(struct asr_pipeline* pipeline, struct asr_ring_slot* slot, int state)
+{
+	mutex_lock(&pipeline->lock);
+	while (slot->state != state && !pipeline->failed) {
+		cond_wait(&pipeline->cond, &pipeline->lock);
+	}
+	int res = (pipeline->failed) ? -1 : 0;
+	mutex_unlock(&pipeline->lock);
+	return res;
+}
 
-	SHA_CTX sha1;
+static void asr_pipeline_set_slot(struct asr_pipeline* pipeline, struct asr_ring_slot* slot, int state)
+{
+	mutex_lock(&pipeline->lock);
+	slot->state = state;
+	cond_broadcast(&pipeline->cond);
+	mutex_unlock(&pipeline->lock);
+}
 
-	if (asr->checksum_chunks) {
-		SHA1_Init(&sha1);
-	}
+static void asr_pipeline_fail(struct asr_pipeline* pipeline)
+{
+	mutex_lock(&pipeline->lock);
+	pipeline->failed = 1;
+	cond_broadcast(&pipeline->cond);
+	mutex_unlock(&pipeline->lock);
+}
 
-	int size = 0;
-	for (i = length; i > 0; i -= size) {
-		size = ASR_PAYLOAD_PACKET_SIZE;
-		if (i < ASR_PAYLOAD_PACKET_SIZE) {
-			size = i;
+static void* asr_pipeline_reader(void* data)
+{
+	struct asr_pipeline* pipeline = (struct asr_pipeline*)data;
+	uint64_t remaining = pipeline->length;
+	uint64_t seq;
+
+	for (seq = 0; seq < pipeline->num_slots; seq++) {
+		struct asr_ring_slot* slot = &pipeline->ring[seq % pipeline->depth];
+		if (asr_pipeline_wait_slot(pipeline, slot, ASR_SLOT_FREE) < 0) {
+			break;
 		}
 
-		if (add_checksum) {
-			add_checksum = 0;
+		uint32_t size = (remaining < ASR_RING_SLOT_SIZE) ? (uint32_t)remaining : ASR_RING_SLOT_SIZE;
+		if (pipeline->map) {
+			slot->data = pipeline->map + (pipeline->length - remaining);
+		} else {
+			if (ipsw_file_read(pipeline->file, slot->buffer, size) != (int64_t)size) {
+				error("Error reading filesystem\n");
+				asr_pipeline_fail(pipeline);
+				break;
+			}
+			slot->data = slot->buffer;
 		}
+		slot->size = size;
+		remaining -= size;
+
+		/* without checksums there is nothing left to do for the hasher */
+		asr_pipeline_set_slot(pipeline, slot, (pipeline->asr->checksum_chunks) ? ASR_SLOT_READ : ASR_SLOT_READY);
+	}
+
+	return NULL;
+}
+
+static void* asr_pipeline_hasher(void* data)
+{
+	struct asr_pipeline* pipeline = (struct asr_pipeline*)data;
+	uint64_t seq;
 
-		if (asr->checksum_chunks && ((chunk + size) >= ASR_CHECKSUM_CHUNK_SIZE)) {
-			// reduce packet size to match checksum chunk size
-			size -= ((chunk + size) - ASR_CHECKSUM_CHUNK_SIZE);
-			add_checksum = 1;
+	for (seq = 0; seq < pipeline->num_slots; seq++) {
+		struct asr_ring_slot* slot = &pipeline->ring[seq % pipeline->depth];
+		if (asr_pipeline_wait_slot(pipeline, slot, ASR_SLOT_READ) < 0) {
+			break;
 		}
 
-		if (fread(data, 1, size, file) != (unsigned int) size) {
-			error("Error reading filesystem\n");
-			fclose(file);
-			return -1;
+		hash_sha1_chunks(slot->data, slot->size, ASR_CHECKSUM_CHUNK_SIZE, slot->checksum);
+
+		asr_pipeline_set_slot(pipeline, slot, ASR_SLOT_READY);
+	}
+
+	return NULL;
+}
+
+static int asr_pipeline_send_slot(struct asr_pipeline* pipeline, struct asr_ring_slot* slot, off_t* bytes)
+{
+	asr_client_t asr = pipeline->asr;
+	uint32_t offset = 0;
+	int chunk = 0;
+	double progress = 0;
+
+	while (offset < slot->size) {
+		uint32_t chunk_end = offset + ASR_CHECKSUM_CHUNK_SIZE;
+		if (chunk_end > slot->size) {
+			chunk_end = slot->size;
 		}
 
-		if (asr_send_buffer(asr, data, size) < 0) {
-			error("ERROR: Unable to send filesystem payload\n");
-			fclose(file);
-			return -1;
+		while (offset < chunk_end) {
+			uint32_t size = chunk_end - offset;
+			if (size > ASR_PAYLOAD_PACKET_SIZE) {
+				size = ASR_PAYLOAD_PACKET_SIZE;
+			}
+
+			if (asr_send_buffer(asr, (const char*)slot->data + offset, size) < 0) {
+				error("ERROR: Unable to send filesystem payload\n");
+				return -1;
+			}
+			offset += size;
+
+			*bytes += size;
+			progress = ((double)*bytes / (double)pipeline->length);
+			if (asr->progress_cb && ((int)(progress*100) > asr->lastprogress)) {
+				asr->progress_cb(progress, asr->progress_cb_data);
+				asr->lastprogress = (int)(progress*100);
+			}
 		}
 
 		if (asr->checksum_chunks) {
-			SHA1_Update(&sha1, data, size);
-			chunk += size;
+			// send checksum of the chunk
+			if (asr_send_buffer(asr, (const char*)slot->checksum[chunk], SHA_DIGEST_LENGTH) < 0) {
+				error("ERROR: Unable to send chunk checksum\n");
+				return -1;
+			}
+		}
+		chunk++;
+	}
 
-			if (add_checksum) {
-				// get sha1 of last chunk
-				SHA1_Final((unsigned char*)data, &sha1);
+	return 0;
+}
 
-				// send checksum
-				if (asr_send_buffer(asr, data, 20) < 0) {
-					error("ERROR: Unable to send chunk checksum\n");
-					fclose(file);
-					return -1;
-				}
+int asr_send_payload(asr_client_t asr, ipsw_file_handle_t file) {
+	struct asr_pipeline pipeline;
+	thread_t reader = (thread_t)NULL;
+	thread_t hasher = (thread_t)NULL;
+	int have_reader = 0;
+	int have_hasher = 0;
+	off_t bytes = 0;
+	uint64_t seq;
+	int res = 0;
+	int i;
+
+	memset(&pipeline, '\0', sizeof(struct asr_pipeline));
+	pipeline.asr = asr;
+	pipeline.depth = (asr->ring_depth > 0) ? asr->ring_depth : ASR_RING_DEFAULT_DEPTH;
+
+	if (file == NULL || ipsw_file_seek(file, 0) < 0) {
+		error("ERROR: Unable to read filesystem image\n");
+		return -1;
+	}
+	pipeline.file = file;
+	pipeline.map = ipsw_file_get_mapping(file);
+	pipeline.length = ipsw_file_size(file);
 
-				// reset SHA1 context
-				SHA1_Init(&sha1);
+	pipeline.num_slots = (pipeline.length + ASR_RING_SLOT_SIZE - 1) / ASR_RING_SLOT_SIZE;
+	if (pipeline.num_slots < (uint64_t)pipeline.depth) {
+		pipeline.depth = (pipeline.num_slots > 0) ? (int)pipeline.num_slots : 1;
+	}
 
-				// reset chunk byte counter
-				chunk = 0;
+	pipeline.ring = (struct asr_ring_slot*)calloc(pipeline.depth, sizeof(struct asr_ring_slot));
+	if (pipeline.ring == NULL) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	if (pipeline.map) {
+		// slots point into the mapping, nothing to copy
+#ifdef MADV_SEQUENTIAL
+		madvise((void*)pipeline.map, (size_t)pipeline.length, MADV_SEQUENTIAL);
+#endif
+		debug("Sending filesystem payload from mapped file using %d ring slots\n", pipeline.depth);
+	} else {
+		for (i = 0; i < pipeline.depth; i++) {
+			pipeline.ring[i].buffer = asr_ring_alloc(ASR_RING_SLOT_SIZE);
+			if (pipeline.ring[i].buffer == NULL) {
+				error("ERROR: Unable to allocate ASR ring buffer\n");
+				res = -1;
+				goto cleanup;
 			}
 		}
+		debug("Sending filesystem payload using %d ring buffers of %d bytes\n", pipeline.depth, ASR_RING_SLOT_SIZE);
+	}
+
+	mutex_init(&pipeline.lock);
+	cond_init(&pipeline.cond);
+
+	if (thread_new(&reader, asr_pipeline_reader, &pipeline) != 0) {
+		error("ERROR: Unable to start ASR reader thread\n");
+		res = -1;
+		goto cleanup_sync;
+	}
+	have_reader = 1;
 
-		bytes += size;
-		progress = ((double)bytes / (double)length);
-		if (asr->progress_cb && ((int)(progress*100) > asr->lastprogress)) {
-			asr->progress_cb(progress, asr->progress_cb_data);
-			asr->lastprogress = (int)(progress*100);
+	if (asr->checksum_chunks) {
+		if (thread_new(&hasher, asr_pipeline_hasher, &pipeline) != 0) {
+			error("ERROR: Unable to start ASR hasher thread\n");
+			asr_pipeline_fail(&pipeline);
+			res = -1;
+			goto cleanup_threads;
 		}
+		have_hasher = 1;
+		debug("Chunk checksums are computed %s SHA extensions\n", hash_sha1_accelerated() ? "with" : "without");
 	}
 
-	// if last chunk wasn't terminated with a checksum we do it here
-	if (asr->checksum_chunks && !add_checksum) {
-		// get sha1 of last chunk
-		SHA1_Final((unsigned char*)data, &sha1);
+	for (seq = 0; seq < pipeline.num_slots; seq++) {
+		struct asr_ring_slot* slot = &pipeline.ring[seq % pipeline.depth];
+		if (asr_pipeline_wait_slot(&pipeline, slot, ASR_SLOT_READY) < 0) {
+			res = -1;
+			break;
+		}
+		if (asr_pipeline_send_slot(&pipeline, slot, &bytes) < 0) {
+			asr_pipeline_fail(&pipeline);
+			res = -1;
+			break;
+		}
+		asr_pipeline_set_slot(&pipeline, slot, ASR_SLOT_FREE);
+	}
 
-		// send checksum
-		if (asr_send_buffer(asr, data, 20) < 0) {
+	// an empty payload still gets terminated with a checksum
+	if (res == 0 && asr->checksum_chunks && pipeline.num_slots == 0) {
+		unsigned char checksum[SHA_DIGEST_LENGTH];
+		SHA1((const unsigned char*)"", 0, checksum);
+		if (asr_send_buffer(asr, (const char*)checksum, SHA_DIGEST_LENGTH) < 0) {
 			error("ERROR: Unable to send chunk checksum\n");
-			fclose(file);
-			return -1;
+			res = -1;
 		}
 	}
 
-	fclose(file);
-	return 0;
+cleanup_threads:
+	if (have_reader) {
+		thread_join(reader);
+		thread_free(reader);
+	}
+	if (have_hasher) {
+		thread_join(hasher);
+		thread_free(hasher);
+	}
+
+cleanup_sync:
+	cond_destroy(&pipeline.cond);
+	mutex_destroy(&pipeline.lock);
+
+cleanup:
+	for (i = 0; i < pipeline.depth; i++) {
+		if (pipeline.ring[i].buffer) {
+			asr_ring_free(pipeline.ring[i].buffer);
+		}
+	}
+	free(pipeline.ring);
+	return res;
 }
@@ -30,26 +30,42 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 
+#include "ipsw.h"
+
+#define ASR_RING_DEFAULT_DEPTH 4
+#define ASR_RING_MAX_DEPTH 64
+
 typedef void (*asr_progress_cb_t)(double, void*);
 
 struct asr_client {
 	idevice_connection_t connection;
+	/* connected socket used instead of connection, -1 if unused */
+	int fd;
 	uint8_t checksum_chunks;
 	int lastprogress;
 	asr_progress_cb_t progress_cb;
 	void* progress_cb_data;
+	int ring_depth;
+	char* oob_buffer;
+	uint32_t oob_buffer_size;
+	uint32_t oob_requests;
+	uint64_t oob_bytes;
 };
 typedef struct asr_client *asr_client_t;
 
 int asr_open_with_timeout(idevice_t device, asr_client_t* asr);
+/* speaks ASR over an already connected socket, e.g. to a simulated device;
+ * fd is closed by asr_free() and when the handshake fails */
+int asr_open_fd(int fd, asr_client_t* asr);
 void asr_set_progress_callback(asr_client_t asr, asr_progress_cb_t, void* userdata);
+void asr_set_ring_depth(asr_client_t asr, int depth);
 int asr_send(asr_client_t asr, plist_t data);
 int asr_receive(asr_client_t asr, plist_t* data);
 int asr_send_buffer(asr_client_t asr, const char* data, uint32_t size);
 void asr_free(asr_client_t asr);
-int asr_perform_validation(asr_client_t asr, const char* filesystem);
-int asr_send_payload(asr_client_t asr, const char* filesystem);
-int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file);
+int asr_perform_validation(asr_client_t asr, ipsw_file_handle_t file);
+int asr_send_payload(asr_client_t asr, ipsw_file_handle_t file);
+int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, ipsw_file_handle_t file);
 
 
 #ifdef __cplusplus
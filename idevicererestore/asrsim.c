@@ -0,0 +1,427 @@
+/*
+ * asrsim.c
+ * Simulated ASR device for exercising the filesystem transfer locally
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+#include <openssl/sha.h>
+#include <plist/plist.h>
+
+#include "asrsim.h"
+#include "asr.h"
+#include "ipsw.h"
+#include "trace.h"
+#include "thread.h"
+#include "common.h"
+
+#define ASR_SIM_BUFFER_SIZE 65536
+#define ASR_SIM_OOB_LENGTH 65536
+
+#ifdef MSG_NOSIGNAL
+#define ASR_SIM_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define ASR_SIM_SEND_FLAGS 0
+#endif
+
+struct asr_sim {
+	int fd;
+	struct asr_sim_config config;
+	struct asr_sim_stats stats;
+	thread_t thread;
+	uint64_t start_us;
+	uint64_t received;
+};
+
+static uint64_t asr_sim_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* holds the device back to the configured bandwidth */
+static void asr_sim_throttle(struct asr_sim* sim, uint64_t count)
+{
+	sim->received += count;
+	if (sim->config.bandwidth == 0) {
+		return;
+	}
+	uint64_t due = sim->start_us + (uint64_t)((double)sim->received * 1000000.0 / (double)sim->config.bandwidth);
+	uint64_t now = asr_sim_time_us();
+	if (due > now) {
+		usleep((useconds_t)(due - now));
+	}
+}
+
+static int asr_sim_read(struct asr_sim* sim, unsigned char* buffer, uint64_t length)
+{
+	uint64_t done = 0;
+	while (done < length) {
+		size_t want = (length - done > ASR_SIM_BUFFER_SIZE) ? ASR_SIM_BUFFER_SIZE : (size_t)(length - done);
+		ssize_t count = recv(sim->fd, buffer + done, want, 0);
+		if (count <= 0) {
+			return -1;
+		}
+		done += count;
+		asr_sim_throttle(sim, count);
+	}
+	return 0;
+}
+
+static int asr_sim_send_command(struct asr_sim* sim, plist_t dict)
+{
+	char* xml = NULL;
+	uint32_t length = 0;
+	uint32_t done = 0;
+
+	if (sim->config.latency_ms) {
+		usleep(sim->config.latency_ms * 1000);
+	}
+
+	plist_to_xml(dict, &xml, &length);
+	plist_free(dict);
+	if (xml == NULL) {
+		return -1;
+	}
+	while (done < length) {
+		ssize_t count = send(sim->fd, xml + done, length - done, ASR_SIM_SEND_FLAGS);
+		if (count <= 0) {
+			break;
+		}
+		done += count;
+	}
+	free(xml);
+
+	return (done == length) ? 0 : -1;
+}
+
+static int asr_sim_receive_plist(struct asr_sim* sim, plist_t* plist)
+{
+	char buffer[ASR_SIM_BUFFER_SIZE];
+	size_t size = 0;
+
+	*plist = NULL;
+	while (size < sizeof(buffer) - 1) {
+		ssize_t count = recv(sim->fd, buffer + size, sizeof(buffer) - 1 - size, 0);
+		if (count <= 0) {
+			return -1;
+		}
+		size += count;
+		buffer[size] = '\0';
+		if (strstr(buffer, "</plist>")) {
+			plist_from_xml(buffer, (uint32_t)size, plist);
+			return (*plist) ? 0 : -1;
+		}
+	}
+
+	return -1;
+}
+
+static plist_t asr_sim_command(const char* command)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Command", plist_new_string(command));
+	return dict;
+}
+
+static int asr_sim_validate(struct asr_sim* sim, uint64_t* size, uint64_t* chunk_size)
+{
+	plist_t dict = asr_sim_command("Initiate");
+	plist_dict_set_item(dict, "Checksum Chunks", plist_new_bool(1));
+	if (asr_sim_send_command(sim, dict) < 0) {
+		return -1;
+	}
+
+	if (asr_sim_receive_plist(sim, &dict) < 0) {
+		error("ERROR: ASR simulator did not receive packet information\n");
+		return -1;
+	}
+	plist_t node = plist_access_path(dict, 2, "Payload", "Size");
+	if (!node || plist_get_node_type(node) != PLIST_UINT) {
+		error("ERROR: ASR simulator received packet information without payload size\n");
+		plist_free(dict);
+		return -1;
+	}
+	plist_get_uint_val(node, size);
+	*chunk_size = 0;
+	node = plist_dict_get_item(dict, "Checksum Chunk Size");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, chunk_size);
+	}
+	plist_free(dict);
+
+	/* spread the OOB reads over the image like the real device reading partition tables and volume headers */
+	int requests = (*size > 0) ? sim->config.oob_requests : 0;
+	uint64_t length = (*size < ASR_SIM_OOB_LENGTH) ? *size : ASR_SIM_OOB_LENGTH;
+	unsigned char* buffer = NULL;
+	if (requests > 0) {
+		buffer = (unsigned char*)malloc((size_t)length);
+		if (buffer == NULL) {
+			return -1;
+		}
+	}
+	int i;
+	for (i = 0; i < requests; i++) {
+		uint64_t offset = (requests > 1) ? ((*size - length) / (requests - 1)) * i : 0;
+		dict = asr_sim_command("OOBData");
+		plist_dict_set_item(dict, "OOB Length", plist_new_uint(length));
+		plist_dict_set_item(dict, "OOB Offset", plist_new_uint(offset));
+		if (asr_sim_send_command(sim, dict) < 0 || asr_sim_read(sim, buffer, length) < 0) {
+			free(buffer);
+			return -1;
+		}
+		sim->stats.oob_bytes += length;
+	}
+	free(buffer);
+
+	return asr_sim_send_command(sim, asr_sim_command("Payload"));
+}
+
+static void* asr_sim_device(void* arg)
+{
+	struct asr_sim* sim = (struct asr_sim*)arg;
+	uint64_t size = 0;
+	uint64_t chunk_size = 0;
+	unsigned char* buffer = NULL;
+
+	sim->start_us = asr_sim_time_us();
+	sim->stats.result = -1;
+
+	if (asr_sim_validate(sim, &size, &chunk_size) < 0) {
+		goto leave;
+	}
+
+	uint64_t buffer_size = chunk_size ? chunk_size : ASR_SIM_BUFFER_SIZE;
+	buffer = (unsigned char*)malloc((size_t)buffer_size);
+	if (buffer == NULL) {
+		goto leave;
+	}
+
+	while (sim->stats.payload_bytes < size) {
+		uint64_t count = size - sim->stats.payload_bytes;
+		if (count > buffer_size) {
+			count = buffer_size;
+		}
+		if (asr_sim_read(sim, buffer, count) < 0) {
+			error("ERROR: ASR simulator lost the connection after " FMT_qu " payload bytes\n", (long long unsigned int)sim->stats.payload_bytes);
+			goto leave;
+		}
+		sim->stats.payload_bytes += count;
+
+		if (chunk_size) {
+			unsigned char expected[SHA_DIGEST_LENGTH];
+			unsigned char checksum[SHA_DIGEST_LENGTH];
+			if (asr_sim_read(sim, expected, sizeof(expected)) < 0) {
+				goto leave;
+			}
+			SHA1(buffer, (size_t)count, checksum);
+			if (memcmp(checksum, expected, sizeof(checksum)) != 0) {
+				sim->stats.checksum_errors++;
+			}
+		}
+	}
+
+	sim->stats.result = (sim->stats.checksum_errors == 0) ? 0 : -1;
+
+leave:
+	free(buffer);
+	sim->stats.duration_us = asr_sim_time_us() - sim->start_us;
+	/* lets the host side see the end of the session right away */
+	close(sim->fd);
+	sim->fd = -1;
+
+	return NULL;
+}
+
+struct asr_sim* asr_sim_start(int fd, const struct asr_sim_config* config)
+{
+	struct asr_sim* sim = (struct asr_sim*)calloc(1, sizeof(struct asr_sim));
+	if (sim == NULL) {
+		return NULL;
+	}
+	sim->fd = fd;
+	if (config) {
+		sim->config = *config;
+	}
+#ifdef SO_NOSIGPIPE
+	int nosigpipe = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+
+	if (thread_new(&sim->thread, asr_sim_device, sim) != 0) {
+		error("ERROR: Unable to start ASR simulator thread\n");
+		free(sim);
+		return NULL;
+	}
+
+	return sim;
+}
+
+int asr_sim_finish(struct asr_sim* sim, struct asr_sim_stats* stats)
+{
+	if (sim == NULL) {
+		return -1;
+	}
+
+	thread_join(sim->thread);
+	thread_free(sim->thread);
+
+	int result = sim->stats.result;
+	if (stats) {
+		*stats = sim->stats;
+	}
+	free(sim);
+
+	return result;
+}
+
+struct asr_sim_session {
+	const char* filesystem;
+	const struct asr_sim_config* config;
+	struct trace* trace;
+	int index;
+	thread_t thread;
+	struct asr_sim_stats stats;
+	int result;
+};
+
+static void* asr_sim_host(void* arg)
+{
+	struct asr_sim_session* session = (struct asr_sim_session*)arg;
+	ipsw_file_handle_t file = NULL;
+	asr_client_t asr = NULL;
+	struct asr_sim* sim = NULL;
+	char name[32];
+	int fds[2];
+
+	session->result = -1;
+	snprintf(name, sizeof(name), "session %d", session->index);
+	int span = trace_begin(session->trace, "asr_sim", name);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		error("ERROR: Unable to create ASR simulator socket pair\n");
+		trace_end(session->trace, span, 0, -1);
+		return NULL;
+	}
+
+	sim = asr_sim_start(fds[1], session->config);
+	if (sim == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		trace_end(session->trace, span, 0, -1);
+		return NULL;
+	}
+
+	file = ipsw_file_open_local(session->filesystem);
+	if (file == NULL) {
+		error("ERROR: Unable to open %s\n", session->filesystem);
+		close(fds[0]);
+	} else if (asr_open_fd(fds[0], &asr) < 0) {
+		error("ERROR: Unable to connect to ASR simulator\n");
+	} else if (asr_perform_validation(asr, file) < 0) {
+		error("ERROR: ASR simulator session %d failed validation\n", session->index);
+	} else if (asr_send_payload(asr, file) < 0) {
+		error("ERROR: ASR simulator session %d failed to send payload\n", session->index);
+	} else {
+		session->result = 0;
+	}
+	if (asr) {
+		asr_free(asr);
+	}
+	if (file) {
+		ipsw_file_close(file);
+	}
+
+	if (asr_sim_finish(sim, &session->stats) < 0) {
+		session->result = -1;
+	}
+	trace_end(session->trace, span, session->stats.payload_bytes, session->result);
+
+	return NULL;
+}
+
+int asr_sim_run(const char* filesystem, int sessions, const struct asr_sim_config* config, struct trace* trace)
+{
+	struct asr_sim_session* session = NULL;
+	uint64_t total = 0;
+	int failed = 0;
+	int i;
+
+	if (filesystem == NULL || sessions <= 0) {
+		return -1;
+	}
+
+	session = (struct asr_sim_session*)calloc(sessions, sizeof(struct asr_sim_session));
+	if (session == NULL) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	if (config->bandwidth) {
+		info("Sending %s to %d simulated ASR receiver(s) at %.1f MB/s, latency %ums\n", filesystem, sessions,
+		     (double)config->bandwidth / 1048576.0, config->latency_ms);
+	} else {
+		info("Sending %s to %d simulated ASR receiver(s), latency %ums\n", filesystem, sessions, config->latency_ms);
+	}
+
+	uint64_t start = asr_sim_time_us();
+	for (i = 0; i < sessions; i++) {
+		session[i].filesystem = filesystem;
+		session[i].config = config;
+		session[i].trace = trace;
+		session[i].index = i;
+		session[i].result = -1;
+		if (thread_new(&session[i].thread, asr_sim_host, &session[i]) != 0) {
+			error("ERROR: Unable to start ASR simulator session %d\n", i);
+			sessions = i;
+			failed++;
+			break;
+		}
+	}
+	for (i = 0; i < sessions; i++) {
+		thread_join(session[i].thread);
+		thread_free(session[i].thread);
+	}
+	uint64_t elapsed = asr_sim_time_us() - start;
+
+	for (i = 0; i < sessions; i++) {
+		struct asr_sim_stats* stats = &session[i].stats;
+		double seconds = (double)stats->duration_us / 1000000.0;
+		info("Session %d: %s, " FMT_qu " payload bytes, " FMT_qu " OOB bytes, %u checksum errors, %.2f MB/s\n",
+		     i, (session[i].result == 0) ? "OK" : "FAILED",
+		     (long long unsigned int)stats->payload_bytes, (long long unsigned int)stats->oob_bytes, stats->checksum_errors,
+		     (seconds > 0) ? ((double)stats->payload_bytes / 1048576.0) / seconds : 0.0);
+		total += stats->payload_bytes;
+		if (session[i].result < 0) {
+			failed++;
+		}
+	}
+	info("Sent " FMT_qu " bytes in %.2fs, %.2f MB/s aggregate, %d session(s) failed\n",
+	     (long long unsigned int)total, (double)elapsed / 1000000.0,
+	     (elapsed > 0) ? ((double)total / 1048576.0) / ((double)elapsed / 1000000.0) : 0.0, failed);
+
+	free(session);
+
+	return (failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,69 @@
+/*
+ * asrsim.h
+ * Simulated ASR device for exercising the filesystem transfer locally
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_ASRSIM_H
+#define IDEVICERESTORE_ASRSIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct trace;
+struct asr_sim;
+
+struct asr_sim_config {
+	/* bytes per second the device accepts, 0 for unlimited */
+	uint64_t bandwidth;
+	/* delay before every command the device sends */
+	unsigned int latency_ms;
+	/* number of OOB reads issued during validation */
+	int oob_requests;
+};
+
+struct asr_sim_stats {
+	uint64_t payload_bytes;
+	uint64_t oob_bytes;
+	uint32_t checksum_errors;
+	uint64_t duration_us;
+	int result;
+};
+
+/* Plays the device side of an ASR session on fd, one end of a connected
+ * socket, on its own thread: it sends Initiate, reads the packet info,
+ * requests OOB data, then receives and verifies the checksummed payload.
+ * The host side is driven through asr_open_fd() on the other end. */
+struct asr_sim* asr_sim_start(int fd, const struct asr_sim_config* config);
+
+/* waits for the session to end, fills stats, frees sim and returns its result */
+int asr_sim_finish(struct asr_sim* sim, struct asr_sim_stats* stats);
+
+/* Sends filesystem to the given number of concurrently simulated devices
+ * the way the filesystem step of a restore does, reports per session and
+ * aggregate throughput and records a span per session in trace if it is
+ * not NULL. Only ASR is played, restored data requests and the DFU and
+ * recovery mode uploads are not part of the run. */
+int asr_sim_run(const char* filesystem, int sessions, const struct asr_sim_config* config, struct trace* trace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ * bandwidth.c
+ * Scheduler for the bulk transfers of concurrent restores on shared USB controllers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#elif defined(__linux__)
+#include <dirent.h>
+#endif
+
+#include "bandwidth.h"
+#include "common.h"
+#include "thread.h"
+
+#define BANDWIDTH_MAX_CONTROLLERS 32
+#define BANDWIDTH_MAX_DEVICES 64
+/* how often a waiting transfer can be overtaken by smaller ones that came
+ * after it before it is served in arrival order */
+#define BANDWIDTH_MAX_OVERTAKEN 4
+
+struct bandwidth_controller {
+	uint32_t id;
+	int active;
+};
+
+struct bandwidth_waiter {
+	int token;
+	uint64_t size;
+	uint64_t ticket;
+	int overtaken;
+	struct bandwidth_waiter* next;
+};
+
+/* controller a device was last seen on, it stays attached to the same
+ * port while it re-enumerates between modes */
+struct bandwidth_device {
+	uint64_t ecid;
+	uint32_t controller;
+};
+
+static thread_once_t bandwidth_once = THREAD_ONCE_INIT;
+static mutex_t bandwidth_lock;
+static cond_t bandwidth_cond;
+static int bandwidth_limit = 0;
+static struct bandwidth_controller bandwidth_controllers[BANDWIDTH_MAX_CONTROLLERS];
+static int bandwidth_num_controllers = 0;
+static struct bandwidth_device bandwidth_devices[BANDWIDTH_MAX_DEVICES];
+static int bandwidth_num_devices = 0;
+static struct bandwidth_waiter* bandwidth_waiters = NULL;
+static uint64_t bandwidth_next_ticket = 0;
+
+static void bandwidth_init(void)
+{
+	mutex_init(&bandwidth_lock);
+	cond_init(&bandwidth_cond);
+}
+
+/* The USB serial number is the UDID in normal and restore mode, which
+ * ends with the ECID on newer devices, and has an ECID:... field in
+ * DFU and recovery mode. */
+static int bandwidth_serial_matches(const char* serial, uint64_t ecid, const char* udid)
+{
+	const char* p = strstr(serial, "ECID:");
+	if (p) {
+		return (ecid != 0 && strtoull(p + 5, NULL, 16) == ecid);
+	}
+
+	if (udid) {
+		const char* s = serial;
+		const char* u = udid;
+		while (*s && *u) {
+			if (*u == '-') {
+				u++;
+				continue;
+			}
+			if (tolower((unsigned char)*s) != tolower((unsigned char)*u)) {
+				break;
+			}
+			s++;
+			u++;
+		}
+		if (*s == '\0' && *u == '\0') {
+			return 1;
+		}
+	}
+
+	size_t len = strlen(serial);
+	if (ecid != 0 && len == 24 && strspn(serial, "0123456789abcdefABCDEF") == len) {
+		return (strtoull(serial + 8, NULL, 16) == ecid);
+	}
+
+	return 0;
+}
+
+#ifdef __APPLE__
+static int bandwidth_find_controller(uint64_t ecid, const char* udid, uint32_t* controller)
+{
+	static const char* classes[] = { "IOUSBHostDevice", "IOUSBDevice" };
+	int found = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]) && !found; i++) {
+		io_iterator_t iter = 0;
+		io_service_t service;
+
+		if (IOServiceGetMatchingServices(MACH_PORT_NULL, IOServiceMatching(classes[i]), &iter) != KERN_SUCCESS) {
+			continue;
+		}
+		while (!found && (service = IOIteratorNext(iter)) != 0) {
+			CFTypeRef serial = IORegistryEntryCreateCFProperty(service, CFSTR("USB Serial Number"), kCFAllocatorDefault, 0);
+			CFTypeRef location = IORegistryEntryCreateCFProperty(service, CFSTR("locationID"), kCFAllocatorDefault, 0);
+			char buf[256];
+
+			if (serial && location && CFGetTypeID(serial) == CFStringGetTypeID() && CFGetTypeID(location) == CFNumberGetTypeID() &&
+			    CFStringGetCString((CFStringRef)serial, buf, sizeof(buf), kCFStringEncodingUTF8) &&
+			    bandwidth_serial_matches(buf, ecid, udid)) {
+				uint32_t loc = 0;
+				CFNumberGetValue((CFNumberRef)location, kCFNumberSInt32Type, &loc);
+				// the top byte of the location is the bus, one per controller
+				*controller = loc >> 24;
+				found = 1;
+			}
+			if (serial) {
+				CFRelease(serial);
+			}
+			if (location) {
+				CFRelease(location);
+			}
+			IOObjectRelease(service);
+		}
+		IOObjectRelease(iter);
+	}
+
+	return (found) ? 0 : -1;
+}
+#elif defined(__linux__)
+static int bandwidth_read_attribute(const char* device, const char* name, char* buf, size_t size)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", device, name);
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	if (!fgets(buf, size, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return 0;
+}
+
+static int bandwidth_find_controller(uint64_t ecid, const char* udid, uint32_t* controller)
+{
+	DIR* dir = opendir("/sys/bus/usb/devices");
+	struct dirent* ent;
+	int found = 0;
+
+	if (!dir) {
+		return -1;
+	}
+	while (!found && (ent = readdir(dir)) != NULL) {
+		char serial[256];
+		char busnum[16];
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		if (bandwidth_read_attribute(ent->d_name, "serial", serial, sizeof(serial)) == 0 &&
+		    bandwidth_serial_matches(serial, ecid, udid) &&
+		    bandwidth_read_attribute(ent->d_name, "busnum", busnum, sizeof(busnum)) == 0) {
+			*controller = (uint32_t)strtoul(busnum, NULL, 10);
+			found = 1;
+		}
+	}
+	closedir(dir);
+
+	return (found) ? 0 : -1;
+}
+#else
+static int bandwidth_find_controller(uint64_t ecid, const char* udid, uint32_t* controller)
+{
+	(void)ecid;
+	(void)udid;
+	(void)controller;
+	return -1;
+}
+#endif
+
+/* called with bandwidth_lock held */
+static int bandwidth_get_token(uint32_t controller)
+{
+	int i;
+	for (i = 0; i < bandwidth_num_controllers; i++) {
+		if (bandwidth_controllers[i].id == controller) {
+			return i;
+		}
+	}
+	if (bandwidth_num_controllers == BANDWIDTH_MAX_CONTROLLERS) {
+		return -1;
+	}
+	bandwidth_controllers[i].id = controller;
+	bandwidth_controllers[i].active = 0;
+	bandwidth_num_controllers++;
+	return i;
+}
+
+/* called with bandwidth_lock held */
+static void bandwidth_remember(uint64_t ecid, uint32_t controller)
+{
+	int i;
+	if (ecid == 0) {
+		return;
+	}
+	for (i = 0; i < bandwidth_num_devices; i++) {
+		if (bandwidth_devices[i].ecid == ecid) {
+			bandwidth_devices[i].controller = controller;
+			return;
+		}
+	}
+	if (bandwidth_num_devices < BANDWIDTH_MAX_DEVICES) {
+		bandwidth_devices[bandwidth_num_devices].ecid = ecid;
+		bandwidth_devices[bandwidth_num_devices].controller = controller;
+		bandwidth_num_devices++;
+	}
+}
+
+/* called with bandwidth_lock held */
+static int bandwidth_recall(uint64_t ecid, uint32_t* controller)
+{
+	int i;
+	for (i = 0; ecid != 0 && i < bandwidth_num_devices; i++) {
+		if (bandwidth_devices[i].ecid == ecid) {
+			*controller = bandwidth_devices[i].controller;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* called with bandwidth_lock held, smallest first unless one of them has
+ * been overtaken too often, those go first and in the order they came */
+static int bandwidth_is_next(struct bandwidth_waiter* waiter)
+{
+	struct bandwidth_waiter* w;
+	if (bandwidth_limit <= 0) {
+		return 1;
+	}
+	if (bandwidth_controllers[waiter->token].active >= bandwidth_limit) {
+		return 0;
+	}
+	int starved = (waiter->overtaken >= BANDWIDTH_MAX_OVERTAKEN);
+	for (w = bandwidth_waiters; w; w = w->next) {
+		if (w == waiter || w->token != waiter->token) {
+			continue;
+		}
+		if (w->overtaken >= BANDWIDTH_MAX_OVERTAKEN) {
+			if (!starved || w->ticket < waiter->ticket) {
+				return 0;
+			}
+		} else if (!starved && (w->size < waiter->size || (w->size == waiter->size && w->ticket < waiter->ticket))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void bandwidth_set_limit(int transfers)
+{
+	thread_once(&bandwidth_once, bandwidth_init);
+	mutex_lock(&bandwidth_lock);
+	bandwidth_limit = (transfers > 0) ? transfers : 0;
+	cond_broadcast(&bandwidth_cond);
+	mutex_unlock(&bandwidth_lock);
+}
+
+int bandwidth_acquire(uint64_t ecid, const char* udid, uint64_t size)
+{
+	uint32_t controller = 0;
+	struct bandwidth_waiter waiter;
+	struct bandwidth_waiter** p;
+	struct bandwidth_waiter* w;
+
+	thread_once(&bandwidth_once, bandwidth_init);
+	mutex_lock(&bandwidth_lock);
+	int limit = bandwidth_limit;
+	mutex_unlock(&bandwidth_lock);
+	if (limit <= 0) {
+		return -1;
+	}
+
+	// the registry walk can take a moment, don't hold up the others with it
+	int found = bandwidth_find_controller(ecid, udid, &controller);
+
+	mutex_lock(&bandwidth_lock);
+	if (found == 0) {
+		bandwidth_remember(ecid, controller);
+	} else if (bandwidth_recall(ecid, &controller) < 0) {
+		mutex_unlock(&bandwidth_lock);
+		debug("Unable to find the USB controller of the device, not scheduling its transfer\n");
+		return -1;
+	}
+
+	waiter.token = bandwidth_get_token(controller);
+	if (waiter.token < 0) {
+		mutex_unlock(&bandwidth_lock);
+		return -1;
+	}
+	waiter.size = size;
+	waiter.ticket = bandwidth_next_ticket++;
+	waiter.overtaken = 0;
+	waiter.next = bandwidth_waiters;
+	bandwidth_waiters = &waiter;
+
+	if (!bandwidth_is_next(&waiter)) {
+		info("Waiting for a transfer slot on USB controller %u...\n", controller);
+		while (!bandwidth_is_next(&waiter)) {
+			cond_wait(&bandwidth_cond, &bandwidth_lock);
+		}
+	}
+
+	for (p = &bandwidth_waiters; *p != &waiter; p = &(*p)->next);
+	*p = waiter.next;
+	// the longer ones waiting in front were just overtaken once more
+	for (w = bandwidth_waiters; w; w = w->next) {
+		if (w->token == waiter.token && w->ticket < waiter.ticket) {
+			w->overtaken++;
+		}
+	}
+	bandwidth_controllers[waiter.token].active++;
+	// the next smallest may fit as well
+	cond_broadcast(&bandwidth_cond);
+	mutex_unlock(&bandwidth_lock);
+
+	return waiter.token;
+}
+
+void bandwidth_release(int token)
+{
+	if (token < 0) {
+		return;
+	}
+
+	mutex_lock(&bandwidth_lock);
+	if (bandwidth_controllers[token].active > 0) {
+		bandwidth_controllers[token].active--;
+	}
+	cond_broadcast(&bandwidth_cond);
+	mutex_unlock(&bandwidth_lock);
+}
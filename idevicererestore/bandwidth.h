@@ -0,0 +1,50 @@
+/*
+ * bandwidth.h
+ * Scheduler for the bulk transfers of concurrent restores on shared USB controllers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_BANDWIDTH_H
+#define IDEVICERESTORE_BANDWIDTH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Devices are grouped by the USB controller they are attached to, and at
+ * most this many of them on each controller get to run a bulk transfer
+ * (component uploads, the ASR filesystem stream) at the same time. The
+ * others keep doing their TSS requests, personalization and mode changes
+ * until a slot frees up. 0, the default, doesn't limit anything. */
+void bandwidth_set_limit(int transfers);
+
+/* Waits for a transfer slot on the controller of the device with ecid,
+ * or udid if ecid is 0. Waiting transfers get the slot smallest first, so
+ * the short uploads of a mode change don't queue behind a filesystem, but
+ * one that has been overtaken a few times is served before newer ones.
+ * Returns the token to pass to bandwidth_release(), -1 if the transfer
+ * isn't scheduled because there is no limit or the controller of the
+ * device can't be found. */
+int bandwidth_acquire(uint64_t ecid, const char* udid, uint64_t size);
+void bandwidth_release(int token);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * bbfw.c
+ * In-memory model of a baseband firmware (.bbfw) bundle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zip.h>
+
+#include "bbfw.h"
+#include "common.h"
+
+bbfw_bundle* bbfw_bundle_open(const char* path)
+{
+	int zerr = 0;
+	zip_int64_t i;
+	struct zip* za = NULL;
+
+	za = zip_open(path, 0, &zerr);
+	if (!za) {
+		error("ERROR: Could not open ZIP archive '%s': %d\n", path, zerr);
+		return NULL;
+	}
+
+	bbfw_bundle* bundle = (bbfw_bundle*)malloc(sizeof(bbfw_bundle));
+	if (!bundle) {
+		error("ERROR: Out of memory\n");
+		zip_close(za);
+		return NULL;
+	}
+	memset(bundle, '\0', sizeof(bbfw_bundle));
+
+	zip_int64_t numf = zip_get_num_entries(za, 0);
+	bundle->entries = (bbfw_entry*)calloc((numf > 0) ? numf : 1, sizeof(bbfw_entry));
+	if (!bundle->entries) {
+		error("ERROR: Out of memory\n");
+		goto fail;
+	}
+
+	for (i = 0; i < numf; i++) {
+		struct zip_stat zstat;
+		zip_stat_init(&zstat);
+		if (zip_stat_index(za, i, 0, &zstat) != 0 || !zstat.name) {
+			error("ERROR: zip_stat_index failed for index %d\n", (int)i);
+			goto fail;
+		}
+
+		bbfw_entry* entry = &bundle->entries[bundle->num_entries];
+		entry->name = strdup(zstat.name);
+		entry->size = (unsigned int)zstat.size;
+		entry->data = (unsigned char*)malloc(entry->size + 1);
+		bundle->num_entries++;
+		if (!entry->name || !entry->data) {
+			error("ERROR: Out of memory\n");
+			goto fail;
+		}
+
+		struct zip_file* zfile = zip_fopen_index(za, i, 0);
+		if (zfile == NULL) {
+			error("ERROR: zip_fopen_index failed for index %d\n", (int)i);
+			goto fail;
+		}
+		if (zip_fread(zfile, entry->data, entry->size) != (zip_int64_t)entry->size) {
+			error("ERROR: zip_fread: failed\n");
+			zip_fclose(zfile);
+			goto fail;
+		}
+		entry->data[entry->size] = '\0';
+		zip_fclose(zfile);
+	}
+
+	zip_close(za);
+	return bundle;
+
+fail:
+	zip_close(za);
+	bbfw_bundle_free(bundle);
+	return NULL;
+}
+
+void bbfw_bundle_free(bbfw_bundle* bundle)
+{
+	int i;
+
+	if (!bundle) {
+		return;
+	}
+	for (i = 0; i < bundle->num_entries; i++) {
+		free(bundle->entries[i].name);
+		free(bundle->entries[i].data);
+		free(bundle->entries[i].signed_data);
+		free(bundle->entries[i].sig_blob);
+	}
+	free(bundle->entries);
+	free(bundle);
+}
+
+int bbfw_bundle_locate(bbfw_bundle* bundle, const char* name)
+{
+	int i;
+
+	for (i = 0; i < bundle->num_entries; i++) {
+		if (!strcmp(bundle->entries[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const unsigned char* bbfw_entry_get_data(bbfw_entry* entry, unsigned int* size)
+{
+	if (entry->signed_data) {
+		*size = entry->signed_size;
+		return entry->signed_data;
+	}
+	*size = entry->size;
+	return entry->data;
+}
+
+int bbfw_entry_set_signed(bbfw_entry* entry, const unsigned char* data, unsigned int size, const unsigned char* blob, unsigned int blob_size)
+{
+	unsigned char* signed_data = (unsigned char*)malloc(size);
+	unsigned char* sig_blob = (unsigned char*)malloc(blob_size ? blob_size : 1);
+	if (!signed_data || !sig_blob) {
+		error("ERROR: Out of memory\n");
+		free(signed_data);
+		free(sig_blob);
+		return -1;
+	}
+	memcpy(signed_data, data, size);
+	memcpy(sig_blob, blob, blob_size);
+
+	free(entry->signed_data);
+	free(entry->sig_blob);
+	entry->signed_data = signed_data;
+	entry->signed_size = size;
+	entry->sig_blob = sig_blob;
+	entry->sig_blob_size = blob_size;
+
+	return 0;
+}
+
+int bbfw_entry_is_signed_with(bbfw_entry* entry, const unsigned char* blob, unsigned int blob_size)
+{
+	return (entry->signed_data && entry->sig_blob_size == blob_size && memcmp(entry->sig_blob, blob, blob_size) == 0);
+}
+
+int bbfw_write_archive(const bbfw_output* files, int num_files, unsigned char** data, size_t* size)
+{
+	zip_error_t zerr;
+	zip_source_t* src = NULL;
+	zip_t* za = NULL;
+	zip_stat_t zstat;
+	unsigned char* buffer = NULL;
+	int i;
+
+	zip_error_init(&zerr);
+	src = zip_source_buffer_create(NULL, 0, 0, &zerr);
+	if (!src) {
+		error("ERROR: Could not create baseband archive buffer: %s\n", zip_error_strerror(&zerr));
+		zip_error_fini(&zerr);
+		return -1;
+	}
+
+	za = zip_open_from_source(src, ZIP_TRUNCATE, &zerr);
+	if (!za) {
+		error("ERROR: Could not create baseband archive: %s\n", zip_error_strerror(&zerr));
+		zip_source_free(src);
+		zip_error_fini(&zerr);
+		return -1;
+	}
+	zip_error_fini(&zerr);
+
+	// the buffer source has to survive zip_close() so it can be read back
+	zip_source_keep(src);
+
+	for (i = 0; i < num_files; i++) {
+		zip_source_t* zs = zip_source_buffer(za, files[i].data, files[i].size, 0);
+		if (!zs) {
+			error("ERROR: out of memory\n");
+			goto fail;
+		}
+		if (zip_file_add(za, files[i].name, zs, ZIP_FL_OVERWRITE) < 0) {
+			error("ERROR: could not add '%s' to baseband archive\n", files[i].name);
+			zip_source_free(zs);
+			goto fail;
+		}
+	}
+
+	if (zip_close(za) < 0) {
+		error("ERROR: could not write baseband archive: %s\n", zip_strerror(za));
+		goto fail;
+	}
+	za = NULL;
+
+	zip_stat_init(&zstat);
+	if (zip_source_stat(src, &zstat) < 0 || zip_source_open(src) < 0) {
+		error("ERROR: could not read back baseband archive\n");
+		goto fail;
+	}
+	buffer = (unsigned char*)malloc(zstat.size ? zstat.size : 1);
+	if (!buffer || zip_source_read(src, buffer, zstat.size) != (zip_int64_t)zstat.size) {
+		error("ERROR: could not read back baseband archive\n");
+		zip_source_close(src);
+		free(buffer);
+		goto fail;
+	}
+	zip_source_close(src);
+	zip_source_free(src);
+
+	*data = buffer;
+	*size = (size_t)zstat.size;
+	return 0;
+
+fail:
+	if (za) {
+		zip_discard(za);
+	}
+	zip_source_free(src);
+	return -1;
+}
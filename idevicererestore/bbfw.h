@@ -0,0 +1,62 @@
+/*
+ * bbfw.h
+ * In-memory model of a baseband firmware (.bbfw) bundle
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BBFW_H
+#define BBFW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* one file of the bundle, signed_data holds the image signed with
+ * sig_blob so later BasebandData requests for the same blob reuse it */
+typedef struct {
+	char* name;
+	unsigned char* data;
+	unsigned int size;
+	unsigned char* signed_data;
+	unsigned int signed_size;
+	unsigned char* sig_blob;
+	unsigned int sig_blob_size;
+} bbfw_entry;
+
+typedef struct {
+	bbfw_entry* entries;
+	int num_entries;
+} bbfw_bundle;
+
+/* a file of the archive handed to restored, data is not copied */
+typedef struct {
+	const char* name;
+	const unsigned char* data;
+	unsigned int size;
+} bbfw_output;
+
+bbfw_bundle* bbfw_bundle_open(const char* path);
+void bbfw_bundle_free(bbfw_bundle* bundle);
+int bbfw_bundle_locate(bbfw_bundle* bundle, const char* name);
+
+/* returns the signed image if there is one, the original otherwise */
+const unsigned char* bbfw_entry_get_data(bbfw_entry* entry, unsigned int* size);
+int bbfw_entry_set_signed(bbfw_entry* entry, const unsigned char* data, unsigned int size, const unsigned char* blob, unsigned int blob_size);
+int bbfw_entry_is_signed_with(bbfw_entry* entry, const unsigned char* blob, unsigned int blob_size);
+
+/* builds a zip archive of files in memory */
+int bbfw_write_archive(const bbfw_output* files, int num_files, unsigned char** data, size_t* size);
+
+#endif
@@ -0,0 +1,815 @@
+/*
+ * bench.c
+ * Offline benchmark of the extraction, personalization and signing code
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#include <plist/plist.h>
+
+#include "idevicerestore.h"
+#include "common.h"
+#include "ipsw.h"
+#include "tss.h"
+#include "img3.h"
+#include "fls.h"
+#include "mbn.h"
+#include "bbfw.h"
+#include "log.h"
+
+#define BENCH_DEFAULT_ITERATIONS 10
+/* root filesystems are streamed to the device, never held in memory */
+#define BENCH_MAX_COMPONENT_SIZE (256 * 1024 * 1024)
+/* the usual sizes of an ApImg4Ticket, a baseband image signature and a BBTicket */
+#define BENCH_IMG4_TICKET_SIZE 4096
+#define BENCH_BB_SIG_SIZE 0x100
+#define BENCH_BBTICKET_SIZE 0x400
+
+/* one run of an operation, bytes is what it processed */
+typedef int (*bench_fn)(void* arg, uint64_t* bytes);
+
+/* what the process running an operation reports back */
+struct bench_sample {
+	int result;
+	int iterations;
+	uint64_t bytes;
+	uint64_t min_us;
+	uint64_t median_us;
+	/* how much the peak RSS grew while the operation ran */
+	uint64_t peak_rss_kb;
+};
+
+struct bench_result {
+	const char* operation;
+	char* name;
+	struct bench_sample sample;
+};
+
+struct bench {
+	int iterations;
+	struct bench_result* results;
+	int num_results;
+	int failed;
+};
+
+struct bench_component {
+	ipsw_archive* archive;
+	char* component;
+	char* path;
+	unsigned char* data;
+	unsigned int size;
+	plist_t tss;
+};
+
+struct bench_extract_file {
+	ipsw_archive* archive;
+	const char* path;
+	const char* outfile;
+};
+
+struct bench_tss {
+	plist_t build_identity;
+	char* hardware_model;
+	int image4;
+	tss_template_t template;
+	plist_t parameters;
+};
+
+struct bench_bbfw_entry {
+	bbfw_entry* entry;
+	const unsigned char* blob;
+	unsigned int blob_size;
+};
+
+struct bench_bbfw_package {
+	bbfw_output* files;
+	int num_files;
+};
+
+static struct option longopts[] = {
+	{ "iterations", required_argument, NULL, 'n' },
+	{ "identity",   required_argument, NULL, 'i' },
+	{ "ticket",     required_argument, NULL, 't' },
+	{ "output",     required_argument, NULL, 'o' },
+	{ "help",       no_argument,       NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void bench_usage(int argc, char* argv[])
+{
+	(void)argc;
+	char* name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] IPSW\n", (name ? name + 1 : argv[0]));
+	printf("Time the extraction, personalization, TSS request and baseband signing\n");
+	printf("code of idevicerestore on a local IPSW, without a device or network.\n\n");
+	printf("  -n, --iterations N\trun every operation N times (default %d)\n", BENCH_DEFAULT_ITERATIONS);
+	printf("  -i, --identity N\tuse build identity N of the BuildManifest (default 0)\n");
+	printf("  -t, --ticket FILE\tpersonalize with the tickets of an SHSH plist instead of\n");
+	printf("\t\t\tsynthetic ones\n");
+	printf("  -o, --output FILE\twrite the results to FILE, CSV if it ends in .csv and\n");
+	printf("\t\t\tJSON otherwise (default: JSON on stdout)\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+static uint64_t bench_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t bench_peak_rss_kb(void)
+{
+#ifdef WIN32
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss / 1024;
+#else
+	return (uint64_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+static int bench_compare_us(const void* a, const void* b)
+{
+	uint64_t ua = *(const uint64_t*)a;
+	uint64_t ub = *(const uint64_t*)b;
+	return (ua < ub) ? -1 : (ua > ub) ? 1 : 0;
+}
+
+static void bench_measure(struct bench* bench, bench_fn fn, void* arg, struct bench_sample* sample)
+{
+	int i;
+
+	memset(sample, '\0', sizeof(struct bench_sample));
+	uint64_t* times = (uint64_t*)calloc(bench->iterations, sizeof(uint64_t));
+	if (!times) {
+		sample->result = -1;
+		return;
+	}
+
+	uint64_t peak = bench_peak_rss_kb();
+	for (i = 0; i < bench->iterations && sample->result == 0; i++) {
+		uint64_t start = bench_time_us();
+		sample->result = fn(arg, &sample->bytes);
+		times[i] = bench_time_us() - start;
+	}
+	uint64_t after = bench_peak_rss_kb();
+
+	qsort(times, i, sizeof(uint64_t), bench_compare_us);
+	sample->iterations = i;
+	sample->min_us = times[0];
+	sample->median_us = times[i / 2];
+	sample->peak_rss_kb = (after > peak) ? after - peak : 0;
+	free(times);
+}
+
+static void bench_run(struct bench* bench, const char* operation, const char* name, bench_fn fn, void* arg)
+{
+	struct bench_sample sample;
+	int measured = 0;
+
+	struct bench_result* results = (struct bench_result*)realloc(bench->results, (bench->num_results + 1) * sizeof(struct bench_result));
+	if (!results) {
+		error("ERROR: Out of memory\n");
+		bench->failed++;
+		return;
+	}
+	bench->results = results;
+
+	// the components print what they personalize, on every iteration
+	idevicerestore_set_info_stream(NULL);
+#ifndef WIN32
+	/* every operation gets a process of its own, so its peak RSS is not
+	 * hidden by a larger one that ran before it */
+	int fds[2];
+	log_flush();
+	if (pipe(fds) == 0) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			// the log writer thread is not part of the child
+			idevicerestore_set_error_stream(NULL);
+			bench_measure(bench, fn, arg, &sample);
+			ssize_t written = write(fds[1], &sample, sizeof(sample));
+			_exit((written == sizeof(sample)) ? 0 : 1);
+		}
+		close(fds[1]);
+		if (pid > 0) {
+			size_t got = 0;
+			while (got < sizeof(sample)) {
+				ssize_t n = read(fds[0], (char*)&sample + got, sizeof(sample) - got);
+				if (n <= 0) {
+					break;
+				}
+				got += n;
+			}
+			waitpid(pid, NULL, 0);
+			if (got != sizeof(sample)) {
+				memset(&sample, '\0', sizeof(sample));
+				sample.result = -1;
+			}
+			measured = 1;
+		}
+		close(fds[0]);
+	}
+#endif
+	if (!measured) {
+		bench_measure(bench, fn, arg, &sample);
+	}
+	idevicerestore_set_info_stream(stderr);
+
+	if (sample.result != 0) {
+		error("ERROR: %s of %s failed\n", operation, name);
+		bench->failed++;
+	} else {
+		info("%-14s %-28s %8llu us %10llu bytes\n", operation, name, (long long unsigned int)sample.median_us, (long long unsigned int)sample.bytes);
+	}
+	bench->results[bench->num_results].operation = operation;
+	bench->results[bench->num_results].name = strdup(name);
+	bench->results[bench->num_results].sample = sample;
+	bench->num_results++;
+}
+
+static int bench_extract(void* arg, uint64_t* bytes)
+{
+	struct bench_component* c = (struct bench_component*)arg;
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+
+	if (extract_component(c->archive, c->path, &data, &size) < 0) {
+		return -1;
+	}
+	*bytes = size;
+	free(data);
+	return 0;
+}
+
+static int bench_extract_file(void* arg, uint64_t* bytes)
+{
+	struct bench_extract_file* e = (struct bench_extract_file*)arg;
+	struct stat st;
+
+	int res = ipsw_archive_extract_to_file_with_progress(e->archive, e->path, e->outfile, 0);
+	if (res == 0 && stat(e->outfile, &st) == 0) {
+		*bytes = (uint64_t)st.st_size;
+	}
+	remove(e->outfile);
+	return res;
+}
+
+static int bench_personalize(void* arg, uint64_t* bytes)
+{
+	struct bench_component* c = (struct bench_component*)arg;
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+
+	if (personalize_component(c->component, c->data, c->size, c->tss, &data, &size) < 0) {
+		return -1;
+	}
+	*bytes = size;
+	free(data);
+	return 0;
+}
+
+static int bench_tss_template(void* arg, uint64_t* bytes)
+{
+	struct bench_tss* t = (struct bench_tss*)arg;
+
+	// templates are cached, only a miss shows what building one costs
+	tss_template_cache_clear();
+	tss_template_t tmpl = tss_template_get(t->build_identity, t->hardware_model, t->image4);
+	if (!tmpl) {
+		return -1;
+	}
+	tss_template_free(tmpl);
+	*bytes = 0;
+	return 0;
+}
+
+static int bench_tss_request(void* arg, uint64_t* bytes)
+{
+	struct bench_tss* t = (struct bench_tss*)arg;
+
+	plist_t request = tss_template_create_request(t->template, t->parameters, 0);
+	if (!request) {
+		return -1;
+	}
+	plist_free(request);
+	*bytes = 0;
+	return 0;
+}
+
+static int bench_fls_sign(void* arg, uint64_t* bytes)
+{
+	struct bench_bbfw_entry* b = (struct bench_bbfw_entry*)arg;
+
+	fls_file* fls = fls_parse(b->entry->data, b->entry->size);
+	if (!fls) {
+		return -1;
+	}
+	int res = fls_update_sig_blob(fls, b->blob, b->blob_size);
+	*bytes = fls->size;
+	fls_free(fls);
+	return res;
+}
+
+static int bench_fls_ticket(void* arg, uint64_t* bytes)
+{
+	struct bench_bbfw_entry* b = (struct bench_bbfw_entry*)arg;
+
+	fls_file* fls = fls_parse(b->entry->data, b->entry->size);
+	if (!fls) {
+		return -1;
+	}
+	int res = fls_insert_ticket(fls, b->blob, b->blob_size);
+	*bytes = fls->size;
+	fls_free(fls);
+	return res;
+}
+
+static int bench_mbn_sign(void* arg, uint64_t* bytes)
+{
+	struct bench_bbfw_entry* b = (struct bench_bbfw_entry*)arg;
+
+	mbn_file* mbn = mbn_parse(b->entry->data, b->entry->size);
+	if (!mbn) {
+		return -1;
+	}
+	int res = mbn_update_sig_blob(mbn, b->blob, b->blob_size);
+	*bytes = mbn->size;
+	mbn_free(mbn);
+	return res;
+}
+
+static int bench_bbfw_package(void* arg, uint64_t* bytes)
+{
+	struct bench_bbfw_package* p = (struct bench_bbfw_package*)arg;
+	unsigned char* data = NULL;
+	size_t size = 0;
+
+	if (bbfw_write_archive(p->files, p->num_files, &data, &size) < 0) {
+		return -1;
+	}
+	*bytes = size;
+	free(data);
+	return 0;
+}
+
+/* Image3 blobs are an ECID, SHSH and CERT element, the first one sized
+ * like the 64 bytes personalize_component() hands to img3 */
+static void bench_add_img3_blob(plist_t tss, const char* component)
+{
+	unsigned int sizes[3] = { 64, 12 + 128, 12 + 0x300 };
+	unsigned int types[3] = { kEcidElement, kShshElement, kCertElement };
+	unsigned int total = sizes[0] + sizes[1] + sizes[2];
+	unsigned int offset = 0;
+	int i;
+
+	unsigned char* blob = (unsigned char*)calloc(1, total);
+	if (!blob) {
+		return;
+	}
+	for (i = 0; i < 3; i++) {
+		img3_element_header* header = (img3_element_header*)(blob + offset);
+		header->signature = types[i];
+		header->full_size = sizes[i];
+		header->data_size = sizes[i] - sizeof(img3_element_header);
+		offset += sizes[i];
+	}
+	plist_t entry = plist_new_dict();
+	plist_dict_set_item(entry, "Blob", plist_new_data((const char*)blob, total));
+	plist_dict_set_item(tss, component, entry);
+	free(blob);
+}
+
+/* an ApImg4Ticket is only wrapped into the IMG4, any DER sequence will do */
+static void bench_add_img4_ticket(plist_t tss)
+{
+	unsigned char* ticket = (unsigned char*)calloc(1, BENCH_IMG4_TICKET_SIZE);
+	if (!ticket) {
+		return;
+	}
+	ticket[0] = 0x30;
+	ticket[1] = 0x82;
+	ticket[2] = ((BENCH_IMG4_TICKET_SIZE - 4) >> 8) & 0xFF;
+	ticket[3] = (BENCH_IMG4_TICKET_SIZE - 4) & 0xFF;
+	plist_dict_set_item(tss, "ApImg4Ticket", plist_new_data((const char*)ticket, BENCH_IMG4_TICKET_SIZE));
+	free(ticket);
+}
+
+static plist_t bench_read_ticket(const char* path)
+{
+	char* data = NULL;
+	size_t size = 0;
+	plist_t tss = NULL;
+
+	if (read_file(path, (void**)&data, &size) < 0) {
+		return NULL;
+	}
+	if (size > 8 && memcmp(data, "bplist00", 8) == 0) {
+		plist_from_bin(data, (uint32_t)size, &tss);
+	} else {
+		plist_from_xml(data, (uint32_t)size, &tss);
+	}
+	free(data);
+	if (!tss || plist_get_node_type(tss) != PLIST_DICT) {
+		error("ERROR: %s is not an SHSH plist\n", path);
+		plist_free(tss);
+		return NULL;
+	}
+	return tss;
+}
+
+static int bench_load_components(ipsw_archive* archive, plist_t build_identity, struct bench_component** components)
+{
+	int count = 0;
+	char* key = NULL;
+	plist_t node = NULL;
+	plist_dict_iter iter = NULL;
+
+	*components = NULL;
+	plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+	if (!manifest || plist_get_node_type(manifest) != PLIST_DICT) {
+		error("ERROR: Unable to find Manifest node\n");
+		return -1;
+	}
+	plist_dict_new_iter(manifest, &iter);
+	do {
+		key = NULL;
+		plist_dict_next_item(manifest, iter, &key, &node);
+		if (!key) {
+			break;
+		}
+		char* path = NULL;
+		off_t size = 0;
+		plist_t path_node = plist_access_path(node, 2, "Info", "Path");
+		if (path_node && plist_get_node_type(path_node) == PLIST_STRING) {
+			plist_get_string_val(path_node, &path);
+		}
+		if (!path || strcmp(key, "BasebandFirmware") == 0 || ipsw_archive_get_file_size(archive, path, &size) < 0
+		    || size <= 0 || size > BENCH_MAX_COMPONENT_SIZE) {
+			free(path);
+			free(key);
+			continue;
+		}
+		struct bench_component* grown = (struct bench_component*)realloc(*components, (count + 1) * sizeof(struct bench_component));
+		if (!grown) {
+			free(path);
+			free(key);
+			break;
+		}
+		*components = grown;
+		struct bench_component* c = &(*components)[count];
+		memset(c, '\0', sizeof(struct bench_component));
+		c->archive = archive;
+		c->component = key;
+		c->path = path;
+		if (extract_component(archive, path, &c->data, &c->size) < 0) {
+			free(c->component);
+			free(c->path);
+			continue;
+		}
+		count++;
+	} while (key);
+	free(iter);
+
+	return count;
+}
+
+static void bench_run_baseband(struct bench* bench, ipsw_archive* archive, plist_t build_identity)
+{
+	char* path = NULL;
+	int i;
+
+	plist_t node = plist_access_path(build_identity, 4, "Manifest", "BasebandFirmware", "Info", "Path");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		info("NOTE: No baseband firmware in this build identity\n");
+		return;
+	}
+	plist_get_string_val(node, &path);
+	char* bbfwfn = tempnam(NULL, "bbfw_");
+	if (!path || !bbfwfn) {
+		free(path);
+		free(bbfwfn);
+		return;
+	}
+
+	struct bench_extract_file extract = { archive, path, bbfwfn };
+	bench_run(bench, "extract_file", path, bench_extract_file, &extract);
+	if (ipsw_archive_extract_to_file_with_progress(archive, path, bbfwfn, 0) < 0) {
+		free(path);
+		free(bbfwfn);
+		return;
+	}
+	bbfw_bundle* bundle = bbfw_bundle_open(bbfwfn);
+	remove(bbfwfn);
+	free(bbfwfn);
+	free(path);
+	if (!bundle) {
+		return;
+	}
+
+	unsigned char sig[BENCH_BB_SIG_SIZE];
+	unsigned char bbticket[BENCH_BBTICKET_SIZE];
+	memset(sig, 0xA5, sizeof(sig));
+	memset(bbticket, 0x5A, sizeof(bbticket));
+
+	bbfw_output* files = (bbfw_output*)calloc(bundle->num_entries + 1, sizeof(bbfw_output));
+	if (!files) {
+		bbfw_bundle_free(bundle);
+		return;
+	}
+	for (i = 0; i < bundle->num_entries; i++) {
+		bbfw_entry* entry = &bundle->entries[i];
+		const char* ext = strrchr(entry->name, '.');
+		struct bench_bbfw_entry signing = { entry, sig, sizeof(sig) };
+		if (ext && !strcmp(ext, ".fls")) {
+			bench_run(bench, "fls_sign", entry->name, bench_fls_sign, &signing);
+			if (!strcmp(entry->name, "ebl.fls")) {
+				struct bench_bbfw_entry ticketing = { entry, bbticket, sizeof(bbticket) };
+				bench_run(bench, "fls_ticket", entry->name, bench_fls_ticket, &ticketing);
+			}
+		} else if (ext && !strcmp(ext, ".mbn")) {
+			bench_run(bench, "mbn_sign", entry->name, bench_mbn_sign, &signing);
+		}
+		files[i].name = entry->name;
+		files[i].data = entry->data;
+		files[i].size = entry->size;
+	}
+	files[bundle->num_entries].name = "bbticket.der";
+	files[bundle->num_entries].data = bbticket;
+	files[bundle->num_entries].size = sizeof(bbticket);
+
+	struct bench_bbfw_package package = { files, bundle->num_entries + 1 };
+	bench_run(bench, "bbfw_package", "BasebandFirmware", bench_bbfw_package, &package);
+
+	free(files);
+	bbfw_bundle_free(bundle);
+}
+
+static void bench_write_json_string(FILE* f, const char* str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fputc('\\', f);
+			fputc(*str, f);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+/* bytes per second of the median run */
+static uint64_t bench_throughput(const struct bench_sample* s)
+{
+	if (s->bytes == 0 || s->median_us == 0) {
+		return 0;
+	}
+	return (s->bytes * 1000000) / s->median_us;
+}
+
+static int bench_write(struct bench* bench, const char* path, const char* ipsw)
+{
+	FILE* f = stdout;
+	int csv = 0;
+	int i;
+
+	if (path) {
+		size_t len = strlen(path);
+		csv = (len > 4 && strcasecmp(path + len - 4, ".csv") == 0);
+		f = fopen(path, "w");
+		if (!f) {
+			error("ERROR: Unable to open %s\n", path);
+			return -1;
+		}
+	}
+
+	if (csv) {
+		fprintf(f, "operation,name,iterations,bytes,min_us,median_us,bytes_per_sec,peak_rss_kb,result\n");
+	} else {
+		fprintf(f, "{\"ipsw\":");
+		bench_write_json_string(f, ipsw);
+		fprintf(f, ",\"results\":[");
+	}
+	for (i = 0; i < bench->num_results; i++) {
+		const struct bench_result* r = &bench->results[i];
+		const struct bench_sample* s = &r->sample;
+		if (csv) {
+			fprintf(f, "%s,\"%s\",%d," FMT_qu "," FMT_qu "," FMT_qu "," FMT_qu "," FMT_qu ",%d\n", r->operation, r->name, s->iterations,
+				(long long unsigned int)s->bytes, (long long unsigned int)s->min_us, (long long unsigned int)s->median_us,
+				(long long unsigned int)bench_throughput(s), (long long unsigned int)s->peak_rss_kb, s->result);
+		} else {
+			fprintf(f, "%s{\"operation\":\"%s\",\"name\":", (i > 0) ? "," : "", r->operation);
+			bench_write_json_string(f, r->name);
+			fprintf(f, ",\"iterations\":%d,\"bytes\":" FMT_qu ",\"min_us\":" FMT_qu ",\"median_us\":" FMT_qu ",\"bytes_per_sec\":" FMT_qu ",\"peak_rss_kb\":" FMT_qu ",\"result\":%d}",
+				s->iterations, (long long unsigned int)s->bytes, (long long unsigned int)s->min_us, (long long unsigned int)s->median_us,
+				(long long unsigned int)bench_throughput(s), (long long unsigned int)s->peak_rss_kb, s->result);
+		}
+	}
+	if (!csv) {
+		fprintf(f, "]}\n");
+	}
+
+	if (f != stdout) {
+		fclose(f);
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench bench;
+	struct bench_component* components = NULL;
+	plist_t buildmanifest = NULL;
+	plist_t tss = NULL;
+	const char* ticket = NULL;
+	const char* output = NULL;
+	int identity = 0;
+	int tss_enabled = 0;
+	int num_components = 0;
+	int opt;
+	int i;
+
+	memset(&bench, '\0', sizeof(bench));
+	bench.iterations = BENCH_DEFAULT_ITERATIONS;
+
+	while ((opt = getopt_long(argc, argv, "n:i:t:o:h", longopts, NULL)) > 0) {
+		switch (opt) {
+		case 'n':
+			bench.iterations = atoi(optarg);
+			if (bench.iterations < 1) {
+				error("ERROR: Invalid number of iterations '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			identity = atoi(optarg);
+			break;
+		case 't':
+			ticket = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'h':
+			bench_usage(argc, argv);
+			return 0;
+		default:
+			bench_usage(argc, argv);
+			return -1;
+		}
+	}
+	if (optind >= argc) {
+		bench_usage(argc, argv);
+		return -1;
+	}
+	const char* ipsw = argv[optind];
+
+	// results may go to stdout
+	idevicerestore_set_info_stream(stderr);
+
+	ipsw_archive* archive = ipsw_open(ipsw);
+	if (!archive) {
+		error("ERROR: Unable to open %s\n", ipsw);
+		return -1;
+	}
+	if (ipsw_archive_extract_build_manifest(archive, &buildmanifest, &tss_enabled) < 0) {
+		error("ERROR: Unable to extract BuildManifest from %s\n", ipsw);
+		ipsw_close(archive);
+		return -1;
+	}
+	plist_t build_identity = build_manifest_get_build_identity(buildmanifest, identity);
+	if (!build_identity) {
+		error("ERROR: There is no build identity %d in the BuildManifest\n", identity);
+		plist_free(buildmanifest);
+		ipsw_close(archive);
+		return -1;
+	}
+
+	num_components = bench_load_components(archive, build_identity, &components);
+	if (num_components <= 0) {
+		error("ERROR: No components to benchmark in %s\n", ipsw);
+		plist_free(build_identity);
+		plist_free(buildmanifest);
+		ipsw_close(archive);
+		return -1;
+	}
+
+	// Image3 files start with their magic in little endian
+	int image4 = !(components[0].size >= 4 && memcmp(components[0].data, "3gmI", 4) == 0);
+	if (ticket) {
+		tss = bench_read_ticket(ticket);
+		if (!tss) {
+			image4 = -1;
+		}
+	} else {
+		tss = plist_new_dict();
+		if (image4) {
+			bench_add_img4_ticket(tss);
+		} else {
+			for (i = 0; i < num_components; i++) {
+				bench_add_img3_blob(tss, components[i].component);
+			}
+		}
+	}
+	info("Benchmarking %d components of build identity %d, %d iterations each\n", num_components, identity, bench.iterations);
+
+	for (i = 0; i < num_components; i++) {
+		bench_run(&bench, "extract", components[i].component, bench_extract, &components[i]);
+	}
+	if (tss) {
+		for (i = 0; i < num_components; i++) {
+			components[i].tss = tss;
+			bench_run(&bench, "personalize", components[i].component, bench_personalize, &components[i]);
+		}
+	} else {
+		bench.failed++;
+	}
+
+	struct bench_tss request;
+	memset(&request, '\0', sizeof(request));
+	request.build_identity = build_identity;
+	request.image4 = (image4 > 0);
+	plist_t node = plist_access_path(build_identity, 2, "Info", "DeviceClass");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &request.hardware_model);
+	}
+	if (request.hardware_model) {
+		unsigned char nonce[32];
+		unsigned char sep_nonce[20];
+		memset(nonce, 0x11, sizeof(nonce));
+		memset(sep_nonce, 0x22, sizeof(sep_nonce));
+		bench_run(&bench, "tss_template", request.hardware_model, bench_tss_template, &request);
+		request.template = tss_template_get(build_identity, request.hardware_model, request.image4);
+		request.parameters = plist_new_dict();
+		plist_dict_set_item(request.parameters, "ApECID", plist_new_uint(0x1122334455667788ULL));
+		plist_dict_set_item(request.parameters, "ApNonce", plist_new_data((const char*)nonce, sizeof(nonce)));
+		plist_dict_set_item(request.parameters, "ApSepNonce", plist_new_data((const char*)sep_nonce, sizeof(sep_nonce)));
+		if (request.template) {
+			bench_run(&bench, "tss_request", request.hardware_model, bench_tss_request, &request);
+		}
+		tss_template_free(request.template);
+		plist_free(request.parameters);
+		free(request.hardware_model);
+	} else {
+		error("ERROR: Unable to find DeviceClass in build identity %d\n", identity);
+		bench.failed++;
+	}
+
+	bench_run_baseband(&bench, archive, build_identity);
+
+	bench_write(&bench, output, ipsw);
+
+	for (i = 0; i < bench.num_results; i++) {
+		free(bench.results[i].name);
+	}
+	free(bench.results);
+	for (i = 0; i < num_components; i++) {
+		free(components[i].component);
+		free(components[i].path);
+		free(components[i].data);
+	}
+	free(components);
+	plist_free(tss);
+	plist_free(build_identity);
+	plist_free(buildmanifest);
+	ipsw_close(archive);
+
+	return (bench.failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * budget.c
+ * Memory budget for the component buffers of all restores in a process
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+
+#include "budget.h"
+#include "thread.h"
+
+#define BUDGET_POLL_INTERVAL 100
+
+static thread_once_t budget_once = THREAD_ONCE_INIT;
+static mutex_t budget_lock;
+static cond_t budget_cond;
+static uint64_t budget_limit = 0;
+static struct budget_account budget_total;
+/* accounts with anything charged, and those of them that are waiting */
+static int budget_holders = 0;
+static int budget_stuck = 0;
+
+static void budget_init(void)
+{
+	mutex_init(&budget_lock);
+	cond_init(&budget_cond);
+}
+
+/* called with budget_lock held */
+static int budget_is_stuck(const struct budget_account* account)
+{
+	return account->waiting > 0 && account->current > 0;
+}
+
+/* called with budget_lock held, after account changed from what
+ * was_holder and was_stuck describe */
+static void budget_track(const struct budget_account* account, int was_holder, int was_stuck)
+{
+	budget_holders += (account->current > 0) - was_holder;
+	budget_stuck += budget_is_stuck(account) - was_stuck;
+}
+
+/* called with budget_lock held */
+static void budget_add(struct budget_account* account, uint64_t size)
+{
+	int was_holder = (account->current > 0);
+	int was_stuck = budget_is_stuck(account);
+
+	account->current += size;
+	if (account->current > account->peak) {
+		account->peak = account->current;
+	}
+	budget_total.current += size;
+	if (budget_total.current > budget_total.peak) {
+		budget_total.peak = budget_total.current;
+	}
+	budget_track(account, was_holder, was_stuck);
+}
+
+/* called with budget_lock held */
+static void budget_sub(struct budget_account* account, uint64_t size)
+{
+	int was_holder = (account->current > 0);
+	int was_stuck = budget_is_stuck(account);
+
+	if (size > account->current) {
+		size = account->current;
+	}
+	account->current -= size;
+	budget_total.current -= size;
+	budget_track(account, was_holder, was_stuck);
+	cond_broadcast(&budget_cond);
+}
+
+/* called with budget_lock held */
+static int budget_fits(uint64_t size)
+{
+	return budget_limit == 0 || budget_total.current == 0 || budget_total.current + size <= budget_limit;
+}
+
+void budget_set_limit(uint64_t limit)
+{
+	thread_once(&budget_once, budget_init);
+	mutex_lock(&budget_lock);
+	budget_limit = limit;
+	cond_broadcast(&budget_cond);
+	mutex_unlock(&budget_lock);
+}
+
+uint64_t budget_get_limit(void)
+{
+	thread_once(&budget_once, budget_init);
+	mutex_lock(&budget_lock);
+	uint64_t limit = budget_limit;
+	mutex_unlock(&budget_lock);
+	return limit;
+}
+
+int budget_reserve(struct budget_account* account, uint64_t size, int (*interrupt)(void* arg), void* arg)
+{
+	if (!account) {
+		return -1;
+	}
+
+	thread_once(&budget_once, budget_init);
+	mutex_lock(&budget_lock);
+	while (!budget_fits(size)) {
+		if (interrupt && interrupt(arg)) {
+			mutex_unlock(&budget_lock);
+			return -1;
+		}
+		cond_wait_timeout(&budget_cond, &budget_lock, BUDGET_POLL_INTERVAL);
+	}
+	budget_add(account, size);
+	mutex_unlock(&budget_lock);
+
+	return 0;
+}
+
+int budget_acquire(struct budget_account* account, uint64_t size, int (*interrupt)(void* arg), void* arg)
+{
+	int res = 0;
+
+	if (!account) {
+		return -1;
+	}
+	if (size == 0) {
+		return 0;
+	}
+
+	thread_once(&budget_once, budget_init);
+	mutex_lock(&budget_lock);
+	int was_stuck = budget_is_stuck(account);
+	account->waiting++;
+	budget_stuck += budget_is_stuck(account) - was_stuck;
+	/* Waiting only helps while some other account can still free what it
+	 * holds. Once all of them wait as well, one of them goes ahead. */
+	while (!budget_fits(size) && budget_total.current > account->current && budget_stuck < budget_holders) {
+		if (interrupt && interrupt(arg)) {
+			res = -1;
+			break;
+		}
+		cond_wait_timeout(&budget_cond, &budget_lock, BUDGET_POLL_INTERVAL);
+	}
+	was_stuck = budget_is_stuck(account);
+	account->waiting--;
+	budget_stuck += budget_is_stuck(account) - was_stuck;
+	if (res == 0) {
+		budget_add(account, size);
+	}
+	mutex_unlock(&budget_lock);
+
+	return res;
+}
+
+int budget_resize(struct budget_account* account, uint64_t* charged, uint64_t size, int (*interrupt)(void* arg), void* arg)
+{
+	if (!account || !charged) {
+		return -1;
+	}
+
+	if (size > *charged) {
+		if (budget_acquire(account, size - *charged, interrupt, arg) < 0) {
+			return -1;
+		}
+	} else {
+		budget_release(account, *charged - size);
+	}
+	*charged = size;
+
+	return 0;
+}
+
+void budget_release(struct budget_account* account, uint64_t size)
+{
+	if (!account || size == 0) {
+		return;
+	}
+
+	thread_once(&budget_once, budget_init);
+	mutex_lock(&budget_lock);
+	budget_sub(account, size);
+	mutex_unlock(&budget_lock);
+}
+
+void budget_get_usage(const struct budget_account* account, uint64_t* current, uint64_t* peak)
+{
+	thread_once(&budget_once, budget_init);
+	mutex_lock(&budget_lock);
+	if (!account) {
+		account = &budget_total;
+	}
+	if (current) {
+		*current = account->current;
+	}
+	if (peak) {
+		*peak = account->peak;
+	}
+	mutex_unlock(&budget_lock);
+}
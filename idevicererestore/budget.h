@@ -0,0 +1,72 @@
+/*
+ * budget.h
+ * Memory budget for the component buffers of all restores in a process
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_BUDGET_H
+#define IDEVICERESTORE_BUDGET_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Every client charges the extracted, personalized and plist copies of
+ * the components it holds to its account, and all accounts share one
+ * process wide limit. Room is taken before a buffer is allocated. Work
+ * done ahead of time waits for it with budget_reserve() and gives up
+ * when it is interrupted. The restore itself waits with budget_acquire(),
+ * which also lets it through once no other account could free anything,
+ * so restores waiting on each other always progress. */
+struct budget_account {
+	uint64_t current;
+	uint64_t peak;
+	/* threads waiting in budget_acquire() */
+	int waiting;
+};
+
+/* 0, the default, doesn't limit anything */
+void budget_set_limit(uint64_t limit);
+uint64_t budget_get_limit(void);
+
+/* Charges size bytes once they fit under the limit, or right away if
+ * nothing else is charged. interrupt is polled while waiting, if it
+ * returns non-zero nothing is charged and -1 is returned. */
+int budget_reserve(struct budget_account* account, uint64_t size, int (*interrupt)(void* arg), void* arg);
+
+/* Like budget_reserve(), but size is also charged when account holds
+ * everything that is charged, or when every account holding memory is
+ * waiting in here too. */
+int budget_acquire(struct budget_account* account, uint64_t size, int (*interrupt)(void* arg), void* arg);
+
+/* Moves what account has charged for a buffer from *charged to size,
+ * acquiring any growth like budget_acquire(). *charged is left as it was
+ * if that is interrupted. */
+int budget_resize(struct budget_account* account, uint64_t* charged, uint64_t size, int (*interrupt)(void* arg), void* arg);
+
+/* size is clamped to what account has charged */
+void budget_release(struct budget_account* account, uint64_t size);
+
+/* current and peak usage of account, or of the whole process if NULL */
+void budget_get_usage(const struct budget_account* account, uint64_t* current, uint64_t* peak);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
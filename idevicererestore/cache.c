@@ -0,0 +1,601 @@
+/*
+ * cache.c
+ * Functions for the on-disk cache of reusable restore data
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <utime.h>
+#endif
+
+#include "cache.h"
+#include "common.h"
+#include "thread.h"
+#include "hash.h"
+
+int cache_get_path(const char* cache_dir, const char* bucket, const unsigned char* key, unsigned int key_size, char* path, size_t path_size) {
+	unsigned int i = 0;
+	size_t len = 0;
+
+	if (!cache_dir || !bucket || !key || key_size == 0) {
+		return -1;
+	}
+
+	len = snprintf(path, path_size, "%s/%s", cache_dir, bucket);
+	if (len + 2 * key_size + 2 > path_size) {
+		error("ERROR: Cache path for %s is too long\n", bucket);
+		return -1;
+	}
+	if (mkdir_with_parents(path, 0755) < 0) {
+		error("ERROR: Unable to create cache directory %s\n", path);
+		return -1;
+	}
+
+	path[len++] = '/';
+	for (i = 0; i < key_size; i++) {
+		len += sprintf(path + len, "%02x", key[i]);
+	}
+
+	return 0;
+}
+
+int cache_create_temp(const char* path, char* tmpf, size_t tmpf_size) {
+	int fd = -1;
+
+	if (snprintf(tmpf, tmpf_size, "%s.XXXXXX", path) >= (int)tmpf_size) {
+		return -1;
+	}
+#ifdef WIN32
+	if (_mktemp(tmpf) == NULL) {
+		return -1;
+	}
+	fd = open(tmpf, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+#else
+	fd = mkstemp(tmpf);
+#endif
+	if (fd < 0) {
+		error("ERROR: Unable to create %s: %s\n", tmpf, strerror(errno));
+		return -1;
+	}
+
+	return fd;
+}
+
+int cache_publish_file(const char* tmpf, const char* path) {
+#ifdef WIN32
+	remove(path);
+#endif
+	if (rename(tmpf, path) < 0) {
+		error("ERROR: Unable to rename %s to %s: %s\n", tmpf, path, strerror(errno));
+		remove(tmpf);
+		return -1;
+	}
+
+	return 0;
+}
+
+int cache_publish(const char* path, const unsigned char* data, unsigned int size) {
+	char tmpf[1024];
+
+	int fd = cache_create_temp(path, tmpf, sizeof(tmpf));
+	if (fd < 0) {
+		return -1;
+	}
+
+	FILE* f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		remove(tmpf);
+		return -1;
+	}
+	size_t bytes = fwrite(data, 1, size, f);
+	if (fclose(f) != 0 || bytes != size) {
+		error("ERROR: Unable to write %s\n", tmpf);
+		remove(tmpf);
+		return -1;
+	}
+
+	return cache_publish_file(tmpf, path);
+}
+
+static int cache_hash_file(const char* file, unsigned char* sha1) {
+	FILE* f = fopen(file, "rb");
+	if (!f) {
+		return -1;
+	}
+	int res = hash_sha1_file(f, sha1);
+	fclose(f);
+	return res;
+}
+
+int cache_put_checksum(const char* path, const char* file) {
+	char sumfn[1024];
+	unsigned char sha1[HASH_SHA1_LENGTH];
+
+	if (cache_hash_file(file, sha1) < 0) {
+		return -1;
+	}
+	/* published before the entry, so an entry is never seen without it */
+	snprintf(sumfn, sizeof(sumfn), "%s.sha1", path);
+	return cache_publish(sumfn, sha1, sizeof(sha1));
+}
+
+int cache_check_checksum(const char* path) {
+	char sumfn[1024];
+	unsigned char stored[HASH_SHA1_LENGTH];
+	unsigned char sha1[HASH_SHA1_LENGTH];
+
+	snprintf(sumfn, sizeof(sumfn), "%s.sha1", path);
+	FILE* f = fopen(sumfn, "rb");
+	if (!f) {
+		/* entries from before checksums were kept are fetched again */
+		return -1;
+	}
+	size_t length = fread(stored, 1, sizeof(stored), f);
+	fclose(f);
+	if (length != sizeof(stored) || cache_hash_file(path, sha1) < 0) {
+		return -1;
+	}
+	return (memcmp(stored, sha1, sizeof(sha1)) == 0) ? 0 : -1;
+}
+
+void cache_remove(const char* path) {
+	char sumfn[1024];
+
+	remove(path);
+	snprintf(sumfn, sizeof(sumfn), "%s.sha1", path);
+	remove(sumfn);
+}
+
+int cache_map(const char* path, unsigned char** data, unsigned int* size, int* mapped) {
+	struct stat st;
+
+	*data = NULL;
+	*size = 0;
+	*mapped = 0;
+
+	if (stat(path, &st) < 0 || st.st_size <= 0 || (uint64_t)st.st_size > 0xFFFFFFFFULL) {
+		return -1;
+	}
+
+#ifndef WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map != MAP_FAILED) {
+		*data = (unsigned char*)map;
+		*size = (unsigned int)st.st_size;
+		*mapped = 1;
+		return 0;
+	}
+	debug("NOTE: Unable to map %s (%s), reading it instead\n", path, strerror(errno));
+#endif
+
+	size_t length = 0;
+	if (read_file(path, (void**)data, &length) < 0) {
+		return -1;
+	}
+	*size = (unsigned int)length;
+
+	return 0;
+}
+
+void cache_release(unsigned char* data, unsigned int size, int mapped) {
+	if (!data) {
+		return;
+	}
+#ifndef WIN32
+	if (mapped) {
+		munmap(data, size);
+		return;
+	}
+#endif
+	free(data);
+}
+
+/* fcntl() locks belong to the process and all of them are dropped as soon
+ * as any descriptor of the lock file is closed, so every entry is locked
+ * at most once per process and shared by the threads through this table */
+struct cache_lease {
+	char* path;
+	uint64_t size;
+	int refs;
+	int filling;
+	int fd;
+	struct cache_lease* next;
+};
+
+static struct cache_lease* cache_leases = NULL;
+static thread_once_t cache_leases_once = THREAD_ONCE_INIT;
+static mutex_t cache_leases_lock;
+static cond_t cache_leases_cond;
+
+static void cache_leases_init(void)
+{
+	mutex_init(&cache_leases_lock);
+	cond_init(&cache_leases_cond);
+}
+
+static int cache_entry_complete(const char* path, uint64_t size)
+{
+	struct stat st;
+	if (stat(path, &st) < 0) {
+		return 0;
+	}
+	return (size == 0 || (uint64_t)st.st_size == size);
+}
+
+#ifndef WIN32
+static int cache_lock_fd(int fd, short type, int wait)
+{
+	struct flock ldata;
+	memset(&ldata, '\0', sizeof(ldata));
+	ldata.l_type = type;
+	ldata.l_whence = SEEK_SET;
+	while (fcntl(fd, (wait) ? F_SETLKW : F_SETLK, &ldata) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* opens and locks <path>.lock, retrying if it was replaced by an eviction
+ * while we were waiting for the lock */
+static int cache_lock_entry(const char* path, short type)
+{
+	char lockfn[1024];
+	struct stat st_fd, st_path;
+
+	snprintf(lockfn, sizeof(lockfn), "%s.lock", path);
+	while (1) {
+		int fd = open(lockfn, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			debug("ERROR: could not open or create lockfile '%s'\n", lockfn);
+			return -1;
+		}
+		if (cache_lock_fd(fd, type, 1) < 0) {
+			debug("ERROR: can't lock file, error %d\n", errno);
+			close(fd);
+			return -1;
+		}
+		if (fstat(fd, &st_fd) == 0 && stat(lockfn, &st_path) == 0 && st_fd.st_ino == st_path.st_ino && st_fd.st_dev == st_path.st_dev) {
+			/* the lock file's modification time tracks the last use */
+			utime(lockfn, NULL);
+			return fd;
+		}
+		close(fd);
+	}
+}
+
+/* the cross process part of cache_lease_acquire() */
+static int cache_lease_lock(struct cache_lease* lease)
+{
+	while (1) {
+		lease->fd = cache_lock_entry(lease->path, F_RDLCK);
+		if (lease->fd < 0) {
+			return -1;
+		}
+		if (cache_entry_complete(lease->path, lease->size)) {
+			return CACHE_LEASE_READY;
+		}
+
+		/* wait for readers of an older copy and for other fillers */
+		if (cache_lock_fd(lease->fd, F_WRLCK, 1) < 0) {
+			/* EDEADLK, another process is upgrading as well */
+			close(lease->fd);
+			lease->fd = -1;
+			usleep(10000);
+			continue;
+		}
+		if (cache_entry_complete(lease->path, lease->size)) {
+			cache_lock_fd(lease->fd, F_RDLCK, 1);
+			return CACHE_LEASE_READY;
+		}
+		return CACHE_LEASE_FILL;
+	}
+}
+#else
+/* LockFileEx() can't convert locks, leases only coordinate threads here */
+static int cache_lease_lock(struct cache_lease* lease)
+{
+	lease->fd = -1;
+	return (cache_entry_complete(lease->path, lease->size)) ? CACHE_LEASE_READY : CACHE_LEASE_FILL;
+}
+#endif
+
+static void cache_lease_unlink(struct cache_lease* lease)
+{
+	struct cache_lease** p = &cache_leases;
+	while (*p && *p != lease) {
+		p = &(*p)->next;
+	}
+	if (*p) {
+		*p = lease->next;
+	}
+	if (lease->fd >= 0) {
+		close(lease->fd);
+	}
+	free(lease->path);
+	free(lease);
+}
+
+int cache_lease_acquire(const char* path, uint64_t size, cache_lease_t* lease)
+{
+	struct cache_lease* entry = NULL;
+	int res;
+
+	if (!path || !lease) {
+		return -1;
+	}
+	*lease = NULL;
+
+	thread_once(&cache_leases_once, cache_leases_init);
+	mutex_lock(&cache_leases_lock);
+	while (1) {
+		for (entry = cache_leases; entry; entry = entry->next) {
+			if (strcmp(entry->path, path) == 0) {
+				break;
+			}
+		}
+		if (!entry || !entry->filling) {
+			break;
+		}
+		/* block until the thread holding the entry has filled it */
+		cond_wait(&cache_leases_cond, &cache_leases_lock);
+	}
+
+	if (entry && entry->refs > 0 && entry->size == size) {
+		entry->refs++;
+		mutex_unlock(&cache_leases_lock);
+		*lease = entry;
+		return CACHE_LEASE_READY;
+	}
+	if (entry) {
+		/* still leased with a different expected size */
+		mutex_unlock(&cache_leases_lock);
+		error("ERROR: %s is in use with a different size\n", path);
+		return -1;
+	}
+
+	entry = (struct cache_lease*)malloc(sizeof(struct cache_lease));
+	if (!entry) {
+		mutex_unlock(&cache_leases_lock);
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	memset(entry, '\0', sizeof(struct cache_lease));
+	entry->path = strdup(path);
+	entry->size = size;
+	entry->fd = -1;
+	entry->filling = 1;
+	entry->next = cache_leases;
+	cache_leases = entry;
+	mutex_unlock(&cache_leases_lock);
+
+	res = cache_lease_lock(entry);
+
+	mutex_lock(&cache_leases_lock);
+	if (res < 0) {
+		cache_lease_unlink(entry);
+		cond_broadcast(&cache_leases_cond);
+		mutex_unlock(&cache_leases_lock);
+		return -1;
+	}
+	entry->refs = 1;
+	if (res == CACHE_LEASE_READY) {
+		entry->filling = 0;
+		cond_broadcast(&cache_leases_cond);
+	}
+	mutex_unlock(&cache_leases_lock);
+
+	*lease = entry;
+	return res;
+}
+
+int cache_lease_filled(cache_lease_t lease, int success)
+{
+	if (!lease) {
+		return -1;
+	}
+
+	mutex_lock(&cache_leases_lock);
+	if (success && cache_entry_complete(lease->path, lease->size)) {
+#ifndef WIN32
+		/* let the waiting readers in */
+		cache_lock_fd(lease->fd, F_RDLCK, 1);
+#endif
+		lease->filling = 0;
+		success = 1;
+	} else {
+		/* waiters retry filling it themselves */
+		cache_lease_unlink(lease);
+		success = 0;
+	}
+	cond_broadcast(&cache_leases_cond);
+	mutex_unlock(&cache_leases_lock);
+
+	return (success) ? 0 : -1;
+}
+
+void cache_lease_release(cache_lease_t lease)
+{
+	if (!lease) {
+		return;
+	}
+
+	mutex_lock(&cache_leases_lock);
+	if (--lease->refs <= 0) {
+		cache_lease_unlink(lease);
+	}
+	mutex_unlock(&cache_leases_lock);
+}
+
+struct cache_candidate {
+	char* path;
+	uint64_t size;
+	time_t last_used;
+};
+
+static int cache_candidate_compare(const void* a, const void* b)
+{
+	const struct cache_candidate* ca = (const struct cache_candidate*)a;
+	const struct cache_candidate* cb = (const struct cache_candidate*)b;
+	if (ca->last_used != cb->last_used) {
+		return (ca->last_used < cb->last_used) ? -1 : 1;
+	}
+	return strcmp(ca->path, cb->path);
+}
+
+/* collects the entries that have a lock file in the subdirectories of cache_dir */
+static int cache_collect_candidates(const char* cache_dir, struct cache_candidate** candidates, int* num_candidates)
+{
+	char path[1024];
+	struct dirent* ep;
+	struct dirent* fp;
+	int capacity = 0;
+	int count = 0;
+	struct cache_candidate* list = NULL;
+
+	DIR* dir = opendir(cache_dir);
+	if (!dir) {
+		return -1;
+	}
+	while ((ep = readdir(dir)) != NULL) {
+		if (ep->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, ep->d_name);
+		DIR* sub = opendir(path);
+		if (!sub) {
+			continue;
+		}
+		while ((fp = readdir(sub)) != NULL) {
+			size_t len = strlen(fp->d_name);
+			struct stat st_lock, st_entry;
+			if (len <= 5 || strcmp(fp->d_name + len - 5, ".lock") != 0) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s/%s", cache_dir, ep->d_name, fp->d_name);
+			if (stat(path, &st_lock) < 0) {
+				continue;
+			}
+			path[strlen(path) - 5] = '\0';
+			if (stat(path, &st_entry) < 0 || !S_ISREG(st_entry.st_mode)) {
+				continue;
+			}
+			if (count == capacity) {
+				capacity = (capacity) ? capacity * 2 : 16;
+				struct cache_candidate* grown = (struct cache_candidate*)realloc(list, capacity * sizeof(struct cache_candidate));
+				if (!grown) {
+					break;
+				}
+				list = grown;
+			}
+			list[count].path = strdup(path);
+			list[count].size = (uint64_t)st_entry.st_size;
+			list[count].last_used = st_lock.st_mtime;
+			count++;
+		}
+		closedir(sub);
+	}
+	closedir(dir);
+
+	*candidates = list;
+	*num_candidates = count;
+	return 0;
+}
+
+int cache_evict(const char* cache_dir, uint64_t budget, uint64_t reserve)
+{
+	struct cache_candidate* candidates = NULL;
+	int num_candidates = 0;
+	uint64_t total = 0;
+	int i;
+
+	if (!cache_dir || budget == 0) {
+		return 0;
+	}
+	if (cache_collect_candidates(cache_dir, &candidates, &num_candidates) < 0) {
+		return -1;
+	}
+	for (i = 0; i < num_candidates; i++) {
+		total += candidates[i].size;
+	}
+	qsort(candidates, num_candidates, sizeof(struct cache_candidate), cache_candidate_compare);
+
+	thread_once(&cache_leases_once, cache_leases_init);
+	mutex_lock(&cache_leases_lock);
+	for (i = 0; i < num_candidates && total + reserve > budget; i++) {
+		struct cache_lease* entry;
+		for (entry = cache_leases; entry; entry = entry->next) {
+			if (strcmp(entry->path, candidates[i].path) == 0) {
+				break;
+			}
+		}
+		if (entry) {
+			/* leased by this process, opening its lock file would drop the lock */
+			continue;
+		}
+#ifndef WIN32
+		char lockfn[1024];
+		snprintf(lockfn, sizeof(lockfn), "%s.lock", candidates[i].path);
+		int fd = open(lockfn, O_RDWR);
+		if (fd < 0) {
+			continue;
+		}
+		if (cache_lock_fd(fd, F_WRLCK, 0) < 0) {
+			/* leased or being filled by another process */
+			close(fd);
+			continue;
+		}
+		info("Evicting cached %s (%llu bytes)\n", candidates[i].path, (unsigned long long)candidates[i].size);
+		cache_remove(candidates[i].path);
+		/* waiters on the old lock file notice it is gone and open a new one */
+		remove(lockfn);
+		close(fd);
+#else
+		info("Evicting cached %s (%llu bytes)\n", candidates[i].path, (unsigned long long)candidates[i].size);
+		cache_remove(candidates[i].path);
+#endif
+		total -= candidates[i].size;
+	}
+	mutex_unlock(&cache_leases_lock);
+
+	if (total + reserve > budget) {
+		error("WARNING: Cache in %s is over its limit of %llu bytes, the remaining entries are in use\n", cache_dir, (unsigned long long)budget);
+	}
+
+	for (i = 0; i < num_candidates; i++) {
+		free(candidates[i].path);
+	}
+	free(candidates);
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * cache.h
+ * Functions for the on-disk cache of reusable restore data
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_CACHE_H
+#define IDEVICERESTORE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Entries live in <cache_dir>/<bucket>/ and are named by the hex string of
+ * their key, e.g. the manifest digest of a component. They are written to a
+ * temporary file and renamed into place, so readers never see a partial
+ * entry and concurrent restores can share the same cache directory. */
+int cache_get_path(const char* cache_dir, const char* bucket, const unsigned char* key, unsigned int key_size, char* path, size_t path_size);
+int cache_publish(const char* path, const unsigned char* data, unsigned int size);
+
+/* For entries written by someone else, e.g. a download: creates an empty
+ * temporary file next to path and returns its descriptor, then
+ * cache_publish_file() renames the finished file into place. */
+int cache_create_temp(const char* path, char* tmpf, size_t tmpf_size);
+int cache_publish_file(const char* tmpf, const char* path);
+
+/* A SHA1 of an entry's contents kept in <path>.sha1, for entries whose key
+ * does not describe their bytes, like downloads keyed by their URL.
+ * cache_put_checksum() stores the hash of file, the finished temporary file
+ * that is about to be published as path, and cache_check_checksum()
+ * returns 0 only if path still hashes to the stored value.
+ * cache_remove() drops an entry that failed the check. */
+int cache_put_checksum(const char* path, const char* file);
+int cache_check_checksum(const char* path);
+void cache_remove(const char* path);
+
+/* Loads an entry, memory mapped where the platform allows it. Buffers
+ * returned by cache_map() must be released with cache_release(). */
+int cache_map(const char* path, unsigned char** data, unsigned int* size, int* mapped);
+void cache_release(unsigned char* data, unsigned int size, int mapped);
+
+/* Leases on large entries like extracted filesystems, which are used in
+ * place for a whole restore. An entry at path has a <path>.lock file that
+ * every lease holds a shared lock on and that the process filling the
+ * entry holds exclusively, so leased entries are never evicted and other
+ * threads or processes wait for a fill in progress instead of repeating it.
+ * cache_lease_acquire() returns CACHE_LEASE_READY once path holds size
+ * bytes (any size if 0) or CACHE_LEASE_FILL if the caller has to create it
+ * and then report the outcome with cache_lease_filled(). */
+enum {
+	CACHE_LEASE_READY = 0,
+	CACHE_LEASE_FILL = 1
+};
+typedef struct cache_lease* cache_lease_t;
+int cache_lease_acquire(const char* path, uint64_t size, cache_lease_t* lease);
+int cache_lease_filled(cache_lease_t lease, int success);
+void cache_lease_release(cache_lease_t lease);
+
+/* Removes the least recently leased entries in the subdirectories of
+ * cache_dir until they use no more than budget bytes with reserve bytes
+ * still to be added. Entries that are leased anywhere are skipped. */
+int cache_evict(const char* cache_dir, uint64_t budget, uint64_t reserve);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,6 +33,8 @@
 #include <time.h>
 
 #include "common.h"
+#include "thread.h"
+#include "log.h"
 
 #define MAX_PRINT_LEN 64*1024
 
@@ -63,7 +65,7 @@ void info(const char* format, ...)
 	if (info_disabled) return;
 	va_list vargs;
 	va_start(vargs, format);
-	vfprintf((info_stream) ? info_stream : stdout, format, vargs);
+	log_write(LOG_LEVEL_INFO, (info_stream) ? info_stream : stdout, format, vargs);
 	va_end(vargs);
 }
 
@@ -75,7 +77,7 @@ void error(const char* format, ...)
 	vsnprintf(idevicerestore_err_buff, idevicerestore_err_buff_size, format, vargs);
 	va_end(vargs);
 	if (!error_disabled) {
-		vfprintf((error_stream) ? error_stream : stderr, format, vargs2);
+		log_write(LOG_LEVEL_ERROR, (error_stream) ? error_stream : stderr, format, vargs2);
 	}
 	va_end(vargs2);
 }
@@ -88,7 +90,7 @@ void debug(const char* format, ...)
 	}
 	va_list vargs;
 	va_start(vargs, format);
-	vfprintf((debug_stream) ? debug_stream : stderr, format, vargs);
+	log_write(LOG_LEVEL_DEBUG, (debug_stream) ? debug_stream : stderr, format, vargs);
 	va_end(vargs);
 }
 
@@ -208,20 +210,139 @@ void debug_plist(plist_t plist) {
 	free(data);
 }
 
+/* dumps queued by debug_plist_bin_async(), printed by a single thread so
+ * the XML conversion stays off the caller's path */
+#define DEBUG_PLIST_MAX_PENDING 64
+
+struct debug_plist_job {
+	char* data;
+	uint32_t size;
+	struct debug_plist_job* next;
+};
+
+static thread_once_t debug_plist_once = THREAD_ONCE_INIT;
+static mutex_t debug_plist_lock;
+static cond_t debug_plist_cond;
+static thread_t debug_plist_thread;
+static struct debug_plist_job* debug_plist_head = NULL;
+static struct debug_plist_job* debug_plist_tail = NULL;
+static int debug_plist_pending = 0;
+static int debug_plist_busy = 0;
+static int debug_plist_running = 0;
+
+static void* debug_plist_worker(void* arg)
+{
+	(void)arg;
+	mutex_lock(&debug_plist_lock);
+	while (1) {
+		while (!debug_plist_head) {
+			debug_plist_busy = 0;
+			cond_broadcast(&debug_plist_cond);
+			cond_wait(&debug_plist_cond, &debug_plist_lock);
+		}
+		struct debug_plist_job* job = debug_plist_head;
+		debug_plist_head = job->next;
+		if (!debug_plist_head) {
+			debug_plist_tail = NULL;
+		}
+		debug_plist_pending--;
+		debug_plist_busy = 1;
+		mutex_unlock(&debug_plist_lock);
+
+		plist_t plist = NULL;
+		plist_from_bin(job->data, job->size, &plist);
+		if (plist) {
+			debug_plist(plist);
+			plist_free(plist);
+		}
+		free(job->data);
+		free(job);
+
+		mutex_lock(&debug_plist_lock);
+	}
+	return NULL;
+}
+
+static void debug_plist_init(void)
+{
+	mutex_init(&debug_plist_lock);
+	cond_init(&debug_plist_cond);
+	debug_plist_running = (thread_new(&debug_plist_thread, debug_plist_worker, NULL) == 0);
+}
+
+void debug_plist_bin_async(const char* data, uint32_t size)
+{
+	if (debug_disabled || !idevicerestore_debug || !data || size == 0) {
+		return;
+	}
+	thread_once(&debug_plist_once, debug_plist_init);
+	if (!debug_plist_running) {
+		plist_t plist = NULL;
+		plist_from_bin(data, size, &plist);
+		if (plist) {
+			debug_plist(plist);
+			plist_free(plist);
+		}
+		return;
+	}
+
+	struct debug_plist_job* job = (struct debug_plist_job*)malloc(sizeof(struct debug_plist_job));
+	if (!job) {
+		return;
+	}
+	job->data = (char*)malloc(size);
+	if (!job->data) {
+		free(job);
+		return;
+	}
+	memcpy(job->data, data, size);
+	job->size = size;
+	job->next = NULL;
+
+	mutex_lock(&debug_plist_lock);
+	if (debug_plist_pending >= DEBUG_PLIST_MAX_PENDING) {
+		/* never let diagnostics hold up or bloat the caller */
+		mutex_unlock(&debug_plist_lock);
+		free(job->data);
+		free(job);
+		return;
+	}
+	if (debug_plist_tail) {
+		debug_plist_tail->next = job;
+	} else {
+		debug_plist_head = job;
+	}
+	debug_plist_tail = job;
+	debug_plist_pending++;
+	cond_broadcast(&debug_plist_cond);
+	mutex_unlock(&debug_plist_lock);
+}
+
+void debug_plist_flush(void)
+{
+	if (!debug_plist_running) {
+		return;
+	}
+	mutex_lock(&debug_plist_lock);
+	while (debug_plist_head || debug_plist_busy) {
+		cond_wait(&debug_plist_cond, &debug_plist_lock);
+	}
+	mutex_unlock(&debug_plist_lock);
+}
+
 void print_progress_bar(double progress) {
 #ifndef WIN32
 	if (info_disabled) return;
+	char bar[51];
 	int i = 0;
 	if(progress < 0) return;
 	if(progress > 100) progress = 100;
-	info("\r[");
 	for(i = 0; i < 50; i++) {
-		if(i < progress / 2) info("=");
-		else info(" ");
+		bar[i] = (i < progress / 2) ? '=' : ' ';
 	}
-	info("] %5.1f%%", progress);
-	if(progress == 100) info("\n");
-	fflush((info_stream) ? info_stream : stdout);
+	bar[50] = '\0';
+	// one message per update, the log writer flushes it
+	info("\r[%s] %5.1f%%%s", bar, progress, (progress == 100) ? "\n" : "");
 #endif
 }
 
@@ -275,6 +396,97 @@ int mkdir_with_parents(const char *dir, int mode)
 	return res;
 }
 
+void component_segments_init(struct component_segments* segs)
+{
+	memset(segs, '\0', sizeof(struct component_segments));
+}
+
+int component_segments_add(struct component_segments* segs, const unsigned char* data, unsigned int size)
+{
+	if (size == 0) {
+		return 0;
+	}
+	/* extend the previous segment if this one continues it in the same buffer */
+	if (segs->count > 0 && segs->seg[segs->count-1].data + segs->seg[segs->count-1].size == data) {
+		segs->seg[segs->count-1].size += size;
+		segs->size += size;
+		return 0;
+	}
+	if (segs->count >= COMPONENT_SEGMENTS_MAX) {
+		error("ERROR: Too many component segments\n");
+		return -1;
+	}
+	segs->seg[segs->count].data = data;
+	segs->seg[segs->count].size = size;
+	segs->count++;
+	segs->size += size;
+	return 0;
+}
+
+int component_segments_add_inline(struct component_segments* segs, const unsigned char* data, unsigned int size)
+{
+	if (segs->inline_used + size > COMPONENT_SEGMENTS_INLINE_SIZE) {
+		error("ERROR: Component segment header too large\n");
+		return -1;
+	}
+	unsigned char* p = segs->inline_data + segs->inline_used;
+	memcpy(p, data, size);
+	segs->inline_used += size;
+
+	/* merge with the previous segment if it ends right where this one starts */
+	if (segs->count > 0 && segs->seg[segs->count-1].data + segs->seg[segs->count-1].size == p) {
+		segs->seg[segs->count-1].size += size;
+		segs->size += size;
+		return 0;
+	}
+	return component_segments_add(segs, p, size);
+}
+
+int component_segments_copy(const struct component_segments* segs, unsigned char** data, unsigned int* size)
+{
+	unsigned int i;
+	unsigned int offset = 0;
+	unsigned char* buf = (unsigned char*)malloc(segs->size > 0 ? segs->size : 1);
+	if (!buf) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < segs->count; i++) {
+		memcpy(buf + offset, segs->seg[i].data, segs->seg[i].size);
+		offset += segs->seg[i].size;
+	}
+	*data = buf;
+	*size = offset;
+	return 0;
+}
+
+const unsigned char* component_segments_gather(struct component_segments* segs, unsigned int* size)
+{
+	unsigned int gathered_size = 0;
+
+	*size = segs->size;
+	if (segs->count == 1) {
+		/* nothing to stitch, hand out the source buffer directly */
+		return segs->seg[0].data;
+	}
+	if (!segs->gathered && component_segments_copy(segs, &segs->gathered, &gathered_size) < 0) {
+		*size = 0;
+		return NULL;
+	}
+	return segs->gathered;
+}
+
+void component_segments_free(struct component_segments* segs)
+{
+	if (segs->owned) {
+		free(segs->owned);
+	}
+	if (segs->gathered) {
+		free(segs->gathered);
+	}
+	memset(segs, '\0', sizeof(struct component_segments));
+}
+
 void idevicerestore_progress(struct idevicerestore_client_t* client, int step, double progress)
 {
 	if(client && client->progress_cb) {
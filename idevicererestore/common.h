@@ -36,6 +36,7 @@ extern "C" {
 #include <libirecovery.h>
 
 #include "idevicerestore.h"
+#include "budget.h"
 
 #define MODE_UNKNOWN        -1
 #define MODE_WTF             0
@@ -57,6 +58,15 @@ struct dfu_client_t;
 struct normal_client_t;
 struct restore_client_t;
 struct recovery_client_t;
+struct ipsw_archive;
+struct idevicerestore_shared_t;
+struct tss_pending;
+struct trace;
+struct component_stage;
+struct component_verify;
+struct manifest_index;
+struct manifest_identity;
+struct journal;
 
 struct idevicerestore_mode_t {
 	int index;
@@ -77,6 +87,7 @@ struct idevicerestore_client_t {
 	char* bbfwtmp;
 	int flags;
 	char* otamanifest;
+	plist_t otaBuildManifest;
 	plist_t tss;
 	plist_t basebandBuildIdentity;
 	char* tss_url;
@@ -86,9 +97,18 @@ struct idevicerestore_client_t {
 	int nonce_size;
 	int image4supported;
 	plist_t preflight_info;
+	struct tss_pending* bbtss_pending;
+	struct component_stage* stage;
+	/* pre-flight digest check, running until the device reached recovery mode */
+	struct component_verify* verify;
+	struct manifest_index* manifest_index;
+	/* index entry of the build identity this copy was taken from */
+	const struct manifest_identity* identity;
+	plist_t identity_plist;
 	char* udid;
 	char* srnm;
 	char* ipsw;
+	struct ipsw_archive* archive;
 	const char* filesystem;
 	struct dfu_client_t* dfu;
 	struct normal_client_t* normal;
@@ -102,8 +122,19 @@ struct idevicerestore_client_t {
 	int build_major;
 	char* restore_boot_args;
 	char* cache_dir;
+	/* bytes extracted filesystems may use in cache_dir, 0 for no limit */
+	uint64_t cache_limit;
+	struct cache_lease* filesystem_lease;
+	/* checkpoints of this restore in cache_dir, NULL without one */
+	struct journal* journal;
+	/* component buffers held by this client */
+	struct budget_account memory;
 	idevicerestore_progress_cb_t progress_cb;
 	void* progress_cb_data;
+	int asr_ring_depth;
+	struct idevicerestore_shared_t* shared;
+	struct trace* trace;
+	char* trace_path;
     char *manifestPath;
     char *basebandPath;
 };
@@ -117,6 +148,10 @@ void error(const char* format, ...);
 void debug(const char* format, ...);
 
 void debug_plist(plist_t plist);
+/* prints a binary plist like debug_plist() on a background thread */
+void debug_plist_bin_async(const char* data, uint32_t size);
+/* waits until all queued debug plists are printed */
+void debug_plist_flush(void);
 void print_progress_bar(double progress);
 int read_file(const char* filename, void** data, size_t* size);
 int write_file(const char* filename, const void* data, size_t size);
@@ -138,6 +173,34 @@ char *generate_guid(void);
 
 int mkdir_with_parents(const char *dir, int mode);
 
+/* A personalized component described as a list of segments that point into
+ * the caller's component buffer, the TSS blob and a small inline buffer for
+ * the generated headers. The structure must not be copied once filled. */
+#define COMPONENT_SEGMENTS_MAX 20
+#define COMPONENT_SEGMENTS_INLINE_SIZE 64
+
+struct component_segment {
+	const unsigned char* data;
+	unsigned int size;
+};
+
+struct component_segments {
+	struct component_segment seg[COMPONENT_SEGMENTS_MAX];
+	unsigned int count;
+	unsigned int size;
+	unsigned char inline_data[COMPONENT_SEGMENTS_INLINE_SIZE];
+	unsigned int inline_used;
+	unsigned char* owned;
+	unsigned char* gathered;
+};
+
+void component_segments_init(struct component_segments* segs);
+int component_segments_add(struct component_segments* segs, const unsigned char* data, unsigned int size);
+int component_segments_add_inline(struct component_segments* segs, const unsigned char* data, unsigned int size);
+int component_segments_copy(const struct component_segments* segs, unsigned char** data, unsigned int* size);
+const unsigned char* component_segments_gather(struct component_segments* segs, unsigned int* size);
+void component_segments_free(struct component_segments* segs);
+
 void idevicerestore_progress(struct idevicerestore_client_t* client, int step, double progress);
 
 #ifndef HAVE_STRSEP
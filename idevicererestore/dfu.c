@@ -32,6 +32,11 @@
 #include "recovery.h"
 #include "idevicerestore.h"
 #include "common.h"
+#include "cache.h"
+#include "trace.h"
+#include "stage.h"
+#include "event.h"
+#include "bandwidth.h"
 
 int dfu_progress_callback(irecv_client_t client, const irecv_event_t* event) {
 	if (event->type == IRECV_PROGRESS) {
@@ -134,7 +139,9 @@ int dfu_send_buffer(struct idevicerestore_client_t* client, unsigned char* buffe
 
 	info("Sending data (%d bytes)...\n", size);
 
+	int slot = bandwidth_acquire(client->ecid, client->udid, size);
 	err = irecv_send_buffer(client->dfu->client, buffer, size, 1);
+	bandwidth_release(slot);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send data: %s\n", irecv_strerror(err));
 		return -1;
@@ -152,7 +159,7 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 		}
 	}
 	if (!path) {
-		if (build_identity_get_component_path(build_identity, component, &path) < 0) {
+		if (idevicerestore_get_component_path(client, build_identity, component, &path) < 0) {
 			error("ERROR: Unable to get path for component '%s'\n", component);
 			free(path);
 			return -1;
@@ -161,37 +168,68 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 
 	unsigned char* component_data = NULL;
 	unsigned int component_size = 0;
+	int component_mapped = 0;
+	unsigned char* data = NULL;
+	uint32_t size = 0;
+	/* bytes of the staged or extracted component charged to client->memory */
+	uint64_t charged = 0;
+
+	if (!(client->flags & FLAG_CUSTOM) && component_stage_take(client->stage, component, path, &data, &size) == 0) {
+		free(path);
+		path = NULL;
+		charged = size;
+		goto staged;
+	}
 
-	if (extract_component(client->ipsw, path, &component_data, &component_size) < 0) {
+	if (idevicerestore_reserve_component(client, path, &charged) < 0) {
+		free(path);
+		return -1;
+	}
+	if (extract_component_cached(client, build_identity, component, path, &component_data, &component_size, &component_mapped) < 0) {
 		error("ERROR: Unable to extract component: %s\n", component);
 		free(path);
+		budget_release(&client->memory, charged);
 		return -1;
 	}
 	free(path);
 	path = NULL;
 
-	unsigned char* data = NULL;
-	uint32_t size = 0;
-
     if (!(client->flags & FLAG_CUSTOM)) {
         
         if (personalize_component(component, component_data, component_size, client->tss, &data, &size) < 0) {
             error("ERROR: Unable to get personalized component: %s\n", component);
-            free(component_data);
+            cache_release(component_data, component_size, component_mapped);
+            budget_release(&client->memory, charged);
             return -1;
         }
-        free(component_data);
+        cache_release(component_data, component_size, component_mapped);
         component_data = NULL;
     }
     else {
-        data = component_data;
+        // custom components are sent as they are, and data gets freed later on
+        if (component_mapped) {
+            data = (unsigned char*)malloc(component_size);
+            if (!data) {
+                error("ERROR: Out of memory\n");
+                cache_release(component_data, component_size, component_mapped);
+                budget_release(&client->memory, charged);
+                return -1;
+            }
+            memcpy(data, component_data, component_size);
+            cache_release(component_data, component_size, component_mapped);
+        } else {
+            data = component_data;
+        }
         size = component_size;
     }
     
+staged:
 	/* Using cached blobs is only available with 32-bit devices. */
 	if (client->image4supported & FLAG_RERESTORE) {
 		error("ERROR: Re-Restoring is only supported on 32-bit devices.\n");
-		exit(-1);
+		free(data);
+		budget_release(&client->memory, charged);
+		return -1;
 	}
 
 	if (!client->image4supported && client->build_major > 8 && !(client->flags & FLAG_CUSTOM) && !strcmp(component, "iBEC")) {
@@ -199,6 +237,8 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 		unsigned int tsize = 0;
 		if (tss_response_get_ap_ticket(client->tss, &ticket, &tsize) < 0) {
 			error("ERROR: Unable to get ApTicket from TSS request\n");
+			free(data);
+			budget_release(&client->memory, charged);
 			return -1;
 		}
 		uint32_t fillsize = 0;
@@ -219,14 +259,20 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 	info("Sending %s (%d bytes)...\n", component, size);
 
 	// FIXME: Did I do this right????
+	int slot = bandwidth_acquire(client->ecid, client->udid, size);
+	int span = trace_begin(client->trace, "dfu_send", component);
 	irecv_error_t err = irecv_send_buffer(client->dfu->client, data, size, 1);
+	trace_end(client->trace, span, (err == IRECV_E_SUCCESS) ? size : 0, err);
+	bandwidth_release(slot);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send %s component: %s\n", component, irecv_strerror(err));
 		free(data);
+		budget_release(&client->memory, charged);
 		return -1;
 	}
 
 	free(data);
+	budget_release(&client->memory, charged);
 	return 0;
 }
 
@@ -352,9 +398,9 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 	}
 
 	if (client->build_major > 8) {
-		/* reconnect */
+		/* reconnect once iBSS dropped the DFU connection */
 		dfu_client_free(client);
-		sleep(2);
+		device_wait_for_mode(client, MODE_UNKNOWN, 2000);
 		dfu_client_new(client);
 
 		/* get nonce */
@@ -413,32 +459,11 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 
 	dfu_client_free(client);
     
-    /* Wait 2s after attempting to boot the image */
-    sleep(2);
+    /* Give the device up to 2s to drop off the bus while it boots the image */
+    device_wait_for_mode(client, MODE_UNKNOWN, 2000);
     
-    mode = 0;
-    
-    /* Try checking for the device's mode for about 10 seconds until it's in recovery again */
-    for (int i=0; i < 20; i++) {
-        
-        /* Get the current mode */
-        mode = check_mode(client);
-        
-        /* If mode came back NULL, wait 0.5s and try again */
-        if (!mode) {
-            usleep(500000);
-            continue;
-        }
-        
-        /* If the current mode is not recovery, wait 0.5s and try again */
-        if (mode != MODE_RECOVERY) {
-            usleep(500000);
-            continue;
-        }
-        
-        /* Hello recovery */
-        break;
-    }
+    /* Then wait for about 10 seconds until it's in recovery again */
+    device_wait_for_mode(client, MODE_RECOVERY, 10000);
 
 	// Reconnect to device, but this time make sure we're not still in DFU mode
 	if (recovery_client_new(client) < 0) {
@@ -19,13 +19,22 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "download.h"
+#include "hash.h"
 #include "common.h"
+#include "net.h"
 
 typedef struct {
 	int length;
@@ -46,7 +55,7 @@ static size_t download_write_buffer_callback(char* data, size_t size, size_t nme
 int download_to_buffer(const char* url, char** buf, uint32_t* length)
 {
 	int res = 0;
-	CURL* handle = curl_easy_init();
+	CURL* handle = net_handle_acquire();
 	if (handle == NULL) {
 		error("ERROR: could not initialize CURL\n");
 		return -1;
@@ -70,7 +79,7 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	curl_easy_setopt(handle, CURLOPT_URL, url);
 
 	curl_easy_perform(handle);
-	curl_easy_cleanup(handle);
+	net_handle_release(handle);
 
 	if (response.length > 0) {
 		*length = response.length;
@@ -82,16 +91,16 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	return res;
 }
 
-static int lastprogress = 0;
-
+/* clientp points to the last percentage printed by this download */
 static int download_progress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
 {
+	int* lastprogress = (int*)clientp;
 	double p = (dlnow / dltotal) * 100;
 
 	if (p < 100.0f) {
-		if ((int)p > lastprogress) {
+		if ((int)p > *lastprogress) {
 			info("downloading: %d%%\n", (int)p);
-			lastprogress = (int)p;
+			*lastprogress = (int)p;
 		}
 	}
 
@@ -101,7 +110,8 @@ static int download_progress(void *clientp, double dltotal, double dlnow, double
 int download_to_file(const char* url, const char* filename, int enable_progress)
 {
 	int res = 0;
-	CURL* handle = curl_easy_init();
+	int lastprogress = 0;
+	CURL* handle = net_handle_acquire();
 	if (handle == NULL) {
 		error("ERROR: could not initialize CURL\n");
 		return -1;
@@ -110,11 +120,10 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 	FILE* f = fopen(filename, "wb");
 	if (!f) {
 		error("ERROR: cannot open '%s' for writing\n", filename);
+		net_handle_release(handle);
 		return -1;
 	}
 
-	lastprogress = 0;
-
 	if (idevicerestore_debug)
 		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
 
@@ -124,8 +133,10 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA, f);
 
-	if (enable_progress > 0)
+	if (enable_progress > 0) {
 		curl_easy_setopt(handle, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback)&download_progress);
+		curl_easy_setopt(handle, CURLOPT_PROGRESSDATA, &lastprogress);
+	}
 
 	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, enable_progress > 0 ? 0: 1);
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, "InetURL/1.0");
@@ -133,7 +144,7 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 	curl_easy_setopt(handle, CURLOPT_URL, url);
 
 	curl_easy_perform(handle);
-	curl_easy_cleanup(handle);
+	net_handle_release(handle);
 
 	off_t sz = ftello(f);
 	fclose(f);
@@ -145,3 +156,683 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 
 	return res;
 }
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* segments smaller than this aren't worth their own connection */
+#define DOWNLOAD_MIN_SEGMENT_SIZE (16 * 1024 * 1024)
+/* how much data may arrive before the journal is rewritten */
+#define DOWNLOAD_JOURNAL_INTERVAL (8 * 1024 * 1024)
+/* how much already written data is hashed back per callback */
+#define DOWNLOAD_HASH_CATCHUP_SIZE (1024 * 1024)
+#define DOWNLOAD_MAX_RETRIES 3
+#define DOWNLOAD_JOURNAL_MAGIC "IDRDL2"
+
+struct download_job;
+
+struct download_segment {
+	struct download_job* job;
+	CURL* handle;
+	uint64_t start;
+	uint64_t end;
+	uint64_t done;
+	int retries;
+	/* SHA1 of the done bytes, kept in the journal and checked on resume */
+	EVP_MD_CTX* sha1ctx;
+};
+
+struct download_job {
+	const char* url;
+	int fd;
+	uint64_t size;
+	/* SHA1 of the ETag and Last-Modified headers, a resume needs the same file */
+	unsigned char validator[SHA_DIGEST_LENGTH];
+	struct download_segment segs[DOWNLOAD_MAX_CONNECTIONS];
+	int num_segs;
+	char journal[1024];
+	uint64_t journal_pending;
+	int enable_progress;
+	int lastprogress;
+	int no_ranges;
+	int io_error;
+	/* the SHA1 is updated in file order, everything behind hash_pos is hashed */
+	int hash;
+	EVP_MD_CTX* sha1ctx;
+	uint64_t hash_pos;
+	int hash_seg;
+	unsigned char* hash_buf;
+};
+
+static int download_pwrite(int fd, const void* data, size_t size, uint64_t offset)
+{
+	const char* p = (const char*)data;
+	if (lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1) {
+		return -1;
+	}
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int download_pread(int fd, void* data, size_t size, uint64_t offset)
+{
+	char* p = (char*)data;
+	if (lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1) {
+		return -1;
+	}
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static EVP_MD_CTX* download_sha1_new(void)
+{
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	if (ctx && EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) != 1) {
+		EVP_MD_CTX_free(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
+
+/* finalizes a copy, the context keeps hashing. Without one the digest is
+ * left zeroed, which only makes a resume download the range again */
+static void download_sha1_peek(const EVP_MD_CTX* ctx, unsigned char* digest)
+{
+	EVP_MD_CTX* copy = EVP_MD_CTX_new();
+	if (!copy || EVP_MD_CTX_copy_ex(copy, ctx) != 1 || EVP_DigestFinal_ex(copy, digest, NULL) != 1) {
+		memset(digest, '\0', SHA_DIGEST_LENGTH);
+	}
+	EVP_MD_CTX_free(copy);
+}
+
+static void download_job_free_hashes(struct download_job* job)
+{
+	int i;
+	for (i = 0; i < DOWNLOAD_MAX_CONNECTIONS; i++) {
+		EVP_MD_CTX_free(job->segs[i].sha1ctx);
+		job->segs[i].sha1ctx = NULL;
+	}
+	EVP_MD_CTX_free(job->sha1ctx);
+	job->sha1ctx = NULL;
+}
+
+static void download_hex_encode(const unsigned char* data, char* hex)
+{
+	int i;
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++) {
+		sprintf(hex + i*2, "%02x", data[i]);
+	}
+}
+
+static int download_hex_decode(const char* hex, unsigned char* data)
+{
+	int i;
+	if (strlen(hex) != SHA_DIGEST_LENGTH*2) {
+		return -1;
+	}
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++) {
+		unsigned int byte = 0;
+		if (sscanf(hex + i*2, "%2x", &byte) != 1) {
+			return -1;
+		}
+		data[i] = (unsigned char)byte;
+	}
+	return 0;
+}
+
+static void download_journal_write(struct download_job* job)
+{
+	char hex[SHA_DIGEST_LENGTH*2+1];
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	int i;
+	FILE* f = fopen(job->journal, "w");
+	if (!f) {
+		return;
+	}
+	download_hex_encode(job->validator, hex);
+	fprintf(f, "%s " FMT_qu " %d %s\n", DOWNLOAD_JOURNAL_MAGIC, (long long unsigned int)job->size, job->num_segs, hex);
+	for (i = 0; i < job->num_segs; i++) {
+		download_sha1_peek(job->segs[i].sha1ctx, digest);
+		download_hex_encode(digest, hex);
+		fprintf(f, FMT_qu " " FMT_qu " " FMT_qu " %s\n", (long long unsigned int)job->segs[i].start, (long long unsigned int)job->segs[i].end, (long long unsigned int)job->segs[i].done, hex);
+	}
+	fclose(f);
+	job->journal_pending = 0;
+}
+
+/* picks up the segment layout of an interrupted download of the same file,
+ * the checksum of what each segment had written goes to checksums */
+static int download_journal_read(struct download_job* job, unsigned char (*checksums)[SHA_DIGEST_LENGTH])
+{
+	char magic[8];
+	char hex[SHA_DIGEST_LENGTH*2+1];
+	unsigned char validator[SHA_DIGEST_LENGTH];
+	long long unsigned int size = 0;
+	int num_segs = 0;
+	int i;
+
+	FILE* f = fopen(job->journal, "r");
+	if (!f) {
+		return -1;
+	}
+	if (fscanf(f, "%7s %llu %d %40s", magic, &size, &num_segs, hex) != 4 || strcmp(magic, DOWNLOAD_JOURNAL_MAGIC) != 0
+	    || download_hex_decode(hex, validator) < 0 || num_segs < 1 || num_segs > DOWNLOAD_MAX_CONNECTIONS) {
+		fclose(f);
+		return -1;
+	}
+	if (size != job->size || memcmp(validator, job->validator, SHA_DIGEST_LENGTH) != 0) {
+		info("The file changed on the server since the download was interrupted, starting over\n");
+		fclose(f);
+		return -1;
+	}
+	for (i = 0; i < num_segs; i++) {
+		long long unsigned int start = 0, end = 0, done = 0;
+		if (fscanf(f, "%llu %llu %llu %40s", &start, &end, &done, hex) != 4 || start > end || end > size || done > end - start
+		    || (i == 0 && start != 0) || (i > 0 && start != job->segs[i-1].end) || download_hex_decode(hex, checksums[i]) < 0) {
+			fclose(f);
+			return -1;
+		}
+		job->segs[i].start = start;
+		job->segs[i].end = end;
+		job->segs[i].done = done;
+	}
+	fclose(f);
+	if (job->segs[num_segs-1].end != job->size) {
+		return -1;
+	}
+	job->num_segs = num_segs;
+	return 0;
+}
+
+/* hashes what the journal says each segment wrote back from the file, the
+ * journal can be ahead of what reached the disk before a crash, and a
+ * segment that doesn't match its checksum is downloaded again */
+static int download_journal_verify(struct download_job* job, unsigned char (*checksums)[SHA_DIGEST_LENGTH])
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	int i;
+
+	unsigned char* buf = (unsigned char*)malloc(DOWNLOAD_HASH_CATCHUP_SIZE);
+	if (!buf) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < job->num_segs; i++) {
+		struct download_segment* seg = &job->segs[i];
+		uint64_t pos = 0;
+		while (pos < seg->done) {
+			uint64_t chunk = seg->done - pos;
+			if (chunk > DOWNLOAD_HASH_CATCHUP_SIZE) {
+				chunk = DOWNLOAD_HASH_CATCHUP_SIZE;
+			}
+			if (download_pread(job->fd, buf, (size_t)chunk, seg->start + pos) < 0) {
+				break;
+			}
+			EVP_DigestUpdate(seg->sha1ctx, buf, (size_t)chunk);
+			pos += chunk;
+		}
+		download_sha1_peek(seg->sha1ctx, digest);
+		if (pos < seg->done || memcmp(digest, checksums[i], SHA_DIGEST_LENGTH) != 0) {
+			info("Downloaded range " FMT_qu "-" FMT_qu " is damaged, downloading it again\n", (long long unsigned int)seg->start, (long long unsigned int)(seg->start + seg->done));
+			seg->done = 0;
+			EVP_DigestInit_ex(seg->sha1ctx, EVP_sha1(), NULL);
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+static int download_is_complete(struct download_job* job)
+{
+	int i;
+	for (i = 0; i < job->num_segs; i++) {
+		if (job->segs[i].start + job->segs[i].done < job->segs[i].end) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* hashes data that was written before the hash position reached it, like
+ * resumed ranges or segments that finished ahead of the one in front */
+static void download_hash_catch_up(struct download_job* job, uint64_t limit)
+{
+	while (job->hash && !job->io_error && job->hash_seg < job->num_segs) {
+		struct download_segment* seg = &job->segs[job->hash_seg];
+		uint64_t avail = seg->start + seg->done;
+		if (job->hash_pos >= seg->end) {
+			job->hash_seg++;
+			continue;
+		}
+		if (job->hash_pos >= avail || limit == 0) {
+			break;
+		}
+		uint64_t chunk = avail - job->hash_pos;
+		if (chunk > DOWNLOAD_HASH_CATCHUP_SIZE) {
+			chunk = DOWNLOAD_HASH_CATCHUP_SIZE;
+		}
+		if (chunk > limit) {
+			chunk = limit;
+		}
+		if (download_pread(job->fd, job->hash_buf, (size_t)chunk, job->hash_pos) < 0) {
+			error("ERROR: Unable to read back downloaded data\n");
+			job->io_error = 1;
+			break;
+		}
+		EVP_DigestUpdate(job->sha1ctx, job->hash_buf, (size_t)chunk);
+		job->hash_pos += chunk;
+		limit -= chunk;
+	}
+}
+
+static void download_print_progress(struct download_job* job)
+{
+	uint64_t done = 0;
+	int i;
+
+	if (!job->enable_progress || job->size == 0) {
+		return;
+	}
+	for (i = 0; i < job->num_segs; i++) {
+		done += job->segs[i].done;
+	}
+	int p = (int)((done * 100) / job->size);
+	if (p > job->lastprogress && p < 100) {
+		info("downloading: %d%%\n", p);
+		job->lastprogress = p;
+	}
+}
+
+static size_t download_segment_write_callback(char* data, size_t size, size_t nmemb, struct download_segment* seg)
+{
+	struct download_job* job = seg->job;
+	size_t total = size * nmemb;
+	uint64_t pos = seg->start + seg->done;
+	long code = 0;
+
+	curl_easy_getinfo(seg->handle, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 206 && !(code == 200 && job->num_segs == 1 && pos == 0)) {
+		// the server ignored the range, the data doesn't belong here
+		job->no_ranges = 1;
+		return 0;
+	}
+	if (total > seg->end - pos) {
+		total = (size_t)(seg->end - pos);
+	}
+	if (total == 0) {
+		return size * nmemb;
+	}
+	if (download_pwrite(job->fd, data, total, pos) < 0) {
+		error("ERROR: Unable to write downloaded data\n");
+		job->io_error = 1;
+		return 0;
+	}
+
+	EVP_DigestUpdate(seg->sha1ctx, data, total);
+
+	// data that lands right at the hash position never has to be read back
+	if (job->hash && job->hash_seg < job->num_segs && &job->segs[job->hash_seg] == seg && job->hash_pos == pos) {
+		EVP_DigestUpdate(job->sha1ctx, data, total);
+		job->hash_pos += total;
+	}
+	seg->done += total;
+
+	download_hash_catch_up(job, DOWNLOAD_HASH_CATCHUP_SIZE);
+
+	job->journal_pending += total;
+	if (job->journal_pending >= DOWNLOAD_JOURNAL_INTERVAL) {
+		download_journal_write(job);
+	}
+	download_print_progress(job);
+
+	return size * nmemb;
+}
+
+static int download_segment_start(CURLM* multi, struct download_segment* seg)
+{
+	char range[64];
+
+	seg->handle = net_handle_acquire();
+	if (!seg->handle) {
+		error("ERROR: could not initialize CURL\n");
+		return -1;
+	}
+	if (idevicerestore_debug)
+		curl_easy_setopt(seg->handle, CURLOPT_VERBOSE, 1);
+
+	/* disable SSL verification to allow download from untrusted https locations */
+	curl_easy_setopt(seg->handle, CURLOPT_SSL_VERIFYPEER, 0);
+
+	curl_easy_setopt(seg->handle, CURLOPT_WRITEFUNCTION, (curl_write_callback)&download_segment_write_callback);
+	curl_easy_setopt(seg->handle, CURLOPT_WRITEDATA, seg);
+	curl_easy_setopt(seg->handle, CURLOPT_PRIVATE, seg);
+	curl_easy_setopt(seg->handle, CURLOPT_USERAGENT, "InetURL/1.0");
+	curl_easy_setopt(seg->handle, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(seg->handle, CURLOPT_URL, seg->job->url);
+	snprintf(range, sizeof(range), FMT_qu "-" FMT_qu, (long long unsigned int)(seg->start + seg->done), (long long unsigned int)(seg->end - 1));
+	curl_easy_setopt(seg->handle, CURLOPT_RANGE, range);
+
+	if (curl_multi_add_handle(multi, seg->handle) != CURLM_OK) {
+		net_handle_release(seg->handle);
+		seg->handle = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void download_segment_stop(CURLM* multi, struct download_segment* seg)
+{
+	if (seg->handle) {
+		curl_multi_remove_handle(multi, seg->handle);
+		net_handle_release(seg->handle);
+		seg->handle = NULL;
+	}
+}
+
+struct download_probe_result {
+	uint64_t length;
+	EVP_MD_CTX* validator;
+};
+
+static size_t download_probe_header_callback(char* data, size_t size, size_t nmemb, struct download_probe_result* probe)
+{
+	size_t total = size * nmemb;
+	const char* prefix = "content-range:";
+	size_t plen = strlen(prefix);
+
+	if (total > plen && strncasecmp(data, prefix, plen) == 0) {
+		// Content-Range: bytes 0-0/<length>
+		const char* slash = memchr(data, '/', total);
+		if (slash && slash[1] >= '0' && slash[1] <= '9') {
+			probe->length = strtoull(slash + 1, NULL, 10);
+		}
+	} else if ((total > 5 && strncasecmp(data, "etag:", 5) == 0) || (total > 14 && strncasecmp(data, "last-modified:", 14) == 0)) {
+		// the whole header line, the CRLF included, a redirect's headers come first
+		EVP_DigestUpdate(probe->validator, data, total);
+	}
+	return total;
+}
+
+static size_t download_probe_write_callback(char* data, size_t size, size_t nmemb, void* userdata)
+{
+	return size * nmemb;
+}
+
+/* asks for the first byte only, the answer tells whether byte ranges are
+ * served, how large the file is and which version of it is served */
+static int download_probe(const char* url, uint64_t* size, unsigned char* validator)
+{
+	struct download_probe_result probe;
+	long code = 0;
+	CURL* handle = net_handle_acquire();
+	if (handle == NULL) {
+		error("ERROR: could not initialize CURL\n");
+		return -1;
+	}
+
+	if (idevicerestore_debug)
+		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
+
+	/* disable SSL verification to allow download from untrusted https locations */
+	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
+
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, (curl_write_callback)&download_probe_header_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &probe);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, (curl_write_callback)&download_probe_write_callback);
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, "InetURL/1.0");
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(handle, CURLOPT_URL, url);
+	curl_easy_setopt(handle, CURLOPT_RANGE, "0-0");
+
+	probe.length = 0;
+	probe.validator = download_sha1_new();
+	if (probe.validator == NULL) {
+		error("ERROR: Unable to set up SHA1\n");
+		net_handle_release(handle);
+		return -1;
+	}
+	CURLcode res = curl_easy_perform(handle);
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+	net_handle_release(handle);
+
+	EVP_DigestFinal_ex(probe.validator, validator, NULL);
+	EVP_MD_CTX_free(probe.validator);
+	if (res != CURLE_OK || code != 206 || probe.length == 0) {
+		return -1;
+	}
+	*size = probe.length;
+	return 0;
+}
+
+static int download_sha1_file(const char* filename, unsigned char* sha1)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f) {
+		return -1;
+	}
+	int res = hash_sha1_file(f, sha1);
+	fclose(f);
+	return res;
+}
+
+int download_is_resumable(const char* filename)
+{
+	char journal[1024];
+	struct stat st;
+
+	snprintf(journal, sizeof(journal), "%s.part", filename);
+	return (stat(journal, &st) == 0 && stat(filename, &st) == 0) ? 1 : 0;
+}
+
+int download_to_file_segmented(const char* url, const char* filename, int connections, unsigned char* sha1, int enable_progress)
+{
+	struct download_job job;
+	unsigned char checksums[DOWNLOAD_MAX_CONNECTIONS][SHA_DIGEST_LENGTH];
+	unsigned char validator[SHA_DIGEST_LENGTH];
+	uint64_t size = 0;
+	int resumed = 0;
+	int i;
+	int res = -1;
+
+	if (!url || !filename) {
+		return -1;
+	}
+	if (connections < 1) {
+		connections = DOWNLOAD_DEFAULT_CONNECTIONS;
+	}
+	if (connections > DOWNLOAD_MAX_CONNECTIONS) {
+		connections = DOWNLOAD_MAX_CONNECTIONS;
+	}
+
+	if (download_probe(url, &size, validator) < 0) {
+		// no ranges or no length, fetch it in one go and hash it afterwards
+		debug("DEBUG: %s: server does not support ranges, using a single connection\n", __func__);
+		if (download_to_file(url, filename, enable_progress) < 0) {
+			return -1;
+		}
+		if (sha1 && download_sha1_file(filename, sha1) < 0) {
+			return -1;
+		}
+		return 0;
+	}
+
+	memset(&job, '\0', sizeof(job));
+	job.url = url;
+	job.size = size;
+	memcpy(job.validator, validator, sizeof(validator));
+	job.enable_progress = enable_progress;
+	job.hash = (sha1 != NULL);
+	snprintf(job.journal, sizeof(job.journal), "%s.part", filename);
+
+	if (download_journal_read(&job, checksums) == 0) {
+		info("Resuming download of %s\n", filename);
+		resumed = 1;
+	} else {
+		uint64_t seg_size;
+		if (size / connections < DOWNLOAD_MIN_SEGMENT_SIZE) {
+			connections = (int)(size / DOWNLOAD_MIN_SEGMENT_SIZE);
+			if (connections < 1) {
+				connections = 1;
+			}
+		}
+		seg_size = size / connections;
+		job.num_segs = connections;
+		for (i = 0; i < connections; i++) {
+			job.segs[i].start = seg_size * i;
+			job.segs[i].end = (i == connections-1) ? size : seg_size * (i+1);
+			job.segs[i].done = 0;
+		}
+		remove(filename);
+	}
+	for (i = 0; i < job.num_segs; i++) {
+		job.segs[i].job = &job;
+		job.segs[i].sha1ctx = download_sha1_new();
+		if (job.segs[i].sha1ctx == NULL) {
+			error("ERROR: Unable to set up SHA1\n");
+			download_job_free_hashes(&job);
+			return -1;
+		}
+	}
+
+	job.fd = open(filename, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (job.fd < 0) {
+		error("ERROR: cannot open '%s' for writing\n", filename);
+		download_job_free_hashes(&job);
+		return -1;
+	}
+	// preallocate so every connection can write at its own offset
+	if (ftruncate(job.fd, (off_t)size) < 0) {
+		error("ERROR: Unable to allocate %s for download\n", filename);
+		close(job.fd);
+		download_job_free_hashes(&job);
+		return -1;
+	}
+	if (resumed && download_journal_verify(&job, checksums) < 0) {
+		close(job.fd);
+		download_job_free_hashes(&job);
+		return -1;
+	}
+	download_journal_write(&job);
+
+	if (job.hash) {
+		job.hash_buf = (unsigned char*)malloc(DOWNLOAD_HASH_CATCHUP_SIZE);
+		job.sha1ctx = download_sha1_new();
+		if (!job.hash_buf || !job.sha1ctx) {
+			error("ERROR: Out of memory\n");
+			free(job.hash_buf);
+			close(job.fd);
+			download_job_free_hashes(&job);
+			return -1;
+		}
+	}
+
+	CURLM* multi = curl_multi_init();
+	if (!multi) {
+		error("ERROR: could not initialize CURL\n");
+		free(job.hash_buf);
+		close(job.fd);
+		download_job_free_hashes(&job);
+		return -1;
+	}
+
+	int running = 0;
+	for (i = 0; i < job.num_segs; i++) {
+		struct download_segment* seg = &job.segs[i];
+		if (seg->start + seg->done < seg->end) {
+			if (download_segment_start(multi, seg) < 0) {
+				job.io_error = 1;
+				break;
+			}
+			running++;
+		}
+	}
+
+	while (running > 0 && !job.io_error && !job.no_ranges) {
+		int still_running = 0;
+		int msgs_left = 0;
+		CURLMsg* msg = NULL;
+
+		curl_multi_perform(multi, &still_running);
+		while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+			struct download_segment* seg = NULL;
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			CURLcode result = msg->data.result;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&seg);
+			download_segment_stop(multi, seg);
+			running--;
+			if (seg->start + seg->done >= seg->end) {
+				continue;
+			}
+			// the connection dropped, continue the range where it stopped
+			if (job.no_ranges || job.io_error || ++seg->retries > DOWNLOAD_MAX_RETRIES) {
+				error("ERROR: Download of range " FMT_qu "-" FMT_qu " failed: %s\n", (long long unsigned int)seg->start, (long long unsigned int)seg->end, curl_easy_strerror(result));
+				job.io_error = 1;
+				break;
+			}
+			debug("DEBUG: %s: retrying range at " FMT_qu "\n", __func__, (long long unsigned int)(seg->start + seg->done));
+			if (download_segment_start(multi, seg) < 0) {
+				job.io_error = 1;
+				break;
+			}
+			running++;
+		}
+		if (running > 0 && !job.io_error) {
+			curl_multi_wait(multi, NULL, 0, 100, NULL);
+		}
+	}
+
+	for (i = 0; i < job.num_segs; i++) {
+		download_segment_stop(multi, &job.segs[i]);
+	}
+	curl_multi_cleanup(multi);
+
+	if (!job.io_error && !job.no_ranges && download_is_complete(&job)) {
+		// whatever arrived out of order is still waiting in the page cache
+		download_hash_catch_up(&job, job.size);
+		if (job.hash && job.hash_pos != job.size) {
+			job.io_error = 1;
+		}
+		if (!job.io_error) {
+			if (job.hash) {
+				EVP_DigestFinal_ex(job.sha1ctx, sha1, NULL);
+			}
+			res = 0;
+		}
+	}
+	close(job.fd);
+	free(job.hash_buf);
+
+	if (res == 0) {
+		remove(job.journal);
+	} else if (job.no_ranges) {
+		// ranges were promised but not honoured, start over with one stream
+		remove(job.journal);
+		remove(filename);
+		if (download_to_file(url, filename, enable_progress) == 0 && (!sha1 || download_sha1_file(filename, sha1) == 0)) {
+			res = 0;
+		}
+	} else {
+		// keep what we have so the next attempt can resume
+		download_journal_write(&job);
+	}
+	download_job_free_hashes(&job);
+
+	return res;
+}
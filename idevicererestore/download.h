@@ -31,6 +31,18 @@ extern "C" {
 int download_to_buffer(const char* url, char** buf, uint32_t* length);
 int download_to_file(const char* url, const char* filename, int enable_progress);
 
+#define DOWNLOAD_DEFAULT_CONNECTIONS 4
+#define DOWNLOAD_MAX_CONNECTIONS 16
+
+/* Downloads url through several HTTP range requests written straight into
+ * a preallocated file. Progress is kept in <filename>.part so an
+ * interrupted download resumes where it stopped, as long as the server
+ * still reports the same size, ETag and Last-Modified and the data already
+ * written matches the checksum kept for each range. If sha1 is given it is
+ * filled with the SHA1 of the file, computed while the data arrives. */
+int download_to_file_segmented(const char* url, const char* filename, int connections, unsigned char* sha1, int enable_progress);
+int download_is_resumable(const char* filename);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,213 @@
+/*
+ * event.c
+ * Shared device event subscription and mode transition waits
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "event.h"
+#include "thread.h"
+#include "common.h"
+#include "trace.h"
+#include "idevicerestore.h"
+
+struct device_event_handler {
+	device_event_handler_t handler;
+	void* user_data;
+};
+
+static thread_once_t device_event_once = THREAD_ONCE_INIT;
+static mutex_t device_event_lock;
+static mutex_t device_event_subscribe_lock;
+static cond_t device_event_cond;
+static struct device_event_handler* device_event_handlers = NULL;
+static int device_event_num_handlers = 0;
+static unsigned int device_event_generation = 0;
+static int device_event_dispatching = 0;
+
+static void device_event_init(void)
+{
+	mutex_init(&device_event_lock);
+	mutex_init(&device_event_subscribe_lock);
+	cond_init(&device_event_cond);
+}
+
+static void device_event_cb(const idevice_event_t* event, void* user_data)
+{
+	struct device_event_handler* handlers = NULL;
+	int num_handlers = 0;
+	int i;
+
+	(void)user_data;
+
+	// handlers may talk to the device, so they are called on a copy of the
+	// list and the waiters aren't blocked meanwhile
+	mutex_lock(&device_event_lock);
+	if (device_event_num_handlers > 0) {
+		handlers = (struct device_event_handler*) malloc(device_event_num_handlers * sizeof(struct device_event_handler));
+	}
+	if (handlers) {
+		memcpy(handlers, device_event_handlers, device_event_num_handlers * sizeof(struct device_event_handler));
+		num_handlers = device_event_num_handlers;
+	}
+	device_event_dispatching = 1;
+	mutex_unlock(&device_event_lock);
+
+	for (i = 0; i < num_handlers; i++) {
+		if (handlers[i].handler) {
+			handlers[i].handler(event, handlers[i].user_data);
+		}
+	}
+	free(handlers);
+
+	// the generation only changes after every handler saw the event
+	mutex_lock(&device_event_lock);
+	device_event_dispatching = 0;
+	device_event_generation++;
+	cond_broadcast(&device_event_cond);
+	mutex_unlock(&device_event_lock);
+}
+
+int device_event_add_handler(device_event_handler_t handler, void* user_data)
+{
+	thread_once(&device_event_once, device_event_init);
+
+	mutex_lock(&device_event_subscribe_lock);
+	mutex_lock(&device_event_lock);
+	struct device_event_handler* handlers = (struct device_event_handler*) realloc(device_event_handlers, (device_event_num_handlers + 1) * sizeof(struct device_event_handler));
+	if (handlers == NULL) {
+		mutex_unlock(&device_event_lock);
+		mutex_unlock(&device_event_subscribe_lock);
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	device_event_handlers = handlers;
+	device_event_handlers[device_event_num_handlers].handler = handler;
+	device_event_handlers[device_event_num_handlers].user_data = user_data;
+	int num_handlers = ++device_event_num_handlers;
+	mutex_unlock(&device_event_lock);
+
+	if (num_handlers == 1) {
+		idevice_event_subscribe(device_event_cb, NULL);
+	}
+	mutex_unlock(&device_event_subscribe_lock);
+
+	return 0;
+}
+
+void device_event_remove_handler(device_event_handler_t handler, void* user_data)
+{
+	int i;
+
+	thread_once(&device_event_once, device_event_init);
+
+	mutex_lock(&device_event_subscribe_lock);
+	mutex_lock(&device_event_lock);
+	for (i = 0; i < device_event_num_handlers; i++) {
+		if (device_event_handlers[i].handler == handler && device_event_handlers[i].user_data == user_data) {
+			device_event_handlers[i] = device_event_handlers[--device_event_num_handlers];
+			break;
+		}
+	}
+	// a handler may still be running on the copy taken by the event thread
+	while (handler && device_event_dispatching) {
+		cond_wait(&device_event_cond, &device_event_lock);
+	}
+	int num_handlers = device_event_num_handlers;
+	mutex_unlock(&device_event_lock);
+
+	// the event thread is joined on unsubscribe, so this must not be done
+	// while holding the lock the callback takes
+	if (num_handlers == 0) {
+		idevice_event_unsubscribe();
+	}
+	mutex_unlock(&device_event_subscribe_lock);
+}
+
+unsigned int device_event_get_generation(void)
+{
+	thread_once(&device_event_once, device_event_init);
+
+	mutex_lock(&device_event_lock);
+	unsigned int generation = device_event_generation;
+	mutex_unlock(&device_event_lock);
+
+	return generation;
+}
+
+int device_event_wait(unsigned int* seen, unsigned int timeout_ms)
+{
+	int res = 0;
+
+	thread_once(&device_event_once, device_event_init);
+
+	mutex_lock(&device_event_lock);
+	if (device_event_generation == *seen) {
+		res = cond_wait_timeout(&device_event_cond, &device_event_lock, timeout_ms);
+	}
+	*seen = device_event_generation;
+	mutex_unlock(&device_event_lock);
+
+	return res;
+}
+
+static uint64_t device_wait_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int device_wait_for_mode(struct idevicerestore_client_t* client, int mode, unsigned int timeout_ms)
+{
+	int res = -1;
+	uint64_t start = device_wait_time_ms();
+
+	// usbmuxd doesn't see DFU and recovery mode devices, but it wakes us
+	// up for the others and for a device dropping out of normal or restore
+	int subscribed = (device_event_add_handler(NULL, NULL) == 0);
+	unsigned int poll_ms = (mode == MODE_NORMAL || mode == MODE_RESTORE) ? 1000 : DEVICE_WAIT_POLL_MS;
+	int span = trace_begin(client->trace, "mode_wait", (mode == MODE_UNKNOWN) ? "Disconnect" : idevicerestore_modes[mode].string);
+
+	for (;;) {
+		unsigned int seen = device_event_get_generation();
+		int current = check_mode(client);
+		if (current == mode) {
+			res = 0;
+			break;
+		}
+
+		uint64_t elapsed = device_wait_time_ms() - start;
+		if (elapsed >= timeout_ms) {
+			break;
+		}
+		if (elapsed + poll_ms > timeout_ms) {
+			poll_ms = (unsigned int)(timeout_ms - elapsed);
+		}
+		device_event_wait(&seen, poll_ms);
+	}
+
+	trace_end(client->trace, span, 0, res);
+	if (subscribed) {
+		device_event_remove_handler(NULL, NULL);
+	}
+
+	return res;
+}
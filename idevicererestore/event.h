@@ -0,0 +1,58 @@
+/*
+ * event.h
+ * Shared device event subscription and mode transition waits
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_EVENT_H
+#define IDEVICERESTORE_EVENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+
+struct idevicerestore_client_t;
+
+/* idevice_event_subscribe() takes a single callback per process, so every
+ * part of the restore interested in usbmuxd events registers a handler
+ * here instead. A NULL handler only keeps the subscription alive, which
+ * is all a waiter needs. */
+typedef void (*device_event_handler_t)(const idevice_event_t* event, void* user_data);
+
+int device_event_add_handler(device_event_handler_t handler, void* user_data);
+void device_event_remove_handler(device_event_handler_t handler, void* user_data);
+
+/* every event bumps the generation, device_event_wait() returns as soon
+ * as it differs from *seen (which is then updated) or timeout_ms passed */
+unsigned int device_event_get_generation(void);
+int device_event_wait(unsigned int* seen, unsigned int timeout_ms);
+
+/* Waits for the client's device to show up in mode, or to disappear when
+ * mode is MODE_UNKNOWN. Normal and restore mode devices are picked up as
+ * soon as usbmuxd reports them; libirecovery has no hotplug events, so
+ * DFU and recovery mode are probed every DEVICE_WAIT_POLL_MS. Returns 0
+ * once the device is in mode and -1 on timeout. */
+#define DEVICE_WAIT_POLL_MS 250
+
+int device_wait_for_mode(struct idevicerestore_client_t* client, int mode, unsigned int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
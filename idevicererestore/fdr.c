@@ -27,6 +27,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifndef WIN32
+#include <sys/select.h>
+#endif
 #include <libimobiledevice/libimobiledevice.h>
 
 #include "socket.h" /* from libimobiledevice/common */
@@ -44,9 +47,14 @@
 #define FDR_PROXY_MSG 0x105
 #define FDR_PLIST_MSG 0xbbaa
 
+/* plist messages are small, anything bigger is a broken stream */
+#define FDR_MAX_PLIST_SIZE (16 * 1024 * 1024)
+
+#define FDR_PROXY_BUFSIZE (256 * 1024)
+#define FDR_PROXY_IDLE_TIMEOUT 1000
+
 static uint64_t conn_port;
 static int ctrlprotoversion = 2;
-static int serial;
 
 static int fdr_receive_plist(fdr_client_t fdr, plist_t* data);
 static int fdr_send_plist(fdr_client_t fdr, plist_t data);
@@ -127,6 +135,8 @@ void fdr_free(fdr_client_t fdr)
 
 	fdr_disconnect(fdr);
 
+	free(fdr->recv_buf);
+	free(fdr->send_buf);
 	free(fdr);
 	fdr = NULL;
 }
@@ -190,34 +200,54 @@ void *fdr_listener_thread(void *cdata)
 	return (void *)(intptr_t)res;
 }
 
+static int fdr_reserve_buffer(char** buf, uint32_t* buf_size, uint32_t size)
+{
+	if (*buf_size >= size) {
+		return 0;
+	}
+	uint32_t new_size = (*buf_size > 0) ? *buf_size : 4096;
+	while (new_size < size) {
+		new_size *= 2;
+	}
+	char* new_buf = realloc(*buf, new_size);
+	if (!new_buf) {
+		return -1;
+	}
+	*buf = new_buf;
+	*buf_size = new_size;
+	return 0;
+}
+
 static int fdr_receive_plist(fdr_client_t fdr, plist_t* data)
 {
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	uint32_t len, bytes = 0;
-	char* buf = NULL;
 
 	device_error = idevice_connection_receive(fdr->connection, (char*)&len, sizeof(len), &bytes);
 	if (device_error != IDEVICE_E_SUCCESS) {
 		error("ERROR: Unable to receive packet length from FDR (%d)\n", device_error);
 		return -1;
 	}
+	if (len == 0 || len > FDR_MAX_PLIST_SIZE) {
+		error("ERROR: Invalid FDR packet length %u\n", len);
+		return -1;
+	}
 
-	buf = calloc(1, len);
-	if (!buf) {
+	if (fdr_reserve_buffer(&fdr->recv_buf, &fdr->recv_buf_size, len) < 0) {
 		error("ERROR: Unable to allocate memory for FDR receive buffer\n");
 		return -1;
 	}
 
-	device_error = idevice_connection_receive(fdr->connection, buf, len, &bytes);
+	device_error = idevice_connection_receive(fdr->connection, fdr->recv_buf, len, &bytes);
 	if (device_error != IDEVICE_E_SUCCESS) {
 		error("ERROR: Unable to receive data from FDR\n");
-		free(buf);
 		return -1;
 	}
-	plist_from_bin(buf, bytes, data);
-	free(buf);
+	plist_from_bin(fdr->recv_buf, bytes, data);
 
 	debug("FDR Received %d bytes\n", bytes);
+	if (idevicerestore_debug)
+		debug_plist_bin_async(fdr->recv_buf, bytes);
 
 	return 0;
 }
@@ -237,23 +267,26 @@ static int fdr_send_plist(fdr_client_t fdr, plist_t data)
 
 	debug("FDR sending %d bytes:\n", len);
 	if (idevicerestore_debug)
-		debug_plist(data);
-	device_error = idevice_connection_send(fdr->connection, (char *)&len, sizeof(len), &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != sizeof(len)) {
-		error("ERROR: FDR unable to send data length. (%d) Sent %u of %u bytes.\n", 
-		      device_error, bytes, sizeof(len));
+		debug_plist_bin_async(buf, len);
+
+	/* length and payload go out in one send */
+	if (fdr_reserve_buffer(&fdr->send_buf, &fdr->send_buf_size, sizeof(len) + len) < 0) {
+		error("ERROR: Unable to allocate memory for FDR send buffer\n");
 		free(buf);
 		return -1;
 	}
-	device_error = idevice_connection_send(fdr->connection, buf, len, &bytes);
+	memcpy(fdr->send_buf, &len, sizeof(len));
+	memcpy(fdr->send_buf + sizeof(len), buf, len);
 	free(buf);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
+
+	device_error = idevice_connection_send(fdr->connection, fdr->send_buf, sizeof(len) + len, &bytes);
+	if (device_error != IDEVICE_E_SUCCESS || bytes != sizeof(len) + len) {
 		error("ERROR: FDR unable to send data (%d). Sent %u of %u bytes.\n",
-		      device_error, bytes, len);
+		      device_error, bytes, (uint32_t)(sizeof(len) + len));
 		return -1;
 	}
 
-	debug("FDR Sent %d bytes\n", bytes);
+	debug("FDR Sent %d bytes\n", len);
 	return 0;
 }
 
@@ -295,8 +328,6 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 			error("ERROR: FDR did not get Begin command reply.\n");
 			return -1;
 		}
-		if (idevicerestore_debug)
-			debug_plist(dict);
 		node = plist_dict_get_item(dict, "ConnPort");
 		if (node && plist_get_node_type(node) == PLIST_UINT) {
 			plist_get_uint_val(node, &conn_port);
@@ -477,6 +508,112 @@ static int fdr_handle_plist_cmd(fdr_client_t fdr)
 	return 1; /* should terminate thread */
 }
 
+static int fdr_proxy_send_all(int sockfd, const char* data, uint32_t size)
+{
+	uint32_t done = 0;
+	while (done < size) {
+		int sent = socket_send(sockfd, (void*)(data + done), size - done);
+		if (sent <= 0) {
+			return -1;
+		}
+		done += sent;
+	}
+	return 0;
+}
+
+/* Forwards data between the device and sockfd as soon as either side
+ * becomes readable, until one of them closes the connection. */
+static int fdr_proxy_relay(fdr_client_t fdr, int sockfd)
+{
+	idevice_error_t device_error = IDEVICE_E_SUCCESS;
+	uint32_t sent = 0, bytes = 0;
+	int devfd = -1;
+	int res = 0;
+
+	if (idevice_connection_get_fd(fdr->connection, &devfd) != IDEVICE_E_SUCCESS || devfd < 0) {
+		error("ERROR: FDR %p unable to get connection fd\n", fdr);
+		return -1;
+	}
+
+	char* buf = (char*)malloc(FDR_PROXY_BUFSIZE);
+	if (!buf) {
+		error("ERROR: Unable to allocate memory for FDR proxy buffer\n");
+		return -1;
+	}
+
+	while (fdr->connection) {
+		fd_set fds;
+		struct timeval to;
+		FD_ZERO(&fds);
+		FD_SET(devfd, &fds);
+		FD_SET(sockfd, &fds);
+		/* wake up now and then to notice fdr_disconnect() from another thread */
+		to.tv_sec = FDR_PROXY_IDLE_TIMEOUT / 1000;
+		to.tv_usec = (FDR_PROXY_IDLE_TIMEOUT % 1000) * 1000;
+		int sret = select(((devfd > sockfd) ? devfd : sockfd) + 1, &fds, NULL, NULL, &to);
+		if (sret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error("ERROR: FDR %p proxy select failed: %s\n", fdr, strerror(errno));
+			res = -1;
+			break;
+		}
+		if (sret == 0) {
+			continue;
+		}
+
+		if (FD_ISSET(devfd, &fds)) {
+			bytes = 0;
+			device_error = idevice_connection_receive_timeout(fdr->connection, buf, FDR_PROXY_BUFSIZE, &bytes, 1);
+			if (device_error != IDEVICE_E_SUCCESS) {
+				error("ERROR: FDR %p Unable to receive proxy payload (%d)\n", fdr, device_error);
+				res = -1;
+				break;
+			}
+			if (bytes) {
+				debug("FDR %p got payload of %u bytes, now try to proxy it\n", fdr, bytes);
+				if (fdr_proxy_send_all(sockfd, buf, bytes) < 0) {
+					error("ERROR: Sending proxy payload failed: %s\n", strerror(errno));
+					res = -1;
+					break;
+				}
+			} else {
+				/* readable without data means the device side is gone */
+				debug("FDR %p proxy connection closed by device\n", fdr);
+				res = -1;
+				break;
+			}
+		}
+
+		if (FD_ISSET(sockfd, &fds)) {
+			int bytes_ret = socket_receive_timeout(sockfd, buf, FDR_PROXY_BUFSIZE, 0, 1);
+			if (bytes_ret < 0) {
+				if (bytes_ret != -EAGAIN)
+					error("ERROR: FDR %p receiving proxy payload failed: %s\n",
+					      fdr, strerror(-bytes_ret));
+				else
+					res = 1; /* the remote side closed the connection */
+				break;
+			}
+			bytes = bytes_ret;
+			if (bytes) {
+				debug("FDR %p Received %u bytes reply data, sending to device\n", fdr, bytes);
+				device_error = idevice_connection_send(fdr->connection, buf, bytes, &sent);
+				if (device_error != IDEVICE_E_SUCCESS || bytes != sent) {
+					error("ERROR: FDR %p unable to send data (%d). Sent %u of %u bytes.\n",
+					      fdr, device_error, sent, bytes);
+					res = -1;
+					break;
+				}
+			}
+		}
+	}
+	free(buf);
+
+	return res;
+}
+
 static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 {
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
@@ -536,52 +673,7 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 		return -1;
 	}
 
-	int res = 0, bytes_ret;
-	while (1) {
-		bytes = 0;
-		device_error = idevice_connection_receive_timeout(fdr->connection, buf, sizeof(buf), &bytes, 100);
-		if (device_error != IDEVICE_E_SUCCESS) {
-			error("ERROR: FDR %p Unable to receive proxy payload (%d)\n", fdr, device_error);
-			res = -1;
-			break;
-		} else if (!bytes) {
-			//debug("WARNING: Timeout waiting for proxy payload. %p\n", fdr);
-		}
-		if (bytes) {
-			debug("FDR %p got payload of %u bytes, now try to proxy it\n", fdr, bytes);
-			debug("Sending %u bytes of data\n", bytes);
-			sent = socket_send(sockfd, buf, bytes);
-			if (sent != bytes) {
-				error("ERROR: Sending proxy payload failed: %s\n", strerror(errno));
-				socket_close(sockfd);
-				res = -1;
-				break;
-			}
-		}
-		bytes_ret = socket_receive_timeout(sockfd, buf, sizeof(buf), 0, 100);
-		if (bytes_ret < 0) {
-			if (errno)
-				error("ERROR: FDR %p receiving proxy payload failed: %s\n",
-				      fdr, strerror(errno));
-			else
-				res = 1; /* close connection if no data with no error */
-			break;
-		}
-
-		bytes = bytes_ret;
-		if (bytes) {
-			debug("FDR %p Received %u bytes reply data,%s sending to device\n",
-			      fdr, bytes, (bytes ? "" : " not"));
-
-			device_error = idevice_connection_send(fdr->connection, buf, bytes, &sent);
-			if (device_error != IDEVICE_E_SUCCESS || bytes != sent) {
-				error("ERROR: FDR %p unable to send data (%d). Sent %u of %u bytes.\n",
-				      fdr, device_error, sent, bytes);
-				res = -1;
-				break;
-			}
-		} else serial++;
-	}
+	int res = fdr_proxy_relay(fdr, sockfd);
 	socket_close(sockfd);
 	return res;
 }
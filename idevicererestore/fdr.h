@@ -38,6 +38,11 @@ struct fdr_client {
 	idevice_connection_t connection;
 	idevice_t device;
 	fdr_type_t type;
+	/* reused for every plist message on this connection */
+	char* recv_buf;
+	uint32_t recv_buf_size;
+	char* send_buf;
+	uint32_t send_buf_size;
 };
 typedef struct fdr_client *fdr_client_t;
 
@@ -0,0 +1,211 @@
+/*
+ * hash.c
+ * SHA1 helpers for large buffers and files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#include "hash.h"
+#include "thread.h"
+#include "common.h"
+
+/* large enough that the per-call overhead of EVP_DigestUpdate and fread vanishes */
+#define HASH_BLOCK_SIZE (1024 * 1024)
+#define HASH_NUM_BLOCKS 2
+
+int hash_sha1_accelerated(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (__get_cpuid_max(0, NULL) < 7) {
+		return 0;
+	}
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) ? 1 : 0;
+#elif defined(__aarch64__) || defined(__arm64__)
+	/* every ARMv8 core Apple ships has the crypto extensions */
+#ifdef __APPLE__
+	return 1;
+#else
+	return 0;
+#endif
+#else
+	return 0;
+#endif
+}
+
+void hash_sha1_chunks(const unsigned char* data, uint64_t size, uint32_t chunk_size, unsigned char (*checksums)[HASH_SHA1_LENGTH])
+{
+	uint64_t offset = 0;
+	int chunk = 0;
+
+	while (offset < size) {
+		uint64_t count = size - offset;
+		if (count > chunk_size) {
+			count = chunk_size;
+		}
+		/* one shot, no context setup and teardown per chunk */
+		SHA1(data + offset, (size_t)count, checksums[chunk++]);
+		offset += count;
+	}
+}
+
+struct hash_block {
+	unsigned char* data;
+	size_t size;
+	int full;
+};
+
+struct hash_reader {
+	FILE* f;
+	struct hash_block blocks[HASH_NUM_BLOCKS];
+	mutex_t lock;
+	cond_t cond;
+	int error;
+};
+
+static void* hash_reader_thread(void* data)
+{
+	struct hash_reader* reader = (struct hash_reader*)data;
+	int i = 0;
+
+	while (1) {
+		struct hash_block* block = &reader->blocks[i];
+
+		mutex_lock(&reader->lock);
+		while (block->full) {
+			cond_wait(&reader->cond, &reader->lock);
+		}
+		mutex_unlock(&reader->lock);
+
+		size_t size = fread(block->data, 1, HASH_BLOCK_SIZE, reader->f);
+		int error = ferror(reader->f);
+
+		mutex_lock(&reader->lock);
+		block->size = size;
+		block->full = 1;
+		if (size < HASH_BLOCK_SIZE) {
+			reader->error = error;
+		}
+		cond_broadcast(&reader->cond);
+		mutex_unlock(&reader->lock);
+
+		if (size < HASH_BLOCK_SIZE) {
+			break;
+		}
+		i = (i + 1) % HASH_NUM_BLOCKS;
+	}
+
+	return NULL;
+}
+
+int hash_sha1_file(FILE* f, unsigned char* sha1)
+{
+	struct hash_reader reader;
+	thread_t thread;
+	EVP_MD_CTX* sha1ctx;
+	int result = 0;
+	int i;
+
+	if (!f || !sha1) {
+		return -1;
+	}
+
+	sha1ctx = EVP_MD_CTX_new();
+	if (sha1ctx == NULL || EVP_DigestInit_ex(sha1ctx, EVP_sha1(), NULL) != 1) {
+		error("ERROR: Unable to set up SHA1\n");
+		EVP_MD_CTX_free(sha1ctx);
+		return -1;
+	}
+
+	memset(&reader, '\0', sizeof(reader));
+	reader.f = f;
+	for (i = 0; i < HASH_NUM_BLOCKS; i++) {
+		reader.blocks[i].data = (unsigned char*)malloc(HASH_BLOCK_SIZE);
+		if (reader.blocks[i].data == NULL) {
+			error("ERROR: Out of memory\n");
+			while (i-- > 0) {
+				free(reader.blocks[i].data);
+			}
+			EVP_MD_CTX_free(sha1ctx);
+			return -1;
+		}
+	}
+	mutex_init(&reader.lock);
+	cond_init(&reader.cond);
+
+	if (thread_new(&thread, hash_reader_thread, &reader) != 0) {
+		/* hash on this thread alone */
+		size_t size;
+		while ((size = fread(reader.blocks[0].data, 1, HASH_BLOCK_SIZE, f)) > 0) {
+			EVP_DigestUpdate(sha1ctx, reader.blocks[0].data, size);
+		}
+		result = ferror(f) ? -1 : 0;
+	} else {
+		i = 0;
+		while (1) {
+			struct hash_block* block = &reader.blocks[i];
+
+			mutex_lock(&reader.lock);
+			while (!block->full) {
+				cond_wait(&reader.cond, &reader.lock);
+			}
+			mutex_unlock(&reader.lock);
+
+			EVP_DigestUpdate(sha1ctx, block->data, block->size);
+			int last = (block->size < HASH_BLOCK_SIZE);
+
+			mutex_lock(&reader.lock);
+			block->full = 0;
+			cond_broadcast(&reader.cond);
+			if (last) {
+				result = (reader.error) ? -1 : 0;
+			}
+			mutex_unlock(&reader.lock);
+
+			if (last) {
+				break;
+			}
+			i = (i + 1) % HASH_NUM_BLOCKS;
+		}
+
+		thread_join(thread);
+		thread_free(thread);
+	}
+
+	EVP_DigestFinal_ex(sha1ctx, sha1, NULL);
+	EVP_MD_CTX_free(sha1ctx);
+
+	cond_destroy(&reader.cond);
+	mutex_destroy(&reader.lock);
+	for (i = 0; i < HASH_NUM_BLOCKS; i++) {
+		free(reader.blocks[i].data);
+	}
+
+	if (result < 0) {
+		error("ERROR: Unable to read file for hashing\n");
+	}
+
+	return result;
+}
@@ -0,0 +1,47 @@
+/*
+ * hash.h
+ * SHA1 helpers for large buffers and files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_HASH_H
+#define IDEVICERESTORE_HASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HASH_SHA1_LENGTH 20
+
+/* OpenSSL picks its SHA extension code at runtime, this only reports
+ * whether the CPU has them so slow hashing can be explained. */
+int hash_sha1_accelerated(void);
+
+/* SHA1 of every chunk_size slice of data, the last one may be shorter */
+void hash_sha1_chunks(const unsigned char* data, uint64_t size, uint32_t chunk_size, unsigned char (*checksums)[HASH_SHA1_LENGTH]);
+
+/* SHA1 of f from its current position to the end. The file is read in
+ * large blocks on a second thread while the calling thread hashes. */
+int hash_sha1_file(FILE* f, unsigned char* sha1);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -42,6 +42,7 @@
 #include "img3.h"
 #include "img4.h"
 #include "ipsw.h"
+#include "asr.h"
 #include "common.h"
 #include "normal.h"
 #include "restore.h"
@@ -49,10 +50,23 @@
 #include "recovery.h"
 #include "idevicerestore.h"
 #include "partial.h"
-
-#include "locking.h"
+#include "thread.h"
+#include "cache.h"
+#include "trace.h"
+#include "asrsim.h"
+#include "log.h"
+#include "manifest.h"
+#include "stage.h"
+#include "event.h"
+#include "shshstore.h"
+#include "server.h"
+#include "bandwidth.h"
+#include "journal.h"
+#include "verify.h"
+#include "net.h"
 
 #define VERSION_XML "version.xml"
+#define VERSION_INDEX "version_index.plist"
 
 #include <openssl/sha.h>
 
@@ -61,6 +75,20 @@ static struct option longopts[] = {
     { "debug",   no_argument,       NULL, 'd' },
     { "help",    no_argument,       NULL, 'h' },
     { "rerestore",    no_argument,      NULL, 'r' },
+    { "asr-ring-depth", required_argument, NULL, 'R' },
+    { "ecid",    required_argument, NULL, 'i' },
+    { "udid",    required_argument, NULL, 'u' },
+    { "cache-path", required_argument, NULL, 'C' },
+    { "cache-limit", required_argument, NULL, 'M' },
+    { "memory-limit", required_argument, NULL, 'B' },
+    { "usb-transfers", required_argument, NULL, 'U' },
+    { "verify",  no_argument,       NULL, 'V' },
+    { "trace", required_argument, NULL, 'T' },
+    { "log", required_argument, NULL, 'L' },
+    { "import-shsh", required_argument, NULL, 'I' },
+    { "simulate-asr", required_argument, NULL, 'S' },
+    { "daemon", required_argument, NULL, 'D' },
+    { "submit", required_argument, NULL, 'J' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -69,6 +97,30 @@ void usage(int argc, char* argv[]) {
     printf("Usage: %s [OPTIONS] IPSW\n\n", (name ? name + 1 : argv[0]));
     printf("  -r, --rerestore\ttake advantage of the 9.x 32 bit re-restore bug\n");
     printf("  -d, --debug\t\tprint debug information\n");
+    printf("  -R, --asr-ring-depth N\tnumber of buffers used to stream the filesystem (default %d)\n", ASR_RING_DEFAULT_DEPTH);
+    printf("  -i, --ecid ECID\ttarget specific device by its hexadecimal ECID\n");
+    printf("  -u, --udid UDID\ttarget specific device by its 40-digit device UDID\n");
+    printf("  -C, --cache-path DIR\tuse specified directory for caching extracted or other reused files\n");
+    printf("  -M, --cache-limit MB\tevict the least recently used extracted filesystems and downloads\n");
+    printf("\t\t\tin the cache directory to keep them below MB megabytes\n");
+    printf("  -B, --memory-limit MB\tkeep the firmware components held in memory by all restores below\n");
+    printf("\t\t\tMB megabytes by delaying the ones prepared ahead of time\n");
+    printf("  -U, --usb-transfers N\tlet at most N devices on the same USB controller receive firmware\n");
+    printf("\t\t\tat once, the others get their TSS and personalization done meanwhile\n");
+    printf("  -V, --verify\t\tcheck every component against its BuildManifest digest while the\n");
+    printf("\t\t\tfilesystem is extracted, and send no firmware to the device on a mismatch\n");
+    printf("  -I, --import-shsh DIR\tadd the ECID-product-version-build.shsh files in DIR to the SHSH store and exit\n");
+    printf("  -T, --trace FILE\twrite phase timings and throughput to FILE (CSV if it ends in .csv, JSON otherwise)\n");
+    printf("  -L, --log FILE\talso append every message as a JSON line to FILE\n");
+    printf("  -S, --simulate-asr N[:MBPS[:MS]]\n");
+    printf("\t\t\tsend the filesystem image given instead of IPSW over ASR to N simulated\n");
+    printf("\t\t\treceivers limited to MBPS megabytes per second with MS latency and exit,\n");
+    printf("\t\t\tonly the filesystem transfer of a restore is simulated\n");
+    printf("  -D, --daemon SOCKET\tkeep running and restore the jobs submitted on the unix socket SOCKET,\n");
+    printf("\t\t\treusing opened firmware files, version data and TSS connections\n");
+    printf("  -J, --submit SOCKET\thand the restore of IPSW to the daemon listening on SOCKET\n");
+    printf("\n");
+    printf("Pass --ecid or --udid more than once to restore several devices in parallel.\n");
     printf("\n");
     printf("Homepage: https://downgrade.party\n");
     printf("Based on idevicerestore by libimobiledevice.\n");
@@ -78,16 +130,75 @@ void usage(int argc, char* argv[]) {
 
 static int idevicerestore_keep_pers = 0;
 
+/* resources prepared once by idevicerestore_shared_new() and shared
+ * read-only by all clients restoring the same IPSW */
+struct idevicerestore_shared_t {
+    ipsw_archive* archive;
+    plist_t version_data;
+    plist_t build_manifest;
+    struct manifest_index* manifest_index;
+    int tss_enabled;
+    struct shsh_store* shsh;
+};
+
+struct idevicerestore_worker_t {
+    struct idevicerestore_client_t* client;
+    thread_t thread;
+    int result;
+};
+
+static struct shsh_store* open_shsh_store(struct idevicerestore_client_t* client)
+{
+    char dir[1024];
+    
+    if (client->shared && client->shared->shsh) {
+        return client->shared->shsh;
+    }
+    if (client->cache_dir) {
+        snprintf(dir, sizeof(dir), "%s/shsh", client->cache_dir);
+    } else {
+        strcpy(dir, "shsh");
+    }
+    return shsh_store_open(dir);
+}
+
+static void close_shsh_store(struct idevicerestore_client_t* client, struct shsh_store* store)
+{
+    if (!client->shared || client->shared->shsh != store) {
+        shsh_store_close(store);
+    }
+}
+
+static void set_scratch_path(struct idevicerestore_client_t* client, char** path, const char* name)
+{
+    char tmp[1024];
+    
+    free(*path);
+    if (client->shared) {
+        // the scratch files get personalized, every worker needs its own
+        snprintf(tmp, sizeof(tmp), "%s.%llx", name, (long long unsigned int)client->ecid);
+        *path = strdup(tmp);
+    } else {
+        *path = strdup(name);
+    }
+}
+
 static int load_version_data(struct idevicerestore_client_t* client)
 {
     if (!client) {
         return -1;
     }
     
+    if (client->version_data) {
+        return 0;
+    }
+    
     struct stat fst;
+    struct stat ist;
     int cached = 0;
     
     char version_xml[1024];
+    char version_index[1024];
     
     if (client->cache_dir) {
         if (stat(client->cache_dir, &fst) < 0) {
@@ -96,8 +207,12 @@ static int load_version_data(struct idevicerestore_client_t* client)
         strcpy(version_xml, client->cache_dir);
         strcat(version_xml, "/");
         strcat(version_xml, VERSION_XML);
+        strcpy(version_index, client->cache_dir);
+        strcat(version_index, "/");
+        strcat(version_index, VERSION_INDEX);
     } else {
         strcpy(version_xml, VERSION_XML);
+        strcpy(version_index, VERSION_INDEX);
     }
     
     if ((stat(version_xml, &fst) < 0) || ((time(NULL)-86400) > fst.st_mtime)) {
@@ -107,6 +222,7 @@ static int load_version_data(struct idevicerestore_client_t* client)
         
         if (download_to_file("http://itunes.apple.com/check/version",  version_xml_tmp, 0) == 0) {
             remove(version_xml);
+            remove(version_index);
             if (rename(version_xml_tmp, version_xml) < 0) {
                 error("ERROR: Could not update '%s'\n", version_xml);
             } else {
@@ -119,6 +235,31 @@ static int load_version_data(struct idevicerestore_client_t* client)
     
     char *verbuf = NULL;
     size_t verlen = 0;
+    
+    /* the index is only trusted if it was built from the current version.xml */
+    if ((stat(version_xml, &fst) == 0) && (stat(version_index, &ist) == 0) && (ist.st_mtime >= fst.st_mtime)) {
+        read_file(version_index, (void**)&verbuf, &verlen);
+        if (verbuf && verlen >= 8 && memcmp(verbuf, "bplist00", 8) == 0) {
+            plist_t index = NULL;
+            plist_from_bin(verbuf, (uint32_t)verlen, &index);
+            if (index && ipsw_version_index_is_valid(index)) {
+                client->version_data = index;
+            } else if (index) {
+                plist_free(index);
+            }
+        }
+        free(verbuf);
+        verbuf = NULL;
+        if (client->version_data) {
+            debug("Using version index '%s'\n", version_index);
+            if (cached) {
+                info("NOTE: using cached version data\n");
+            }
+            return 0;
+        }
+        remove(version_index);
+    }
+    
     read_file(version_xml, (void**)&verbuf, &verlen);
     
     if (!verbuf) {
@@ -126,16 +267,30 @@ static int load_version_data(struct idevicerestore_client_t* client)
         return -1;
     }
     
-    client->version_data = NULL;
-    plist_from_xml(verbuf, verlen, &client->version_data);
+    plist_t version_data = NULL;
+    plist_from_xml(verbuf, verlen, &version_data);
     free(verbuf);
     
-    if (!client->version_data) {
+    if (!version_data) {
         remove(version_xml);
         error("ERROR: Cannot parse plist data from '%s'.\n", version_xml);
         return -1;
     }
     
+    client->version_data = ipsw_version_index_create(version_data);
+    if (client->version_data) {
+        char* bin = NULL;
+        uint32_t binlen = 0;
+        plist_to_bin(client->version_data, &bin, &binlen);
+        if (bin && (write_file(version_index, bin, binlen) < 0)) {
+            error("WARNING: Could not write version index '%s'\n", version_index);
+        }
+        free(bin);
+        plist_free(version_data);
+    } else {
+        client->version_data = version_data;
+    }
+    
     if (cached) {
         info("NOTE: using cached version data\n");
     }
@@ -143,6 +298,8 @@ static int load_version_data(struct idevicerestore_client_t* client)
     return 0;
 }
 
+static plist_t get_build_identity(struct idevicerestore_client_t* client, plist_t build_manifest, const char* behavior);
+
 int idevicerestore_start(struct idevicerestore_client_t* client)
 {
     int tss_enabled = 0;
@@ -186,7 +343,8 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
     idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.0);
     
     // update version data (from cache, or apple if too old)
-    load_version_data(client);
+    int span = trace_begin(client->trace, "version_data", NULL);
+    trace_end(client->trace, span, 0, load_version_data(client));
     
     // check which mode the device is currently in so we know where to start
     
@@ -225,7 +383,10 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
         if (!wtftmp) {
             // Download WTF IPSW
             char* s_wtfurl = NULL;
-            plist_t wtfurl = plist_access_path(client->version_data, 7, "MobileDeviceSoftwareVersionsByVersion", "5", "RecoverySoftwareVersions", "WTF", "304218112", "5", "FirmwareURL");
+            plist_t wtfurl = plist_dict_get_item(client->version_data, "WTFFirmwareURL");
+            if (!wtfurl) {
+                wtfurl = plist_access_path(client->version_data, 7, "MobileDeviceSoftwareVersionsByVersion", "5", "RecoverySoftwareVersions", "WTF", "304218112", "5", "FirmwareURL");
+            }
             if (wtfurl && (plist_get_node_type(wtfurl) == PLIST_STRING)) {
                 plist_get_string_val(wtfurl, &s_wtfurl);
             }
@@ -325,12 +486,42 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
         return -1;
     }
     
+    // open the ipsw once, all components are read through this handle
+    if (!client->archive) {
+        client->archive = ipsw_open(client->ipsw);
+        if (!client->archive) {
+            error("ERROR: Unable to open %s. Firmware file might be corrupt.\n", client->ipsw);
+            return -1;
+        }
+    }
+    
     // extract buildmanifest
     plist_t buildmanifest = NULL;
-    info("Extracting BuildManifest from IPSW\n");
-    if (ipsw_extract_build_manifest(client->ipsw, &buildmanifest, &tss_enabled) < 0) {
-        error("ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
-        return -1;
+    if (client->shared) {
+        buildmanifest = plist_copy(client->shared->build_manifest);
+        tss_enabled = client->shared->tss_enabled;
+    }
+    else {
+        info("Extracting BuildManifest from IPSW\n");
+    }
+    if (!buildmanifest) {
+        span = trace_begin(client->trace, "manifest_extract", "BuildManifest.plist");
+        int res = ipsw_archive_extract_build_manifest(client->archive, &buildmanifest, &tss_enabled);
+        trace_end(client->trace, span, 0, res);
+        if (res < 0) {
+            error("ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+            return -1;
+        }
+    }
+    
+    // build identities and components are looked up through the index from here on
+    client->identity = NULL;
+    client->identity_plist = NULL;
+    manifest_index_free(client->manifest_index);
+    if (client->shared && client->shared->manifest_index) {
+        client->manifest_index = manifest_index_ref(client->shared->manifest_index);
+    } else {
+        client->manifest_index = manifest_index_new(buildmanifest);
     }
     
     idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.8);
@@ -359,9 +550,15 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
     
     client->tss = NULL;
     plist_t build_identity = NULL;
+    char* fsname = NULL;
+    char* filesystem = NULL;
+    // check if we already have an extracted filesystem
+    int delete_fs = 0;
+    // temporary copy kept by the journal until the restore succeeds
+    int journal_fs = 0;
     
     if (client->flags & FLAG_ERASE) {
-        build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(buildmanifest, client->device->hardware_model, "Erase");
+        build_identity = get_build_identity(client, buildmanifest, "Erase");
         if (build_identity == NULL) {
             error("ERROR: Unable to find any build identities\n");
             plist_free(buildmanifest);
@@ -369,14 +566,15 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
         }
     }
     else if (client->flags & FLAG_UPDATE) {
-        build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(buildmanifest, client->device->hardware_model, "Update");
+        build_identity = get_build_identity(client, buildmanifest, "Update");
         if (!build_identity) {
-            build_identity = build_manifest_get_build_identity_for_model(buildmanifest, client->device->hardware_model);
+            build_identity = get_build_identity(client, buildmanifest, NULL);
         }
     }
     else {
-        error("No install option chosen.\n");
-        exit(1);
+        error("ERROR: No install option chosen.\n");
+        plist_free(buildmanifest);
+        return -1;
     }
     
     plist_t buildmanifest2 = NULL;
@@ -392,6 +590,28 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
     }
     info("Found ECID " FMT_qu "\n", (long long unsigned int)client->ecid);
     
+    // pick up the checkpoints of an earlier attempt that failed
+    journal_free(client->journal);
+    client->journal = journal_open(client->cache_dir, client->ecid, client->ipsw);
+    
+    int journal_flags = 0;
+    int resumed_identity = 0;
+    if ((client->flags & FLAG_RERESTORE) && journal_get_identity(client->journal, &journal_flags) == 0) {
+        plist_t identity = get_build_identity(client, buildmanifest, (journal_flags & FLAG_ERASE) ? "Erase" : "Update");
+        if (!identity && !(journal_flags & FLAG_ERASE)) {
+            identity = get_build_identity(client, buildmanifest, NULL);
+        }
+        if (identity) {
+            if (build_identity) {
+                plist_free(build_identity);
+            }
+            build_identity = identity;
+            client->flags = (client->flags & ~(FLAG_ERASE | FLAG_UPDATE | FLAG_CUSTOM)) | journal_flags;
+            resumed_identity = 1;
+            info("Using the %s build identity selected by an earlier attempt\n", (journal_flags & FLAG_ERASE) ? "Erase" : "Update");
+        }
+    }
+    
     if (client->build_major > 8) {
         unsigned char* nonce = NULL;
         int nonce_size = 0;
@@ -414,48 +634,31 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
     
     if (get_tss_response(client, build_identity, &client->tss) < 0) {
         error("ERROR: Unable to get SHSH blobs for this device\n");
-        return -1;
+        result = -1;
+        goto cleanup;
     }
     
     if (client->flags & FLAG_SHSHONLY) {
         if (!client->tss) {
             error("ERROR: could not fetch TSS record\n");
-            plist_free(buildmanifest);
-            return -1;
+            result = -1;
+            goto cleanup;
         }
         else {
-            char *bin = NULL;
-            uint32_t blen = 0;
-            plist_to_bin(client->tss, &bin, &blen);
-            if (bin) {
-                char zfn[1024];
-                if (client->cache_dir) {
-                    strcpy(zfn, client->cache_dir);
-                    strcat(zfn, "/shsh");
-                }
-                else {
-                    strcpy(zfn, "shsh");
-                }
-                mkdir_with_parents(zfn, 0755);
-                sprintf(zfn + strlen(zfn), "/" FMT_qu "-%s-%s-%s.shsh", (long long int)client->ecid, client->device->product_type, client->version, client->build);
-                struct stat fst;
-                if (stat(zfn, &fst) != 0) {
-                    gzFile zf = gzopen(zfn, "wb");
-                    gzwrite(zf, bin, blen);
-                    gzclose(zf);
-                    info("SHSH saved to '%s'\n", zfn);
-                }
-                else {
-                    info("SHSH '%s' already present.\n", zfn);
-                }
-                free(bin);
+            struct shsh_store* store = open_shsh_store(client);
+            int res = shsh_store_put(store, client->ecid, client->device->product_type, client->version, client->build, client->tss);
+            if (res == 0) {
+                info("SHSH for " FMT_qu "-%s-%s-%s saved\n", (long long int)client->ecid, client->device->product_type, client->version, client->build);
+            }
+            else if (res == 1) {
+                info("SHSH for " FMT_qu "-%s-%s-%s already present.\n", (long long int)client->ecid, client->device->product_type, client->version, client->build);
             }
             else {
-                error("ERROR: could not get TSS record data\n");
+                error("ERROR: could not save TSS record\n");
             }
-            plist_free(client->tss);
-            plist_free(buildmanifest);
-            return 0;
+            close_shsh_store(client, store);
+            result = 0;
+            goto cleanup;
         }
     }
     
@@ -463,7 +666,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
      * try to automatically detect if it contains an Erase or Update ramdisk hash, then
      * update the client flags if required.
      */
-    if (tss_enabled && (client->flags & FLAG_RERESTORE)) {
+    if (tss_enabled && (client->flags & FLAG_RERESTORE) && !resumed_identity) {
         
         unsigned int ticketSize = 0;
         unsigned char *ticketData = 0;
@@ -487,7 +690,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
         char *path = 0;
         
         /* Try to get the path of the RestoreRamDisk for the current build identity */
-        if (build_identity_get_component_path(build_identity, component, &path) < 0) {
+        if (idevicerestore_get_component_path(client, build_identity, component, &path) < 0) {
             error("ERROR: Unable to get path for component '%s'\n", component);
             
             if (path) {
@@ -500,47 +703,44 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
         
         unsigned char *ramdiskData = 0;
         unsigned int ramdiskSize = 0;
+        int ramdiskMapped = 0;
+        unsigned char ramdiskHeader[0x14];
+        unsigned char hashBuf[0x14];
         
-        /* Try to get a buffer with the RestoreRamDisk */
-        ret = extract_component(client->ipsw, path, &ramdiskData, &ramdiskSize);
+        /* Only the Image3 header and a digest of the signed contents are needed here, a cached
+         * copy is hashed in place and anything else is streamed from the IPSW without being kept */
+        if (map_cached_component(client, build_identity, component, path, &ramdiskData, &ramdiskSize, &ramdiskMapped) == 0) {
+            ret = (ramdiskSize < 0x14) ? -1 : 0;
+            if (ret == 0) {
+                memcpy(ramdiskHeader, ramdiskData, 0x14);
+                SHA1(ramdiskData+0xC, (ramdiskSize-0xC), hashBuf);
+            }
+            cache_release(ramdiskData, ramdiskSize, ramdiskMapped);
+        } else if (ipsw_read_range(client->archive, path, 0, ramdiskHeader, 0x14) != 0x14) {
+            ret = -1;
+        } else {
+            ret = 0;
+            /* If an unsigned RestoreRamDisk image is encountered, this is probably a custom restore, no need to hash it */
+            if (*(uint32_t*)(void*)(ramdiskHeader+0xC) != 0x0) {
+                ret = ipsw_archive_digest_entry(client->archive, path, 0xC, hashBuf);
+            }
+        }
         
         free(path);
         
-        if (ret < 0 || !(ramdiskSize && ramdiskData)) {
-            error("ERROR: Unable to extract component: %s\n", component);
-            free(ticketData);
-            goto rdcheckdone;
-        }
-        
-        if (ramdiskSize < 0x14) {
-            debug("Ramdisk data was not large enough to be an Image3\n");
-            free(ramdiskData);
+        if (ret < 0) {
+            error("ERROR: Unable to read component %s as an Image3\n", component);
             free(ticketData);
             goto rdcheckdone;
         }
         
         /* If an unsigned RestoreRamDisk image is encountered, this is probably a custom restore. Move on from here. */
-        if (*(uint32_t*)(void*)(ramdiskData+0xC) == 0x0) {
+        if (*(uint32_t*)(void*)(ramdiskHeader+0xC) == 0x0) {
             free(ticketData);
-            free(ramdiskData);
             client->flags |= FLAG_CUSTOM;
             goto rdcheckdone;
         }
         
-        /* Create a buffer for the RestoreRamDisk digest */
-        void *hashBuf = malloc(0x14);
-        
-        if (!hashBuf) {
-            goto rdcheckdone;
-        }
-        
-        bzero(hashBuf, 0x14);
-        
-        /* Hash the signed Image3 contents */
-        SHA1(ramdiskData+0xC, (ramdiskSize-0xC), hashBuf);
-        
-        free(ramdiskData);
-        
         int foundHash = 0;
         
         /* Search the ticket for the computed RestoreRamDisk digest */
@@ -552,9 +752,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
             }
         }
         
-        /* Free the hash */
-        free(hashBuf);
-        
         /* If the RestoreRamDisk digest hash wasn't found in the APTicket, change the build identity and try again. */
         if (!foundHash) {
             
@@ -565,7 +762,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
                     client->flags &= ~FLAG_ERASE;
                     
                     /* Set build_identity to Update */
-                    build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(buildmanifest, client->device->hardware_model, "Update");
+                    build_identity = get_build_identity(client, buildmanifest, "Update");
                     
                     /* If build_identity comes back NULL, there might not be an Update identity in the manifest. */
                     if (!build_identity) {
@@ -573,7 +770,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
                         client->flags |= FLAG_ERASE;
                         
                         /* Switch build identity back to Erase */
-                        build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(buildmanifest, client->device->hardware_model, "Erase");
+                        build_identity = get_build_identity(client, buildmanifest, "Erase");
                         
                         /* Free the ticket data */
                         free(ticketData);
@@ -587,7 +784,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
                     client->flags |= FLAG_ERASE;
                     
                     /* Change build_identity to Erase */
-                    build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(buildmanifest, client->device->hardware_model, "Erase");
+                    build_identity = get_build_identity(client, buildmanifest, "Erase");
                 }
             }
             
@@ -597,7 +794,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
                 client->flags |= FLAG_ERASE;
                 
                 /* Change build_identity to Erase */
-                build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(buildmanifest, client->device->hardware_model, "Erase");
+                build_identity = get_build_identity(client, buildmanifest, "Erase");
                 
                 /* Free the ticket data */
                 free(ticketData);
@@ -630,26 +827,41 @@ rdcheckdone:
     /* Verify if we have tss records if required */
     if ((tss_enabled) && (client->tss == NULL)) {
         error("ERROR: Unable to proceed without a TSS record.\n");
-        plist_free(buildmanifest);
-        return -1;
+        result = -1;
+        goto cleanup;
     }
     
     if ((tss_enabled) && client->tss) {
         /* fix empty dicts */
         fixup_tss(client->tss);
     }
+    
+    if (client->flags & FLAG_RERESTORE) {
+        journal_put_identity(client->journal, client->flags & (FLAG_ERASE | FLAG_UPDATE | FLAG_CUSTOM));
+    }
+    if (client->tss) {
+        journal_put_tss(client->journal, build_identity, client->nonce, client->nonce_size, client->tss);
+    }
+    
+    /* personalize the boot chain while the filesystem is extracted and the device reboots */
+    if (client->tss) {
+        client->stage = component_stage_start(client, build_identity);
+    }
+    /* and hash every component meanwhile, it has to pass before the device is sent anything */
+    component_verify_free(client->verify);
+    client->verify = NULL;
+    if (client->flags & FLAG_VERIFY) {
+        client->verify = component_verify_start(client, build_identity);
+    }
     idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.1);
     
     // Get filesystem name from build identity
-    char* fsname = NULL;
-    if (build_identity_get_component_path(build_identity, "OS", &fsname) < 0) {
+    if (idevicerestore_get_component_path(client, build_identity, "OS", &fsname) < 0) {
         error("ERROR: Unable get path for filesystem component\n");
-        return -1;
+        result = -1;
+        goto cleanup;
     }
     
-    // check if we already have an extracted filesystem
-    int delete_fs = 0;
-    char* filesystem = NULL;
     struct stat st;
     memset(&st, '\0', sizeof(struct stat));
     char tmpf[1024];
@@ -677,65 +889,73 @@ rdcheckdone:
     strcat(tmpf, "/");
     strcat(tmpf, fsname);
     
-    memset(&st, '\0', sizeof(struct stat));
-    if (stat(tmpf, &st) == 0) {
-        off_t fssize = 0;
-        ipsw_get_file_size(client->ipsw, fsname, &fssize);
-        if ((fssize > 0) && (st.st_size == fssize)) {
+    off_t fssize = 0;
+    ipsw_archive_get_file_size(client->archive, fsname, &fssize);
+    
+    if (ipsw_archive_entry_is_compressed(client->archive, fsname) == 0) {
+        // stored entries are read directly from the IPSW while sending
+        info("Filesystem is stored uncompressed, it will be streamed from the IPSW\n");
+    } else {
+        // waits while another restore is extracting the same filesystem
+        int lease = cache_lease_acquire(tmpf, (fssize > 0) ? (uint64_t)fssize : 0, &client->filesystem_lease);
+        if (lease == CACHE_LEASE_READY) {
             info("Using cached filesystem from '%s'\n", tmpf);
             filesystem = strdup(tmpf);
-        }
-    }
-    
-    if (!filesystem) {
-        char extfn[1024];
-        strcpy(extfn, tmpf);
-        strcat(extfn, ".extract");
-        char lockfn[1024];
-        strcpy(lockfn, tmpf);
-        strcat(lockfn, ".lock");
-        lock_info_t li;
-        
-        lock_file(lockfn, &li);
-        FILE* extf = NULL;
-        if (access(extfn, F_OK) != 0) {
-            extf = fopen(extfn, "w");
-        }
-        unlock_file(&li);
-        if (!extf) {
-            // use temp filename
-            filesystem = tempnam(NULL, "ipsw_");
-            if (!filesystem) {
-                error("WARNING: Could not get temporary filename, using '%s' in current directory\n", fsname);
-                filesystem = strdup(fsname);
+        } else if (lease != CACHE_LEASE_FILL && journal_get_filesystem(client->journal, &filesystem) == 0) {
+            info("Using filesystem extracted by an earlier attempt to '%s'\n", filesystem);
+            journal_fs = 1;
+        } else {
+            char extfn[1024];
+            if (lease == CACHE_LEASE_FILL) {
+                if (client->cache_dir && client->cache_limit > 0) {
+                    cache_evict(client->cache_dir, client->cache_limit, (uint64_t)fssize);
+                }
+                // use <fsname>.extract as filename
+                strcpy(extfn, tmpf);
+                strcat(extfn, ".extract");
+                filesystem = strdup(extfn);
+            } else {
+                // use temp filename
+                filesystem = tempnam(NULL, "ipsw_");
+                if (!filesystem) {
+                    error("WARNING: Could not get temporary filename, using '%s' in current directory\n", fsname);
+                    filesystem = strdup(fsname);
+                }
+                delete_fs = (client->journal == NULL);
+                journal_fs = !delete_fs;
+            }
+            
+            // Extract filesystem from IPSW
+            info("Extracting filesystem from IPSW\n");
+            span = trace_begin(client->trace, "filesystem_extract", fsname);
+            int res = ipsw_archive_extract_to_file_with_progress(client->archive, fsname, filesystem, 1);
+            trace_end(client->trace, span, (res < 0) ? 0 : (uint64_t)fssize, res);
+            if (res < 0) {
+                error("ERROR: Unable to extract filesystem from IPSW\n");
+                if (client->filesystem_lease) {
+                    remove(filesystem);
+                    cache_lease_filled(client->filesystem_lease, 0);
+                    client->filesystem_lease = NULL;
+                }
+                result = -1;
+                goto cleanup;
+            }
+            
+            if (client->filesystem_lease) {
+                // rename <fsname>.extract to <fsname>
+                remove(tmpf);
+                rename(filesystem, tmpf);
+                free(filesystem);
+                filesystem = strdup(tmpf);
+                if (cache_lease_filled(client->filesystem_lease, 1) < 0) {
+                    client->filesystem_lease = NULL;
+                }
             }
-            delete_fs = 1;
-        }
-        else {
-            // use <fsname>.extract as filename
-            filesystem = strdup(extfn);
-            fclose(extf);
-        }
-        remove(lockfn);
-        
-        // Extract filesystem from IPSW
-        info("Extracting filesystem from IPSW\n");
-        if (ipsw_extract_to_file_with_progress(client->ipsw, fsname, filesystem, 1) < 0) {
-            error("ERROR: Unable to extract filesystem from IPSW\n");
-            if (client->tss)
-                plist_free(client->tss);
-            plist_free(buildmanifest);
-            return -1;
-        }
-        
-        if (strstr(filesystem, ".extract")) {
-            // rename <fsname>.extract to <fsname>
-            remove(tmpf);
-            rename(filesystem, tmpf);
-            free(filesystem);
-            filesystem = strdup(tmpf);
         }
     }
+    if (filesystem) {
+        journal_put_filesystem(client->journal, filesystem, (uint64_t)fssize);
+    }
     
     
     // if the device is in normal mode, place device into recovery mode
@@ -743,10 +963,20 @@ rdcheckdone:
         info("Entering recovery mode...\n");
         if (normal_enter_recovery(client) < 0) {
             error("ERROR: Unable to place device into recovery mode from %s mode\n", client->mode->string);
-            if (client->tss)
-                plist_free(client->tss);
-            plist_free(buildmanifest);
-            return -5;
+            result = -5;
+            goto cleanup;
+        }
+    }
+    
+    // the check ran while the device rebooted, nothing is sent to it before it passed
+    if (client->verify) {
+        info("Waiting for the component check...\n");
+        int res = component_verify_finish(client->verify);
+        client->verify = NULL;
+        if (res < 0) {
+            error("ERROR: The IPSW is damaged or was modified, not restoring it\n");
+            result = -1;
+            goto cleanup;
         }
     }
     
@@ -758,19 +988,16 @@ rdcheckdone:
         recovery_client_free(client);
         if (dfu_enter_recovery(client, build_identity) < 0) {
             error("ERROR: Unable to place device into recovery mode from %s mode\n", client->mode->string);
-            plist_free(buildmanifest);
-            if (client->tss)
-                plist_free(client->tss);
-            if (delete_fs && filesystem)
-                unlink(filesystem);
-            return -2;
+            result = -2;
+            goto cleanup;
         }
     }
     else {
         if (client->build_major > 8) {
             if (client->image4supported) {
                 error("This copy of iDeviceReRestore does not support Image4 devices. Use iDeviceRestore instead (https://github.com/libimobiledevice/idevicerestore)\n");
-                return -1;
+                result = -1;
+                goto cleanup;
             }
             else {
                 /* send ApTicket */
@@ -783,44 +1010,25 @@ rdcheckdone:
         /* now we load the iBEC */
         if (recovery_send_ibec(client, build_identity) < 0) {
             error("ERROR: Unable to send iBEC\n");
-            if (delete_fs && filesystem)
-                unlink(filesystem);
-            return -2;
+            result = -2;
+            goto cleanup;
         }
         
         recovery_client_free(client);
         
-        /* Wait 2s after attempting to boot the image */
-        sleep(2);
-        
-        int mode = 0;
+        /* Give the device up to 2s to drop off the bus while it boots the image */
+        device_wait_for_mode(client, MODE_UNKNOWN, 2000);
         
-        /* Try checking for the device's mode for about 10 seconds until it's in recovery again */
-        for (int i=0; i < 20; i++) {
-            
-            /* Get the current mode */
-            mode = check_mode(client);
-            
-            /* If mode came back NULL, wait 0.5s and try again */
-            if (!mode) {
-                usleep(500000);
-                continue;
-            }
-            
-            /* If the current mode is not recovery, wait 0.5s and try again */
-            if (mode != MODE_RECOVERY) {
-                usleep(500000);
-                continue;
-            }
+        /* Then wait for about 10 seconds until it's in recovery again */
+        if (device_wait_for_mode(client, MODE_RECOVERY, 10000) == 0) {
             
             /* Hello recovery */
             
             if (recovery_client_new(client)) {
                 error("Failed to connect to device\n");
-                return -1;
+                result = -1;
+                goto cleanup;
             }
-            
-            break;
         }
     }
     
@@ -829,7 +1037,8 @@ rdcheckdone:
     
     if (!device_info) {
         error("Couldn't query device info\n");
-        return -1;
+        result = -1;
+        goto cleanup;
     }
     
     switch (device_info->ibfl) {
@@ -843,7 +1052,8 @@ rdcheckdone:
                 error("Failed to enter iBEC. Your APTicket might not be usable for re-restoring.\n");
             }
             
-            return -1;
+            result = -1;
+            goto cleanup;
             
         case 0x1A:
         case 0x02:
@@ -863,26 +1073,26 @@ rdcheckdone:
         
         if ((ipsw_get_latest_fw(client->version_data, client->device->product_type, &fwurl, isha1) < 0) || !fwurl) {
             error("ERROR: can't get URL for latest firmware\n");
-            return -1;
+            result = -1;
+            goto cleanup;
         }
         
         /* download latest firmware's BuildManifest to grab bbfw path later */
         debug("fwurl: %s\n", fwurl);
-        partialzip_download_file(fwurl, "BuildManifest.plist", "BuildManifest_New.plist");
-        client->otamanifest = "BuildManifest_New.plist";
-        
-        FILE *ofp = fopen(client->otamanifest, "rb");
-        struct stat *ostat = (struct stat*) malloc(sizeof(struct stat));
-        stat(client->otamanifest, ostat);
-        char *opl = (char *)malloc(sizeof(char) *(ostat->st_size + 1));
-        fread(opl, sizeof(char), ostat->st_size, ofp);
-        fclose(ofp);
+        set_scratch_path(client, &client->otamanifest, "BuildManifest_New.plist");
+        download_remote_component(client, fwurl, "BuildManifest.plist", isha1, sizeof(isha1), client->otamanifest);
         
-        if (memcmp(opl, "bplist00", 8) == 0)
-            plist_from_bin(opl, (uint32_t)ostat->st_size, &buildmanifest2);
-        else
-            plist_from_xml(opl, (uint32_t)ostat->st_size, &buildmanifest2);
-        free(ostat);
+        /* parsed once here, the baseband requests during the restore reuse it */
+        if (client->otaBuildManifest) {
+            plist_free(client->otaBuildManifest);
+            client->otaBuildManifest = NULL;
+        }
+        buildmanifest2 = idevicerestore_get_ota_manifest(client);
+        if (!buildmanifest2) {
+            error("ERROR: Unable to parse BuildManifest of the latest firmware\n");
+            result = -1;
+            goto cleanup;
+        }
         const char *device = client->device->product_type;
         
         int indexCount = -1;
@@ -917,8 +1127,11 @@ rdcheckdone:
         unsigned long major = strtoul(build, NULL, 10);
         
         if (major >= 14 && indexCount == -1) {
-            error("Error parsing BuildManifest.\n");
-            exit(-1);
+            error("ERROR: Unable to find the build identity for %s in the BuildManifest of the latest firmware\n", device);
+            free(version);
+            free(build);
+            result = -1;
+            goto cleanup;
         }
         else if (major >= 14)
             build_identity2 = build_manifest_get_build_identity(buildmanifest2, indexCount);
@@ -1056,14 +1269,14 @@ rdcheckdone:
             void *bbfwData = 0;
             size_t bbfwSz = 0;
             
-            extract_component(client->ipsw, bbfwpath, (unsigned char**)&bbfwData, (unsigned int*)&bbfwSz);
+            extract_component(client->archive, bbfwpath, (unsigned char**)&bbfwData, (unsigned int*)&bbfwSz);
             
             if (!bbfwSz || !bbfwData) {
                 debug("Failed to extract BasebandFirmware from IPSW\n");
                 goto bbdownload;
             }
             
-            client->basebandPath = "bbfw.tmp";
+            set_scratch_path(client, &client->basebandPath, "bbfw.tmp");
             
             FILE *bbfwFd = fopen(client->basebandPath, "w");
             fwrite(bbfwData, bbfwSz, 1, bbfwFd);
@@ -1081,14 +1294,17 @@ rdcheckdone:
                 printf("Downloading baseband firmware.\n");
                 plist_get_string_val(bbfw_path, &bbfwpath);
                 debug("bbfwpath: %s\n", bbfwpath);
-                partialzip_download_file(fwurl, bbfwpath, "bbfw.tmp");
-                client->basebandPath = "bbfw.tmp";
+                set_scratch_path(client, &client->basebandPath, "bbfw.tmp");
+                download_baseband_firmware(client, fwurl, isha1, build_identity2, bbfwpath, client->basebandPath);
             }
         }
     }
     
 bbdlout:
     
+    // both nonces are known now, let the baseband ticket be signed while the AP one is requested
+    restore_prefetch_baseband_tss(client, build_identity);
+    
     if (!client->image4supported && (client->build_major > 8)) {
         // we need another tss request with nonce.
         unsigned char* nonce = NULL;
@@ -1097,9 +1313,8 @@ bbdlout:
         if (get_ap_nonce(client, &nonce, &nonce_size) < 0) {
             error("ERROR: Unable to get nonce from device!\n");
             recovery_send_reset(client);
-            if (delete_fs && filesystem)
-                unlink(filesystem);
-            return -2;
+            result = -2;
+            goto cleanup;
         }
         
         if (!client->nonce || (nonce_size != client->nonce_size) || (memcmp(nonce, client->nonce, nonce_size) != 0)) {
@@ -1118,17 +1333,20 @@ bbdlout:
             plist_free(client->tss);
             if (get_tss_response(client, build_identity, &client->tss) < 0) {
                 error("ERROR: Unable to get SHSH blobs for this device\n");
-                if (delete_fs && filesystem)
-                    unlink(filesystem);
-                return -1;
+                result = -1;
+                goto cleanup;
             }
             if (!client->tss) {
                 error("ERROR: can't continue without TSS\n");
-                if (delete_fs && filesystem)
-                    unlink(filesystem);
-                return -1;
+                result = -1;
+                goto cleanup;
             }
             fixup_tss(client->tss);
+            journal_put_tss(client->journal, build_identity, client->nonce, client->nonce_size, client->tss);
+            
+            // whatever was staged is signed with the old nonce
+            component_stage_free(client->stage);
+            client->stage = component_stage_start(client, build_identity);
         }
     }
     idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.7);
@@ -1137,18 +1355,13 @@ bbdlout:
     if (client->mode->index == MODE_RECOVERY) {
         if (client->srnm == NULL) {
             error("ERROR: could not retrieve device serial number. Can't continue.\n");
-            if (delete_fs && filesystem)
-                unlink(filesystem);
-            return -1;
+            result = -1;
+            goto cleanup;
         }
         if (recovery_enter_restore(client, build_identity) < 0) {
             error("ERROR: Unable to place device into restore mode\n");
-            plist_free(buildmanifest);
-            if (client->tss)
-                plist_free(client->tss);
-            if (delete_fs && filesystem)
-                unlink(filesystem);
-            return -2;
+            result = -2;
+            goto cleanup;
         }
         recovery_client_free(client);
     }
@@ -1160,15 +1373,13 @@ bbdlout:
         result = restore_device(client, build_identity, filesystem);
         if (result < 0) {
             error("ERROR: Unable to restore device\n");
-            if (delete_fs && filesystem)
-                unlink(filesystem);
-            return result;
+            goto cleanup;
         }
     }
     
     info("Cleaning up...\n");
-    if (delete_fs && filesystem)
-        unlink(filesystem);
+    // nothing left to resume
+    journal_discard(client->journal);
     
     /* special handling of AppleTVs */
     if (strncmp(client->device->product_type, "AppleTV", 7) == 0) {
@@ -1189,11 +1400,33 @@ bbdlout:
         idevicerestore_progress(client, RESTORE_NUM_STEPS-1, 1.0);
     }
     
+cleanup:
+    // a failed attempt keeps the journal's copy of the filesystem for the next one
+    if (filesystem && (delete_fs || (journal_fs && result == 0)))
+        unlink(filesystem);
+    free(filesystem);
+    free(fsname);
+    
+    component_verify_free(client->verify);
+    client->verify = NULL;
+    component_stage_free(client->stage);
+    client->stage = NULL;
+    cache_lease_release(client->filesystem_lease);
+    client->filesystem_lease = NULL;
+    journal_free(client->journal);
+    client->journal = NULL;
+    
+    if (client->tss)
+        plist_free(client->tss);
+    client->tss = NULL;
+    
     if (buildmanifest)
         plist_free(buildmanifest);
     
     if (build_identity)
         plist_free(build_identity);
+    client->identity = NULL;
+    client->identity_plist = NULL;
     
     return result;
 }
@@ -1224,6 +1457,18 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
     if (client->nonce) {
         free(client->nonce);
     }
+    if (client->stage) {
+        component_stage_free(client->stage);
+    }
+    // anything still charged would keep other restores waiting for it
+    budget_release(&client->memory, client->memory.current);
+    component_verify_free(client->verify);
+    if (client->bbtss_pending) {
+        plist_t bbtss = tss_request_wait(client->bbtss_pending);
+        if (bbtss) {
+            plist_free(bbtss);
+        }
+    }
     if (client->udid) {
         free(client->udid);
     }
@@ -1233,6 +1478,9 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
     if (client->ipsw) {
         free(client->ipsw);
     }
+    if (client->archive) {
+        ipsw_close(client->archive);
+    }
     if (client->version) {
         free(client->version);
     }
@@ -1245,6 +1493,38 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
     if (client->cache_dir) {
         free(client->cache_dir);
     }
+    cache_lease_release(client->filesystem_lease);
+    manifest_index_free(client->manifest_index);
+    journal_free(client->journal);
+    if (client->memory.peak > 0) {
+        debug("Peak component memory of this restore: %llu KB\n", (unsigned long long)(client->memory.peak / 1024));
+    }
+    
+    // print the debug plists and messages that are still queued before the restore output ends
+    debug_plist_flush();
+    log_flush();
+    
+    if (client->otaBuildManifest) {
+        plist_free(client->otaBuildManifest);
+    }
+    if (client->basebandBuildIdentity) {
+        plist_free(client->basebandBuildIdentity);
+    }
+    if (client->otamanifest) {
+        free(client->otamanifest);
+    }
+    if (client->basebandPath) {
+        free(client->basebandPath);
+    }
+    if (client->trace) {
+        if (client->trace_path && trace_write(client->trace, client->trace_path, client->ecid) == 0) {
+            info("Wrote restore trace to %s\n", client->trace_path);
+        }
+        trace_free(client->trace);
+    }
+    if (client->trace_path) {
+        free(client->trace_path);
+    }
     free(client);
 }
 
@@ -1283,6 +1563,10 @@ void idevicerestore_set_ipsw(struct idevicerestore_client_t* client, const char*
         free(client->ipsw);
         client->ipsw = NULL;
     }
+    if (client->archive) {
+        ipsw_close(client->archive);
+        client->archive = NULL;
+    }
     if (path) {
         client->ipsw = strdup(path);
     }
@@ -1301,6 +1585,29 @@ void idevicerestore_set_cache_path(struct idevicerestore_client_t* client, const
     }
 }
 
+void idevicerestore_set_cache_limit(struct idevicerestore_client_t* client, uint64_t limit)
+{
+    if (!client)
+        return;
+    client->cache_limit = limit;
+}
+
+void idevicerestore_set_trace_path(struct idevicerestore_client_t* client, const char* path)
+{
+    if (!client)
+        return;
+    if (client->trace_path) {
+        free(client->trace_path);
+        client->trace_path = NULL;
+    }
+    if (path) {
+        client->trace_path = strdup(path);
+        if (!client->trace) {
+            client->trace = trace_new();
+        }
+    }
+}
+
 void idevicerestore_set_progress_callback(struct idevicerestore_client_t* client, idevicerestore_progress_cb_t cbfunc, void* userdata)
 {
     if (!client)
@@ -1309,49 +1616,425 @@ void idevicerestore_set_progress_callback(struct idevicerestore_client_t* client
     client->progress_cb_data = userdata;
 }
 
-#ifndef IDEVICERESTORE_NOMAIN
-int main(int argc, char* argv[]) {
-    int opt = 0;
-    int optindex = 0;
-    char* ipsw = NULL;
-    int result = 0;
+void idevicerestore_set_asr_ring_depth(struct idevicerestore_client_t* client, int depth)
+{
+    if (!client)
+        return;
+    client->asr_ring_depth = depth;
+}
+
+static void* idevicerestore_worker_thread(void* data)
+{
+    struct idevicerestore_worker_t* worker = (struct idevicerestore_worker_t*)data;
+    char context[64];
+    // everything this device logs is prefixed with its ECID or UDID
+    if (worker->client->ecid) {
+        snprintf(context, sizeof(context), "%llX", (unsigned long long)worker->client->ecid);
+    } else {
+        snprintf(context, sizeof(context), "%s", worker->client->udid);
+    }
+    log_set_context(context);
+    worker->result = idevicerestore_start(worker->client);
+    log_set_context(NULL);
+    return NULL;
+}
+
+struct idevicerestore_shared_t* idevicerestore_shared_new(struct idevicerestore_client_t* client)
+{
+    struct idevicerestore_shared_t* shared = NULL;
     
-    struct idevicerestore_client_t* client = idevicerestore_client_new();
-    if (client == NULL) {
-        error("ERROR: could not create idevicerestore client\n");
-        return -1;
+    if (!client || !client->ipsw) {
+        return NULL;
     }
     
-    while ((opt = getopt_long(argc, argv, "dhcersxtplui:nC:k:", longopts, &optindex)) > 0) {
-        switch (opt) {
-            case 'h':
-                usage(argc, argv);
-                return 0;
-                
-            case 'd':
-                client->flags |= FLAG_DEBUG;
-                break;
-                
-            case 'r':
-                client->flags |= FLAG_RERESTORE;
-                break;
-                
-            default:
-                usage(argc, argv);
-                return -1;
-        }
+    if (access(client->ipsw, F_OK) < 0) {
+        error("ERROR: Firmware file %s does not exist.\n", client->ipsw);
+        return NULL;
     }
     
-    if (((argc-optind) == 1) || (client->flags & FLAG_LATEST)) {
-        argc -= optind;
-        argv += optind;
-        
+    shared = (struct idevicerestore_shared_t*) malloc(sizeof(struct idevicerestore_shared_t));
+    if (!shared) {
+        error("ERROR: Out of memory\n");
+        return NULL;
+    }
+    memset(shared, '\0', sizeof(struct idevicerestore_shared_t));
+    
+    shared->archive = ipsw_open(client->ipsw);
+    if (!shared->archive) {
+        error("ERROR: Unable to open %s. Firmware file might be corrupt.\n", client->ipsw);
+        free(shared);
+        return NULL;
+    }
+    
+    info("Extracting BuildManifest from IPSW\n");
+    if (ipsw_archive_extract_build_manifest(shared->archive, &shared->build_manifest, &shared->tss_enabled) < 0) {
+        error("ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+        idevicerestore_shared_free(shared);
+        return NULL;
+    }
+    
+    shared->manifest_index = manifest_index_new(shared->build_manifest);
+    
+    // version data is loaded once and handed to every client
+    int span = trace_begin(client->trace, "version_data", NULL);
+    trace_end(client->trace, span, 0, load_version_data(client));
+    if (client->version_data) {
+        shared->version_data = plist_copy(client->version_data);
+    }
+    
+    if (client->flags & (FLAG_RERESTORE | FLAG_SHSHONLY)) {
+        shared->shsh = open_shsh_store(client);
+    }
+    
+    return shared;
+}
+
+void idevicerestore_shared_free(struct idevicerestore_shared_t* shared)
+{
+    if (!shared) {
+        return;
+    }
+    shsh_store_close(shared->shsh);
+    manifest_index_free(shared->manifest_index);
+    plist_free(shared->build_manifest);
+    plist_free(shared->version_data);
+    ipsw_close(shared->archive);
+    free(shared);
+}
+
+void idevicerestore_set_shared(struct idevicerestore_client_t* client, struct idevicerestore_shared_t* shared)
+{
+    if (!client) {
+        return;
+    }
+    client->shared = shared;
+    if (!shared) {
+        return;
+    }
+    if (client->archive) {
+        ipsw_close(client->archive);
+    }
+    client->archive = ipsw_archive_ref(shared->archive);
+    if (!client->version_data && shared->version_data) {
+        client->version_data = plist_copy(shared->version_data);
+    }
+}
+
+int idevicerestore_start_multi(struct idevicerestore_client_t** clients, int num_clients, int* results)
+{
+    struct idevicerestore_shared_t* shared = NULL;
+    struct idevicerestore_worker_t* workers = NULL;
+    int failed = 0;
+    int i = 0;
+    
+    if (!clients || num_clients <= 0 || !clients[0]->ipsw) {
+        return -1;
+    }
+    
+    for (i = 0; i < num_clients; i++) {
+        if (clients[i]->flags & FLAG_LATEST) {
+            error("ERROR: FLAG_LATEST cannot be used when restoring multiple devices.\n");
+            return -1;
+        }
+        if (!clients[i]->ipsw || strcmp(clients[i]->ipsw, clients[0]->ipsw) != 0) {
+            error("ERROR: All devices must be restored with the same firmware file.\n");
+            return -1;
+        }
+        if (!clients[i]->ecid && !clients[i]->udid) {
+            error("ERROR: Every device needs an ECID or UDID when restoring multiple devices.\n");
+            return -1;
+        }
+    }
+    
+    shared = idevicerestore_shared_new(clients[0]);
+    if (!shared) {
+        return -1;
+    }
+    
+    // saved blobs of the queued devices are read while the first ones connect
+    if (shared->shsh) {
+        uint64_t* ecids = (uint64_t*) malloc(num_clients * sizeof(uint64_t));
+        int num_ecids = 0;
+        for (i = 0; ecids && i < num_clients; i++) {
+            if (clients[i]->ecid) {
+                ecids[num_ecids++] = clients[i]->ecid;
+            }
+        }
+        if (num_ecids > 0) {
+            shsh_store_prefetch(shared->shsh, ecids, num_ecids);
+        }
+        free(ecids);
+    }
+    
+    workers = (struct idevicerestore_worker_t*) malloc(num_clients * sizeof(struct idevicerestore_worker_t));
+    if (!workers) {
+        error("ERROR: Out of memory\n");
+        idevicerestore_shared_free(shared);
+        return -1;
+    }
+    memset(workers, '\0', num_clients * sizeof(struct idevicerestore_worker_t));
+    
+    for (i = 0; i < num_clients; i++) {
+        struct idevicerestore_client_t* client = clients[i];
+        idevicerestore_set_shared(client, shared);
+        
+        workers[i].client = client;
+        workers[i].result = -1;
+        if (thread_new(&workers[i].thread, idevicerestore_worker_thread, &workers[i]) != 0) {
+            error("ERROR: Unable to start worker for device %d\n", i);
+            idevicerestore_set_shared(client, NULL);
+            workers[i].client = NULL;
+        }
+    }
+    
+    for (i = 0; i < num_clients; i++) {
+        if (workers[i].client) {
+            thread_join(workers[i].thread);
+            thread_free(workers[i].thread);
+            idevicerestore_set_shared(workers[i].client, NULL);
+        }
+        if (workers[i].result != 0) {
+            failed++;
+        }
+        if (results) {
+            results[i] = workers[i].result;
+        }
+    }
+    
+    free(workers);
+    idevicerestore_shared_free(shared);
+    
+    return (failed > 0) ? -1 : 0;
+}
+
+#ifndef IDEVICERESTORE_NOMAIN
+static const char* restore_step_names[RESTORE_NUM_STEPS] = {
+    "Detecting device",
+    "Preparing",
+    "Uploading filesystem",
+    "Verifying filesystem",
+    "Flashing firmware",
+    "Flashing baseband"
+};
+
+struct device_target_t {
+    unsigned long long ecid;
+    char* udid;
+    char name[64];
+    int step;
+    int decile;
+};
+
+static void device_progress_cb(int step, double step_progress, void* userdata)
+{
+    struct device_target_t* target = (struct device_target_t*)userdata;
+    int decile = (int)(step_progress * 10.0);
+    
+    if (step < 0 || step >= RESTORE_NUM_STEPS) {
+        return;
+    }
+    // only report step changes and every 10% so parallel output stays readable
+    if (step == target->step && decile == target->decile) {
+        return;
+    }
+    target->step = step;
+    target->decile = decile;
+    // the worker's log context already names the device
+    info("%s: %d%%\n", restore_step_names[step], (int)(step_progress * 100.0));
+}
+
+int main(int argc, char* argv[]) {
+    int opt = 0;
+    int optindex = 0;
+    char* ipsw = NULL;
+    int result = 0;
+    int i = 0;
+    struct device_target_t* targets = NULL;
+    int num_targets = 0;
+    const char* shsh_import_dir = NULL;
+    struct asr_sim_config sim_config;
+    int sim_sessions = 0;
+    const char* daemon_socket = NULL;
+    const char* submit_socket = NULL;
+    
+    struct idevicerestore_client_t* client = idevicerestore_client_new();
+    if (client == NULL) {
+        error("ERROR: could not create idevicerestore client\n");
+        return -1;
+    }
+    
+    while ((opt = getopt_long(argc, argv, "dhcersxtplu:i:nC:M:B:U:VT:L:k:R:I:S:D:J:", longopts, &optindex)) > 0) {
+        switch (opt) {
+            case 'h':
+                usage(argc, argv);
+                return 0;
+                
+            case 'd':
+                client->flags |= FLAG_DEBUG;
+                break;
+                
+            case 'r':
+                client->flags |= FLAG_RERESTORE;
+                break;
+                
+            case 'R':
+                client->asr_ring_depth = atoi(optarg);
+                if (client->asr_ring_depth <= 0 || client->asr_ring_depth > ASR_RING_MAX_DEPTH) {
+                    error("ERROR: Invalid ASR ring depth %s (must be 1-%d)\n", optarg, ASR_RING_MAX_DEPTH);
+                    return -1;
+                }
+                break;
+                
+            case 'C':
+                idevicerestore_set_cache_path(client, optarg);
+                break;
+                
+            case 'M': {
+                unsigned long long limit = 0;
+                if (sscanf(optarg, "%llu", &limit) != 1 || limit == 0) {
+                    error("ERROR: Invalid cache limit '%s'\n", optarg);
+                    return -1;
+                }
+                idevicerestore_set_cache_limit(client, (uint64_t)limit * 1048576);
+                break;
+            }
+                
+            case 'B': {
+                unsigned long long limit = 0;
+                if (sscanf(optarg, "%llu", &limit) != 1 || limit == 0) {
+                    error("ERROR: Invalid memory limit '%s'\n", optarg);
+                    return -1;
+                }
+                budget_set_limit((uint64_t)limit * 1048576);
+                break;
+            }
+                
+            case 'U': {
+                int transfers = atoi(optarg);
+                if (transfers <= 0) {
+                    error("ERROR: Invalid number of USB transfers '%s'\n", optarg);
+                    return -1;
+                }
+                bandwidth_set_limit(transfers);
+                break;
+            }
+                
+            case 'V':
+                client->flags |= FLAG_VERIFY;
+                break;
+                
+            case 'T':
+                idevicerestore_set_trace_path(client, optarg);
+                break;
+                
+            case 'L':
+                if (log_set_sink(optarg) < 0) {
+                    error("ERROR: Unable to open log file %s\n", optarg);
+                    return -1;
+                }
+                break;
+                
+            case 'I':
+                shsh_import_dir = optarg;
+                break;
+                
+            case 'S': {
+                unsigned int mbps = 0;
+                memset(&sim_config, '\0', sizeof(sim_config));
+                sim_config.oob_requests = 8;
+                if (sscanf(optarg, "%d:%u:%u", &sim_sessions, &mbps, &sim_config.latency_ms) < 1 || sim_sessions <= 0) {
+                    error("ERROR: Invalid ASR simulation '%s' (expected N[:MBPS[:MS]])\n", optarg);
+                    return -1;
+                }
+                sim_config.bandwidth = (uint64_t)mbps * 1048576;
+                break;
+            }
+                
+            case 'D':
+                daemon_socket = optarg;
+                break;
+                
+            case 'J':
+                submit_socket = optarg;
+                break;
+                
+            case 'i':
+            case 'u': {
+                struct device_target_t* t = (struct device_target_t*) realloc(targets, (num_targets + 1) * sizeof(struct device_target_t));
+                if (t == NULL) {
+                    error("ERROR: Out of memory\n");
+                    return -1;
+                }
+                targets = t;
+                t = &targets[num_targets++];
+                memset(t, '\0', sizeof(struct device_target_t));
+                t->step = -1;
+                if (opt == 'i') {
+                    t->ecid = strtoull(optarg, NULL, 16);
+                    if (t->ecid == 0) {
+                        error("ERROR: Could not parse ECID from '%s'\n", optarg);
+                        return -1;
+                    }
+                    snprintf(t->name, sizeof(t->name), "%llX", t->ecid);
+                } else {
+                    t->udid = optarg;
+                    snprintf(t->name, sizeof(t->name), "%s", optarg);
+                }
+                break;
+            }
+                
+            default:
+                usage(argc, argv);
+                return -1;
+        }
+    }
+    
+    if (shsh_import_dir) {
+        struct shsh_store* store = open_shsh_store(client);
+        if (!store) {
+            error("ERROR: Unable to open the SHSH store\n");
+            return -1;
+        }
+        int imported = shsh_store_import_dir(store, shsh_import_dir);
+        shsh_store_close(store);
+        if (imported < 0) {
+            return -1;
+        }
+        info("Imported %d SHSH blobs from %s\n", imported, shsh_import_dir);
+        return 0;
+    }
+    
+    if (daemon_socket) {
+        if (optind < argc || num_targets > 0) {
+            usage(argc, argv);
+            return -1;
+        }
+        curl_global_init(CURL_GLOBAL_ALL);
+        result = server_run(daemon_socket, client);
+        idevicerestore_client_free(client);
+        tss_template_cache_clear();
+        partialzip_sessions_close();
+        net_cleanup();
+        curl_global_cleanup();
+        return result;
+    }
+    
+    if (((argc-optind) == 1) || (client->flags & FLAG_LATEST)) {
+        argc -= optind;
+        argv += optind;
+        
         ipsw = argv[0];
     } else {
         usage(argc, argv);
         return -1;
     }
     
+    if (sim_sessions > 0) {
+        result = asr_sim_run(ipsw, sim_sessions, &sim_config, client->trace);
+        idevicerestore_client_free(client);
+        return result;
+    }
+    
     if ((client->flags & FLAG_LATEST) && (client->flags & FLAG_CUSTOM)) {
         error("ERROR: You can't use --custom and --latest options at the same time.\n");
         return -1;
@@ -1361,12 +2044,83 @@ int main(int argc, char* argv[]) {
         client->ipsw = strdup(ipsw);
     }
     
+    if (submit_socket) {
+        struct device_target_t target;
+        if (num_targets != 1) {
+            error("ERROR: --submit needs exactly one --ecid or --udid\n");
+            return -1;
+        }
+        target = targets[0];
+        result = server_submit(submit_socket, client->ipsw, target.ecid, target.udid, client->flags, device_progress_cb, &target);
+        info("%s (%d)\n", (result == 0) ? "Restore succeeded" : "Restore failed", result);
+        idevicerestore_client_free(client);
+        free(targets);
+        return result;
+    }
+    
     curl_global_init(CURL_GLOBAL_ALL);
     
-    result = idevicerestore_start(client);
+    if (num_targets <= 1) {
+        if (num_targets == 1) {
+            idevicerestore_set_ecid(client, targets[0].ecid);
+            idevicerestore_set_udid(client, targets[0].udid);
+        }
+        result = idevicerestore_start(client);
+    } else {
+        struct idevicerestore_client_t** clients = (struct idevicerestore_client_t**) malloc(num_targets * sizeof(struct idevicerestore_client_t*));
+        int* results = (int*) malloc(num_targets * sizeof(int));
+        if (!clients || !results) {
+            error("ERROR: Out of memory\n");
+            return -1;
+        }
+        for (i = 0; i < num_targets; i++) {
+            clients[i] = idevicerestore_client_new();
+            if (clients[i] == NULL) {
+                error("ERROR: could not create idevicerestore client\n");
+                return -1;
+            }
+            idevicerestore_set_flags(clients[i], client->flags);
+            idevicerestore_set_ipsw(clients[i], client->ipsw);
+            idevicerestore_set_asr_ring_depth(clients[i], client->asr_ring_depth);
+            idevicerestore_set_cache_path(clients[i], client->cache_dir);
+            idevicerestore_set_cache_limit(clients[i], client->cache_limit);
+            idevicerestore_set_ecid(clients[i], targets[i].ecid);
+            idevicerestore_set_udid(clients[i], targets[i].udid);
+            idevicerestore_set_progress_callback(clients[i], device_progress_cb, &targets[i]);
+            if (client->trace_path) {
+                // one trace per device, named after it and keeping the extension
+                char trace_path[1024];
+                const char* ext = strrchr(client->trace_path, '.');
+                if (!ext || strchr(ext, '/')) {
+                    ext = client->trace_path + strlen(client->trace_path);
+                }
+                snprintf(trace_path, sizeof(trace_path), "%.*s-%s%s", (int)(ext - client->trace_path), client->trace_path, targets[i].name, ext);
+                idevicerestore_set_trace_path(clients[i], trace_path);
+            }
+        }
+        // the per-device traces replace the one of the template client
+        idevicerestore_set_trace_path(client, NULL);
+        
+        result = idevicerestore_start_multi(clients, num_targets, results);
+        
+        for (i = 0; i < num_targets; i++) {
+            info("[%s] %s (%d)\n", targets[i].name, (results[i] == 0) ? "Restore succeeded" : "Restore failed", results[i]);
+            idevicerestore_client_free(clients[i]);
+        }
+        free(clients);
+        free(results);
+        
+        uint64_t peak = 0;
+        budget_get_usage(NULL, NULL, &peak);
+        info("Peak firmware component memory: %llu KB\n", (unsigned long long)(peak / 1024));
+    }
     
     idevicerestore_client_free(client);
+    free(targets);
     
+    tss_template_cache_clear();
+    partialzip_sessions_close();
+    net_cleanup();
     curl_global_cleanup();
     
     return result;
@@ -1676,61 +2430,61 @@ plist_t build_manifest_get_build_identity_for_model(plist_t build_manifest, cons
     return build_manifest_get_build_identity_for_model_with_restore_behavior(build_manifest, hardware_model, NULL);
 }
 
+static plist_t get_build_identity(struct idevicerestore_client_t* client, plist_t build_manifest, const char* behavior)
+{
+    plist_t build_identity = NULL;
+    const struct manifest_identity* identity = NULL;
+    
+    if (client->manifest_index) {
+        identity = manifest_index_find_identity(client->manifest_index, client->device->hardware_model, behavior);
+        if (identity) {
+            build_identity = build_manifest_get_build_identity(build_manifest, identity->index);
+        }
+    } else {
+        build_identity = build_manifest_get_build_identity_for_model_with_restore_behavior(build_manifest, client->device->hardware_model, behavior);
+    }
+    
+    // remember which index entry this copy belongs to for the component lookups
+    client->identity = (build_identity) ? identity : NULL;
+    client->identity_plist = build_identity;
+    
+    return build_identity;
+}
+
 int get_tss_response(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss) {
     plist_t request = NULL;
     plist_t response = NULL;
     *tss = NULL;
     
+    /* saved blobs don't depend on the nonce, fresh ones are only good for the one they were signed for */
+    if (journal_get_tss(client->journal, build_identity, client->nonce, client->nonce_size, !(client->flags & FLAG_RERESTORE), tss) == 0) {
+        info("Using SHSH blobs of an earlier attempt\n");
+        return 0;
+    }
+    
     if ((client->flags & FLAG_RERESTORE)) {
         error("checking for local shsh\n");
         
-        /* first check for local copy */
-        char zfn[1024];
+        /* first check the blob store, then for a copy saved by earlier versions */
         if (client->version) {
-            if (client->cache_dir) {
-                sprintf(zfn, "%s/shsh/" FMT_qu "-%s-%s-%s.shsh", client->cache_dir, (long long int)client->ecid, client->device->product_type, client->version, client->build);
-            } else {
-                sprintf(zfn, "shsh/" FMT_qu "-%s-%s-%s.shsh", (long long int)client->ecid, client->device->product_type, client->version, client->build);
-            }
-            struct stat fst;
-            if (stat(zfn, &fst) == 0) {
-                gzFile zf = gzopen(zfn, "rb");
-                if (zf) {
-                    int blen = 0;
-                    int readsize = 16384;
-                    int bufsize = readsize;
-                    char* bin = (char*)malloc(bufsize);
-                    char* p = bin;
-                    do {
-                        int bytes_read = gzread(zf, p, readsize);
-                        if (bytes_read < 0) {
-                            fprintf(stderr, "Error reading gz compressed data\n");
-                            exit(EXIT_FAILURE);
-                        }
-                        blen += bytes_read;
-                        if (bytes_read < readsize) {
-                            if (gzeof(zf)) {
-                                bufsize += bytes_read;
-                                break;
-                            }
-                        }
-                        bufsize += readsize;
-                        bin = realloc(bin, bufsize);
-                        p = bin + blen;
-                    } while (!gzeof(zf));
-                    gzclose(zf);
-                    if (blen > 0) {
-                        if (memcmp(bin, "bplist00", 8) == 0) {
-                            plist_from_bin(bin, blen, tss);
-                        } else {
-                            plist_from_xml(bin, blen, tss);
-                        }
+            struct shsh_store* store = open_shsh_store(client);
+            if (shsh_store_get(store, client->ecid, client->device->product_type, client->version, client->build, tss) < 0) {
+                char zfn[1024];
+                if (client->cache_dir) {
+                    sprintf(zfn, "%s/shsh/" FMT_qu "-%s-%s-%s.shsh", client->cache_dir, (long long int)client->ecid, client->device->product_type, client->version, client->build);
+                } else {
+                    sprintf(zfn, "shsh/" FMT_qu "-%s-%s-%s.shsh", (long long int)client->ecid, client->device->product_type, client->version, client->build);
+                }
+                struct stat fst;
+                if (stat(zfn, &fst) == 0) {
+                    if (shsh_store_read_legacy(zfn, tss) == 0 && store) {
+                        shsh_store_put(store, client->ecid, client->device->product_type, client->version, client->build, *tss);
                     }
-                    free(bin);
+                } else {
+                    error("no local file %s\n", zfn);
                 }
-            } else {
-                error("no local file %s\n", zfn);
             }
+            close_shsh_store(client, store);
         } else {
             error("No version found?!\n");
         }
@@ -1748,7 +2502,15 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
         info("Trying to fetch new SHSH blob\n");
     }
     
-    /* populate parameters */
+    /* everything taken from the build identity is shared by all devices
+     * of this model */
+    tss_template_t template = tss_template_get(build_identity, client->device->hardware_model, client->image4supported);
+    if (template == NULL) {
+        error("ERROR: Unable to create TSS request template\n");
+        return -1;
+    }
+    
+    /* populate per-device parameters */
     plist_t parameters = plist_new_dict();
     plist_dict_set_item(parameters, "ApECID", plist_new_uint(client->ecid));
     if (client->nonce) {
@@ -1763,58 +2525,7 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
         free(sep_nonce);
     }
     
-    plist_dict_set_item(parameters, "ApProductionMode", plist_new_bool(1));
-    if (client->image4supported) {
-        plist_dict_set_item(parameters, "ApSecurityMode", plist_new_bool(1));
-        plist_dict_set_item(parameters, "ApSupportsImg4", plist_new_bool(1));
-    } else {
-        plist_dict_set_item(parameters, "ApSupportsImg4", plist_new_bool(0));
-    }
-    
-    tss_parameters_add_from_manifest(parameters, build_identity);
-    
-    /* create basic request */
-    request = tss_request_new(NULL);
-    if (request == NULL) {
-        error("ERROR: Unable to create TSS request\n");
-        plist_free(parameters);
-        return -1;
-    }
-    
-    /* add common tags from manifest */
-    if (tss_request_add_common_tags(request, parameters, NULL) < 0) {
-        error("ERROR: Unable to add common tags to TSS request\n");
-        plist_free(request);
-        plist_free(parameters);
-        return -1;
-    }
-    
-    /* add tags from manifest */
-    if (tss_request_add_ap_tags(request, parameters, NULL) < 0) {
-        error("ERROR: Unable to add common tags to TSS request\n");
-        plist_free(request);
-        plist_free(parameters);
-        return -1;
-    }
-    
-    if (client->image4supported) {
-        /* add personalized parameters */
-        if (tss_request_add_ap_img4_tags(request, parameters) < 0) {
-            error("ERROR: Unable to add img4 tags to TSS request\n");
-            plist_free(request);
-            plist_free(parameters);
-            return -1;
-        }
-    } else {
-        /* add personalized parameters */
-        if (tss_request_add_ap_img3_tags(request, parameters) < 0) {
-            error("ERROR: Unable to add img3 tags to TSS request\n");
-            plist_free(request);
-            plist_free(parameters);
-            return -1;
-        }
-    }
-    
+    int baseband = 0;
     if (client->mode->index == MODE_NORMAL) {
         /* normal mode; request baseband ticket aswell */
         plist_t pinfo = NULL;
@@ -1837,15 +2548,26 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
             if (node) {
                 plist_dict_set_item(parameters, "BbSNUM", plist_copy(node));
             }
-            
-            /* add baseband parameters */
-            tss_request_add_baseband_tags(request, parameters, NULL);
+            baseband = 1;
         }
         client->preflight_info = pinfo;
     }
     
+    /* fill in the template */
+    int rspan = trace_begin(client->trace, "tss_request", "ApTicket");
+    request = tss_template_create_request(template, parameters, baseband);
+    tss_template_free(template);
+    trace_end(client->trace, rspan, 0, (request) ? 0 : -1);
+    if (request == NULL) {
+        error("ERROR: Unable to create TSS request\n");
+        plist_free(parameters);
+        return -1;
+    }
+    
     /* send request and grab response */
+    int span = trace_begin(client->trace, "tss", "ApTicket");
     response = tss_request_send(request, client->tss_url);
+    trace_end(client->trace, span, 0, (response) ? 0 : -1);
     if (response == NULL) {
         info("ERROR: Unable to send TSS request\n");
         plist_free(request);
@@ -1908,7 +2630,7 @@ int build_manifest_get_identity_count(plist_t build_manifest) {
     return plist_array_get_size(build_identities_array);
 }
 
-int extract_component(const char* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size)
+int extract_component(struct ipsw_archive* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size)
 {
     char* component_name = NULL;
     if (!ipsw || !path || !component_data || !component_size) {
@@ -1922,52 +2644,387 @@ int extract_component(const char* ipsw, const char* path, unsigned char** compon
         component_name = (char*) path;
     
     info("Extracting %s...\n", component_name);
-    if (ipsw_extract_to_memory(ipsw, path, component_data, component_size) < 0) {
-        error("ERROR: Unable to extract %s from %s\n", component_name, ipsw);
+    if (ipsw_archive_extract_to_memory(ipsw, path, component_data, component_size) < 0) {
+        error("ERROR: Unable to extract %s from %s\n", component_name, ipsw->path);
         return -1;
     }
     
     return 0;
 }
 
-int personalize_component(const char *component_name, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size) {
+plist_t idevicerestore_get_ota_manifest(struct idevicerestore_client_t* client)
+{
+    size_t size = 0;
+    char* data = NULL;
+    
+    if (client->otaBuildManifest || !client->otamanifest) {
+        return client->otaBuildManifest;
+    }
+    
+    if (read_file(client->otamanifest, (void**)&data, &size) < 0) {
+        return NULL;
+    }
+    if (size >= 8 && memcmp(data, "bplist00", 8) == 0)
+        plist_from_bin(data, (uint32_t)size, &client->otaBuildManifest);
+    else
+        plist_from_xml(data, (uint32_t)size, &client->otaBuildManifest);
+    free(data);
+    
+    return client->otaBuildManifest;
+}
+
+int download_component(struct idevicerestore_client_t* client, const char* url, const char* path, const char* output)
+{
+    struct stat st;
+    int span = trace_begin(client->trace, "download", path);
+    int res = partialzip_download_file_cached(url, path, output, client->cache_dir);
+    trace_end(client->trace, span, (res == 0 && stat(output, &st) == 0) ? (uint64_t)st.st_size : 0, res);
+    return res;
+}
+
+static int copy_cached_file(const char* src, const char* dst)
+{
+    char buf[65536];
+    size_t bytes = 0;
+    int res = 0;
+    
+    FILE* in = fopen(src, "rb");
+    if (!in) {
+        return -1;
+    }
+    FILE* out = fopen(dst, "wb");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+    while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, bytes, out) != bytes) {
+            res = -1;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        res = -1;
+    }
+    fclose(in);
+    if (fclose(out) != 0 || res < 0) {
+        remove(dst);
+        return -1;
+    }
+    return 0;
+}
+
+int download_remote_component(struct idevicerestore_client_t* client, const char* url, const char* path, const unsigned char* digest, unsigned int digest_size, const char* output)
+{
+    char cachefn[1024];
+    char tmpf[1024];
+    unsigned char key[SHA_DIGEST_LENGTH];
+    SHA_CTX ctx;
+    unsigned int i = 0;
+    
+    if (!client->cache_dir) {
+        return download_component(client, url, path, output);
+    }
+    
+    // a digest of zeroes means none is known, firmware URLs alone name a build
+    for (i = 0; digest && i < digest_size && digest[i] == 0; i++);
+    if (i == digest_size) {
+        digest_size = 0;
+    }
+    
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, url, strlen(url));
+    SHA1_Update(&ctx, "\n", 1);
+    SHA1_Update(&ctx, path, strlen(path));
+    if (digest_size > 0) {
+        SHA1_Update(&ctx, "\n", 1);
+        SHA1_Update(&ctx, digest, digest_size);
+    }
+    SHA1_Final(key, &ctx);
+    
+    if (cache_get_path(client->cache_dir, "remote", key, sizeof(key), cachefn, sizeof(cachefn)) < 0) {
+        return download_component(client, url, path, output);
+    }
+    
+    // the lease makes the entry count for -M and keeps it from being evicted while it is copied
+    cache_lease_t lease = NULL;
+    int res = cache_lease_acquire(cachefn, 0, &lease);
+    if (res == CACHE_LEASE_READY && cache_check_checksum(cachefn) < 0) {
+        info("Cached %s from %s is damaged, downloading it again\n", path, url);
+        cache_lease_release(lease);
+        cache_remove(cachefn);
+        res = cache_lease_acquire(cachefn, 0, &lease);
+    }
+    if (res == CACHE_LEASE_READY) {
+        debug("Using cached %s from %s\n", path, url);
+    } else if (res == CACHE_LEASE_FILL) {
+        if (client->cache_limit > 0) {
+            cache_evict(client->cache_dir, client->cache_limit, 0);
+        }
+        int fd = cache_create_temp(cachefn, tmpf, sizeof(tmpf));
+        if (fd < 0) {
+            cache_lease_filled(lease, 0);
+            return download_component(client, url, path, output);
+        }
+        close(fd);
+        if (download_component(client, url, path, tmpf) < 0) {
+            remove(tmpf);
+            cache_lease_filled(lease, 0);
+            return -1;
+        }
+        if (cache_put_checksum(cachefn, tmpf) < 0 || cache_publish_file(tmpf, cachefn) < 0) {
+            remove(tmpf);
+            cache_lease_filled(lease, 0);
+            return download_component(client, url, path, output);
+        }
+        if (cache_lease_filled(lease, 1) < 0) {
+            lease = NULL;
+        }
+    } else {
+        return download_component(client, url, path, output);
+    }
+    
+    // restores remove or rewrite their scratch copy, the entry stays untouched
+    res = copy_cached_file(cachefn, output);
+    cache_lease_release(lease);
+    if (res < 0) {
+        error("ERROR: Unable to copy %s to %s\n", cachefn, output);
+        return -1;
+    }
+    return 0;
+}
+
+int download_baseband_firmware(struct idevicerestore_client_t* client, const char* fwurl, const unsigned char* fwsha1, plist_t build_identity, const char* bbfwpath, const char* output)
+{
+    char* digest = NULL;
+    uint64_t digest_size = 0;
+    
+    // the manifest digest changes with every baseband, the firmware SHA1 is used when there is none
+    plist_t node = plist_access_path(build_identity, 3, "Manifest", "BasebandFirmware", "Digest");
+    if (node && plist_get_node_type(node) == PLIST_DATA) {
+        plist_get_data_val(node, &digest, &digest_size);
+    }
+    int res;
+    if (digest && digest_size > 0) {
+        res = download_remote_component(client, fwurl, bbfwpath, (unsigned char*)digest, (unsigned int)digest_size, output);
+    } else {
+        res = download_remote_component(client, fwurl, bbfwpath, fwsha1, (fwsha1) ? 20 : 0, output);
+    }
+    free(digest);
+    return res;
+}
+
+/* stores the manifest digest of component in digest, it's also the cache key */
+static int get_component_cache_path(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, char* cachefn, size_t cachefn_size, unsigned char* digest, unsigned int* digest_size)
+{
+    char* data = NULL;
+    uint64_t size = 0;
+    
+    if (client->identity && build_identity == client->identity_plist) {
+        const struct manifest_component* entry = manifest_identity_get_component(client->identity, component);
+        if (!client->cache_dir || !entry || !entry->digest || entry->digest_size > SHA384_DIGEST_LENGTH) {
+            return -1;
+        }
+        memcpy(digest, entry->digest, (size_t)entry->digest_size);
+        *digest_size = (unsigned int)entry->digest_size;
+        return cache_get_path(client->cache_dir, "components", entry->digest, (unsigned int)entry->digest_size, cachefn, cachefn_size);
+    }
+    
+    // components are keyed by their manifest digest, the bytes never change for a given digest
+    plist_t node = plist_access_path(build_identity, 3, "Manifest", component, "Digest");
+    if (!client->cache_dir || !node || plist_get_node_type(node) != PLIST_DATA) {
+        return -1;
+    }
+    plist_get_data_val(node, &data, &size);
+    if (!data || size > SHA384_DIGEST_LENGTH || cache_get_path(client->cache_dir, "components", (unsigned char*)data, (unsigned int)size, cachefn, cachefn_size) < 0) {
+        free(data);
+        return -1;
+    }
+    memcpy(digest, data, (size_t)size);
+    *digest_size = (unsigned int)size;
+    free(data);
+    
+    return 0;
+}
+
+/* the manifest digest of an Image3 leaves out the magic and the two size
+ * fields, anything else is hashed whole */
+static int component_matches_digest(const unsigned char* data, unsigned int size, const unsigned char* digest, unsigned int digest_size)
+{
+    unsigned char hash[SHA384_DIGEST_LENGTH];
+    unsigned int skip = 0;
+    uint32_t magic = 0;
+    
+    // the magic tells which of the two it is, so the data is hashed once
+    if (size > 0xC) {
+        memcpy(&magic, data, sizeof(magic));
+        if (magic == kImg3Container) {
+            skip = 0xC;
+        }
+    }
+    
+    if (digest_size == SHA_DIGEST_LENGTH) {
+        SHA1(data + skip, size - skip, hash);
+    } else if (digest_size == SHA384_DIGEST_LENGTH) {
+        SHA384(data + skip, size - skip, hash);
+    } else {
+        return 0;
+    }
+    
+    return (memcmp(hash, digest, digest_size) == 0);
+}
+
+int map_cached_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, const char* path, unsigned char** component_data, unsigned int* component_size, int* mapped)
+{
+    char cachefn[1024];
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    unsigned int digest_size = 0;
+    off_t expected_size = 0;
+    
+    *mapped = 0;
+    if (get_component_cache_path(client, build_identity, component, cachefn, sizeof(cachefn), digest, &digest_size) < 0) {
+        return -1;
+    }
+    
+    ipsw_archive_get_file_size(client->archive, path, &expected_size);
+    if (cache_map(cachefn, component_data, component_size, mapped) < 0) {
+        return -1;
+    }
+    // entries are named by their manifest digest and only published after
+    // matching it, a hit isn't hashed again and a short one is replaced
+    if (expected_size > 0 && *component_size == (unsigned int)expected_size) {
+        info("Using cached %s\n", component);
+        return 0;
+    }
+    debug("Cached %s does not have the size of its IPSW entry, extracting it again\n", component);
+    cache_release(*component_data, *component_size, *mapped);
+    *component_data = NULL;
+    *component_size = 0;
+    *mapped = 0;
+    cache_remove(cachefn);
+    
+    return -1;
+}
+
+/* a restore stops waiting for memory once it is told to quit */
+static int idevicerestore_memory_interrupted(void* arg)
+{
+    struct idevicerestore_client_t* client = (struct idevicerestore_client_t*)arg;
+    return (client->flags & FLAG_QUIT) != 0;
+}
+
+int idevicerestore_reserve_memory(struct idevicerestore_client_t* client, uint64_t* charged, uint64_t size, const char* what)
+{
+    if (budget_resize(&client->memory, charged, size, idevicerestore_memory_interrupted, client) < 0) {
+        error("ERROR: Restore stopped while waiting for memory for %s\n", what);
+        return -1;
+    }
+    return 0;
+}
+
+int idevicerestore_reserve_component(struct idevicerestore_client_t* client, const char* path, uint64_t* charged)
+{
+    off_t size = 0;
+
+    *charged = 0;
+    if (ipsw_archive_get_file_size(client->archive, path, &size) < 0 || size < 0) {
+        size = 0;
+    }
+    return idevicerestore_reserve_memory(client, charged, 2 * (uint64_t)size, path);
+}
+
+int extract_component_cached(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, const char* path, unsigned char** component_data, unsigned int* component_size, int* mapped)
+{
+    char cachefn[1024];
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    unsigned int digest_size = 0;
+    
+    *mapped = 0;
+    
+    if (get_component_cache_path(client, build_identity, component, cachefn, sizeof(cachefn), digest, &digest_size) < 0) {
+        int span = trace_begin(client->trace, "extract", component);
+        int res = extract_component(client->archive, path, component_data, component_size);
+        trace_end(client->trace, span, (res == 0) ? *component_size : 0, res);
+        return res;
+    }
+    if (map_cached_component(client, build_identity, component, path, component_data, component_size, mapped) == 0) {
+        return 0;
+    }
+    
+    int span = trace_begin(client->trace, "extract", component);
+    int res = extract_component(client->archive, path, component_data, component_size);
+    trace_end(client->trace, span, (res == 0) ? *component_size : 0, res);
+    if (res < 0) {
+        return -1;
+    }
+    
+    // a failed store only costs the next run another extraction, a component that
+    // does not match its digest (e.g. one of zeroes) would be replaced on every hit
+    if (!component_matches_digest(*component_data, *component_size, digest, digest_size)) {
+        debug("NOTE: Not caching %s, it does not match its manifest digest\n", component);
+    } else if (cache_publish(cachefn, *component_data, *component_size) < 0) {
+        debug("NOTE: Unable to cache %s\n", component);
+    }
+    
+    return 0;
+}
+
+int personalize_component_segments(const char *component_name, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, struct component_segments* segs) {
     unsigned char* component_blob = NULL;
     unsigned int component_blob_size = 0;
-    unsigned char* stitched_component = NULL;
-    unsigned int stitched_component_size = 0;
-    
+    int res = 0;
+
+    component_segments_init(segs);
+
     if (tss_response && tss_response_get_ap_img4_ticket(tss_response, &component_blob, &component_blob_size) == 0) {
         /* stitch ApImg4Ticket into IMG4 file */
-        img4_stitch_component(component_name, component_data, component_size, component_blob, component_blob_size, &stitched_component, &stitched_component_size);
+        res = img4_stitch_component_segments(component_name, component_data, component_size, component_blob, component_blob_size, segs);
     } else {
         /* try to get blob for current component from tss response */
         if (tss_response && tss_response_get_blob_by_entry(tss_response, component_name, &component_blob) < 0) {
             debug("NOTE: No SHSH blob found for component %s\n", component_name);
         }
-        
+
         if (component_blob != NULL) {
-            if (img3_stitch_component(component_name, component_data, component_size, component_blob, 64, &stitched_component, &stitched_component_size) < 0) {
+            res = img3_stitch_component_segments(component_name, component_data, component_size, component_blob, 64, segs);
+            if (res < 0) {
                 error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
-                free(component_blob);
-                return -1;
             }
         } else {
             info("Not personalizing component %s...\n", component_name);
-            stitched_component = (unsigned char*)malloc(component_size);
-            if (stitched_component) {
-                stitched_component_size = component_size;
-                memcpy(stitched_component, component_data, component_size);
-            }
+            res = component_segments_add(segs, component_data, component_size);
         }
     }
-    free(component_blob);
-    
+    /* the segments may point into the blob, so it lives as long as they do */
+    segs->owned = component_blob;
+    if (res < 0) {
+        component_segments_free(segs);
+        return -1;
+    }
+
     if (idevicerestore_keep_pers) {
-        write_file(component_name, stitched_component, stitched_component_size);
+        unsigned int size = 0;
+        const unsigned char* data = component_segments_gather(segs, &size);
+        if (data) {
+            write_file(component_name, data, size);
+        }
     }
-    
-    *personalized_component = stitched_component;
-    *personalized_component_size = stitched_component_size;
+
+    return 0;
+}
+
+int personalize_component(const char *component_name, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size) {
+    struct component_segments segs;
+
+    if (personalize_component_segments(component_name, component_data, component_size, tss_response, &segs) < 0) {
+        return -1;
+    }
+    if (component_segments_copy(&segs, personalized_component, personalized_component_size) < 0) {
+        component_segments_free(&segs);
+        return -1;
+    }
+    component_segments_free(&segs);
+
     return 0;
 }
 
@@ -2073,6 +3130,20 @@ int build_identity_has_component(plist_t build_identity, const char* component)
     return 0;
 }
 
+int idevicerestore_has_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component) {
+    if (client && client->identity && build_identity == client->identity_plist) {
+        return (manifest_identity_get_component(client->identity, component)) ? 0 : -1;
+    }
+    return build_identity_has_component(build_identity, component);
+}
+
+int idevicerestore_get_component_path(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, char** path) {
+    if (client && client->identity && build_identity == client->identity_plist) {
+        return manifest_identity_get_component_path(client->identity, component, path);
+    }
+    return build_identity_get_component_path(build_identity, component, path);
+}
+
 int build_identity_get_component_path(plist_t build_identity, const char* component, char** path) {
     char* filename = NULL;
     
@@ -43,8 +43,12 @@ extern "C" {
 #define FLAG_LATEST          1 << 8
 #define FLAG_RERESTORE       1 << 9
 #define FLAG_UPDATE          1 << 10
+#define FLAG_VERIFY          1 << 11
 
 struct idevicerestore_client_t;
+struct idevicerestore_shared_t;
+struct ipsw_archive;
+struct component_segments;
 
 enum {
 	RESTORE_STEP_DETECT = 0,
@@ -66,12 +70,25 @@ void idevicerestore_set_udid(struct idevicerestore_client_t* client, const char*
 void idevicerestore_set_flags(struct idevicerestore_client_t* client, int flags);
 void idevicerestore_set_ipsw(struct idevicerestore_client_t* client, const char* path);
 void idevicerestore_set_cache_path(struct idevicerestore_client_t* client, const char* path);
+void idevicerestore_set_cache_limit(struct idevicerestore_client_t* client, uint64_t limit);
 void idevicerestore_set_progress_callback(struct idevicerestore_client_t* client, idevicerestore_progress_cb_t cbfunc, void* userdata);
+void idevicerestore_set_asr_ring_depth(struct idevicerestore_client_t* client, int depth);
+void idevicerestore_set_trace_path(struct idevicerestore_client_t* client, const char* path);
 void idevicerestore_set_info_stream(FILE* strm);
 void idevicerestore_set_error_stream(FILE* strm);
 void idevicerestore_set_debug_stream(FILE* strm);
 
 int idevicerestore_start(struct idevicerestore_client_t* client);
+int idevicerestore_start_multi(struct idevicerestore_client_t** clients, int num_clients, int* results);
+
+/* Opens the IPSW of client and reads everything that doesn't depend on the
+ * device (BuildManifest, manifest index, version data and the SHSH store
+ * if the flags of client need it) once for any number of clients.
+ * idevicerestore_set_shared() hands it to a client before
+ * idevicerestore_start(); it must outlive all clients using it. */
+struct idevicerestore_shared_t* idevicerestore_shared_new(struct idevicerestore_client_t* client);
+void idevicerestore_shared_free(struct idevicerestore_shared_t* shared);
+void idevicerestore_set_shared(struct idevicerestore_client_t* client, struct idevicerestore_shared_t* shared);
 const char* idevicerestore_get_error(void);
 
 void usage(int argc, char* argv[]);
@@ -93,8 +110,31 @@ int build_manifest_get_build_count(plist_t build_manifest);
 void build_identity_print_information(plist_t build_identity);
 int build_identity_has_component(plist_t build_identity, const char* component);
 int build_identity_get_component_path(plist_t build_identity, const char* component, char** path);
+/* same as the above, answered from the manifest index for the client's build identity */
+int idevicerestore_has_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component);
+int idevicerestore_get_component_path(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, char** path);
 int ipsw_extract_filesystem(const char* ipsw, plist_t build_identity, char** filesystem);
-int extract_component(const char* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size);
+int extract_component(struct ipsw_archive* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size);
+/* parses client->otamanifest on first use, the result is owned by the client */
+plist_t idevicerestore_get_ota_manifest(struct idevicerestore_client_t* client);
+int download_component(struct idevicerestore_client_t* client, const char* url, const char* path, const char* output);
+
+/* Like download_component(), but kept under the cache directory keyed by
+ * url, path and digest (the manifest digest of the file or the SHA1 of the
+ * archive), so repeat restores copy it without any network I/O. */
+int download_remote_component(struct idevicerestore_client_t* client, const char* url, const char* path, const unsigned char* digest, unsigned int digest_size, const char* output);
+int download_baseband_firmware(struct idevicerestore_client_t* client, const char* fwurl, const unsigned char* fwsha1, plist_t build_identity, const char* bbfwpath, const char* output);
+/* like extract_component_cached, without extracting the component when it's not cached */
+int map_cached_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, const char* path, unsigned char** component_data, unsigned int* component_size, int* mapped);
+int extract_component_cached(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, const char* path, unsigned char** component_data, unsigned int* component_size, int* mapped);
+/* Moves what client has charged to its memory budget from *charged to
+ * size, waiting while the growth doesn't fit. Returns -1, with *charged
+ * unchanged, if the restore is told to quit meanwhile. */
+int idevicerestore_reserve_memory(struct idevicerestore_client_t* client, uint64_t* charged, uint64_t size, const char* what);
+/* Charges the extracted and the personalized copy of the component at
+ * path before either is allocated, its size in the IPSW stands in for both. */
+int idevicerestore_reserve_component(struct idevicerestore_client_t* client, const char* path, uint64_t* charged);
+int personalize_component_segments(const char *component, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, struct component_segments* segs);
 int personalize_component(const char *component, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size);
 
 const char* get_component_name(const char* filename);
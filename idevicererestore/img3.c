@@ -24,446 +24,281 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "img3.h"
 #include "common.h"
 #include "idevicerestore.h"
 
-static void img3_free(img3_file* image);
-static img3_element* img3_parse_element(const unsigned char* data);
-static void img3_free_element(img3_element* element);
+static int img3_read_element(const unsigned char* data, unsigned int size, unsigned int offset, img3_element* element) {
+	img3_element_header header;
 
-static img3_file* img3_parse_file(const unsigned char* data, unsigned int size) {
-	unsigned int data_offset = 0;
-	img3_element* element;
-	img3_header* header = (img3_header*) data;
-	if (header->signature != kImg3Container) {
-		error("ERROR: Invalid IMG3 file\n");
-		return NULL;
+	if (offset > size || size - offset < sizeof(img3_element_header)) {
+		error("ERROR: Truncated IMG3 element at offset %u\n", offset);
+		return -1;
 	}
-
-	img3_file* image = (img3_file*) malloc(sizeof(img3_file));
-	if (image == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 file\n");
-		return NULL;
+	memcpy(&header, &data[offset], sizeof(img3_element_header));
+	if (header.full_size < sizeof(img3_element_header) || header.full_size > size - offset) {
+		error("ERROR: Invalid size %u of IMG3 element at offset %u\n", header.full_size, offset);
+		return -1;
 	}
+
+	element->type = (img3_element_type) header.signature;
+	element->offset = offset;
+	element->full_size = header.full_size;
+	element->in_signature = 0;
+
+	return 0;
+}
+
+static const unsigned char* img3_element_data(const img3_file* image, const img3_element* element) {
+	return ((element->in_signature) ? image->signature : image->data) + element->offset;
+}
+
+static int img3_parse_file(const unsigned char* data, unsigned int size, img3_file* image) {
+	unsigned int data_offset = 0;
+	img3_element element;
+
 	memset(image, '\0', sizeof(img3_file));
 	image->idx_ecid_element = -1;
 	image->idx_shsh_element = -1;
 	image->idx_cert_element = -1;
 
-	image->header = (img3_header*) malloc(sizeof(img3_header));
-	if (image->header == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 header\n");
-		img3_free(image);
-		return NULL;
+	if (size < sizeof(img3_header)) {
+		error("ERROR: Invalid IMG3 file\n");
+		return -1;
+	}
+	memcpy(&image->header, data, sizeof(img3_header));
+	if (image->header.signature != kImg3Container) {
+		error("ERROR: Invalid IMG3 file\n");
+		return -1;
 	}
-	memcpy(image->header, data, sizeof(img3_header));
+	image->data = data;
+	image->size = size;
 	data_offset += sizeof(img3_header);
 
-	img3_element_header* current = NULL;
 	while (data_offset < size) {
-		current = (img3_element_header*) &data[data_offset];
-		switch (current->signature) {
+		if (img3_read_element(data, size, data_offset, &element) < 0) {
+			return -1;
+		}
+		switch (element.type) {
 		case kTypeElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse TYPE element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed TYPE element\n");
-			break;
-
 		case kDataElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse DATA element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed DATA element\n");
-			break;
-
 		case kVersElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse VERS element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed VERS element\n");
-			break;
-
 		case kSepoElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse SEPO element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed SEPO element\n");
-			break;
-
 		case kBordElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse BORD element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed BORD element\n");
-			break;
-
 		case kChipElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse CHIP element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed CHIP element\n");
-			break;
-
 		case kKbagElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse first KBAG element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed KBAG element\n");
+		case kUnknElement:
 			break;
-
 		case kEcidElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse ECID element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_ecid_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed ECID element\n");
 			break;
-
 		case kShshElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse SHSH element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_shsh_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed SHSH element\n");
 			break;
-
 		case kCertElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse CERT element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_cert_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed CERT element\n");
 			break;
-
-		case kUnknElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse UNKN element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed UNKN element\n");
-			break;
-
 		default:
-			error("ERROR: Unknown IMG3 element type %08x\n", current->signature);
-			img3_free(image);
-			return NULL;
+			error("ERROR: Unknown IMG3 element type %08x\n", element.type);
+			return -1;
 		}
-		data_offset += current->full_size;
-	}
-
-	return image;
-}
-
-static img3_element* img3_parse_element(const unsigned char* data) {
-	img3_element_header* element_header = (img3_element_header*) data;
-	img3_element* element = (img3_element*) malloc(sizeof(img3_element));
-	if (element == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 element\n");
-		return NULL;
-	}
-	memset(element, '\0', sizeof(img3_element));
-
-	element->data = (unsigned char*) malloc(element_header->full_size);
-	if (element->data == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 element data\n");
-		free(element);
-		return NULL;
+		// leave room for the signature elements
+		if (image->num_elements >= IMG3_MAX_ELEMENTS - 3) {
+			error("ERROR: Too many IMG3 elements\n");
+			return -1;
+		}
+		image->elements[image->num_elements++] = element;
+		debug("Parsed %c%c%c%c element\n", (element.type >> 24) & 0xFF, (element.type >> 16) & 0xFF, (element.type >> 8) & 0xFF, element.type & 0xFF);
+		data_offset += element.full_size;
 	}
-	memcpy(element->data, data, element_header->full_size);
-	element->header = (img3_element_header*) element->data;
-	element->type = (img3_element_type) element->header->signature;
 
-	return element;
+	return 0;
 }
 
-static void img3_free(img3_file* image) {
-	if (image != NULL) {
-		if (image->header != NULL) {
-			free(image->header);
-		}
-
-		int i;
-		for (i = 0; i < image->num_elements; i++) {
-			img3_free_element(image->elements[i]);
-			image->elements[i] = NULL;
+static void img3_update_indices(img3_file* image) {
+	int i;
+	image->idx_ecid_element = -1;
+	image->idx_shsh_element = -1;
+	image->idx_cert_element = -1;
+	for (i = 0; i < image->num_elements; i++) {
+		switch (image->elements[i].type) {
+		case kEcidElement:
+			image->idx_ecid_element = i;
+			break;
+		case kShshElement:
+			image->idx_shsh_element = i;
+			break;
+		case kCertElement:
+			image->idx_cert_element = i;
+			break;
+		default:
+			break;
 		}
-		free(image);
-		image = NULL;
 	}
 }
 
-static void img3_free_element(img3_element* element) {
-	if (element != NULL) {
-		if (element->data != NULL) {
-			free(element->data);
-			element->data = NULL;
-		}
-		free(element);
-		element = NULL;
+/* replaces the element at idx, or inserts it before before_idx (appends if
+ * that is negative too) */
+static int img3_set_element(img3_file* image, int idx, int before_idx, const img3_element* element) {
+	if (idx >= 0) {
+		image->elements[idx] = *element;
+		return 0;
+	}
+	if (image->num_elements >= IMG3_MAX_ELEMENTS) {
+		error("ERROR: Too many IMG3 elements\n");
+		return -1;
 	}
+	if (before_idx < 0) {
+		before_idx = image->num_elements;
+	}
+	memmove(&image->elements[before_idx+1], &image->elements[before_idx], (image->num_elements - before_idx) * sizeof(img3_element));
+	image->elements[before_idx] = *element;
+	image->num_elements++;
+	img3_update_indices(image);
+	return 0;
 }
 
 static int img3_replace_signature(img3_file* image, const unsigned char* signature) {
-	int i, oldidx;
-	int offset = 0;
-	img3_element* ecid = img3_parse_element(&signature[offset]);
-	if (ecid == NULL || ecid->type != kEcidElement) {
+	// callers don't know the size of the whole blob, its elements are only
+	// bounded by their own headers
+	unsigned int signature_size = UINT_MAX;
+	unsigned int offset = 0;
+	img3_element ecid, shsh, cert;
+
+	if (img3_read_element(signature, signature_size, offset, &ecid) < 0 || ecid.type != kEcidElement) {
 		error("ERROR: Unable to find ECID element in signature\n");
 		return -1;
 	}
-	offset += ecid->header->full_size;
+	offset += ecid.full_size;
 
-	img3_element* shsh = img3_parse_element(&signature[offset]);
-	if (shsh == NULL || shsh->type != kShshElement) {
+	if (img3_read_element(signature, signature_size, offset, &shsh) < 0 || shsh.type != kShshElement) {
 		error("ERROR: Unable to find SHSH element in signature\n");
 		return -1;
 	}
-	offset += shsh->header->full_size;
+	offset += shsh.full_size;
 
-	img3_element* cert = img3_parse_element(&signature[offset]);
-	if (cert == NULL || cert->type != kCertElement) {
+	if (img3_read_element(signature, signature_size, offset, &cert) < 0 || cert.type != kCertElement) {
 		error("ERROR: Unable to find CERT element in signature\n");
 		return -1;
 	}
-	offset += cert->header->full_size;
-
-	if (image->idx_ecid_element >= 0) {
-		img3_free_element(image->elements[image->idx_ecid_element]);
-		image->elements[image->idx_ecid_element] = ecid;
-	} else {
-		if (image->idx_shsh_element >= 0) {
-			// move elements by 1
-			oldidx = image->idx_shsh_element;
-			for (i = image->num_elements-1; i >= oldidx; i--) {
-				image->elements[i+1] = image->elements[i];
-				switch (image->elements[i+1]->type) {
-				case kShshElement:
-					image->idx_shsh_element = i+1;
-					break;
-				case kCertElement:
-					image->idx_cert_element = i+1;
-					break;
-				case kEcidElement:
-					image->idx_ecid_element = i+1;
-					break;
-				default:
-					break;
-				}
-			}
-			image->elements[oldidx] = ecid;
-			image->idx_ecid_element = oldidx;
-			image->num_elements++;
-		} else {
-			// append if not found
-			image->elements[image->num_elements] = ecid;
-			image->idx_ecid_element = image->num_elements;
-			image->num_elements++;
-		}
-	}
+	offset += cert.full_size;
 
-	if (image->idx_shsh_element >= 0) {
-		img3_free_element(image->elements[image->idx_shsh_element]);
-		image->elements[image->idx_shsh_element] = shsh;
-	} else {
-		if (image->idx_cert_element >= 0) {
-			// move elements by 1
-			oldidx = image->idx_cert_element;
-			for (i = image->num_elements-1; i >= oldidx; i--) {
-				image->elements[i+1] = image->elements[i];
-				switch (image->elements[i+1]->type) {
-				case kShshElement:
-					image->idx_shsh_element = i+1;
-					break;
-				case kCertElement:
-					image->idx_cert_element = i+1;
-					break;
-				case kEcidElement:
-					image->idx_ecid_element = i+1;
-					break;
-				default:
-					break;
-				}
-			}
-			image->elements[oldidx] = shsh;
-			image->idx_shsh_element = oldidx;
-			image->num_elements++;
-		} else {
-			// append if not found
-			image->elements[image->num_elements] = shsh;
-			image->idx_shsh_element = image->num_elements;
-			image->num_elements++;
-		}
-	}
+	image->signature = signature;
+	ecid.in_signature = 1;
+	shsh.in_signature = 1;
+	cert.in_signature = 1;
 
-	if (image->idx_cert_element >= 0) {
-		img3_free_element(image->elements[image->idx_cert_element]);
-		image->elements[image->idx_cert_element] = cert;
-	} else {
-		// append if not found
-		image->elements[image->num_elements] = cert;
-		image->idx_cert_element = image->num_elements;
-		image->num_elements++;
+	if (img3_set_element(image, image->idx_ecid_element, image->idx_shsh_element, &ecid) < 0
+	    || img3_set_element(image, image->idx_shsh_element, image->idx_cert_element, &shsh) < 0
+	    || img3_set_element(image, image->idx_cert_element, -1, &cert) < 0) {
+		return -1;
 	}
 
 	return 0;
 }
 
-static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int* psize) {
+static int img3_get_segments(const img3_file* image, struct component_segments* segs) {
 	int i;
-	int offset = 0;
-	int size = sizeof(img3_header);
+	unsigned int offset = 0;
+	unsigned int size = sizeof(img3_header);
+	unsigned int start = segs->size;
+	img3_header header;
+
+	header.shsh_offset = 0;
 
-	// Add up the size of the image first so we can allocate our memory
+	// Add up the size of the image first so we can build the header
 	for (i = 0; i < image->num_elements; i++) {
-		size += image->elements[i]->header->full_size;
+		if (image->elements[i].type == kShshElement) {
+			header.shsh_offset = offset;
+		}
+		offset += image->elements[i].full_size;
 	}
+	size += offset;
 
 	info("reconstructed size: %d\n", size);
 
-	unsigned char* data = (unsigned char*) malloc(size);
-	if (data == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 data\n");
+	header.full_size = size;
+	header.signature = image->header.signature;
+	header.data_size = size - sizeof(img3_header);
+	header.image_type = image->header.image_type;
+
+	// Reference each section instead of copying it, runs of elements that
+	// are contiguous in their source end up as a single segment
+	if (component_segments_add_inline(segs, (const unsigned char*)&header, sizeof(img3_header)) < 0) {
 		return -1;
 	}
-
-	// Add data to our new header (except shsh_offset)
-	img3_header* header = (img3_header*) data;
-	header->full_size = size;
-	header->signature = image->header->signature;
-	header->data_size = size - sizeof(img3_header);
-	header->image_type = image->header->image_type;
-	header->shsh_offset = 0;
-	offset += sizeof(img3_header);
-
-	// Copy each section over to the new buffer
 	for (i = 0; i < image->num_elements; i++) {
-		memcpy(&data[offset], image->elements[i]->data, image->elements[i]->header->full_size);
-		if (image->elements[i]->type == kShshElement) {
-			header->shsh_offset = offset - sizeof(img3_header);
+		if (component_segments_add(segs, img3_element_data(image, &image->elements[i]), image->elements[i].full_size) < 0) {
+			return -1;
 		}
-		offset += image->elements[i]->header->full_size;
 	}
 
-	if (offset != size) {
+	if (segs->size - start != size) {
 		error("ERROR: Incorrectly sized image data\n");
-		free(data);
-		*pdata = 0;
-		*psize = 0;
 		return -1;
 	}
 
-	*pdata = data;
-	*psize = size;
 	return 0;
 }
 
-int img3_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img3_data, unsigned int *img3_size)
+int img3_stitch_component_segments(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, struct component_segments* segs)
 {
-	img3_file *img3 = NULL;
-	unsigned char* outbuf = NULL;
-	unsigned int outsize = 0;
+	img3_file img3;
 
-	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !img3_data || !img3_size) {
+	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !segs) {
 		return -1;
 	}
 
 	info("Personalizing IMG3 component %s...\n", component_name);
 	
 	/* parse current component as img3 */
-	img3 = img3_parse_file(component_data, component_size);
-	if (img3 == NULL) {
+	if (img3_parse_file(component_data, component_size, &img3) < 0) {
 		error("ERROR: Unable to parse %s IMG3 file\n", component_name);
 		return -1;
 	}
 
-	int i;
-	for (i = 0; i <img3->num_elements; i++) {
-		if (img3->elements[i]->type == kEcidElement) {
-			info("Seems that %s is already personalized, ignoring...\n", component_name);
-			img3_free(img3);
-			outbuf = malloc(component_size);
-			if (!outbuf) {
-				error("ERROR: Unabled to allocate memory for IMG3 data\n");
-				return -1;
-			}
-			memcpy(outbuf, component_data, component_size);
-			*img3_data = outbuf;
-			*img3_size = component_size;
-			return 0;
-		}
+	if (img3.idx_ecid_element >= 0) {
+		info("Seems that %s is already personalized, ignoring...\n", component_name);
+		return component_segments_add(segs, component_data, component_size);
 	}
-	
-	if (((img3_element_header*)blob)->full_size != blob_size) {
-		error("ERROR: Invalid blob passed for %s IMG3: The size %d embedded in the blob does not match the passed size of %d\n", component_name, ((img3_element_header*)blob)->full_size, blob_size, component_name);
-		img3_free(img3);
+
+	if (blob_size < sizeof(img3_element_header) || ((img3_element_header*)blob)->full_size != blob_size) {
+		error("ERROR: Invalid blob passed for %s IMG3: The size %d embedded in the blob does not match the passed size of %d\n", component_name, (blob_size < sizeof(img3_element_header)) ? 0 : ((img3_element_header*)blob)->full_size, blob_size);
 		return -1;
 	}
 
 	/* personalize the component using the blob */
-	if (img3_replace_signature(img3, blob) < 0) {
+	if (img3_replace_signature(&img3, blob) < 0) {
 		error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
-		img3_free(img3);
 		return -1;
 	}
 
-	/* get the img3 file as data */
-	if (img3_get_data(img3, &outbuf, &outsize) < 0) {
+	/* describe the img3 file as segments of the component and the blob */
+	if (img3_get_segments(&img3, segs) < 0) {
 		error("ERROR: Unable to reconstruct %s IMG3\n", component_name);
-		img3_free(img3);
 		return -1;
 	}
 
-	/* cleanup */
-	img3_free(img3);
+	return 0;
+}
+
+int img3_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img3_data, unsigned int *img3_size)
+{
+	struct component_segments segs;
+	int res;
+
+	if (!img3_data || !img3_size) {
+		return -1;
+	}
 
-	*img3_data = outbuf;
-	*img3_size = outsize;
+	component_segments_init(&segs);
+	res = img3_stitch_component_segments(component_name, component_data, component_size, blob, blob_size, &segs);
+	if (res == 0) {
+		res = component_segments_copy(&segs, img3_data, img3_size);
+	}
+	component_segments_free(&segs);
 
-	return 0;
+	return res;
 }
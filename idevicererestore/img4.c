@@ -33,13 +33,12 @@
 #define IMG4_MAGIC "IMG4"
 #define IMG4_MAGIC_SIZE 4
 
-static unsigned char* asn1_create_element_header(unsigned char type, unsigned int size, unsigned char** data, unsigned int *data_size)
+static unsigned int asn1_create_element_header(unsigned char type, unsigned int size, unsigned char* buf)
 {
-	unsigned char buf[6];
 	unsigned int off = 0;
 
-	if (!type || size == 0 || !data || !data_size) {
-		return NULL;
+	if (!type || size == 0 || !buf) {
+		return 0;
 	}
 
 	buf[off++] = type;
@@ -72,26 +71,21 @@ static unsigned char* asn1_create_element_header(unsigned char type, unsigned in
 		buf[off++] = size & 0xFF;
 	}
 
-	*data = malloc(off);
-	memcpy(*data, buf, off);
-	*data_size = off;
-
-	return *data;
-}	
+	return off;
+}
 
-int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size)
+int img4_stitch_component_segments(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, struct component_segments* segs)
 {
-	unsigned char* magic_header = NULL;
+	unsigned char magic_header[6];
 	unsigned int magic_header_size = 0;
-	unsigned char* blob_header = NULL;
+	unsigned char blob_header[6];
 	unsigned int blob_header_size = 0;
-	unsigned char* img4header = NULL;
+	unsigned char img4header[6];
 	unsigned int img4header_size = 0;
 	unsigned int content_size;
-	unsigned char* outbuf;
-	unsigned char* p;
+	const char* tag = NULL;
 
-	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !img4_data || !img4_size) {
+	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !segs) {
 		return -1;
 	}
 
@@ -100,66 +94,67 @@ int img4_stitch_component(const char* component_name, const unsigned char* compo
 	/* first we need check if we have to change the tag for the given component */
 	// FIXME: write proper ASN1 handling code for this
 	if (strcmp(component_name, "RestoreKernelCache") == 0) {
-		memcpy((char*)component_data+0xD, "rkrn", 4);
+		tag = "rkrn";
 	} else if (strcmp(component_name, "RestoreDeviceTree") == 0) {
-		memcpy((char*)component_data+0xD, "rdtr", 4);
+		tag = "rdtr";
 	} else if (strcmp(component_name, "RestoreSEP") == 0) {
-		memcpy((char*)component_data+0xD, "rsep", 4);
+		tag = "rsep";
+	}
+	if (tag && component_size < 0xD + 4) {
+		error("ERROR: %s is too small to be an IM4P payload\n", component_name);
+		return -1;
 	}
 
 	// create element header for the "IMG4" magic
-	asn1_create_element_header(ASN1_IA5_STRING, IMG4_MAGIC_SIZE, &magic_header, &magic_header_size);
+	magic_header_size = asn1_create_element_header(ASN1_IA5_STRING, IMG4_MAGIC_SIZE, magic_header);
 	// create element header for the blob (ApImg4Ticket)
-	asn1_create_element_header(ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED, blob_size, &blob_header, &blob_header_size);
+	blob_header_size = asn1_create_element_header(ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED, blob_size, blob_header);
 
 	// calculate the size for the final IMG4 file (asn1 sequence)
 	content_size = magic_header_size + IMG4_MAGIC_SIZE + component_size + blob_header_size + blob_size;
 
 	// create element header for the final IMG4 asn1 blob
-	asn1_create_element_header(ASN1_SEQUENCE|ASN1_CONSTRUCTED, content_size, &img4header, &img4header_size);
-
-	outbuf = (unsigned char*)malloc(img4header_size + content_size);
-	if (!outbuf) {
-		if (magic_header) {
-			free(magic_header);
-		}
-		if (blob_header) {
-			free(blob_header);
-		}
-		if (img4header) {
-			free(img4header);
-		}
-		error("ERROR: out of memory when personalizing IMG4 component %s\n", component_name);
-		return -1;
+	img4header_size = asn1_create_element_header(ASN1_SEQUENCE|ASN1_CONSTRUCTED, content_size, img4header);
+
+	// now put everything together, the component itself is referenced and never modified
+	int res = component_segments_add_inline(segs, img4header, img4header_size);
+	res |= component_segments_add_inline(segs, magic_header, magic_header_size);
+	res |= component_segments_add_inline(segs, (const unsigned char*)IMG4_MAGIC, IMG4_MAGIC_SIZE);
+	if (tag) {
+		res |= component_segments_add(segs, component_data, 0xD);
+		res |= component_segments_add_inline(segs, (const unsigned char*)tag, 4);
+		res |= component_segments_add(segs, component_data + 0xD + 4, component_size - 0xD - 4);
+	} else {
+		res |= component_segments_add(segs, component_data, component_size);
 	}
-	p = outbuf;
-
-	// now put everything together
-	memcpy(p, img4header, img4header_size);
-	p += img4header_size;
-	memcpy(p, magic_header, magic_header_size);
-	p += magic_header_size;
-	memcpy(p, IMG4_MAGIC, IMG4_MAGIC_SIZE);
-	p += IMG4_MAGIC_SIZE;
-	memcpy(p, component_data, component_size);
-	p += component_size;
-	memcpy(p, blob_header, blob_header_size);
-	p += blob_header_size;
-	memcpy(p, blob, blob_size);
-	p += blob_size;
-
-	*img4_data = outbuf;
-	*img4_size = (p - outbuf);
-
-	if (magic_header) {
-		free(magic_header);
+	res |= component_segments_add_inline(segs, blob_header, blob_header_size);
+	res |= component_segments_add(segs, blob, blob_size);
+	if (res < 0) {
+		error("ERROR: Unable to stitch IMG4 component %s\n", component_name);
+		return -1;
 	}
-	if (blob_header) {
-		free(blob_header);
+
+	return 0;
+}
+
+int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size)
+{
+	struct component_segments segs;
+	int res;
+
+	if (!img4_data || !img4_size) {
+		return -1;
 	}
-	if (img4header) {
-		free(img4header);
+
+	component_segments_init(&segs);
+	res = img4_stitch_component_segments(component_name, component_data, component_size, blob, blob_size, &segs);
+	if (res == 0) {
+		res = component_segments_copy(&segs, img4_data, img4_size);
+		if (res < 0) {
+			error("ERROR: out of memory when personalizing IMG4 component %s\n", component_name);
+		}
 	}
+	component_segments_free(&segs);
 
-	return 0;
+	return res;
 }
@@ -26,6 +26,9 @@
 extern "C" {
 #endif
 
+struct component_segments;
+
+int img4_stitch_component_segments(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, struct component_segments* segs);
 int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size);
 
 #ifdef __cplusplus
@@ -21,26 +21,80 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <zip.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <openssl/sha.h>
 
 #include "ipsw.h"
 #include "locking.h"
 #include "download.h"
+#include "hash.h"
 #include "common.h"
 #include "idevicerestore.h"
 
 #define BUFSIZE 0x100000
+/* inflating in large blocks keeps the per-call overhead of zip_fread low */
+#define EXTRACT_BUFSIZE 0x800000
 
-typedef struct {
-	struct zip* zip;
-} ipsw_archive;
+static unsigned int ipsw_name_hash(const char* name)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int ipsw_build_name_index(ipsw_archive* archive)
+{
+	zip_int64_t num = zip_get_num_entries(archive->zip, 0);
+	if (num < 0) {
+		return -1;
+	}
+	archive->num_entries = (int)num;
+
+	unsigned int size = 16;
+	while (size < (unsigned int)archive->num_entries * 2) {
+		size <<= 1;
+	}
+	archive->name_index = (int*)malloc(size * sizeof(int));
+	if (archive->name_index == NULL) {
+		return -1;
+	}
+	memset(archive->name_index, 0xFF, size * sizeof(int));
+	archive->name_index_size = size;
+
+	int i;
+	for (i = 0; i < archive->num_entries; i++) {
+		const char* name = zip_get_name(archive->zip, i, 0);
+		if (name == NULL) {
+			continue;
+		}
+		unsigned int slot = ipsw_name_hash(name) & (size - 1);
+		while (archive->name_index[slot] >= 0) {
+			slot = (slot + 1) & (size - 1);
+		}
+		archive->name_index[slot] = i;
+	}
 
-ipsw_archive* ipsw_open(const char* ipsw);
-void ipsw_close(ipsw_archive* archive);
+	return 0;
+}
 
 ipsw_archive* ipsw_open(const char* ipsw) {
 	int err = 0;
@@ -49,6 +103,7 @@ ipsw_archive* ipsw_open(const char* ipsw) {
 		error("ERROR: Out of memory\n");
 		return NULL;
 	}
+	memset(archive, '\0', sizeof(ipsw_archive));
 
 	archive->zip = zip_open(ipsw, 0, &err);
 	if (archive->zip == NULL) {
@@ -57,84 +112,472 @@ ipsw_archive* ipsw_open(const char* ipsw) {
 		return NULL;
 	}
 
+	if (ipsw_build_name_index(archive) < 0) {
+		error("ERROR: Unable to index %s\n", ipsw);
+		zip_close(archive->zip);
+		free(archive);
+		return NULL;
+	}
+
+	archive->path = strdup(ipsw);
+	archive->refcount = 1;
+	mutex_init(&archive->lock);
+
 	return archive;
 }
 
-int ipsw_get_file_size(const char* ipsw, const char* infile, off_t* size) {
-	ipsw_archive* archive = ipsw_open(ipsw);
+ipsw_archive* ipsw_archive_ref(ipsw_archive* archive) {
+	if (archive != NULL) {
+		mutex_lock(&archive->lock);
+		archive->refcount++;
+		mutex_unlock(&archive->lock);
+	}
+	return archive;
+}
+
+void ipsw_close(ipsw_archive* archive) {
+	if (archive != NULL) {
+		mutex_lock(&archive->lock);
+		int refcount = --archive->refcount;
+		mutex_unlock(&archive->lock);
+		if (refcount > 0) {
+			return;
+		}
+		zip_unchange_all(archive->zip);
+		zip_close(archive->zip);
+		mutex_destroy(&archive->lock);
+		free(archive->name_index);
+		free(archive->path);
+		free(archive);
+	}
+}
+
+int ipsw_archive_locate(ipsw_archive* archive, const char* infile) {
+	if (archive == NULL || archive->name_index == NULL || infile == NULL) {
+		return -1;
+	}
+
+	unsigned int mask = archive->name_index_size - 1;
+	unsigned int slot = ipsw_name_hash(infile) & mask;
+	int found = -1;
+	mutex_lock(&archive->lock);
+	while (archive->name_index[slot] >= 0) {
+		int zindex = archive->name_index[slot];
+		const char* name = zip_get_name(archive->zip, zindex, 0);
+		if (name && strcmp(name, infile) == 0) {
+			found = zindex;
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+	mutex_unlock(&archive->lock);
+
+	return found;
+}
+
+/* libzip keeps no lock of its own, so even the lookups share archive->lock */
+static int ipsw_archive_stat_index(ipsw_archive* archive, int zindex, struct zip_stat* zstat)
+{
+	zip_stat_init(zstat);
+	mutex_lock(&archive->lock);
+	int res = zip_stat_index(archive->zip, zindex, 0, zstat);
+	mutex_unlock(&archive->lock);
+	return res;
+}
+
+int ipsw_archive_file_exists(ipsw_archive* archive, const char* infile) {
+	if (archive == NULL || archive->zip == NULL) {
+		return -1;
+	}
+
+	if (ipsw_archive_locate(archive, infile) < 0) {
+		return -2;
+	}
+
+	return 0;
+}
+
+int ipsw_archive_get_file_size(ipsw_archive* archive, const char* infile, off_t* size) {
 	if (archive == NULL || archive->zip == NULL) {
 		error("ERROR: Invalid archive\n");
 		return -1;
 	}
 
-	int zindex = zip_name_locate(archive->zip, infile, 0);
+	int zindex = ipsw_archive_locate(archive, infile);
 	if (zindex < 0) {
 		error("ERROR: zip_name_locate: %s\n", infile);
 		return -1;
 	}
 
 	struct zip_stat zstat;
-	zip_stat_init(&zstat);
-	if (zip_stat_index(archive->zip, zindex, 0, &zstat) != 0) {
+	if (ipsw_archive_stat_index(archive, zindex, &zstat) != 0) {
 		error("ERROR: zip_stat_index: %s\n", infile);
 		return -1;
 	}
 
 	*size = zstat.size;
 
-	ipsw_close(archive);
 	return 0;
 }
 
-int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress)
+#ifndef WIN32
+static uint16_t ipsw_le16(const unsigned char* p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t ipsw_le32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t ipsw_le64(const unsigned char* p)
+{
+	return (uint64_t)ipsw_le32(p) | ((uint64_t)ipsw_le32(p + 4) << 32);
+}
+
+static int ipsw_pread_full(int fd, void* buffer, size_t size, uint64_t offset)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t count = pread(fd, (char*)buffer + done, size - done, (off_t)(offset + done));
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+		done += count;
+	}
+	return 0;
+}
+
+/* Finds where the data of entry zindex starts in the archive file. libzip
+ * doesn't expose the local header offsets, so the central directory is
+ * read here and the entry matched by position and name. */
+static int ipsw_archive_get_data_offset(ipsw_archive* archive, int fd, int zindex, uint64_t* data_offset)
+{
+	unsigned char tail[65536 + 22];
+	unsigned char local[30];
+	off_t file_size = lseek(fd, 0, SEEK_END);
+
+	if (file_size < 22) {
+		return -1;
+	}
+
+	/* end of central directory record, possibly followed by a comment */
+	size_t tail_size = (file_size < (off_t)sizeof(tail)) ? (size_t)file_size : sizeof(tail);
+	uint64_t tail_offset = (uint64_t)file_size - tail_size;
+	if (ipsw_pread_full(fd, tail, tail_size, tail_offset) < 0) {
+		return -1;
+	}
+	int eocd = -1;
+	int i;
+	for (i = (int)tail_size - 22; i >= 0; i--) {
+		if (ipsw_le32(tail + i) == 0x06054b50) {
+			eocd = i;
+			break;
+		}
+	}
+	if (eocd < 0) {
+		return -1;
+	}
+	uint64_t num_entries = ipsw_le16(tail + eocd + 10);
+	uint64_t cd_size = ipsw_le32(tail + eocd + 12);
+	uint64_t cd_offset = ipsw_le32(tail + eocd + 16);
+
+	/* zip64 end of central directory, found through its locator */
+	if ((num_entries == 0xFFFF || cd_size == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF) && eocd >= 20
+	    && ipsw_le32(tail + eocd - 20) == 0x07064b50) {
+		unsigned char eocd64[56];
+		if (ipsw_pread_full(fd, eocd64, sizeof(eocd64), ipsw_le64(tail + eocd - 12)) < 0 || ipsw_le32(eocd64) != 0x06064b50) {
+			return -1;
+		}
+		num_entries = ipsw_le64(eocd64 + 32);
+		cd_size = ipsw_le64(eocd64 + 40);
+		cd_offset = ipsw_le64(eocd64 + 48);
+	}
+	if ((uint64_t)zindex >= num_entries || cd_offset + cd_size > (uint64_t)file_size || cd_size > 0x10000000) {
+		return -1;
+	}
+
+	unsigned char* cd = (unsigned char*)malloc(cd_size);
+	if (!cd) {
+		return -1;
+	}
+	if (ipsw_pread_full(fd, cd, cd_size, cd_offset) < 0) {
+		free(cd);
+		return -1;
+	}
+
+	mutex_lock(&archive->lock);
+	const char* zname = zip_get_name(archive->zip, zindex, 0);
+	char* name = (zname) ? strdup(zname) : NULL;
+	mutex_unlock(&archive->lock);
+	if (!name) {
+		free(cd);
+		return -1;
+	}
+
+	uint64_t pos = 0;
+	int res = -1;
+	for (i = 0; i <= zindex && pos + 46 <= cd_size && ipsw_le32(cd + pos) == 0x02014b50; i++) {
+		uint16_t name_len = ipsw_le16(cd + pos + 28);
+		uint16_t extra_len = ipsw_le16(cd + pos + 30);
+		uint16_t comment_len = ipsw_le16(cd + pos + 32);
+		if (pos + 46 + name_len + extra_len > cd_size) {
+			break;
+		}
+		if (i == zindex) {
+			if (name_len != strlen(name) || memcmp(cd + pos + 46, name, name_len) != 0) {
+				break;
+			}
+			uint64_t usize = ipsw_le32(cd + pos + 24);
+			uint64_t csize = ipsw_le32(cd + pos + 20);
+			uint64_t offset = ipsw_le32(cd + pos + 42);
+			/* the zip64 extra field holds the values that didn't fit, in this order */
+			const unsigned char* extra = cd + pos + 46 + name_len;
+			uint16_t e = 0;
+			while (e + 4 <= extra_len) {
+				uint16_t id = ipsw_le16(extra + e);
+				uint16_t len = ipsw_le16(extra + e + 2);
+				if (e + 4 + len > extra_len) {
+					break;
+				}
+				if (id == 0x0001) {
+					const unsigned char* f = extra + e + 4;
+					const unsigned char* fend = f + len;
+					if (usize == 0xFFFFFFFF && f + 8 <= fend) {
+						usize = ipsw_le64(f);
+						f += 8;
+					}
+					if (csize == 0xFFFFFFFF && f + 8 <= fend) {
+						csize = ipsw_le64(f);
+						f += 8;
+					}
+					if (offset == 0xFFFFFFFF && f + 8 <= fend) {
+						offset = ipsw_le64(f);
+					}
+				}
+				e += 4 + len;
+			}
+			if (ipsw_pread_full(fd, local, sizeof(local), offset) == 0 && ipsw_le32(local) == 0x04034b50) {
+				*data_offset = offset + sizeof(local) + ipsw_le16(local + 26) + ipsw_le16(local + 28);
+				res = (*data_offset + csize <= (uint64_t)file_size) ? 0 : -1;
+			}
+			break;
+		}
+		pos += 46 + name_len + extra_len + comment_len;
+	}
+	free(name);
+	free(cd);
+
+	return res;
+}
+
+static void ipsw_preallocate(int fd, uint64_t size)
+{
+	if (size == 0) {
+		return;
+	}
+#if defined(__APPLE__)
+	fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+	if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+		store.fst_flags = F_ALLOCATEALL;
+		fcntl(fd, F_PREALLOCATE, &store);
+	}
+#elif defined(__linux__)
+	/* unlike posix_fallocate() this never falls back to writing zeros */
+	fallocate(fd, 0, 0, (off_t)size);
+#endif
+}
+
+/* Copies size bytes at in_offset of in_fd to the start of out_fd, in the
+ * kernel where it can: copy_file_range() also shares extents on
+ * filesystems that support reflinks, sendfile() covers older kernels. */
+static int ipsw_copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t size, int print_progress)
+{
+	uint64_t done = 0;
+	char* buffer = NULL;
+#ifdef __linux__
+	int use_copy_file_range = 1;
+	int use_sendfile = 1;
+#endif
+
+	while (done < size) {
+		size_t chunk = (size - done < EXTRACT_BUFSIZE) ? (size_t)(size - done) : EXTRACT_BUFSIZE;
+		ssize_t count = -1;
+#ifdef __linux__
+		if (use_copy_file_range) {
+			loff_t off_in = (loff_t)(in_offset + done);
+			loff_t off_out = (loff_t)done;
+			count = copy_file_range(in_fd, &off_in, out_fd, &off_out, chunk, 0);
+			if (count < 0 && errno != EINTR) {
+				/* ENOSYS, EXDEV on older kernels or EINVAL for unsupported files */
+				use_copy_file_range = 0;
+			}
+		} else if (use_sendfile) {
+			off_t off_in = (off_t)(in_offset + done);
+			if (lseek(out_fd, (off_t)done, SEEK_SET) == (off_t)done) {
+				count = sendfile(out_fd, in_fd, &off_in, chunk);
+			}
+			if (count < 0 && errno != EINTR) {
+				use_sendfile = 0;
+			}
+		} else
+#endif
+		{
+			if (!buffer) {
+				buffer = (char*)malloc(EXTRACT_BUFSIZE);
+				if (!buffer) {
+					error("ERROR: Unable to allocate memory\n");
+					return -1;
+				}
+			}
+			if (ipsw_pread_full(in_fd, buffer, chunk, in_offset + done) < 0) {
+				error("ERROR: Unable to read archive: %s\n", strerror(errno));
+				free(buffer);
+				return -1;
+			}
+			size_t written = 0;
+			while (written < chunk) {
+				ssize_t w = pwrite(out_fd, buffer + written, chunk - written, (off_t)(done + written));
+				if (w < 0 && errno == EINTR) {
+					continue;
+				}
+				if (w <= 0) {
+					error("ERROR: Unable to write output file: %s\n", strerror(errno));
+					free(buffer);
+					return -1;
+				}
+				written += w;
+			}
+			count = chunk;
+		}
+		if (count == 0) {
+			/* the archive is shorter than its directory says */
+			error("ERROR: Unexpected end of archive\n");
+			free(buffer);
+			return -1;
+		}
+		if (count < 0) {
+			continue;
+		}
+		done += count;
+		if (print_progress) {
+			print_progress_bar(((double)done / (double)size) * 100.0);
+		}
+	}
+	free(buffer);
+
+	return 0;
+}
+
+/* stored entries are copied straight out of the archive file */
+static int ipsw_archive_extract_stored(ipsw_archive* archive, int zindex, uint64_t size, const char* outfile, int print_progress)
+{
+	uint64_t data_offset = 0;
+
+	int in_fd = open(archive->path, O_RDONLY);
+	if (in_fd < 0) {
+		return 1;
+	}
+	if (ipsw_archive_get_data_offset(archive, in_fd, zindex, &data_offset) < 0) {
+		debug("NOTE: Unable to locate entry data in %s, extracting through libzip\n", archive->path);
+		close(in_fd);
+		return 1;
+	}
+
+	int out_fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0) {
+		error("ERROR: Unable to open output file: %s\n", outfile);
+		close(in_fd);
+		return -1;
+	}
+	ipsw_preallocate(out_fd, size);
+
+	int ret = ipsw_copy_range(in_fd, data_offset, out_fd, size, print_progress);
+	if (ret == 0 && ftruncate(out_fd, (off_t)size) < 0) {
+		ret = -1;
+	}
+	if (close(out_fd) < 0) {
+		error("ERROR: Unable to write output file: %s\n", outfile);
+		ret = -1;
+	}
+	close(in_fd);
+
+	return ret;
+}
+#endif
+
+int ipsw_archive_extract_to_file_with_progress(ipsw_archive* archive, const char* infile, const char* outfile, int print_progress)
 {
 	int ret = 0;
-	ipsw_archive* archive = ipsw_open(ipsw);
 	if (archive == NULL || archive->zip == NULL) {
 		error("ERROR: Invalid archive\n");
 		return -1;
 	}
 
-	int zindex = zip_name_locate(archive->zip, infile, 0);
+	int zindex = ipsw_archive_locate(archive, infile);
 	if (zindex < 0) {
 		error("ERROR: zip_name_locate: %s\n", infile);
 		return -1;
 	}
 
 	struct zip_stat zstat;
-	zip_stat_init(&zstat);
-	if (zip_stat_index(archive->zip, zindex, 0, &zstat) != 0) {
+	if (ipsw_archive_stat_index(archive, zindex, &zstat) != 0) {
 		error("ERROR: zip_stat_index: %s\n", infile);
 		return -1;
 	}
 
-	char* buffer = (char*) malloc(BUFSIZE);
-	if (buffer == NULL) {
-		error("ERROR: Unable to allocate memory\n");
-		return -1;
+#ifndef WIN32
+	if (zstat.comp_method == ZIP_CM_STORE && archive->path) {
+		ret = ipsw_archive_extract_stored(archive, zindex, zstat.size, outfile, print_progress);
+		if (ret <= 0) {
+			return ret;
+		}
+		ret = 0;
 	}
+#endif
 
-	struct zip_file* zfile = zip_fopen_index(archive->zip, zindex, 0);
-	if (zfile == NULL) {
-		error("ERROR: zip_fopen_index: %s\n", infile);
+	char* buffer = (char*) malloc(EXTRACT_BUFSIZE);
+	if (buffer == NULL) {
+		error("ERROR: Unable to allocate memory\n");
 		return -1;
 	}
 
 	FILE* fd = fopen(outfile, "wb");
 	if (fd == NULL) {
 		error("ERROR: Unable to open output file: %s\n", outfile);
-		zip_fclose(zfile);
+		free(buffer);
+		return -1;
+	}
+#ifndef WIN32
+	ipsw_preallocate(fileno(fd), zstat.size);
+#endif
+
+	/* the lock is only held while inflating a block, so other users of the
+	 * archive get their turn while it's written out */
+	mutex_lock(&archive->lock);
+	struct zip_file* zfile = zip_fopen_index(archive->zip, zindex, 0);
+	mutex_unlock(&archive->lock);
+	if (zfile == NULL) {
+		error("ERROR: zip_fopen_index: %s\n", infile);
+		fclose(fd);
+		free(buffer);
 		return -1;
 	}
 
 	off_t i, bytes = 0;
-	int count, size = BUFSIZE;
+	int count, size = EXTRACT_BUFSIZE;
 	double progress;
 	for(i = zstat.size; i > 0; i -= count) {
-		if (i < BUFSIZE)
+		if (i < EXTRACT_BUFSIZE)
 			size = i;
+		mutex_lock(&archive->lock);
 		count = zip_fread(zfile, buffer, size);
-		if (count < 0) {
+		mutex_unlock(&archive->lock);
+		if (count <= 0) {
 			error("ERROR: zip_fread: %s\n", infile);
 			ret = -1;
 			break;
@@ -145,103 +588,95 @@ int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, con
 			break;
 		}
 
-		bytes += size;
+		bytes += count;
 		if (print_progress) {
 			progress = ((double)bytes / (double)zstat.size) * 100.0;
 			print_progress_bar(progress);
 		}
 	}
 
-	fclose(fd);
+	if (fclose(fd) != 0 && ret == 0) {
+		error("ERROR: Unable to write output file: %s\n", outfile);
+		ret = -1;
+	}
+	mutex_lock(&archive->lock);
 	zip_fclose(zfile);
-	ipsw_close(archive);
+	mutex_unlock(&archive->lock);
 	free(buffer);
 	return ret;
 }
 
-int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile)
-{
-	return ipsw_extract_to_file_with_progress(ipsw, infile, outfile, 0);
-}
-
-int ipsw_file_exists(const char* ipsw, const char* infile)
-{
-	ipsw_archive* archive = ipsw_open(ipsw);
-	if (archive == NULL || archive->zip == NULL) {
-		return -1;
-	}
-
-	int zindex = zip_name_locate(archive->zip, infile, 0);
-	if (zindex < 0) {
-		ipsw_close(archive);
-		return -2;
-	}
-
-	ipsw_close(archive);
-
-	return 0;
-}
-
-int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize) {
-	ipsw_archive* archive = ipsw_open(ipsw);
+int ipsw_archive_extract_to_memory(ipsw_archive* archive, const char* infile, unsigned char** pbuffer, unsigned int* psize) {
 	if (archive == NULL || archive->zip == NULL) {
 		error("ERROR: Invalid archive\n");
 		return -1;
 	}
 
-	int zindex = zip_name_locate(archive->zip, infile, 0);
+	int zindex = ipsw_archive_locate(archive, infile);
 	if (zindex < 0) {
 		error("ERROR: zip_name_locate: %s\n", infile);
 		return -1;
 	}
 
 	struct zip_stat zstat;
-	zip_stat_init(&zstat);
-	if (zip_stat_index(archive->zip, zindex, 0, &zstat) != 0) {
+	if (ipsw_archive_stat_index(archive, zindex, &zstat) != 0) {
 		error("ERROR: zip_stat_index: %s\n", infile);
 		return -1;
 	}
 
-	struct zip_file* zfile = zip_fopen_index(archive->zip, zindex, 0);
-	if (zfile == NULL) {
-		error("ERROR: zip_fopen_index: %s\n", infile);
-		return -1;
-	}
-
 	int size = zstat.size;
 	unsigned char* buffer = (unsigned char*) malloc(size+1);
 	if (buffer == NULL) {
 		error("ERROR: Out of memory\n");
-		zip_fclose(zfile);
 		return -1;
 	}
 
-	if (zip_fread(zfile, buffer, size) != size) {
+	mutex_lock(&archive->lock);
+	struct zip_file* zfile = zip_fopen_index(archive->zip, zindex, 0);
+	mutex_unlock(&archive->lock);
+	if (zfile == NULL) {
+		error("ERROR: zip_fopen_index: %s\n", infile);
+		free(buffer);
+		return -1;
+	}
+
+	// inflated a block at a time, like ipsw_archive_extract_to_file_with_progress()
+	int done = 0;
+	while (done < size) {
+		int chunk = (size - done < EXTRACT_BUFSIZE) ? size - done : EXTRACT_BUFSIZE;
+		mutex_lock(&archive->lock);
+		zip_int64_t count = zip_fread(zfile, buffer + done, chunk);
+		mutex_unlock(&archive->lock);
+		if (count <= 0) {
+			break;
+		}
+		done += (int)count;
+	}
+	mutex_lock(&archive->lock);
+	zip_fclose(zfile);
+	mutex_unlock(&archive->lock);
+	if (done != size) {
 		error("ERROR: zip_fread: %s\n", infile);
-		zip_fclose(zfile);
 		free(buffer);
 		return -1;
 	}
 
 	buffer[size] = '\0';
 
-	zip_fclose(zfile);
-	ipsw_close(archive);
-
 	*pbuffer = buffer;
 	*psize = size;
 	return 0;
 }
 
-int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *tss_enabled) {
+int ipsw_archive_extract_build_manifest(ipsw_archive* archive, plist_t* buildmanifest, int *tss_enabled) {
 	unsigned int size = 0;
 	unsigned char* data = NULL;
 
 	*tss_enabled = 0;
 
 	/* older devices don't require personalized firmwares and use a BuildManifesto.plist */
-	if (ipsw_file_exists(ipsw, "BuildManifesto.plist") == 0) {
-		if (ipsw_extract_to_memory(ipsw, "BuildManifesto.plist", &data, &size) == 0) {
+	if (ipsw_archive_file_exists(archive, "BuildManifesto.plist") == 0) {
+		if (ipsw_archive_extract_to_memory(archive, "BuildManifesto.plist", &data, &size) == 0) {
 			plist_from_xml((char*)data, size, buildmanifest);
 			free(data);
 			return 0;
@@ -252,7 +687,7 @@ int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *t
 	size = 0;
 
 	/* whereas newer devices do not require personalized firmwares and use a BuildManifest.plist */
-	if (ipsw_extract_to_memory(ipsw, "BuildManifest.plist", &data, &size) == 0) {
+	if (ipsw_archive_extract_to_memory(archive, "BuildManifest.plist", &data, &size) == 0) {
 		*tss_enabled = 1;
 		plist_from_xml((char*)data, size, buildmanifest);
 		free(data);
@@ -262,6 +697,350 @@ int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *t
 	return -1;
 }
 
+int ipsw_archive_entry_is_compressed(ipsw_archive* archive, const char* infile) {
+	if (archive == NULL || archive->zip == NULL) {
+		return -1;
+	}
+
+	int zindex = ipsw_archive_locate(archive, infile);
+	if (zindex < 0) {
+		return -1;
+	}
+
+	struct zip_stat zstat;
+	if (ipsw_archive_stat_index(archive, zindex, &zstat) != 0) {
+		return -1;
+	}
+
+	return (zstat.comp_method == ZIP_CM_STORE) ? 0 : 1;
+}
+
+ipsw_file_handle_t ipsw_file_open(ipsw_archive* archive, const char* infile) {
+	if (archive == NULL || archive->zip == NULL) {
+		error("ERROR: Invalid archive\n");
+		return NULL;
+	}
+
+	int zindex = ipsw_archive_locate(archive, infile);
+	if (zindex < 0) {
+		error("ERROR: zip_name_locate: %s\n", infile);
+		return NULL;
+	}
+
+	struct zip_stat zstat;
+	if (ipsw_archive_stat_index(archive, zindex, &zstat) != 0) {
+		error("ERROR: zip_stat_index: %s\n", infile);
+		return NULL;
+	}
+
+	ipsw_file_handle_t handle = (ipsw_file_handle_t)calloc(1, sizeof(struct ipsw_file_handle));
+	if (handle == NULL) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+
+	mutex_lock(&archive->lock);
+	handle->zfile = zip_fopen_index(archive->zip, zindex, 0);
+	mutex_unlock(&archive->lock);
+	if (handle->zfile == NULL) {
+		error("ERROR: zip_fopen_index: %s\n", infile);
+		free(handle);
+		return NULL;
+	}
+
+	handle->archive = archive;
+	handle->zindex = zindex;
+	handle->size = zstat.size;
+	handle->seekable = (zstat.comp_method == ZIP_CM_STORE);
+
+	return handle;
+}
+
+ipsw_file_handle_t ipsw_file_open_local(const char* filename) {
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		error("ERROR: Unable to open %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+
+	ipsw_file_handle_t handle = (ipsw_file_handle_t)calloc(1, sizeof(struct ipsw_file_handle));
+	if (handle == NULL) {
+		error("ERROR: Out of memory\n");
+		fclose(file);
+		return NULL;
+	}
+
+	fseeko(file, 0, SEEK_END);
+	handle->size = ftello(file);
+	fseeko(file, 0, SEEK_SET);
+	handle->seekable = 1;
+
+#ifndef WIN32
+	if (handle->size > 0 && handle->size <= (uint64_t)SIZE_MAX) {
+		void* map = mmap(NULL, (size_t)handle->size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (map != MAP_FAILED) {
+			handle->map = (unsigned char*)map;
+			fclose(file);
+			return handle;
+		}
+		debug("NOTE: Unable to map %s (%s), using buffered reads\n", filename, strerror(errno));
+	}
+#endif
+	handle->file = file;
+
+	return handle;
+}
+
+void ipsw_file_close(ipsw_file_handle_t handle) {
+	if (handle == NULL) {
+		return;
+	}
+	if (handle->zfile) {
+		mutex_lock(&handle->archive->lock);
+		zip_fclose(handle->zfile);
+		mutex_unlock(&handle->archive->lock);
+	}
+	if (handle->file) {
+		fclose(handle->file);
+	}
+#ifndef WIN32
+	if (handle->map) {
+		munmap(handle->map, (size_t)handle->size);
+	}
+#endif
+	free(handle);
+}
+
+uint64_t ipsw_file_size(ipsw_file_handle_t handle) {
+	return (handle) ? handle->size : 0;
+}
+
+const unsigned char* ipsw_file_get_mapping(ipsw_file_handle_t handle) {
+	return (handle) ? handle->map : NULL;
+}
+
+int64_t ipsw_file_read(ipsw_file_handle_t handle, void* buffer, size_t size) {
+	int64_t count = 0;
+
+	if (handle == NULL || buffer == NULL) {
+		return -1;
+	}
+
+	if (handle->map) {
+		count = (handle->offset + size > handle->size) ? (int64_t)(handle->size - handle->offset) : (int64_t)size;
+		memcpy(buffer, handle->map + handle->offset, (size_t)count);
+	} else if (handle->file) {
+		count = fread(buffer, 1, size, handle->file);
+		if (count == 0 && ferror(handle->file)) {
+			return -1;
+		}
+	} else {
+		mutex_lock(&handle->archive->lock);
+		/* apply the position set by ipsw_file_seek() */
+		if (handle->seekable && zip_ftell(handle->zfile) != (zip_int64_t)handle->offset
+		    && zip_fseek(handle->zfile, handle->offset, SEEK_SET) != 0) {
+			mutex_unlock(&handle->archive->lock);
+			return -1;
+		}
+		count = zip_fread(handle->zfile, buffer, size);
+		mutex_unlock(&handle->archive->lock);
+		if (count < 0) {
+			return -1;
+		}
+	}
+	handle->offset += count;
+
+	return count;
+}
+
+int ipsw_file_seek(ipsw_file_handle_t handle, uint64_t offset) {
+	if (handle == NULL || offset > handle->size) {
+		return -1;
+	}
+
+	if (handle->map) {
+		handle->offset = offset;
+		return 0;
+	}
+
+	if (handle->file) {
+		if (fseeko(handle->file, offset, SEEK_SET) != 0) {
+			return -1;
+		}
+		handle->offset = offset;
+		return 0;
+	}
+
+	if (handle->seekable) {
+		/* position is applied on the next read */
+		handle->offset = offset;
+		return 0;
+	}
+
+	/* deflated entry, restart from the beginning when seeking backwards */
+	if (offset < handle->offset) {
+		mutex_lock(&handle->archive->lock);
+		zip_fclose(handle->zfile);
+		handle->zfile = zip_fopen_index(handle->archive->zip, handle->zindex, 0);
+		mutex_unlock(&handle->archive->lock);
+		if (handle->zfile == NULL) {
+			error("ERROR: Unable to reopen compressed entry\n");
+			return -1;
+		}
+		handle->offset = 0;
+	}
+
+	char* skipbuf = NULL;
+	while (handle->offset < offset) {
+		if (!skipbuf) {
+			skipbuf = (char*)malloc(BUFSIZE);
+			if (!skipbuf) {
+				return -1;
+			}
+		}
+		uint64_t left = offset - handle->offset;
+		if (ipsw_file_read(handle, skipbuf, (left < BUFSIZE) ? (size_t)left : BUFSIZE) <= 0) {
+			free(skipbuf);
+			return -1;
+		}
+	}
+	free(skipbuf);
+
+	return 0;
+}
+
+int ipsw_get_file_size(const char* ipsw, const char* infile, off_t* size) {
+	ipsw_archive* archive = ipsw_open(ipsw);
+	if (archive == NULL) {
+		error("ERROR: Invalid archive\n");
+		return -1;
+	}
+
+	int ret = ipsw_archive_get_file_size(archive, infile, size);
+	ipsw_close(archive);
+	return ret;
+}
+
+int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress)
+{
+	ipsw_archive* archive = ipsw_open(ipsw);
+	if (archive == NULL) {
+		error("ERROR: Invalid archive\n");
+		return -1;
+	}
+
+	int ret = ipsw_archive_extract_to_file_with_progress(archive, infile, outfile, print_progress);
+	ipsw_close(archive);
+	return ret;
+}
+
+int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile)
+{
+	return ipsw_extract_to_file_with_progress(ipsw, infile, outfile, 0);
+}
+
+int64_t ipsw_read_range(ipsw_archive* archive, const char* infile, uint64_t offset, void* buffer, size_t length) {
+	int64_t total = 0;
+
+	ipsw_file_handle_t handle = ipsw_file_open(archive, infile);
+	if (handle == NULL) {
+		return -1;
+	}
+	if (ipsw_file_seek(handle, offset) < 0) {
+		ipsw_file_close(handle);
+		return -1;
+	}
+	while ((size_t)total < length) {
+		int64_t count = ipsw_file_read(handle, (char*)buffer + total, length - (size_t)total);
+		if (count < 0) {
+			ipsw_file_close(handle);
+			return -1;
+		}
+		if (count == 0) {
+			break;
+		}
+		total += count;
+	}
+	ipsw_file_close(handle);
+
+	return total;
+}
+
+int ipsw_archive_digest_entry(ipsw_archive* archive, const char* infile, uint64_t offset, unsigned char* sha1) {
+	SHA_CTX sha1ctx;
+	uint64_t total = 0;
+
+	ipsw_file_handle_t handle = ipsw_file_open(archive, infile);
+	if (handle == NULL) {
+		return -1;
+	}
+	uint64_t size = ipsw_file_size(handle);
+	if (offset > size || ipsw_file_seek(handle, offset) < 0) {
+		ipsw_file_close(handle);
+		return -1;
+	}
+
+	unsigned char* buffer = (unsigned char*)malloc(BUFSIZE);
+	if (buffer == NULL) {
+		ipsw_file_close(handle);
+		return -1;
+	}
+	SHA1_Init(&sha1ctx);
+	while (offset + total < size) {
+		int64_t count = ipsw_file_read(handle, buffer, BUFSIZE);
+		if (count <= 0) {
+			break;
+		}
+		SHA1_Update(&sha1ctx, buffer, (size_t)count);
+		total += count;
+	}
+	SHA1_Final(sha1, &sha1ctx);
+	free(buffer);
+	ipsw_file_close(handle);
+
+	if (offset + total != size) {
+		error("ERROR: Unable to read %s\n", infile);
+		return -1;
+	}
+	return 0;
+}
+
+int ipsw_file_exists(const char* ipsw, const char* infile)
+{
+	ipsw_archive* archive = ipsw_open(ipsw);
+	if (archive == NULL) {
+		return -1;
+	}
+
+	int ret = ipsw_archive_file_exists(archive, infile);
+	ipsw_close(archive);
+	return ret;
+}
+
+int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize) {
+	ipsw_archive* archive = ipsw_open(ipsw);
+	if (archive == NULL) {
+		error("ERROR: Invalid archive\n");
+		return -1;
+	}
+
+	int ret = ipsw_archive_extract_to_memory(archive, infile, pbuffer, psize);
+	ipsw_close(archive);
+	return ret;
+}
+
+int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *tss_enabled) {
+	ipsw_archive* archive = ipsw_open(ipsw);
+	if (archive == NULL) {
+		*tss_enabled = 0;
+		return -1;
+	}
+
+	int ret = ipsw_archive_extract_build_manifest(archive, buildmanifest, tss_enabled);
+	ipsw_close(archive);
+	return ret;
+}
+
 int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist) {
 	unsigned int size = 0;
 	unsigned char* data = NULL;
@@ -275,15 +1054,7 @@ int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist) {
 	return -1;
 }
 
-void ipsw_close(ipsw_archive* archive) {
-	if (archive != NULL) {
-		zip_unchange_all(archive->zip);
-		zip_close(archive->zip);
-		free(archive);
-	}
-}
-
-int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl, unsigned char* sha1buf)
+static int ipsw_lookup_latest_fw(plist_t version_data, const char* product, char** fwurl, unsigned char* sha1buf, int verbose)
 {
 	*fwurl = NULL;
 	if (sha1buf != NULL) {
@@ -292,14 +1063,14 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 
 	plist_t n1 = plist_dict_get_item(version_data, "MobileDeviceSoftwareVersionsByVersion");
 	if (!n1) {
-		error("%s: ERROR: Can't find MobileDeviceSoftwareVersionsByVersion dict in version data\n", __func__);
+		if (verbose) error("%s: ERROR: Can't find MobileDeviceSoftwareVersionsByVersion dict in version data\n", __func__);
 		return -1;
 	}
 
 	plist_dict_iter iter = NULL;
 	plist_dict_new_iter(n1, &iter);
 	if (!iter) {
-		error("%s: ERROR: Can't get dict iter\n", __func__);
+		if (verbose) error("%s: ERROR: Can't get dict iter\n", __func__);
 		return -1;
 	}
 	char* key = NULL;
@@ -320,7 +1091,7 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 	free(iter);
 
 	if (major == 0) {
-		error("%s: ERROR: Can't find major version?!\n", __func__);
+		if (verbose) error("%s: ERROR: Can't find major version?!\n", __func__);
 		return -1;
 	}
 
@@ -328,13 +1099,13 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 	sprintf(majstr, FMT_qu, (long long unsigned int)major);
 	n1 = plist_access_path(version_data, 7, "MobileDeviceSoftwareVersionsByVersion", majstr, "MobileDeviceSoftwareVersions", product, "Unknown", "Universal", "Restore");
 	if (!n1) {
-		error("%s: ERROR: Can't get Unknown/Universal/Restore node?!\n", __func__);
+		if (verbose) error("%s: ERROR: Can't get Unknown/Universal/Restore node?!\n", __func__);
 		return -1;
 	}
 
 	plist_t n2 = plist_dict_get_item(n1, "BuildVersion");
 	if (!n2 || (plist_get_node_type(n2) != PLIST_STRING)) {
-		error("%s: ERROR: Can't get build version node?!\n", __func__);
+		if (verbose) error("%s: ERROR: Can't get build version node?!\n", __func__);
 		return -1;
 	}
 
@@ -343,7 +1114,7 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 
 	n1 = plist_access_path(version_data, 5, "MobileDeviceSoftwareVersionsByVersion", majstr, "MobileDeviceSoftwareVersions", product, strval);
 	if (!n1) {
-		error("%s: ERROR: Can't get MobileDeviceSoftwareVersions/%s node?!\n", __func__, strval);
+		if (verbose) error("%s: ERROR: Can't get MobileDeviceSoftwareVersions/%s node?!\n", __func__, strval);
 		free(strval);
 		return -1;
 	}
@@ -359,7 +1130,7 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 		free(strval);
 		strval = NULL;
 		if (!n1 || (plist_dict_get_size(n1) == 0)) {
-			error("%s: ERROR: Can't get MobileDeviceSoftwareVersions/%s dict\n", __func__, product);
+			if (verbose) error("%s: ERROR: Can't get MobileDeviceSoftwareVersions/%s dict\n", __func__, product);
 			return -1;
 		}
 	}
@@ -377,7 +1148,7 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 
 	n2 = plist_access_path(n1, 2, "Restore", "FirmwareURL");
 	if (!n2 || (plist_get_node_type(n2) != PLIST_STRING)) {
-		error("%s: ERROR: Can't get FirmwareURL node\n", __func__);
+		if (verbose) error("%s: ERROR: Can't get FirmwareURL node\n", __func__);
 		return -1;
 	}
 
@@ -406,19 +1177,134 @@ int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl,
 	return 0;
 }
 
+#define VERSION_INDEX_FORMAT 1
+
+/* the product index only keeps what ipsw_get_latest_fw needs, so a cached
+ * copy of it is a fraction of the size of the full version data */
+plist_t ipsw_version_index_create(plist_t version_data)
+{
+	plist_t byversion = plist_dict_get_item(version_data, "MobileDeviceSoftwareVersionsByVersion");
+	if (!byversion || plist_get_node_type(byversion) != PLIST_DICT) {
+		return NULL;
+	}
+
+	plist_t products = plist_new_dict();
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(byversion, &iter);
+	char* key = NULL;
+	plist_t val = NULL;
+	do {
+		val = NULL;
+		plist_dict_next_item(byversion, iter, &key, &val);
+		if (!key) {
+			break;
+		}
+		free(key);
+		key = NULL;
+		plist_t versions = plist_dict_get_item(val, "MobileDeviceSoftwareVersions");
+		if (!versions || plist_get_node_type(versions) != PLIST_DICT) {
+			continue;
+		}
+		plist_dict_iter piter = NULL;
+		plist_dict_new_iter(versions, &piter);
+		char* product = NULL;
+		plist_t pval = NULL;
+		do {
+			pval = NULL;
+			plist_dict_next_item(versions, piter, &product, &pval);
+			if (!product) {
+				break;
+			}
+			if (!plist_dict_get_item(products, product)) {
+				char* fwurl = NULL;
+				unsigned char sha1[20];
+				if (ipsw_lookup_latest_fw(version_data, product, &fwurl, sha1, 0) == 0 && fwurl) {
+					plist_t entry = plist_new_dict();
+					plist_dict_set_item(entry, "FirmwareURL", plist_new_string(fwurl));
+					plist_dict_set_item(entry, "FirmwareSHA1", plist_new_data((const char*)sha1, 20));
+					plist_dict_set_item(products, product, entry);
+				}
+				free(fwurl);
+			}
+			free(product);
+			product = NULL;
+		} while (pval);
+		free(piter);
+	} while (val);
+	free(iter);
+
+	plist_t index = plist_new_dict();
+	plist_dict_set_item(index, "IndexFormat", plist_new_uint(VERSION_INDEX_FORMAT));
+	plist_dict_set_item(index, "ProductIndex", products);
+
+	plist_t wtfurl = plist_access_path(version_data, 7, "MobileDeviceSoftwareVersionsByVersion", "5", "RecoverySoftwareVersions", "WTF", "304218112", "5", "FirmwareURL");
+	if (wtfurl && (plist_get_node_type(wtfurl) == PLIST_STRING)) {
+		plist_dict_set_item(index, "WTFFirmwareURL", plist_copy(wtfurl));
+	}
+
+	return index;
+}
+
+int ipsw_version_index_is_valid(plist_t index)
+{
+	uint64_t format = 0;
+	plist_t node = plist_dict_get_item(index, "IndexFormat");
+	if (!node || plist_get_node_type(node) != PLIST_UINT) {
+		return 0;
+	}
+	plist_get_uint_val(node, &format);
+	node = plist_dict_get_item(index, "ProductIndex");
+	return (format == VERSION_INDEX_FORMAT) && node && (plist_get_node_type(node) == PLIST_DICT);
+}
+
+int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl, unsigned char* sha1buf)
+{
+	plist_t products = plist_dict_get_item(version_data, "ProductIndex");
+	if (!products) {
+		return ipsw_lookup_latest_fw(version_data, product, fwurl, sha1buf, 1);
+	}
+
+	*fwurl = NULL;
+	if (sha1buf != NULL) {
+		memset(sha1buf, '\0', 20);
+	}
+
+	plist_t n1 = plist_dict_get_item(products, product);
+	if (!n1) {
+		error("%s: ERROR: Can't find %s in version data\n", __func__, product);
+		return -1;
+	}
+
+	plist_t n2 = plist_dict_get_item(n1, "FirmwareURL");
+	if (!n2 || (plist_get_node_type(n2) != PLIST_STRING)) {
+		error("%s: ERROR: Can't get FirmwareURL node\n", __func__);
+		return -1;
+	}
+	plist_get_string_val(n2, fwurl);
+
+	n2 = plist_dict_get_item(n1, "FirmwareSHA1");
+	if (sha1buf != NULL && n2 && plist_get_node_type(n2) == PLIST_DATA) {
+		char* sha1 = NULL;
+		uint64_t len = 0;
+		plist_get_data_val(n2, &sha1, &len);
+		if (sha1 && len == 20) {
+			memcpy(sha1buf, sha1, 20);
+		}
+		free(sha1);
+	}
+
+	return 0;
+}
+
 static int sha1_verify_fp(FILE* f, unsigned char* expected_sha1)
 {
 	unsigned char tsha1[20];
-	char buf[8192];
 	if (!f) return 0;
-	SHA_CTX sha1ctx;
-	SHA1_Init(&sha1ctx);
 	rewind(f);
-	while (!feof(f)) {
-		size_t sz = fread(buf, 1, 8192, f);
-		SHA1_Update(&sha1ctx, (const void*)buf, sz);
+	if (hash_sha1_file(f, tsha1) < 0) {
+		return 0;
 	}
-	SHA1_Final(tsha1, &sha1ctx);
 	return (memcmp(expected_sha1, tsha1, 20) == 0) ? 1 : 0;
 }
 
@@ -460,8 +1346,11 @@ int ipsw_download_latest_fw(plist_t version_data, const char* product, const cha
 
 	int need_dl = 0;
 	unsigned char zsha1[20] = {0, };
-	FILE* f = fopen(fwlfn, "rb");
-	if (f) {
+	FILE* f = NULL;
+	if (download_is_resumable(fwlfn)) {
+		// an interrupted download, verifying it would only read it twice
+		need_dl = 1;
+	} else if ((f = fopen(fwlfn, "rb"))) {
 		if (memcmp(zsha1, isha1, 20) != 0) {
 			info("Verifying '%s'...\n", fwlfn);
 			if (sha1_verify_fp(f, isha1)) {
@@ -482,27 +1371,21 @@ int ipsw_download_latest_fw(plist_t version_data, const char* product, const cha
 			error("ERROR: Can't download '%s' because it needs a purchase.\n", fwfn);
 			res = -3;
 		} else {
-			remove(fwlfn);
+			int verify = (memcmp(isha1, zsha1, 20) != 0);
+			unsigned char dsha1[20];
 			info("Downloading latest firmware (%s)\n", fwurl);
-			download_to_file(fwurl, fwlfn, 1);
-			if (memcmp(isha1, zsha1, 20) != 0) {
-				info("\nVerifying '%s'...\n", fwlfn);
-				FILE* f = fopen(fwlfn, "rb");
-				if (f) {
-					if (sha1_verify_fp(f, isha1)) {
-						info("Checksum matches.\n");
-					} else {
-						error("ERROR: File download failed (checksum mismatch).\n");
-						res = -4;
-					}
-					fclose(f);
-
-					// make sure to remove invalid files
-					if (res < 0)
-						remove(fwlfn);
+			// the checksum is computed while the data arrives, no extra pass over the file
+			if (download_to_file_segmented(fwurl, fwlfn, DOWNLOAD_DEFAULT_CONNECTIONS, (verify) ? dsha1 : NULL, 1) < 0) {
+				error("ERROR: Unable to download '%s'\n", fwurl);
+				res = -5;
+			} else if (verify) {
+				if (memcmp(dsha1, isha1, 20) == 0) {
+					info("Checksum matches.\n");
 				} else {
-					error("ERROR: Can't open '%s' for checksum verification\n", fwlfn);
-					res = -5;
+					error("ERROR: File download failed (checksum mismatch).\n");
+					res = -4;
+					// make sure to remove invalid files
+					remove(fwlfn);
 				}
 			}
 		}
@@ -29,9 +29,12 @@ extern "C" {
 #endif
 
 #include <zip.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <plist/plist.h>
 
+#include "thread.h"
+
 typedef struct {
 	int index;
 	char* name;
@@ -39,6 +42,63 @@ typedef struct {
 	unsigned char* data;
 } ipsw_file;
 
+/* An opened IPSW archive. The central directory is parsed once on open and
+ * an open-addressing hash table maps entry names to zip indices, so lookups
+ * don't have to go through zip_name_locate() every time. The archive is
+ * reference counted so several clients can share one read-only handle. */
+struct ipsw_archive {
+	struct zip* zip;
+	char* path;
+	int num_entries;
+	int* name_index;
+	unsigned int name_index_size;
+	int refcount;
+	mutex_t lock;
+};
+typedef struct ipsw_archive ipsw_archive;
+
+/* A readable handle on either an entry inside an opened archive or a plain
+ * file on disk. Entries that are stored uncompressed can be seeked freely,
+ * deflated entries are inflated on the fly and seeking backwards reopens
+ * the entry. Plain files are memory mapped where the platform allows it. */
+struct ipsw_file_handle {
+	FILE* file;
+	unsigned char* map;
+	ipsw_archive* archive;
+	struct zip_file* zfile;
+	int zindex;
+	uint64_t size;
+	uint64_t offset;
+	int seekable;
+};
+typedef struct ipsw_file_handle* ipsw_file_handle_t;
+
+ipsw_archive* ipsw_open(const char* ipsw);
+ipsw_archive* ipsw_archive_ref(ipsw_archive* archive);
+void ipsw_close(ipsw_archive* archive);
+int ipsw_archive_locate(ipsw_archive* archive, const char* infile);
+int ipsw_archive_file_exists(ipsw_archive* archive, const char* infile);
+int ipsw_archive_get_file_size(ipsw_archive* archive, const char* infile, off_t* size);
+int ipsw_archive_extract_to_file_with_progress(ipsw_archive* archive, const char* infile, const char* outfile, int print_progress);
+int ipsw_archive_extract_to_memory(ipsw_archive* archive, const char* infile, unsigned char** pbuffer, unsigned int* psize);
+int ipsw_archive_extract_build_manifest(ipsw_archive* archive, plist_t* buildmanifest, int *tss_enabled);
+int ipsw_archive_entry_is_compressed(ipsw_archive* archive, const char* infile);
+
+ipsw_file_handle_t ipsw_file_open(ipsw_archive* archive, const char* infile);
+ipsw_file_handle_t ipsw_file_open_local(const char* filename);
+void ipsw_file_close(ipsw_file_handle_t handle);
+uint64_t ipsw_file_size(ipsw_file_handle_t handle);
+const unsigned char* ipsw_file_get_mapping(ipsw_file_handle_t handle);
+int64_t ipsw_file_read(ipsw_file_handle_t handle, void* buffer, size_t size);
+int ipsw_file_seek(ipsw_file_handle_t handle, uint64_t offset);
+
+/* reads up to length bytes of infile starting at offset without
+ * extracting the rest of it, returns the number of bytes read */
+int64_t ipsw_read_range(ipsw_archive* archive, const char* infile, uint64_t offset, void* buffer, size_t length);
+/* SHA1 of infile from offset to its end, computed while it is read */
+int ipsw_archive_digest_entry(ipsw_archive* archive, const char* infile, uint64_t offset, unsigned char* sha1);
+
+int ipsw_file_exists(const char* ipsw, const char* infile);
 int ipsw_get_file_size(const char* ipsw, const char* infile, off_t* size);
 int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile);
 int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress);
@@ -47,6 +107,8 @@ int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *t
 int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist);
 void ipsw_free_file(ipsw_file* file);
 
+plist_t ipsw_version_index_create(plist_t version_data);
+int ipsw_version_index_is_valid(plist_t index);
 int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl, unsigned char* sha1buf);
 int ipsw_download_latest_fw(plist_t version_data, const char* product, const char* todir, char** ipswfile);
 
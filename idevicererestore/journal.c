@@ -0,0 +1,420 @@
+/*
+ * journal.c
+ * Checkpoints of a restore session so a retry can skip completed phases
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "journal.h"
+#include "cache.h"
+#include "common.h"
+#include "thread.h"
+
+struct journal {
+	char dir[1024];
+	char path[1024];
+	plist_t state;
+	mutex_t lock;
+};
+
+static void journal_component_path(struct journal* journal, const char* component, char* path, size_t path_size)
+{
+	snprintf(path, path_size, "%s/%s.img", journal->dir, component);
+}
+
+static int journal_plist_digest(plist_t plist, unsigned char* digest)
+{
+	char* bin = NULL;
+	uint32_t binlen = 0;
+
+	if (!plist) {
+		return -1;
+	}
+	plist_to_bin(plist, &bin, &binlen);
+	if (!bin) {
+		return -1;
+	}
+	int res = (EVP_Digest(bin, binlen, digest, NULL, EVP_sha1(), NULL) == 1) ? 0 : -1;
+	free(bin);
+
+	return res;
+}
+
+/* called with journal->lock held */
+static int journal_tss_matches(struct journal* journal, plist_t tss)
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	char* stored = NULL;
+	uint64_t stored_size = 0;
+	int res = 0;
+
+	plist_t node = plist_dict_get_item(journal->state, "TSSDigest");
+	if (!tss || !node || plist_get_node_type(node) != PLIST_DATA || journal_plist_digest(tss, digest) < 0) {
+		return 0;
+	}
+	plist_get_data_val(node, &stored, &stored_size);
+	res = (stored && stored_size == SHA_DIGEST_LENGTH && memcmp(stored, digest, SHA_DIGEST_LENGTH) == 0);
+	free(stored);
+
+	return res;
+}
+
+/* called with journal->lock held, the ticket is only good for the build
+ * identity whose Manifest it was requested with */
+static int journal_identity_matches(struct journal* journal, plist_t build_identity)
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	char* stored = NULL;
+	uint64_t stored_size = 0;
+	int res = 0;
+
+	plist_t node = plist_dict_get_item(journal->state, "TSSIdentity");
+	if (!node || plist_get_node_type(node) != PLIST_DATA || journal_plist_digest(plist_dict_get_item(build_identity, "Manifest"), digest) < 0) {
+		return 0;
+	}
+	plist_get_data_val(node, &stored, &stored_size);
+	res = (stored && stored_size == SHA_DIGEST_LENGTH && memcmp(stored, digest, SHA_DIGEST_LENGTH) == 0);
+	free(stored);
+
+	return res;
+}
+
+/* called with journal->lock held */
+static void journal_write(struct journal* journal)
+{
+	char* bin = NULL;
+	uint32_t binlen = 0;
+
+	plist_to_bin(journal->state, &bin, &binlen);
+	if (!bin || cache_publish(journal->path, (const unsigned char*)bin, binlen) < 0) {
+		error("WARNING: Unable to write session journal %s\n", journal->path);
+	}
+	free(bin);
+}
+
+/* called with journal->lock held */
+static void journal_drop_components(struct journal* journal)
+{
+	plist_t components = plist_dict_get_item(journal->state, "Components");
+	char path[1024];
+
+	if (components && plist_get_node_type(components) == PLIST_DICT) {
+		plist_dict_iter iter = NULL;
+		char* key = NULL;
+		plist_dict_new_iter(components, &iter);
+		do {
+			key = NULL;
+			plist_dict_next_item(components, iter, &key, NULL);
+			if (key) {
+				journal_component_path(journal, key, path, sizeof(path));
+				remove(path);
+				free(key);
+			}
+		} while (key);
+		free(iter);
+	}
+	plist_dict_set_item(journal->state, "Components", plist_new_dict());
+}
+
+static uint64_t journal_get_uint(plist_t dict, const char* key)
+{
+	uint64_t value = 0;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &value);
+	}
+	return value;
+}
+
+struct journal* journal_open(const char* cache_dir, uint64_t ecid, const char* ipsw)
+{
+	unsigned char key[8];
+	struct stat st;
+	int i;
+
+	if (!cache_dir || !ipsw || ecid == 0 || stat(ipsw, &st) < 0) {
+		return NULL;
+	}
+
+	struct journal* journal = (struct journal*)malloc(sizeof(struct journal));
+	if (!journal) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(journal, '\0', sizeof(struct journal));
+
+	for (i = 0; i < 8; i++) {
+		key[i] = (unsigned char)(ecid >> (56 - 8 * i));
+	}
+	if (cache_get_path(cache_dir, "sessions", key, sizeof(key), journal->dir, sizeof(journal->dir)) < 0 ||
+	    mkdir_with_parents(journal->dir, 0755) < 0) {
+		free(journal);
+		return NULL;
+	}
+	snprintf(journal->path, sizeof(journal->path), "%s/journal.plist", journal->dir);
+	mutex_init(&journal->lock);
+
+	struct stat jst;
+	if (stat(journal->path, &jst) == 0) {
+		char* buf = NULL;
+		size_t len = 0;
+		read_file(journal->path, (void**)&buf, &len);
+		if (buf && len >= 8 && memcmp(buf, "bplist00", 8) == 0) {
+			plist_from_bin(buf, (uint32_t)len, &journal->state);
+		}
+		free(buf);
+	}
+
+	if (journal->state) {
+		char* path = NULL;
+		plist_t node = plist_dict_get_item(journal->state, "IPSW");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &path);
+		}
+		if (!path || strcmp(path, ipsw) != 0 ||
+		    journal_get_uint(journal->state, "IPSWSize") != (uint64_t)st.st_size ||
+		    journal_get_uint(journal->state, "IPSWTime") != (uint64_t)st.st_mtime) {
+			debug("Dropping session journal of another firmware file\n");
+			journal_drop_components(journal);
+			plist_free(journal->state);
+			journal->state = NULL;
+		}
+		free(path);
+	}
+
+	if (!journal->state) {
+		journal->state = plist_new_dict();
+		plist_dict_set_item(journal->state, "IPSW", plist_new_string(ipsw));
+		plist_dict_set_item(journal->state, "IPSWSize", plist_new_uint((uint64_t)st.st_size));
+		plist_dict_set_item(journal->state, "IPSWTime", plist_new_uint((uint64_t)st.st_mtime));
+		plist_dict_set_item(journal->state, "Components", plist_new_dict());
+	} else {
+		info("Resuming the restore session journaled in %s\n", journal->dir);
+	}
+
+	return journal;
+}
+
+void journal_free(struct journal* journal)
+{
+	if (!journal) {
+		return;
+	}
+
+	plist_free(journal->state);
+	mutex_destroy(&journal->lock);
+	free(journal);
+}
+
+void journal_discard(struct journal* journal)
+{
+	if (!journal) {
+		return;
+	}
+
+	mutex_lock(&journal->lock);
+	journal_drop_components(journal);
+	remove(journal->path);
+	rmdir(journal->dir);
+	plist_free(journal->state);
+	journal->state = plist_new_dict();
+	mutex_unlock(&journal->lock);
+}
+
+int journal_get_identity(struct journal* journal, int* flags)
+{
+	int res = -1;
+
+	if (!journal || !flags) {
+		return -1;
+	}
+
+	mutex_lock(&journal->lock);
+	plist_t node = plist_dict_get_item(journal->state, "Flags");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		*flags = (int)journal_get_uint(journal->state, "Flags");
+		res = 0;
+	}
+	mutex_unlock(&journal->lock);
+
+	return res;
+}
+
+void journal_put_identity(struct journal* journal, int flags)
+{
+	if (!journal) {
+		return;
+	}
+
+	mutex_lock(&journal->lock);
+	plist_dict_set_item(journal->state, "Flags", plist_new_uint((uint64_t)flags));
+	journal_write(journal);
+	mutex_unlock(&journal->lock);
+}
+
+int journal_get_tss(struct journal* journal, plist_t build_identity, const unsigned char* nonce, int nonce_size, int check_nonce, plist_t* tss)
+{
+	int res = -1;
+
+	if (!journal || !build_identity || !tss) {
+		return -1;
+	}
+
+	mutex_lock(&journal->lock);
+	plist_t node = plist_dict_get_item(journal->state, "TSS");
+	if (node && plist_get_node_type(node) == PLIST_DICT && journal_identity_matches(journal, build_identity)) {
+		char* stored = NULL;
+		uint64_t stored_size = 0;
+		plist_t pnonce = plist_dict_get_item(journal->state, "ApNonce");
+		if (pnonce && plist_get_node_type(pnonce) == PLIST_DATA) {
+			plist_get_data_val(pnonce, &stored, &stored_size);
+		}
+		if (!check_nonce || (stored_size == (uint64_t)((nonce) ? nonce_size : 0) && (stored_size == 0 || memcmp(stored, nonce, stored_size) == 0))) {
+			*tss = plist_copy(node);
+			res = 0;
+		}
+		free(stored);
+	}
+	mutex_unlock(&journal->lock);
+
+	return res;
+}
+
+void journal_put_tss(struct journal* journal, plist_t build_identity, const unsigned char* nonce, int nonce_size, plist_t tss)
+{
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned char identity[SHA_DIGEST_LENGTH];
+
+	if (!journal || !build_identity || !tss || journal_plist_digest(tss, digest) < 0
+	    || journal_plist_digest(plist_dict_get_item(build_identity, "Manifest"), identity) < 0) {
+		return;
+	}
+
+	mutex_lock(&journal->lock);
+	if (!journal_tss_matches(journal, tss)) {
+		journal_drop_components(journal);
+	}
+	plist_dict_set_item(journal->state, "TSS", plist_copy(tss));
+	plist_dict_set_item(journal->state, "TSSDigest", plist_new_data((const char*)digest, sizeof(digest)));
+	plist_dict_set_item(journal->state, "TSSIdentity", plist_new_data((const char*)identity, sizeof(identity)));
+	if (nonce && nonce_size > 0) {
+		plist_dict_set_item(journal->state, "ApNonce", plist_new_data((const char*)nonce, nonce_size));
+	} else {
+		plist_dict_remove_item(journal->state, "ApNonce");
+	}
+	journal_write(journal);
+	mutex_unlock(&journal->lock);
+}
+
+int journal_get_filesystem(struct journal* journal, char** path)
+{
+	struct stat st;
+	char* filesystem = NULL;
+
+	if (!journal || !path) {
+		return -1;
+	}
+
+	mutex_lock(&journal->lock);
+	plist_t node = plist_dict_get_item(journal->state, "Filesystem");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &filesystem);
+	}
+	uint64_t size = journal_get_uint(journal->state, "FilesystemSize");
+	mutex_unlock(&journal->lock);
+
+	if (!filesystem || stat(filesystem, &st) < 0 || (uint64_t)st.st_size != size) {
+		free(filesystem);
+		return -1;
+	}
+	*path = filesystem;
+
+	return 0;
+}
+
+void journal_put_filesystem(struct journal* journal, const char* path, uint64_t size)
+{
+	if (!journal || !path) {
+		return;
+	}
+
+	mutex_lock(&journal->lock);
+	plist_dict_set_item(journal->state, "Filesystem", plist_new_string(path));
+	plist_dict_set_item(journal->state, "FilesystemSize", plist_new_uint(size));
+	journal_write(journal);
+	mutex_unlock(&journal->lock);
+}
+
+int journal_get_component(struct journal* journal, plist_t tss, const char* component, unsigned char** data, unsigned int* size)
+{
+	char path[1024];
+	struct stat st;
+	int res = -1;
+
+	if (!journal || !component || !data || !size) {
+		return -1;
+	}
+
+	mutex_lock(&journal->lock);
+	plist_t components = plist_dict_get_item(journal->state, "Components");
+	plist_t node = (components) ? plist_dict_get_item(components, component) : NULL;
+	if (node && plist_get_node_type(node) == PLIST_UINT && journal_tss_matches(journal, tss)) {
+		uint64_t expected = journal_get_uint(components, component);
+		journal_component_path(journal, component, path, sizeof(path));
+		if (stat(path, &st) == 0 && (uint64_t)st.st_size == expected) {
+			void* buf = NULL;
+			size_t len = 0;
+			if (read_file(path, &buf, &len) == 0 && len == expected) {
+				*data = (unsigned char*)buf;
+				*size = (unsigned int)len;
+				res = 0;
+			} else {
+				free(buf);
+			}
+		}
+	}
+	mutex_unlock(&journal->lock);
+
+	return res;
+}
+
+void journal_put_component(struct journal* journal, plist_t tss, const char* component, const unsigned char* data, unsigned int size)
+{
+	char path[1024];
+
+	if (!journal || !component || !data) {
+		return;
+	}
+
+	mutex_lock(&journal->lock);
+	// a stage still running for a replaced response must not mix in its components
+	if (journal_tss_matches(journal, tss)) {
+		plist_t components = plist_dict_get_item(journal->state, "Components");
+		journal_component_path(journal, component, path, sizeof(path));
+		if (components && cache_publish(path, data, size) == 0) {
+			plist_dict_set_item(components, component, plist_new_uint(size));
+			journal_write(journal);
+		}
+	}
+	mutex_unlock(&journal->lock);
+}
@@ -0,0 +1,68 @@
+/*
+ * journal.h
+ * Checkpoints of a restore session so a retry can skip completed phases
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_JOURNAL_H
+#define IDEVICERESTORE_JOURNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+struct journal;
+
+/* The journal of a restore of ipsw on the device with ecid lives in
+ * <cache_dir>/sessions/<ecid>/ and is rewritten after every checkpoint.
+ * It is dropped when it was written for another IPSW, or the IPSW file
+ * changed since. A journal may be shared between threads, and all calls
+ * accept a NULL journal so callers don't have to check. */
+struct journal* journal_open(const char* cache_dir, uint64_t ecid, const char* ipsw);
+void journal_free(struct journal* journal);
+
+/* removes the journal and its components once the restore succeeded */
+void journal_discard(struct journal* journal);
+
+/* the FLAG_ERASE, FLAG_UPDATE and FLAG_CUSTOM restore flags the build
+ * identity was selected with */
+int journal_get_identity(struct journal* journal, int* flags);
+void journal_put_identity(struct journal* journal, int flags);
+
+/* The TSS response is only handed out again for the build identity it
+ * was stored with, and the nonce it was requested with unless check_nonce
+ * is 0. Storing a different response drops the components personalized
+ * with the previous one. */
+int journal_get_tss(struct journal* journal, plist_t build_identity, const unsigned char* nonce, int nonce_size, int check_nonce, plist_t* tss);
+void journal_put_tss(struct journal* journal, plist_t build_identity, const unsigned char* nonce, int nonce_size, plist_t tss);
+
+/* returns the extracted filesystem if it still exists with its size */
+int journal_get_filesystem(struct journal* journal, char** path);
+void journal_put_filesystem(struct journal* journal, const char* path, uint64_t size);
+
+/* Personalized components are kept for the TSS response in the journal
+ * only, tss is the response they are (to be) personalized with. */
+int journal_get_component(struct journal* journal, plist_t tss, const char* component, unsigned char** data, unsigned int* size);
+void journal_put_component(struct journal* journal, plist_t tss, const char* component, const unsigned char* data, unsigned int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
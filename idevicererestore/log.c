@@ -0,0 +1,359 @@
+/*
+ * log.c
+ * Asynchronous backend for info(), error() and debug()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "thread.h"
+
+#define LOG_RING_SIZE 1024 /* must be a power of two */
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_INLINE_SIZE 256
+#define LOG_CONTEXT_SIZE 64
+#define LOG_MAX_STREAMS 4
+#define LOG_IDLE_TIMEOUT 100
+
+struct log_slot {
+	uint64_t seq;
+	int level;
+	FILE* stream;
+	uint64_t time_us;
+	char context[LOG_CONTEXT_SIZE];
+	/* messages that don't fit inline are copied to the heap */
+	char* heap;
+	char text[LOG_INLINE_SIZE];
+};
+
+struct log_ring {
+	struct log_slot slots[LOG_RING_SIZE];
+	uint64_t head;
+	uint64_t tail;
+	uint64_t written;
+	uint64_t dropped;
+	int waiting;
+	mutex_t lock;
+	/* held while writing to the streams and the sink */
+	mutex_t output_lock;
+	cond_t cond;
+	cond_t drained;
+	thread_t thread;
+	int running;
+	FILE* sink;
+	/* whether the last message written to a stream ended its line */
+	FILE* streams[LOG_MAX_STREAMS];
+	int line_start[LOG_MAX_STREAMS];
+};
+
+static struct log_ring ring;
+static thread_once_t log_once = THREAD_ONCE_INIT;
+static __thread char log_context[LOG_CONTEXT_SIZE];
+
+static const char* log_level_names[] = { "info", "error", "debug" };
+
+static uint64_t log_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int* log_line_start(FILE* stream)
+{
+	int i;
+	for (i = 0; i < LOG_MAX_STREAMS; i++) {
+		if (ring.streams[i] == stream) {
+			return &ring.line_start[i];
+		}
+		if (ring.streams[i] == NULL) {
+			ring.streams[i] = stream;
+			ring.line_start[i] = 1;
+			return &ring.line_start[i];
+		}
+	}
+	return NULL;
+}
+
+static void log_sink_write(const struct log_slot* slot, const char* text)
+{
+	const char* p;
+	size_t length = strlen(text);
+
+	while (length > 0 && text[length - 1] == '\n') {
+		length--;
+	}
+	fprintf(ring.sink, "{\"time_us\":%llu,\"level\":\"%s\",\"context\":\"%s\",\"message\":\"",
+	        (unsigned long long)slot->time_us, log_level_names[slot->level], slot->context);
+	for (p = text; p < text + length; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (c == '"' || c == '\\') {
+			fputc('\\', ring.sink);
+			fputc(c, ring.sink);
+		} else if (c == '\n') {
+			fputs("\\n", ring.sink);
+		} else if (c < 0x20) {
+			fprintf(ring.sink, "\\u%04x", c);
+		} else {
+			fputc(c, ring.sink);
+		}
+	}
+	fputs("\"}\n", ring.sink);
+}
+
+/* called with ring.output_lock held */
+static void log_output(const struct log_slot* slot)
+{
+	const char* text = (slot->heap) ? slot->heap : slot->text;
+
+	if (slot->stream) {
+		int* line_start = log_line_start(slot->stream);
+		if (slot->context[0] && text[0] == '\r') {
+			fprintf(slot->stream, "\r[%s] %s", slot->context, text + 1);
+		} else if (slot->context[0] && (!line_start || *line_start)) {
+			fprintf(slot->stream, "[%s] %s", slot->context, text);
+		} else {
+			fputs(text, slot->stream);
+		}
+		if (line_start && text[0]) {
+			*line_start = (text[strlen(text) - 1] == '\n');
+		}
+	}
+	if (ring.sink) {
+		log_sink_write(slot, text);
+	}
+}
+
+static void log_flush_streams(void)
+{
+	int i;
+	for (i = 0; i < LOG_MAX_STREAMS && ring.streams[i]; i++) {
+		fflush(ring.streams[i]);
+	}
+	if (ring.sink) {
+		fflush(ring.sink);
+	}
+}
+
+static void* log_writer_thread(void* arg)
+{
+	(void)arg;
+	while (1) {
+		uint64_t written = 0;
+		mutex_lock(&ring.output_lock);
+		while (1) {
+			struct log_slot* slot = &ring.slots[ring.tail & LOG_RING_MASK];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != ring.tail + 1) {
+				break;
+			}
+			log_output(slot);
+			free(slot->heap);
+			slot->heap = NULL;
+			__atomic_store_n(&slot->seq, ring.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+			ring.tail++;
+			written++;
+		}
+
+		uint64_t dropped = __atomic_exchange_n(&ring.dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+			fprintf(stderr, "WARNING: %llu debug messages were dropped\n", (unsigned long long)dropped);
+		}
+		if (written > 0 || dropped > 0) {
+			log_flush_streams();
+		}
+		mutex_unlock(&ring.output_lock);
+
+		mutex_lock(&ring.lock);
+		__atomic_store_n(&ring.written, ring.tail, __ATOMIC_SEQ_CST);
+		cond_broadcast(&ring.drained);
+		__atomic_store_n(&ring.waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring.slots[ring.tail & LOG_RING_MASK].seq, __ATOMIC_SEQ_CST) != ring.tail + 1) {
+			cond_wait_timeout(&ring.cond, &ring.lock, LOG_IDLE_TIMEOUT);
+		}
+		__atomic_store_n(&ring.waiting, 0, __ATOMIC_SEQ_CST);
+		mutex_unlock(&ring.lock);
+	}
+
+	return NULL;
+}
+
+static void log_init(void)
+{
+	uint64_t i;
+	for (i = 0; i < LOG_RING_SIZE; i++) {
+		ring.slots[i].seq = i;
+	}
+	mutex_init(&ring.lock);
+	mutex_init(&ring.output_lock);
+	cond_init(&ring.cond);
+	cond_init(&ring.drained);
+	/* the writer is never joined, it goes away with the process */
+	ring.running = (thread_new(&ring.thread, log_writer_thread, NULL) == 0);
+	if (ring.running) {
+		atexit(log_flush);
+	}
+}
+
+static struct log_slot* log_claim_slot(uint64_t* seq)
+{
+	uint64_t pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	while (1) {
+		struct log_slot* slot = &ring.slots[pos & LOG_RING_MASK];
+		int64_t diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*seq = pos;
+				return slot;
+			}
+		} else if (diff < 0) {
+			/* full, the writer hasn't freed this slot yet */
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void log_wake_writer(void)
+{
+	if (__atomic_load_n(&ring.waiting, __ATOMIC_SEQ_CST)) {
+		mutex_lock(&ring.lock);
+		cond_signal(&ring.cond);
+		mutex_unlock(&ring.lock);
+	}
+}
+
+void log_write(int level, FILE* stream, const char* format, va_list args)
+{
+	char text[LOG_INLINE_SIZE];
+	char* heap = NULL;
+	va_list args2;
+
+	va_copy(args2, args);
+	int length = vsnprintf(text, sizeof(text), format, args);
+	if (length < 0) {
+		va_end(args2);
+		return;
+	}
+	if (length >= (int)sizeof(text)) {
+		heap = (char*)malloc(length + 1);
+		if (heap) {
+			vsnprintf(heap, length + 1, format, args2);
+		}
+	}
+	va_end(args2);
+
+	thread_once(&log_once, log_init);
+
+	struct log_slot* slot = NULL;
+	uint64_t seq = 0;
+	if (ring.running) {
+		while ((slot = log_claim_slot(&seq)) == NULL) {
+			if (level == LOG_LEVEL_DEBUG) {
+				__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+				free(heap);
+				return;
+			}
+			log_wake_writer();
+			usleep(1000);
+		}
+	} else {
+		/* no writer thread, write synchronously */
+		static struct log_slot fallback;
+		mutex_lock(&ring.output_lock);
+		slot = &fallback;
+	}
+
+	slot->level = level;
+	slot->stream = stream;
+	slot->time_us = log_time_us();
+	strcpy(slot->context, log_context);
+	slot->heap = heap;
+	if (!heap) {
+		memcpy(slot->text, text, (length < LOG_INLINE_SIZE) ? length + 1 : LOG_INLINE_SIZE);
+	}
+
+	if (!ring.running) {
+		log_output(slot);
+		free(slot->heap);
+		slot->heap = NULL;
+		log_flush_streams();
+		mutex_unlock(&ring.output_lock);
+		return;
+	}
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_SEQ_CST);
+	log_wake_writer();
+}
+
+void log_set_context(const char* context)
+{
+	if (context) {
+		snprintf(log_context, sizeof(log_context), "%s", context);
+	} else {
+		log_context[0] = '\0';
+	}
+}
+
+const char* log_get_context(void)
+{
+	return log_context;
+}
+
+int log_set_sink(const char* path)
+{
+	FILE* sink = NULL;
+
+	if (path) {
+		sink = fopen(path, "a");
+		if (!sink) {
+			return -1;
+		}
+	}
+
+	thread_once(&log_once, log_init);
+	log_flush();
+
+	mutex_lock(&ring.output_lock);
+	if (ring.sink) {
+		fclose(ring.sink);
+	}
+	ring.sink = sink;
+	mutex_unlock(&ring.output_lock);
+
+	return 0;
+}
+
+void log_flush(void)
+{
+	if (!ring.running) {
+		return;
+	}
+
+	uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST);
+	mutex_lock(&ring.lock);
+	while (__atomic_load_n(&ring.written, __ATOMIC_SEQ_CST) < head) {
+		cond_signal(&ring.cond);
+		cond_wait_timeout(&ring.drained, &ring.lock, LOG_IDLE_TIMEOUT);
+	}
+	mutex_unlock(&ring.lock);
+}
@@ -0,0 +1,61 @@
+/*
+ * log.h
+ * Asynchronous backend for info(), error() and debug()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_LOG_H
+#define IDEVICERESTORE_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+
+enum {
+	LOG_LEVEL_INFO = 0,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_DEBUG
+};
+
+/* Messages are formatted on the calling thread into a fixed size ring
+ * that producers claim slots of without taking a lock, and written to
+ * their stream by a single background thread in the order they were
+ * logged. When the ring is full debug messages are dropped and counted,
+ * info and error messages wait for a free slot. */
+void log_write(int level, FILE* stream, const char* format, va_list args);
+
+/* Prefixes every line logged by the calling thread with "[context] ",
+ * NULL stops prefixing. */
+void log_set_context(const char* context);
+
+/* context of the calling thread, empty if it has none */
+const char* log_get_context(void);
+
+/* Additionally writes every message as a JSON line to path, NULL closes
+ * the current sink. */
+int log_set_sink(const char* path);
+
+/* waits until everything logged so far has been written */
+void log_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
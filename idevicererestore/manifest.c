@@ -0,0 +1,403 @@
+/*
+ * manifest.c
+ * Hash index of the build identities and components of a BuildManifest
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "manifest.h"
+#include "thread.h"
+#include "common.h"
+
+#define MANIFEST_EMPTY_SLOT UINT32_MAX
+
+struct manifest_identity_key {
+	/* lowercased "model\nbehavior", behavior empty for "any" */
+	char* key;
+	uint32_t identity;
+};
+
+struct manifest_index {
+	mutex_t lock;
+	int refcount;
+	struct manifest_identity* identities;
+	uint32_t num_identities;
+	struct manifest_identity_key* keys;
+	uint32_t num_keys;
+	uint32_t* key_table;
+	uint32_t key_table_size;
+};
+
+static const struct {
+	const char* name;
+	int flag;
+} manifest_flag_names[] = {
+	{ "IsFirmwarePayload", MANIFEST_COMPONENT_FIRMWARE_PAYLOAD },
+	{ "IsLoadedByiBoot", MANIFEST_COMPONENT_LOADED_BY_IBOOT },
+	{ "IsLoadedByiBootStage1", MANIFEST_COMPONENT_LOADED_BY_IBSS },
+	{ "IsiBootEANFirmware", MANIFEST_COMPONENT_IBOOT_EAN_FIRMWARE },
+	{ "IsiBootNonEssentialFirmware", MANIFEST_COMPONENT_IBOOT_NON_ESSENTIAL },
+	{ "IsFUDFirmware", MANIFEST_COMPONENT_FUD_FIRMWARE },
+	{ "IsSecondaryFirmwarePayload", MANIFEST_COMPONENT_SECONDARY_PAYLOAD },
+	{ NULL, 0 }
+};
+
+/* FNV-1a */
+static uint32_t manifest_hash(const char* str)
+{
+	uint32_t hash = 2166136261u;
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* power of two with at most 50% load */
+static uint32_t manifest_table_size(uint32_t count)
+{
+	uint32_t size = 8;
+	while (size < count * 2) {
+		size <<= 1;
+	}
+	return size;
+}
+
+static uint32_t* manifest_table_new(uint32_t size)
+{
+	uint32_t* table = (uint32_t*)malloc(size * sizeof(uint32_t));
+	if (table) {
+		memset(table, 0xFF, size * sizeof(uint32_t));
+	}
+	return table;
+}
+
+static char* manifest_get_string(plist_t dict, const char* key)
+{
+	char* str = NULL;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &str);
+	}
+	return str;
+}
+
+static int manifest_index_component(struct manifest_component* component, const char* name, plist_t entry)
+{
+	memset(component, '\0', sizeof(struct manifest_component));
+	component->name = strdup(name);
+	if (!component->name) {
+		return -1;
+	}
+
+	plist_t digest = plist_dict_get_item(entry, "Digest");
+	if (digest && plist_get_node_type(digest) == PLIST_DATA) {
+		plist_get_data_val(digest, (char**)&component->digest, &component->digest_size);
+	}
+
+	plist_t info = plist_dict_get_item(entry, "Info");
+	if (info && plist_get_node_type(info) == PLIST_DICT) {
+		int i;
+		component->path = manifest_get_string(info, "Path");
+		for (i = 0; manifest_flag_names[i].name; i++) {
+			uint8_t val = 0;
+			plist_t node = plist_dict_get_item(info, manifest_flag_names[i].name);
+			if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+				plist_get_bool_val(node, &val);
+			}
+			if (val) {
+				component->flags |= manifest_flag_names[i].flag;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int manifest_index_identity(struct manifest_identity* identity, uint32_t index, plist_t ident)
+{
+	identity->index = index;
+
+	plist_t manifest = plist_dict_get_item(ident, "Manifest");
+	if (!manifest || plist_get_node_type(manifest) != PLIST_DICT) {
+		return 0;
+	}
+
+	uint32_t count = plist_dict_get_size(manifest);
+	identity->components = (struct manifest_component*)calloc((count > 0) ? count : 1, sizeof(struct manifest_component));
+	identity->component_table_size = manifest_table_size(count);
+	identity->component_table = manifest_table_new(identity->component_table_size);
+	if (!identity->components || !identity->component_table) {
+		return -1;
+	}
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(manifest, &iter);
+	while (iter && identity->num_components < count) {
+		char* name = NULL;
+		plist_t entry = NULL;
+		plist_dict_next_item(manifest, iter, &name, &entry);
+		if (!name) {
+			break;
+		}
+		if (!entry || plist_get_node_type(entry) != PLIST_DICT) {
+			free(name);
+			continue;
+		}
+		uint32_t mask = identity->component_table_size - 1;
+		uint32_t slot = manifest_hash(name) & mask;
+		while (identity->component_table[slot] != MANIFEST_EMPTY_SLOT) {
+			slot = (slot + 1) & mask;
+		}
+		struct manifest_component* component = &identity->components[identity->num_components];
+		if (manifest_index_component(component, name, entry) < 0) {
+			free(name);
+			free(iter);
+			return -1;
+		}
+		free(name);
+		identity->component_table[slot] = identity->num_components++;
+	}
+	free(iter);
+
+	return 0;
+}
+
+static char* manifest_identity_key(const char* hardware_model, const char* behavior)
+{
+	size_t model_len = strlen(hardware_model);
+	size_t behavior_len = (behavior) ? strlen(behavior) : 0;
+	char* key = (char*)malloc(model_len + behavior_len + 2);
+	size_t i;
+
+	if (!key) {
+		return NULL;
+	}
+	for (i = 0; i < model_len; i++) {
+		key[i] = tolower((unsigned char)hardware_model[i]);
+	}
+	key[model_len] = '\n';
+	for (i = 0; i < behavior_len; i++) {
+		key[model_len + 1 + i] = tolower((unsigned char)behavior[i]);
+	}
+	key[model_len + 1 + behavior_len] = '\0';
+
+	return key;
+}
+
+static const struct manifest_identity_key* manifest_index_lookup_key(struct manifest_index* index, const char* key)
+{
+	uint32_t mask = index->key_table_size - 1;
+	uint32_t slot = manifest_hash(key) & mask;
+
+	while (index->key_table[slot] != MANIFEST_EMPTY_SLOT) {
+		const struct manifest_identity_key* entry = &index->keys[index->key_table[slot]];
+		if (strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/* keeps the first identity for every key, like the linear scan did */
+static void manifest_index_add_key(struct manifest_index* index, char* key, uint32_t identity)
+{
+	if (manifest_index_lookup_key(index, key)) {
+		free(key);
+		return;
+	}
+
+	uint32_t mask = index->key_table_size - 1;
+	uint32_t slot = manifest_hash(key) & mask;
+	while (index->key_table[slot] != MANIFEST_EMPTY_SLOT) {
+		slot = (slot + 1) & mask;
+	}
+	index->keys[index->num_keys].key = key;
+	index->keys[index->num_keys].identity = identity;
+	index->key_table[slot] = index->num_keys++;
+}
+
+struct manifest_index* manifest_index_new(plist_t build_manifest)
+{
+	plist_t identities = plist_dict_get_item(build_manifest, "BuildIdentities");
+	if (!identities || plist_get_node_type(identities) != PLIST_ARRAY) {
+		error("ERROR: Unable to find build identities node\n");
+		return NULL;
+	}
+
+	struct manifest_index* index = (struct manifest_index*)calloc(1, sizeof(struct manifest_index));
+	if (!index) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	mutex_init(&index->lock);
+	index->refcount = 1;
+
+	uint32_t count = plist_array_get_size(identities);
+	index->identities = (struct manifest_identity*)calloc((count > 0) ? count : 1, sizeof(struct manifest_identity));
+	/* every identity adds at most a "model and behavior" and a "model" key */
+	index->keys = (struct manifest_identity_key*)calloc((count > 0) ? count * 2 : 1, sizeof(struct manifest_identity_key));
+	index->key_table_size = manifest_table_size(count * 2);
+	index->key_table = manifest_table_new(index->key_table_size);
+	if (!index->identities || !index->keys || !index->key_table) {
+		error("ERROR: Out of memory\n");
+		manifest_index_free(index);
+		return NULL;
+	}
+
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		plist_t ident = plist_array_get_item(identities, i);
+		struct manifest_identity* identity = &index->identities[index->num_identities++];
+		if (!ident || plist_get_node_type(ident) != PLIST_DICT) {
+			identity->index = i;
+			continue;
+		}
+		if (manifest_index_identity(identity, i, ident) < 0) {
+			error("ERROR: Out of memory\n");
+			manifest_index_free(index);
+			return NULL;
+		}
+
+		plist_t info = plist_dict_get_item(ident, "Info");
+		if (!info || plist_get_node_type(info) != PLIST_DICT) {
+			continue;
+		}
+		char* devclass = manifest_get_string(info, "DeviceClass");
+		if (!devclass) {
+			continue;
+		}
+		char* behavior = manifest_get_string(info, "RestoreBehavior");
+		char* key = manifest_identity_key(devclass, NULL);
+		if (key) {
+			manifest_index_add_key(index, key, i);
+		}
+		if (behavior) {
+			key = manifest_identity_key(devclass, behavior);
+			if (key) {
+				manifest_index_add_key(index, key, i);
+			}
+		}
+		free(behavior);
+		free(devclass);
+	}
+
+	debug("Indexed %u build identities\n", index->num_identities);
+
+	return index;
+}
+
+struct manifest_index* manifest_index_ref(struct manifest_index* index)
+{
+	if (index) {
+		mutex_lock(&index->lock);
+		index->refcount++;
+		mutex_unlock(&index->lock);
+	}
+	return index;
+}
+
+void manifest_index_free(struct manifest_index* index)
+{
+	uint32_t i, j;
+
+	if (!index) {
+		return;
+	}
+	mutex_lock(&index->lock);
+	int refcount = --index->refcount;
+	mutex_unlock(&index->lock);
+	if (refcount > 0) {
+		return;
+	}
+
+	for (i = 0; i < index->num_identities; i++) {
+		struct manifest_identity* identity = &index->identities[i];
+		for (j = 0; j < identity->num_components; j++) {
+			free(identity->components[j].name);
+			free(identity->components[j].path);
+			free(identity->components[j].digest);
+		}
+		free(identity->components);
+		free(identity->component_table);
+	}
+	for (i = 0; i < index->num_keys; i++) {
+		free(index->keys[i].key);
+	}
+	free(index->identities);
+	free(index->keys);
+	free(index->key_table);
+	mutex_destroy(&index->lock);
+	free(index);
+}
+
+const struct manifest_identity* manifest_index_find_identity(struct manifest_index* index, const char* hardware_model, const char* behavior)
+{
+	if (!index || !hardware_model) {
+		return NULL;
+	}
+
+	char* key = manifest_identity_key(hardware_model, behavior);
+	if (!key) {
+		return NULL;
+	}
+	const struct manifest_identity_key* entry = manifest_index_lookup_key(index, key);
+	free(key);
+
+	return (entry) ? &index->identities[entry->identity] : NULL;
+}
+
+const struct manifest_component* manifest_identity_get_component(const struct manifest_identity* identity, const char* name)
+{
+	if (!identity || !identity->component_table || !name) {
+		return NULL;
+	}
+
+	uint32_t mask = identity->component_table_size - 1;
+	uint32_t slot = manifest_hash(name) & mask;
+	while (identity->component_table[slot] != MANIFEST_EMPTY_SLOT) {
+		const struct manifest_component* component = &identity->components[identity->component_table[slot]];
+		if (strcmp(component->name, name) == 0) {
+			return component;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+int manifest_identity_get_component_path(const struct manifest_identity* identity, const char* name, char** path)
+{
+	const struct manifest_component* component = manifest_identity_get_component(identity, name);
+	if (!component) {
+		error("ERROR: Unable to find component node for %s\n", name);
+		return -1;
+	}
+	if (!component->path) {
+		error("ERROR: Unable to find component info path node for %s\n", name);
+		return -1;
+	}
+
+	*path = strdup(component->path);
+
+	return (*path) ? 0 : -1;
+}
@@ -0,0 +1,81 @@
+/*
+ * manifest.h
+ * Hash index of the build identities and components of a BuildManifest
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_MANIFEST_H
+#define IDEVICERESTORE_MANIFEST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* Info booleans of a manifest component */
+#define MANIFEST_COMPONENT_FIRMWARE_PAYLOAD     (1 << 0)
+#define MANIFEST_COMPONENT_LOADED_BY_IBOOT      (1 << 1)
+#define MANIFEST_COMPONENT_LOADED_BY_IBSS       (1 << 2)
+#define MANIFEST_COMPONENT_IBOOT_EAN_FIRMWARE   (1 << 3)
+#define MANIFEST_COMPONENT_IBOOT_NON_ESSENTIAL  (1 << 4)
+#define MANIFEST_COMPONENT_FUD_FIRMWARE         (1 << 5)
+#define MANIFEST_COMPONENT_SECONDARY_PAYLOAD    (1 << 6)
+
+struct manifest_component {
+	char* name;
+	/* NULL if the component has no Info/Path */
+	char* path;
+	unsigned char* digest;
+	uint64_t digest_size;
+	int flags;
+};
+
+struct manifest_identity {
+	/* position in the BuildIdentities array */
+	uint32_t index;
+	struct manifest_component* components;
+	uint32_t num_components;
+	/* open addressed table of positions in components */
+	uint32_t* component_table;
+	uint32_t component_table_size;
+};
+
+struct manifest_index;
+
+/* Reads every build identity of build_manifest once. The index keeps
+ * copies of what it needs, so it stays valid after build_manifest is
+ * freed and can be shared between clients restoring the same IPSW; it is
+ * reference counted like an ipsw_archive. */
+struct manifest_index* manifest_index_new(plist_t build_manifest);
+struct manifest_index* manifest_index_ref(struct manifest_index* index);
+void manifest_index_free(struct manifest_index* index);
+
+/* First identity for hardware_model (and behavior if not NULL), both
+ * compared case-insensitively, or NULL. */
+const struct manifest_identity* manifest_index_find_identity(struct manifest_index* index, const char* hardware_model, const char* behavior);
+
+const struct manifest_component* manifest_identity_get_component(const struct manifest_identity* identity, const char* name);
+
+/* like build_identity_get_component_path(), path must be freed */
+int manifest_identity_get_component_path(const struct manifest_identity* identity, const char* name, char** path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
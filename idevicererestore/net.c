@@ -0,0 +1,140 @@
+/*
+ * net.c
+ * Process wide pool of curl handles sharing connections, DNS and TLS sessions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+
+#include "net.h"
+#include "common.h"
+#include "thread.h"
+
+/* Idle handles kept for reuse, enough for the TSS race and a segmented
+ * download running at the same time */
+#define NET_MAX_IDLE_HANDLES 16
+
+static thread_once_t net_once = THREAD_ONCE_INIT;
+static mutex_t net_lock;
+static CURLSH* net_share = NULL;
+static mutex_t net_share_locks[CURL_LOCK_DATA_LAST];
+static CURL* net_idle[NET_MAX_IDLE_HANDLES];
+static int net_num_idle = 0;
+
+static void net_share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+	(void)handle;
+	(void)access;
+	(void)userptr;
+	if (data < CURL_LOCK_DATA_LAST) {
+		mutex_lock(&net_share_locks[data]);
+	}
+}
+
+static void net_share_unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+	(void)handle;
+	(void)userptr;
+	if (data < CURL_LOCK_DATA_LAST) {
+		mutex_unlock(&net_share_locks[data]);
+	}
+}
+
+static void net_init(void)
+{
+	int i;
+
+	mutex_init(&net_lock);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		mutex_init(&net_share_locks[i]);
+	}
+	net_share = curl_share_init();
+	if (!net_share) {
+		error("WARNING: Unable to create curl share, connections won't be reused\n");
+		return;
+	}
+	curl_share_setopt(net_share, CURLSHOPT_LOCKFUNC, net_share_lock);
+	curl_share_setopt(net_share, CURLSHOPT_UNLOCKFUNC, net_share_unlock);
+	curl_share_setopt(net_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(net_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	if (curl_share_setopt(net_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+		// older libcurl, each handle keeps its own connections
+		debug("Sharing curl connections is not supported\n");
+	}
+}
+
+CURL* net_handle_acquire(void)
+{
+	CURL* handle = NULL;
+
+	thread_once(&net_once, net_init);
+	mutex_lock(&net_lock);
+	if (net_num_idle > 0) {
+		handle = net_idle[--net_num_idle];
+	}
+	mutex_unlock(&net_lock);
+
+	if (handle) {
+		// keeps its connections, drops the options of the last transfer
+		curl_easy_reset(handle);
+	} else {
+		handle = curl_easy_init();
+		if (!handle) {
+			error("ERROR: Unable to create curl handle\n");
+			return NULL;
+		}
+	}
+
+	if (net_share) {
+		curl_easy_setopt(handle, CURLOPT_SHARE, net_share);
+	}
+	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+
+	return handle;
+}
+
+void net_handle_release(CURL* handle)
+{
+	if (!handle) {
+		return;
+	}
+
+	thread_once(&net_once, net_init);
+	mutex_lock(&net_lock);
+	if (net_num_idle < NET_MAX_IDLE_HANDLES) {
+		net_idle[net_num_idle++] = handle;
+		handle = NULL;
+	}
+	mutex_unlock(&net_lock);
+
+	if (handle) {
+		curl_easy_cleanup(handle);
+	}
+}
+
+void net_cleanup(void)
+{
+	thread_once(&net_once, net_init);
+	mutex_lock(&net_lock);
+	while (net_num_idle > 0) {
+		curl_easy_cleanup(net_idle[--net_num_idle]);
+	}
+	if (net_share) {
+		curl_share_cleanup(net_share);
+		net_share = NULL;
+	}
+	mutex_unlock(&net_lock);
+}
@@ -0,0 +1,48 @@
+/*
+ * net.h
+ * Process wide pool of curl handles sharing connections, DNS and TLS sessions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_NET_H
+#define IDEVICERESTORE_NET_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <curl/curl.h>
+
+/* Every handle is attached to one curl share that holds the connection
+ * cache, DNS cache and TLS sessions of the process, so a TSS retry,
+ * version check or partial zip range request to a host that was talked
+ * to before skips the lookup and handshakes. Handles come with their
+ * options reset apart from the share and TCP keep-alive; they may be
+ * used with the easy or the multi interface, from any thread. */
+CURL* net_handle_acquire(void);
+
+/* hands the handle back for reuse, it must not be in a multi handle */
+void net_handle_release(CURL* handle);
+
+/* frees the idle handles and the share, call before curl_global_cleanup()
+ * once all handles are released */
+void net_cleanup(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,7 @@
 #include "common.h"
 #include "normal.h"
 #include "recovery.h"
+#include "event.h"
 
 static int normal_device_connected = 0;
 
@@ -181,6 +182,7 @@ int normal_check_mode(struct idevicerestore_client_t* client) {
 int normal_open_with_timeout(struct idevicerestore_client_t* client) {
 	int i = 0;
 	int attempts = 10;
+	unsigned int seen = 0;
 	idevice_t device = NULL;
 
 	// no context exists so bail
@@ -199,7 +201,10 @@ int normal_open_with_timeout(struct idevicerestore_client_t* client) {
 		}
 	}
 
+	// a device showing up ends the wait early instead of sleeping it out
+	int subscribed = (device_event_add_handler(NULL, NULL) == 0);
 	for (i = 1; i <= attempts; i++) {
+		seen = device_event_get_generation();
 		normal_idevice_new(client, &device);
 		if (device) {
 			normal_device_connected = 1;
@@ -207,10 +212,20 @@ int normal_open_with_timeout(struct idevicerestore_client_t* client) {
 		}
 
 		if (i == attempts) {
-			error("ERROR: Unable to connect to device in normal mode\n");
-			return -1;
+			break;
+		}
+		if (subscribed) {
+			device_event_wait(&seen, 2000);
+		} else {
+			sleep(2);
 		}
-		sleep(2);
+	}
+	if (subscribed) {
+		device_event_remove_handler(NULL, NULL);
+	}
+	if (!device) {
+		error("ERROR: Unable to connect to device in normal mode\n");
+		return -1;
 	}
 
 	client->normal->device = device;
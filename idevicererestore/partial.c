@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <inttypes.h>
 #include <libgen.h>
 
@@ -33,55 +34,150 @@
 #include <inttypes.h>
 #endif
 
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
 #include "partial.h"
+#include "cache.h"
+#include "thread.h"
+#include "net.h"
+
+/* slack added to the range of a file so the local extra field, which may be
+ * longer than the central one, normally arrives with the same request */
+#define PARTIALZIP_LOCAL_EXTRA_SLACK 256
 
-static size_t count = 0;
 char endianness = IS_LITTLE_ENDIAN;
 
-int partialzip_download_file(const char* url, const char* path, const char* output) {
+/* open archives, kept so several files from the same firmware share one
+ * central directory and one kept-alive connection */
+struct partialzip_session {
+	char* url;
+	partialzip_t* info;
+	mutex_t lock;
+	struct partialzip_session* next;
+};
+
+static struct partialzip_session* sessions = NULL;
+static mutex_t sessions_lock;
+static thread_once_t sessions_once = THREAD_ONCE_INIT;
+
+static int partialzip_revalidate(partialzip_t* info);
+
+static void partialzip_sessions_init(void)
+{
+	mutex_init(&sessions_lock);
+}
+
+/* sets reused when the session was opened by an earlier download, its
+ * archive has to be revalidated before it is read from */
+static struct partialzip_session* partialzip_session_get(const char* url, const char* cache_dir, int* reused)
+{
+	struct partialzip_session* session;
+
+	thread_once(&sessions_once, partialzip_sessions_init);
+	mutex_lock(&sessions_lock);
+	for(session = sessions; session; session = session->next)
+	{
+		if(strcmp(session->url, url) == 0)
+			break;
+	}
+	*reused = (session != NULL);
+	if(!session)
+	{
+		partialzip_t* info = partialzip_open_with_cache(url, cache_dir);
+		if(info)
+		{
+			session = (struct partialzip_session*) malloc(sizeof(struct partialzip_session));
+			session->url = strdup(url);
+			session->info = info;
+			mutex_init(&session->lock);
+			session->next = sessions;
+			sessions = session;
+		}
+	}
+	mutex_unlock(&sessions_lock);
+
+	return session;
+}
+
+void partialzip_sessions_close(void)
+{
+	thread_once(&sessions_once, partialzip_sessions_init);
+	mutex_lock(&sessions_lock);
+	while(sessions)
+	{
+		struct partialzip_session* session = sessions;
+		sessions = session->next;
+		partialzip_close(session->info);
+		mutex_destroy(&session->lock);
+		free(session->url);
+		free(session);
+	}
+	mutex_unlock(&sessions_lock);
+}
+
+static int writeFile(void* userData, const unsigned char* data, size_t size)
+{
+	return (fwrite(data, 1, size, (FILE*) userData) == size) ? 0 : -1;
+}
+
+int partialzip_download_file_cached(const char* url, const char* path, const char* output, const char* cache_dir) {
 	FILE* fd;
 	partialzip_file_t* file;
-	partialzip_t* info;
-	unsigned int size;
-	unsigned char* data;
+	struct partialzip_session* session;
+	int reused = 0;
+	int res;
 
-	info = partialzip_open(url);
-	if (!info) {
+	session = partialzip_session_get(url, cache_dir, &reused);
+	if (!session) {
 		printf("Cannot find %s\n", url);
 		return -1;
 	}
 
-	file = partialzip_find_file(info, path);
+	// the curl handle of a session serves one transfer at a time
+	mutex_lock(&session->lock);
+	// the firmware may have been replaced since the central directory was read
+	if (reused && partialzip_revalidate(session->info) < 0) {
+		partialzip_t* info = partialzip_open_with_cache(url, cache_dir);
+		if (!info) {
+			mutex_unlock(&session->lock);
+			printf("Cannot find %s\n", url);
+			return -1;
+		}
+		partialzip_close(session->info);
+		session->info = info;
+	}
+	file = partialzip_find_file(session->info, path);
 	if (!file) {
+		mutex_unlock(&session->lock);
 		printf("Cannot find %s in %s\n", path, url);
 		return -1;
 	}
 
-	data = partialzip_get_file(info, file);
-	if(!data) {
-		printf("Cannot get %s from %s\n", path, url);
-		return -1;
-	}
-	size = file->size;
-
 	fd = fopen(output, "wb");
 	if(!fd) {
+		mutex_unlock(&session->lock);
 		printf("Cannot open file %s for output\n", output);
 		return -1;
 	}
 
-	if(fwrite(data, 1, size, fd) != size) {
-		printf("Unable to write entire file to output\n");
-		fclose(fd);
+	// inflated while it downloads, memory use doesn't depend on the file size
+	res = partialzip_get_file_streaming(session->info, file, writeFile, fd);
+	mutex_unlock(&session->lock);
+
+	if(fclose(fd) != 0 || res < 0) {
+		printf("Cannot get %s from %s\n", path, url);
+		remove(output);
 		return -1;
 	}
 
-	fclose(fd);
-	partialzip_close(info);
-	free(data);
 	return 0;
 }
 
+int partialzip_download_file(const char* url, const char* path, const char* output) {
+	return partialzip_download_file_cached(url, path, output, NULL);
+}
+
 static size_t dummyReceive(void* data, size_t size, size_t nmemb, void* info) {
 	return size * nmemb;
 }
@@ -98,24 +194,45 @@ static size_t receiveCentralDirectory(void* data, size_t size, size_t nmemb, par
 	return size * nmemb;
 }
 
-static size_t receiveData(void* data, size_t size, size_t nmemb, void** pFileData) {
-	memcpy(pFileData[0], data, size * nmemb);
-	pFileData[0] = ((char*)pFileData[0]) + (size * nmemb);
-	partialzip_t* info = ((partialzip_t*)pFileData[1]);
-	partialzip_file_t* file = ((partialzip_file_t*)pFileData[2]);
-	size_t* progress = ((size_t*)pFileData[3]);
-
-	if(progress) {
-		count += size * nmemb;
-		*progress += size * nmemb;
+static char* headerValue(const char* data, size_t total, size_t lenName) {
+	const char* value = data + lenName;
+	const char* valueEnd = data + total;
+	while(value < valueEnd && (*value == ' ' || *value == '\t'))
+		value++;
+	while(valueEnd > value && (valueEnd[-1] == '\r' || valueEnd[-1] == '\n' || valueEnd[-1] == ' '))
+		valueEnd--;
+	char* result = (char*) malloc(valueEnd - value + 1);
+	if(result)
+	{
+		memcpy(result, value, valueEnd - value);
+		result[valueEnd - value] = '\0';
 	}
+	return result;
+}
 
-	if(info && info->progressCallback && file) {
-		*progress = ((double) count/ (double) file->compressedSize) * 100.0;
-		info->progressCallback(info, file, *progress);
+static size_t receiveHeader(char* data, size_t size, size_t nmemb, partialzip_t* info) {
+	size_t total = size * nmemb;
+
+	// a redirect brings its own headers, only the last response counts
+	if(total > 5 && strncmp(data, "HTTP/", 5) == 0)
+	{
+		free(info->etag);
+		info->etag = NULL;
+		free(info->lastModified);
+		info->lastModified = NULL;
+	}
+	else if(total > 5 && strncasecmp(data, "etag:", 5) == 0)
+	{
+		free(info->etag);
+		info->etag = headerValue(data, total, 5);
+	}
+	else if(total > 14 && strncasecmp(data, "last-modified:", 14) == 0)
+	{
+		free(info->lastModified);
+		info->lastModified = headerValue(data, total, 14);
 	}
 
-	return size * nmemb;
+	return total;
 }
 
 static partialzip_file_t* flipFiles(partialzip_t* info)
@@ -150,16 +267,101 @@ static partialzip_file_t* flipFiles(partialzip_t* info)
 	return NULL;
 }
 
+/* the central directory of a remote archive only changes together with
+ * its ETag, or its Last-Modified date when the server sends no ETag, which
+ * makes URL, validator and length a safe cache key */
+static int partialzip_cache_path(partialzip_t* info, const char* cache_dir, char* path, size_t path_size)
+{
+	unsigned char key[SHA_DIGEST_LENGTH];
+	EVP_MD_CTX* ctx;
+	const char* validator = (info->etag) ? info->etag : info->lastModified;
+
+	if(!cache_dir || !validator)
+		return -1;
+
+	ctx = EVP_MD_CTX_new();
+	if(!ctx || EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) != 1)
+	{
+		EVP_MD_CTX_free(ctx);
+		return -1;
+	}
+	EVP_DigestUpdate(ctx, info->url, strlen(info->url));
+	EVP_DigestUpdate(ctx, "\n", 1);
+	EVP_DigestUpdate(ctx, validator, strlen(validator));
+	EVP_DigestUpdate(ctx, &info->length, sizeof(info->length));
+	EVP_DigestFinal_ex(ctx, key, NULL);
+	EVP_MD_CTX_free(ctx);
+
+	return cache_get_path(cache_dir, "partialzip", key, sizeof(key), path, path_size);
+}
+
+static int partialzip_cache_load(partialzip_t* info, const char* path)
+{
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+	int mapped = 0;
+
+	if(cache_map(path, &data, &size, &mapped) < 0)
+		return -1;
+
+	partialzip_end_of_cd_t* desc = (partialzip_end_of_cd_t*) info->centralDirectoryEnd;
+	if(size < sizeof(partialzip_end_of_cd_t))
+	{
+		cache_release(data, size, mapped);
+		return -1;
+	}
+	memcpy(desc, data, sizeof(partialzip_end_of_cd_t));
+	if(desc->signature != 0x06054b50 || desc->CDSize != size - sizeof(partialzip_end_of_cd_t))
+	{
+		cache_release(data, size, mapped);
+		return -1;
+	}
+
+	info->centralDirectoryEndRecvd = sizeof(partialzip_end_of_cd_t);
+	info->centralDirectoryDesc = desc;
+	info->centralDirectory = (char*)malloc(desc->CDSize);
+	memcpy(info->centralDirectory, data + sizeof(partialzip_end_of_cd_t), desc->CDSize);
+	info->centralDirectoryRecvd = desc->CDSize;
+	cache_release(data, size, mapped);
+
+	return 0;
+}
+
+static void partialzip_cache_store(partialzip_t* info, const char* path)
+{
+	size_t size = sizeof(partialzip_end_of_cd_t) + info->centralDirectoryDesc->CDSize;
+	unsigned char* data = (unsigned char*) malloc(size);
+	if(!data)
+		return;
+
+	// the end record is stored as parsed, the directory as received
+	memcpy(data, info->centralDirectoryDesc, sizeof(partialzip_end_of_cd_t));
+	memcpy(data + sizeof(partialzip_end_of_cd_t), info->centralDirectory, info->centralDirectoryDesc->CDSize);
+	cache_publish(path, data, size);
+	free(data);
+}
+
 partialzip_t* partialzip_open(const char* url)
 {
+	return partialzip_open_with_cache(url, NULL);
+}
+
+partialzip_t* partialzip_open_with_cache(const char* url, const char* cache_dir)
+{
+	char cachePath[1024];
+	int cacheable = 0;
+
 	partialzip_t* info = (partialzip_t*) malloc(sizeof(partialzip_t));
 	info->url = strdup(url);
+	info->etag = NULL;
+	info->lastModified = NULL;
+	info->centralDirectory = NULL;
 	info->centralDirectoryRecvd = 0;
 	info->centralDirectoryEndRecvd = 0;
 	info->centralDirectoryDesc = NULL;
 	info->progressCallback = NULL;
 
-	info->hIPSW = curl_easy_init();
+	info->hIPSW = net_handle_acquire();
 
 	curl_easy_setopt(info->hIPSW, CURLOPT_URL, info->url);
 	curl_easy_setopt(info->hIPSW, CURLOPT_FOLLOWLOCATION, 1);
@@ -175,7 +377,7 @@ partialzip_t* partialzip_open(const char* url)
 		if(!f)
 		{
 			curl_free(filePath);
-			curl_easy_cleanup(info->hIPSW);
+			net_handle_release(info->hIPSW);
 			free(info->url);
 			free(info);
 
@@ -190,11 +392,23 @@ partialzip_t* partialzip_open(const char* url)
 	}
 	else
 	{
+		curl_easy_setopt(info->hIPSW, CURLOPT_HEADERFUNCTION, receiveHeader);
+		curl_easy_setopt(info->hIPSW, CURLOPT_HEADERDATA, info);
 		curl_easy_perform(info->hIPSW);
+		curl_easy_setopt(info->hIPSW, CURLOPT_HEADERFUNCTION, NULL);
+		curl_easy_setopt(info->hIPSW, CURLOPT_HEADERDATA, NULL);
 
 		double dFileLength;
 		curl_easy_getinfo(info->hIPSW, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dFileLength);
 		info->length = dFileLength;
+
+		cacheable = (partialzip_cache_path(info, cache_dir, cachePath, sizeof(cachePath)) == 0);
+	}
+
+	if(cacheable && partialzip_cache_load(info, cachePath) == 0)
+	{
+		flipFiles(info);
+		return info;
 	}
 
 	char sRange[100];
@@ -253,19 +467,78 @@ partialzip_t* partialzip_open(const char* url)
 		curl_easy_setopt(info->hIPSW, CURLOPT_HTTPGET, 1);
 		curl_easy_perform(info->hIPSW);
 
+		if(cacheable && info->centralDirectoryRecvd == info->centralDirectoryDesc->CDSize)
+			partialzip_cache_store(info, cachePath);
+
 		flipFiles(info);
 
 		return info;
 	}
 	else 
 	{
-		curl_easy_cleanup(info->hIPSW);
+		net_handle_release(info->hIPSW);
+		free(info->etag);
+		free(info->lastModified);
 		free(info->url);
 		free(info);
 		return NULL;
 	}
 }
 
+static int validatorEquals(const char* a, const char* b)
+{
+	if(!a || !b)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+/* a HEAD request tells if the archive behind an open session is still the
+ * one its central directory was read from */
+static int partialzip_revalidate(partialzip_t* info)
+{
+	char* etag = info->etag;
+	char* lastModified = info->lastModified;
+	uint64_t length = info->length;
+	int res = 0;
+
+	if(strncmp(info->url, "file://", 7) == 0)
+	{
+		char* filePath = (char*) curl_easy_unescape(info->hIPSW, info->url + 7, 0, NULL);
+		FILE* f = fopen(filePath, "rb");
+		curl_free(filePath);
+		if(!f)
+			return -1;
+		fseek(f, 0, SEEK_END);
+		res = ((uint64_t)ftell(f) == length) ? 0 : -1;
+		fclose(f);
+		return res;
+	}
+
+	info->etag = NULL;
+	info->lastModified = NULL;
+	curl_easy_setopt(info->hIPSW, CURLOPT_URL, info->url);
+	curl_easy_setopt(info->hIPSW, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(info->hIPSW, CURLOPT_NOBODY, 1);
+	curl_easy_setopt(info->hIPSW, CURLOPT_RANGE, NULL);
+	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEFUNCTION, dummyReceive);
+	curl_easy_setopt(info->hIPSW, CURLOPT_HEADERFUNCTION, receiveHeader);
+	curl_easy_setopt(info->hIPSW, CURLOPT_HEADERDATA, info);
+	if(curl_easy_perform(info->hIPSW) != CURLE_OK)
+		res = -1;
+	curl_easy_setopt(info->hIPSW, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(info->hIPSW, CURLOPT_HEADERDATA, NULL);
+
+	double dFileLength;
+	curl_easy_getinfo(info->hIPSW, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dFileLength);
+	if(res == 0 && ((uint64_t)dFileLength != length || !validatorEquals(etag, info->etag) || !validatorEquals(lastModified, info->lastModified)))
+		res = -1;
+
+	free(etag);
+	free(lastModified);
+
+	return res;
+}
+
 partialzip_file_t* partialzip_find_file(partialzip_t* info, const char* fileName)
 {
 	char* cur = info->centralDirectory;
@@ -307,74 +580,248 @@ partialzip_file_t* partialzip_list_files(partialzip_t* info)
 	return NULL;
 }
 
-unsigned char* partialzip_get_file(partialzip_t* info, partialzip_file_t* file)
-{
-	count = 0;
+#define PARTIALZIP_INFLATE_CHUNK 65536
+
+/* state of one file transfer, the local header, name and extra field are
+ * parsed off the front of the same response that carries the data, which
+ * is then inflated as it arrives and handed to the write callback */
+typedef struct {
+	partialzip_t* info;
+	partialzip_file_t* file;
 	partialzip_local_file_t localHeader;
-	partialzip_local_file_t* pLocalHeader = &localHeader;
+	size_t localHeaderRecvd;
+	uint64_t skip;
+	uint64_t dataRecvd;
+	uint64_t dataWritten;
+	uint32_t crc;
+	int inflating;
+	z_stream strm;
+	unsigned char* outBuf;
+	partialzip_write_callback_t writeCallback;
+	void* userData;
+	int failed;
+} partialzip_fetch_t;
+
+static int partialzip_fetch_output(partialzip_fetch_t* fetch, const unsigned char* data, size_t size)
+{
+	if(fetch->dataWritten + size > fetch->file->size)
+		return -1;
+	fetch->crc = crc32(fetch->crc, data, size);
+	fetch->dataWritten += size;
+	return fetch->writeCallback(fetch->userData, data, size);
+}
 
-	uint64_t start = file->offset;
-	uint64_t end = file->offset + sizeof(partialzip_local_file_t) - 1;
-	char sRange[100];
-	sprintf(sRange, "%" PRIu64 "-%" PRIu64, start, end);
+static int partialzip_fetch_consume(partialzip_fetch_t* fetch, unsigned char* data, size_t size)
+{
+	if(!fetch->inflating)
+		return partialzip_fetch_output(fetch, data, size);
+
+	fetch->strm.next_in = data;
+	fetch->strm.avail_in = size;
+	while(fetch->strm.avail_in > 0)
+	{
+		fetch->strm.next_out = fetch->outBuf;
+		fetch->strm.avail_out = PARTIALZIP_INFLATE_CHUNK;
+		int ret = inflate(&fetch->strm, Z_NO_FLUSH);
+		if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		{
+			printf("Unable to inflate %s: %s\n", fetch->info->url, (fetch->strm.msg) ? fetch->strm.msg : "error");
+			return -1;
+		}
+		size_t produced = PARTIALZIP_INFLATE_CHUNK - fetch->strm.avail_out;
+		if(produced > 0 && partialzip_fetch_output(fetch, fetch->outBuf, produced) < 0)
+			return -1;
+		if(ret == Z_STREAM_END)
+			break;
+		if(ret == Z_BUF_ERROR && produced == 0)
+			break;
+	}
+	return 0;
+}
+
+static size_t receiveFile(char* data, size_t size, size_t nmemb, partialzip_fetch_t* fetch) {
+	size_t total = size * nmemb;
+	size_t left = total;
+
+	if(fetch->failed)
+		return 0;
+
+	if(fetch->localHeaderRecvd < sizeof(partialzip_local_file_t))
+	{
+		size_t n = sizeof(partialzip_local_file_t) - fetch->localHeaderRecvd;
+		if(n > left)
+			n = left;
+		memcpy(((char*)&fetch->localHeader) + fetch->localHeaderRecvd, data, n);
+		fetch->localHeaderRecvd += n;
+		data += n;
+		left -= n;
+		if(fetch->localHeaderRecvd < sizeof(partialzip_local_file_t))
+			return total;
+
+		FLIPENDIANLE(fetch->localHeader.signature);
+		FLIPENDIANLE(fetch->localHeader.versionExtract);
+		// FLIPENDIANLE(fetch->localHeader.flags);
+		FLIPENDIANLE(fetch->localHeader.method);
+		FLIPENDIANLE(fetch->localHeader.modTime);
+		FLIPENDIANLE(fetch->localHeader.modDate);
+		// FLIPENDIANLE(fetch->localHeader.crc32);
+		FLIPENDIANLE(fetch->localHeader.compressedSize);
+		FLIPENDIANLE(fetch->localHeader.size);
+		FLIPENDIANLE(fetch->localHeader.lenFileName);
+		FLIPENDIANLE(fetch->localHeader.lenExtra);
+		if(fetch->localHeader.signature != 0x04034b50)
+		{
+			fetch->failed = 1;
+			return 0;
+		}
+		fetch->skip = fetch->localHeader.lenFileName + fetch->localHeader.lenExtra;
+	}
+
+	if(fetch->skip > 0)
+	{
+		size_t n = (fetch->skip < left) ? (size_t)fetch->skip : left;
+		fetch->skip -= n;
+		data += n;
+		left -= n;
+	}
+
+	// anything past the compressed data is slack from the coalesced range
+	if(left > fetch->file->compressedSize - fetch->dataRecvd)
+		left = (size_t)(fetch->file->compressedSize - fetch->dataRecvd);
+	if(left > 0)
+	{
+		if(partialzip_fetch_consume(fetch, (unsigned char*)data, left) < 0)
+		{
+			fetch->failed = 1;
+			return 0;
+		}
+		fetch->dataRecvd += left;
 
-	void* pFileHeader[] = {pLocalHeader, NULL, NULL, NULL}; 
+		partialzip_t* info = fetch->info;
+		if(info->progressCallback)
+			info->progressCallback(info, fetch->file, (size_t)(((double) fetch->dataRecvd / (double) fetch->file->compressedSize) * 100.0));
+	}
 
+	return total;
+}
+
+int partialzip_get_file_streaming(partialzip_t* info, partialzip_file_t* file, partialzip_write_callback_t writeCallback, void* userData)
+{
+	partialzip_fetch_t fetch;
+	memset(&fetch, 0, sizeof(fetch));
+	fetch.info = info;
+	fetch.file = file;
+	fetch.writeCallback = writeCallback;
+	fetch.userData = userData;
+	fetch.crc = crc32(0L, Z_NULL, 0);
+
+	if(file->method == 8)
+	{
+		fetch.outBuf = (unsigned char*) malloc(PARTIALZIP_INFLATE_CHUNK);
+		if(!fetch.outBuf)
+			return -1;
+		fetch.strm.zalloc = Z_NULL;
+		fetch.strm.zfree = Z_NULL;
+		fetch.strm.opaque = Z_NULL;
+		if(inflateInit2(&fetch.strm, -MAX_WBITS) != Z_OK)
+		{
+			free(fetch.outBuf);
+			return -1;
+		}
+		fetch.inflating = 1;
+	}
+	else if(file->method != 0)
+	{
+		printf("Unsupported compression method %d\n", file->method);
+		return -1;
+	}
+
+	// one range for header, name, extra field and data, the central
+	// directory tells how long the name and extra field usually are
+	uint64_t start = file->offset;
+	uint64_t end = start + sizeof(partialzip_local_file_t) + file->lenFileName + file->lenExtra + PARTIALZIP_LOCAL_EXTRA_SLACK + file->compressedSize - 1;
+	if(end >= info->length)
+		end = info->length - 1;
+
+	char sRange[100];
 	curl_easy_setopt(info->hIPSW, CURLOPT_URL, info->url);
 	curl_easy_setopt(info->hIPSW, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEFUNCTION, receiveData);
-	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEDATA, &pFileHeader);
-	curl_easy_setopt(info->hIPSW, CURLOPT_RANGE, sRange);
+	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEFUNCTION, receiveFile);
+	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEDATA, &fetch);
 	curl_easy_setopt(info->hIPSW, CURLOPT_HTTPGET, 1);
-	curl_easy_perform(info->hIPSW);
-	
-	FLIPENDIANLE(localHeader.signature);
-	FLIPENDIANLE(localHeader.versionExtract);
-	// FLIPENDIANLE(localHeader.flags);
-	FLIPENDIANLE(localHeader.method);
-	FLIPENDIANLE(localHeader.modTime);
-	FLIPENDIANLE(localHeader.modDate);
-	// FLIPENDIANLE(localHeader.crc32);
-	FLIPENDIANLE(localHeader.compressedSize);
-	FLIPENDIANLE(localHeader.size);
-	FLIPENDIANLE(localHeader.lenFileName);
-	FLIPENDIANLE(localHeader.lenExtra);
-
-	unsigned char* fileData = (unsigned char*) malloc(file->compressedSize);
-	size_t progress = 0;
-	void* pFileData[] = {fileData, info, file, &progress}; 
-
-	start = file->offset + sizeof(partialzip_local_file_t) + localHeader.lenFileName + localHeader.lenExtra;
-	end = start + file->compressedSize - 1;
-	sprintf(sRange, "%" PRIu64 "-%" PRIu64, start, end);
 
-	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEFUNCTION, receiveData);
-	curl_easy_setopt(info->hIPSW, CURLOPT_WRITEDATA, pFileData);
-	curl_easy_setopt(info->hIPSW, CURLOPT_RANGE, sRange);
-	curl_easy_setopt(info->hIPSW, CURLOPT_HTTPGET, 1);
-	curl_easy_perform(info->hIPSW);
+	while(!fetch.failed && fetch.dataRecvd < file->compressedSize)
+	{
+		uint64_t before = fetch.localHeaderRecvd + fetch.dataRecvd;
+		sprintf(sRange, "%" PRIu64 "-%" PRIu64, start, end);
+		curl_easy_setopt(info->hIPSW, CURLOPT_RANGE, sRange);
+		curl_easy_perform(info->hIPSW);
 
-	if(file->method == 8)
+		if(fetch.localHeaderRecvd + fetch.dataRecvd == before)
+			break;
+
+		// a local extra field longer than the slack needs one more range
+		if(fetch.localHeaderRecvd == sizeof(partialzip_local_file_t))
+		{
+			start = file->offset + sizeof(partialzip_local_file_t) + fetch.localHeader.lenFileName + fetch.localHeader.lenExtra + fetch.dataRecvd;
+			end = start + (file->compressedSize - fetch.dataRecvd) - 1;
+			fetch.skip = 0;
+		}
+		else
+		{
+			start = file->offset + fetch.localHeaderRecvd;
+		}
+	}
+
+	if(fetch.inflating)
 	{
-		unsigned char* uncData = (unsigned char*) malloc(file->size);
-		z_stream strm;
-		strm.zalloc = Z_NULL;
-		strm.zfree = Z_NULL;
-		strm.opaque = Z_NULL;
-		strm.avail_in = 0;
-		strm.next_in = NULL;
-
-		inflateInit2(&strm, -MAX_WBITS);
-		strm.avail_in = file->compressedSize;
-		strm.next_in = fileData;
-		strm.avail_out = file->size;
-		strm.next_out = uncData;
-		inflate(&strm, Z_FINISH);
-		inflateEnd(&strm);
-		free(fileData);
-		fileData = uncData;
-	}
-	return fileData;
+		inflateEnd(&fetch.strm);
+		free(fetch.outBuf);
+	}
+
+	if(fetch.failed || fetch.dataRecvd < file->compressedSize)
+		return -1;
+
+	uint32_t crc = file->crc32;
+	FLIPENDIANLE(crc);
+	if(fetch.dataWritten != file->size || fetch.crc != crc)
+	{
+		printf("Corrupt data received from %s\n", info->url);
+		return -1;
+	}
+
+	return 0;
+}
+
+typedef struct {
+	unsigned char* data;
+	size_t size;
+} partialzip_buffer_t;
+
+static int writeBuffer(void* userData, const unsigned char* data, size_t size)
+{
+	partialzip_buffer_t* buffer = (partialzip_buffer_t*) userData;
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+	return 0;
+}
+
+unsigned char* partialzip_get_file(partialzip_t* info, partialzip_file_t* file)
+{
+	partialzip_buffer_t buffer;
+	buffer.size = 0;
+	buffer.data = (unsigned char*) malloc(file->size ? file->size : 1);
+	if(!buffer.data)
+		return NULL;
+
+	// the inflated data goes straight into place, no compressed copy is kept
+	if(partialzip_get_file_streaming(info, file, writeBuffer, &buffer) < 0)
+	{
+		free(buffer.data);
+		return NULL;
+	}
+
+	return buffer.data;
 }
 
 void partialzip_set_progress_callback(partialzip_t* info, partialzip_progress_callback_t progressCallback)
@@ -384,12 +831,12 @@ void partialzip_set_progress_callback(partialzip_t* info, partialzip_progress_ca
 
 void partialzip_close(partialzip_t* info)
 {
-	curl_easy_cleanup(info->hIPSW);
+	net_handle_release(info->hIPSW);
 	free(info->centralDirectory);
+	free(info->etag);
+	free(info->lastModified);
 	free(info->url);
 	free(info);
-
-	curl_global_cleanup();
 }
 
 
@@ -192,9 +192,12 @@ typedef struct {
 typedef struct partialzip_info partialzip_t;
 
 typedef void (*partialzip_progress_callback_t)(partialzip_t* info, partialzip_file_t* file, size_t progress);
+typedef int (*partialzip_write_callback_t)(void* userData, const unsigned char* data, size_t size);
 
 struct partialzip_info {
 	char* url;
+	char* etag;
+	char* lastModified;
 	uint64_t length;
 	CURL* hIPSW;
 	char* centralDirectory;
@@ -207,11 +210,15 @@ struct partialzip_info {
 
 
 partialzip_t* partialzip_open(const char* url);
+partialzip_t* partialzip_open_with_cache(const char* url, const char* cache_dir);
 partialzip_file_t* partialzip_find_file(partialzip_t* info, const char* fileName);
 partialzip_file_t* partialzip_list_files(partialzip_t* info);
 unsigned char* partialzip_get_file(partialzip_t* info, partialzip_file_t* file);
+int partialzip_get_file_streaming(partialzip_t* info, partialzip_file_t* file, partialzip_write_callback_t writeCallback, void* userData);
 void partialzip_close(partialzip_t* info);
 int partialzip_download_file(const char* url, const char* path, const char* output);
+int partialzip_download_file_cached(const char* url, const char* path, const char* output, const char* cache_dir);
+void partialzip_sessions_close(void);
 void partialzip_set_progress_callback(partialzip_t* info, partialzip_progress_callback_t progressCallback);
 void partialzip_free_file(partialzip_file_t* file);
 
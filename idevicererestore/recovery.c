@@ -34,6 +34,10 @@
 #include "img3.h"
 #include "restore.h"
 #include "recovery.h"
+#include "cache.h"
+#include "trace.h"
+#include "stage.h"
+#include "bandwidth.h"
 
 int recovery_progress_callback(irecv_client_t client, const irecv_event_t* event) {
 	if (event->type == IRECV_PROGRESS) {
@@ -257,7 +261,8 @@ int recovery_send_ticket(struct idevicerestore_client_t* client)
 
 int recovery_send_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component) {
 	unsigned int size = 0;
-	unsigned char* data = NULL;
+	const unsigned char* data = NULL;
+	struct component_segments segs;
 	char* path = NULL;
 	irecv_error_t err = 0;
 
@@ -267,7 +272,7 @@ int recovery_send_component(struct idevicerestore_client_t* client, plist_t buil
 		}
 	}
 	if (!path) {
-		if (build_identity_get_component_path(build_identity, component, &path) < 0) {
+		if (idevicerestore_get_component_path(client, build_identity, component, &path) < 0) {
 			error("ERROR: Unable to get path for component '%s'\n", component);
 			free(path);
 			return -1;
@@ -276,25 +281,55 @@ int recovery_send_component(struct idevicerestore_client_t* client, plist_t buil
 
 	unsigned char* component_data = NULL;
 	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, path, &component_data, &component_size);
-	free(path);
-	if (ret < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
-		return -1;
+	int component_mapped = 0;
+	int ret = 0;
+	/* bytes of the staged or extracted component charged to client->memory */
+	uint64_t charged = 0;
+	if (component_stage_take_segments(client->stage, component, path, &segs) == 0) {
+		free(path);
+		charged = segs.size;
+	} else {
+		if (idevicerestore_reserve_component(client, path, &charged) < 0) {
+			free(path);
+			return -1;
+		}
+		ret = extract_component_cached(client, build_identity, component, path, &component_data, &component_size, &component_mapped);
+		free(path);
+		if (ret < 0) {
+			budget_release(&client->memory, charged);
+			error("ERROR: Unable to extract component: %s\n", component);
+			return -1;
+		}
+
+		ret = personalize_component_segments(component, component_data, component_size, client->tss, &segs);
+		if (ret < 0) {
+			cache_release(component_data, component_size, component_mapped);
+			budget_release(&client->memory, charged);
+			error("ERROR: Unable to get personalized component: %s\n", component);
+			return -1;
+		}
 	}
 
-	ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-	free(component_data);
-	if (ret < 0) {
-		error("ERROR: Unable to get personalized component: %s\n", component);
+	/* only stitched components need a contiguous copy, the rest is sent from the source buffer */
+	data = component_segments_gather(&segs, &size);
+	if (!data) {
+		component_segments_free(&segs);
+		cache_release(component_data, component_size, component_mapped);
+		budget_release(&client->memory, charged);
 		return -1;
 	}
 
 	info("Sending %s (%d bytes)...\n", component, size);
 
 	// FIXME: Did I do this right????
-	err = irecv_send_buffer(client->recovery->client, data, size, 0);
-	free(data);
+	int slot = bandwidth_acquire(client->ecid, client->udid, size);
+	int span = trace_begin(client->trace, "recovery_send", component);
+	err = irecv_send_buffer(client->recovery->client, (unsigned char*)data, size, 0);
+	trace_end(client->trace, span, (err == IRECV_E_SUCCESS) ? size : 0, err);
+	bandwidth_release(slot);
+	component_segments_free(&segs);
+	cache_release(component_data, component_size, component_mapped);
+	budget_release(&client->memory, charged);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send %s component: %s\n", component, irecv_strerror(err));
 		return -1;
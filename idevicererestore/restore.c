@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <libimobiledevice/restore.h>
 #include <zip.h>
 #include <libirecovery.h>
@@ -38,6 +40,14 @@
 #include "restore.h"
 #include "common.h"
 #include "partial.h"
+#include "thread.h"
+#include "cache.h"
+#include "trace.h"
+#include "stage.h"
+#include "event.h"
+#include "bbfw.h"
+#include "bandwidth.h"
+#include "log.h"
 #include "globals.h"
 
 #define CREATE_PARTITION_MAP          11
@@ -85,12 +95,15 @@
 #define UPDATE_S3E_FIRMWARE           58
 #define UPDATE_SE_FIRMWARE            59
 
-plist_t build_identity2;
-plist_t buildmanifest2;
-
-static int restore_finished = 0;
-
-static int restore_device_connected = 0;
+/* all clients waiting for a restore mode device share one event handler
+ * and every event is offered to each of them */
+static thread_once_t restore_event_once = THREAD_ONCE_INIT;
+static mutex_t restore_event_lock;
+static mutex_t restore_event_subscribe_lock;
+static cond_t restore_event_cond;
+static int restore_event_busy = 0;
+static struct idevicerestore_client_t** restore_event_clients = NULL;
+static int restore_event_num_clients = 0;
 
 int restore_client_new(struct idevicerestore_client_t* client) {
 	struct restore_client_t* restore = (struct restore_client_t*) malloc(sizeof(struct restore_client_t));
@@ -122,11 +135,26 @@ void restore_client_free(struct idevicerestore_client_t* client) {
 			plist_free(client->restore->bbtss);
 			client->restore->bbtss = NULL;
 		}
+		if(client->restore->bbfw) {
+			bbfw_bundle_free(client->restore->bbfw);
+			client->restore->bbfw = NULL;
+		}
+		mutex_destroy(&client->restore->send_lock);
 		free(client->restore);
 		client->restore = NULL;
 	}
 }
 
+/* restored reads a length and then the plist, so replies sent from data
+ * request workers must not interleave with the ones sent by the loop */
+static restored_error_t restore_send_message(struct idevicerestore_client_t* client, restored_client_t restore, plist_t dict)
+{
+	mutex_lock(&client->restore->send_lock);
+	restored_error_t restore_error = restored_send(restore, dict);
+	mutex_unlock(&client->restore->send_lock);
+	return restore_error;
+}
+
 static int restore_idevice_new(struct idevicerestore_client_t* client, idevice_t* device)
 {
 	int num_devices = 0;
@@ -285,10 +313,14 @@ const char* restore_check_hardware_model(struct idevicerestore_client_t* client)
 void restore_device_callback(const idevice_event_t* event, void* userdata) {
 	struct idevicerestore_client_t* client = (struct idevicerestore_client_t*) userdata;
 	if (event->event == IDEVICE_DEVICE_ADD) {
-		restore_device_connected = 1;
+		if (client->restore) {
+			client->restore->device_connected = 1;
+		}
 		client->udid = strdup(event->udid);
 	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
-		restore_device_connected = 0;
+		if (client->restore) {
+			client->restore->device_connected = 0;
+		}
 		client->flags |= FLAG_QUIT;
 	}
 }
@@ -378,18 +410,132 @@ static int restore_is_current_device(struct idevicerestore_client_t* client, con
 
 static void restore_device_event_cb(const idevice_event_t *event, void *user_data)
 {
-	if (event->event == IDEVICE_DEVICE_ADD) {
-		struct idevicerestore_client_t* client = (struct idevicerestore_client_t*)user_data;
-		if (!restore_device_connected && restore_is_current_device(client, event->udid)) {
-			restore_device_connected = 1;
+	struct idevicerestore_client_t** candidates = NULL;
+	int num_candidates = 0;
+	int i;
+
+	(void)user_data;
+
+	if (event->event != IDEVICE_DEVICE_ADD) {
+		return;
+	}
+
+	// asking for the serial number connects to the device, the waiting
+	// clients are copied and the lock is not held while doing that
+	mutex_lock(&restore_event_lock);
+	if (restore_event_num_clients > 0) {
+		candidates = (struct idevicerestore_client_t**) malloc(restore_event_num_clients * sizeof(struct idevicerestore_client_t*));
+	}
+	if (candidates) {
+		for (i = 0; i < restore_event_num_clients; i++) {
+			if (!restore_event_clients[i]->restore->device_connected) {
+				candidates[num_candidates++] = restore_event_clients[i];
+			}
+		}
+	}
+	restore_event_busy++;
+	mutex_unlock(&restore_event_lock);
+
+	for (i = 0; i < num_candidates; i++) {
+		struct idevicerestore_client_t* client = candidates[i];
+		int claimed = 0;
+		if (!restore_is_current_device(client, event->udid)) {
+			continue;
+		}
+		mutex_lock(&restore_event_lock);
+		if (!client->restore->device_connected) {
 			client->udid = strdup(event->udid);
+			client->restore->device_connected = 1;
+			claimed = 1;
+		}
+		mutex_unlock(&restore_event_lock);
+		if (claimed) {
+			break;
+		}
+	}
+	free(candidates);
+
+	mutex_lock(&restore_event_lock);
+	restore_event_busy--;
+	cond_broadcast(&restore_event_cond);
+	mutex_unlock(&restore_event_lock);
+}
+
+static void restore_event_init(void)
+{
+	mutex_init(&restore_event_lock);
+	mutex_init(&restore_event_subscribe_lock);
+	cond_init(&restore_event_cond);
+}
+
+static int restore_event_add_client(struct idevicerestore_client_t* client)
+{
+	thread_once(&restore_event_once, restore_event_init);
+
+	mutex_lock(&restore_event_subscribe_lock);
+	mutex_lock(&restore_event_lock);
+	struct idevicerestore_client_t** clients = (struct idevicerestore_client_t**) realloc(restore_event_clients, (restore_event_num_clients + 1) * sizeof(struct idevicerestore_client_t*));
+	if (clients == NULL) {
+		mutex_unlock(&restore_event_lock);
+		mutex_unlock(&restore_event_subscribe_lock);
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	restore_event_clients = clients;
+	restore_event_clients[restore_event_num_clients++] = client;
+	int num_clients = restore_event_num_clients;
+	mutex_unlock(&restore_event_lock);
+
+	if (num_clients == 1 && device_event_add_handler(restore_device_event_cb, NULL) < 0) {
+		mutex_lock(&restore_event_lock);
+		restore_event_num_clients--;
+		mutex_unlock(&restore_event_lock);
+		mutex_unlock(&restore_event_subscribe_lock);
+		return -1;
+	}
+	mutex_unlock(&restore_event_subscribe_lock);
+
+	return 0;
+}
+
+static void restore_event_remove_client(struct idevicerestore_client_t* client)
+{
+	int i;
+
+	mutex_lock(&restore_event_subscribe_lock);
+	mutex_lock(&restore_event_lock);
+	for (i = 0; i < restore_event_num_clients; i++) {
+		if (restore_event_clients[i] == client) {
+			restore_event_clients[i] = restore_event_clients[--restore_event_num_clients];
+			break;
 		}
 	}
+	// the callback may still be asking this client's device
+	while (restore_event_busy > 0) {
+		cond_wait(&restore_event_cond, &restore_event_lock);
+	}
+	int num_clients = restore_event_num_clients;
+	mutex_unlock(&restore_event_lock);
+
+	// the event thread is joined on unsubscribe, so this must not be done
+	// while holding the lock the callback takes
+	if (num_clients == 0) {
+		device_event_remove_handler(restore_device_event_cb, NULL);
+	}
+	mutex_unlock(&restore_event_subscribe_lock);
+}
+
+static uint64_t restore_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* returns -2 if the device didn't show up in restore mode in time */
 int restore_open_with_timeout(struct idevicerestore_client_t* client) {
-	int i = 0;
-	int attempts = 180;
+	unsigned int timeout = 180;
+	unsigned int seen = 0;
 	char *type = NULL;
 	uint64_t version = 0;
 	idevice_t device = NULL;
@@ -415,27 +561,36 @@ int restore_open_with_timeout(struct idevicerestore_client_t* client) {
 			return -1;
 		}
 		memset(client->restore, '\0', sizeof(struct restore_client_t));
+		mutex_init(&client->restore->send_lock);
 	}
 
-	restore_device_connected = 0;
+	client->restore->device_connected = 0;
 
 	info("Waiting for device...\n");
-	idevice_event_subscribe(restore_device_event_cb, client);
-	i = 0;
-	while (i++ < attempts) {
-		debug("Attempt %d to connect to restore mode device...\n", i);
-		if (restore_device_connected) {
-			info("Device %s is now connected in restore mode...\n", client->udid);
+	if (restore_event_add_client(client) < 0) {
+		return -1;
+	}
+	// the event handler flips device_connected before the generation changes,
+	// events of other devices wake us up as well so the deadline is wall clock
+	seen = device_event_get_generation();
+	uint64_t start = restore_time_ms();
+	uint64_t deadline = start + (uint64_t)timeout * 1000;
+	while (!client->restore->device_connected) {
+		uint64_t now = restore_time_ms();
+		if (now >= deadline) {
 			break;
 		}
-		sleep(1);
+		if (device_event_wait(&seen, (deadline - now < 1000) ? (unsigned int)(deadline - now) : 1000) == 1) {
+			debug("Waited %u seconds for restore mode device...\n", (unsigned int)((restore_time_ms() - start) / 1000));
+		}
 	}
-	idevice_event_unsubscribe();
+	restore_event_remove_client(client);
 
-	if (!restore_device_connected) {
+	if (!client->restore->device_connected) {
 		error("ERROR: Unable to connect to device in restore mode\n");
-		return (i == attempts ? -2:-1);
+		return -2;
 	}
+	info("Device %s is now connected in restore mode...\n", client->udid);
 
 	info("Connecting now...\n");
 	device_error = idevice_new(&device, client->udid);
@@ -561,8 +716,6 @@ const char* restore_progress_string(unsigned int operation)
 	}
 }
 
-static int lastop = 0;
-
 int restore_handle_previous_restore_log_msg(restored_client_t client, plist_t msg) {
 	plist_t node = NULL;
 	char* restorelog = NULL;
@@ -608,7 +761,7 @@ int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t
 	}
 
 	if ((progress > 0) && (progress <= 100)) {
-		if ((int)operation != lastop) {
+		if ((int)operation != client->restore->last_operation) {
 			info("%s (%d)\n", restore_progress_string(adapted_operation), (int)operation);
 		}
 		switch (adapted_operation) {
@@ -629,12 +782,12 @@ int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t
 	} else {
 		info("%s (%d)\n", restore_progress_string(adapted_operation), (int)operation);
 	}
-	lastop = (int)operation;
+	client->restore->last_operation = (int)operation;
 
 	return 0;
 }
 
-int restore_handle_status_msg(restored_client_t client, plist_t msg) {
+int restore_handle_status_msg(struct idevicerestore_client_t* client, plist_t msg) {
 	int result = 0;
 	uint64_t value = 0;
 	char* log = NULL;
@@ -647,7 +800,7 @@ int restore_handle_status_msg(restored_client_t client, plist_t msg) {
 	switch(value) {
 		case 0:
 			info("Status: Restore Finished\n");
-			restore_finished = 1;
+			client->restore->finished = 1;
 			break;
 		case 0xFFFFFFFFFFFFFFFFLL:
 			info("Status: Verification Error\n");
@@ -747,25 +900,55 @@ static void restore_asr_progress_cb(double progress, void* userdata)
 	}
 }
 
-int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, const char* filesystem) {
+int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, plist_t build_identity, const char* filesystem) {
 	asr_client_t asr = NULL;
+	ipsw_file_handle_t file = NULL;
 
 	info("About to send filesystem...\n");
 
+	if (filesystem) {
+		file = ipsw_file_open_local(filesystem);
+	} else {
+		// no extracted copy, read the filesystem straight out of the IPSW
+		char* fsname = NULL;
+		if (idevicerestore_get_component_path(client, build_identity, "OS", &fsname) < 0) {
+			error("ERROR: Unable get path for filesystem component\n");
+			return -1;
+		}
+		info("Streaming filesystem %s from IPSW\n", fsname);
+		file = ipsw_file_open(client->archive, fsname);
+		free(fsname);
+	}
+	if (file == NULL) {
+		error("ERROR: Unable to open filesystem image\n");
+		return -1;
+	}
+
 	if (asr_open_with_timeout(device, &asr) < 0) {
 		error("ERROR: Unable to connect to ASR\n");
+		ipsw_file_close(file);
 		return -1;
 	}
 	info("Connected to ASR\n");
 
+	// validation and payload stream the whole filesystem, hold the slot for both
+	// but not while the device is still bringing up ASR
+	int slot = bandwidth_acquire(client->ecid, client->udid, ipsw_file_size(file));
+
 	asr_set_progress_callback(asr, restore_asr_progress_cb, (void*)client);
+	asr_set_ring_depth(asr, client->asr_ring_depth);
 
 	// this step sends requested chunks of data from various offsets to asr so
 	// it can validate the filesystem before installing it
 	info("Validating the filesystem\n");
-	if (asr_perform_validation(asr, filesystem) < 0) {
+	int span = trace_begin(client->trace, "asr_validation", NULL);
+	int res = asr_perform_validation(asr, file);
+	trace_end(client->trace, span, asr->oob_bytes, res);
+	if (res < 0) {
 		error("ERROR: ASR was unable to validate the filesystem\n");
 		asr_free(asr);
+		bandwidth_release(slot);
+		ipsw_file_close(file);
 		return -1;
 	}
 	info("Filesystem validated\n");
@@ -773,14 +956,21 @@ int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t de
 	// once the target filesystem has been validated, ASR then requests the
 	// entire filesystem to be sent.
 	info("Sending filesystem now...\n");
-	if (asr_send_payload(asr, filesystem) < 0) {
+	span = trace_begin(client->trace, "asr_payload", NULL);
+	res = asr_send_payload(asr, file);
+	trace_end(client->trace, span, (res < 0) ? 0 : ipsw_file_size(file), res);
+	if (res < 0) {
 		error("ERROR: Unable to send payload to ASR\n");
 		asr_free(asr);
+		bandwidth_release(slot);
+		ipsw_file_close(file);
 		return -1;
 	}
 	info("Done sending filesystem\n");
 
 	asr_free(asr);
+	bandwidth_release(slot);
+	ipsw_file_close(file);
 	return 0;
 }
 
@@ -818,7 +1008,7 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 	}
 
 	info("Sending RootTicket now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send RootTicket (%d)\n", restore_error);
 		plist_free(dict);
@@ -833,7 +1023,8 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 
 int restore_send_kernelcache(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity) {
 	unsigned int size = 0;
-	unsigned char* data = NULL;
+	const unsigned char* data = NULL;
+	struct component_segments segs;
 	char* path = NULL;
 	plist_t blob = NULL;
 	plist_t dict = NULL;
@@ -847,7 +1038,7 @@ int restore_send_kernelcache(restored_client_t restore, struct idevicerestore_cl
 		}
 	}
 	if (!path) {
-		if (build_identity_get_component_path(build_identity, "KernelCache", &path) < 0) {
+		if (idevicerestore_get_component_path(client, build_identity, "KernelCache", &path) < 0) {
 			error("ERROR: Unable to find kernelcache path\n");
 			return -1;
 		}
@@ -856,30 +1047,66 @@ int restore_send_kernelcache(restored_client_t restore, struct idevicerestore_cl
 	const char* component = "KernelCache";
 	unsigned char* component_data = NULL;
 	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, path, &component_data, &component_size);
-	free(path);
-	path = NULL;
-	if (ret < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
-		return -1;
+	int component_mapped = 0;
+	uint64_t charged = 0;
+	/* what stays charged for the staged or extracted source */
+	uint64_t source = 0;
+	int ret = 0;
+	if (component_stage_take_segments(client->stage, component, path, &segs) == 0) {
+		free(path);
+		path = NULL;
+		charged = segs.size;
+		source = charged;
+	} else {
+		if (idevicerestore_reserve_component(client, path, &charged) < 0) {
+			free(path);
+			return -1;
+		}
+		ret = extract_component_cached(client, build_identity, component, path, &component_data, &component_size, &component_mapped);
+		free(path);
+		path = NULL;
+		if (ret < 0) {
+			budget_release(&client->memory, charged);
+			error("ERROR: Unable to extract component: %s\n", component);
+			return -1;
+		}
+
+		ret = personalize_component_segments(component, component_data, component_size, client->tss, &segs);
+		if (ret < 0) {
+			cache_release(component_data, component_size, component_mapped);
+			budget_release(&client->memory, charged);
+			error("ERROR: Unable to get personalized component: %s\n", component);
+			return -1;
+		}
+		source = (component_mapped) ? 0 : component_size;
 	}
 
-	ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-	free(component_data);
+	/* plist_new_data() copies anyway, so unstitched kernelcaches go in straight from the source buffer;
+	 * room for the stitched copy, if any, and the one in the plist is taken before either exists */
+	uint64_t copies = (segs.count > 1) ? 2 * (uint64_t)segs.size : segs.size;
+	if (idevicerestore_reserve_memory(client, &charged, source + copies, component) == 0) {
+		data = component_segments_gather(&segs, &size);
+	}
+	if (data) {
+		dict = plist_new_dict();
+		blob = plist_new_data((const char*)data, size);
+		plist_dict_set_item(dict, "KernelCacheFile", blob);
+	}
+	component_segments_free(&segs);
+	cache_release(component_data, component_size, component_mapped);
 	component_data = NULL;
-	if (ret < 0) {
+	budget_release(&client->memory, charged - ((dict) ? size : 0));
+	if (!dict) {
 		error("ERROR: Unable to get personalized component: %s\n", component);
 		return -1;
 	}
 
-	dict = plist_new_dict();
-	blob = plist_new_data((char*)data, size);
-	plist_dict_set_item(dict, "KernelCacheFile", blob);
-	free(data);
-
 	info("Sending KernelCache now...\n");
-	restore_error = restored_send(restore, dict);
+	int span = trace_begin(client->trace, "restore_send", component);
+	restore_error = restore_send_message(client, restore, dict);
+	trace_end(client->trace, span, (restore_error == RESTORE_E_SUCCESS) ? size : 0, restore_error);
 	plist_free(dict);
+	budget_release(&client->memory, size);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send kernelcache data\n");
 		return -1;
@@ -889,6 +1116,228 @@ int restore_send_kernelcache(restored_client_t restore, struct idevicerestore_cl
 	return 0;
 }
 
+/* NOR images are personalized by a few workers while the array is
+ * assembled in manifest order; a worker never gets more than
+ * NOR_WORKER_WINDOW entries ahead of the assembly so memory stays bounded */
+#define NOR_WORKERS 4
+#define NOR_WORKER_WINDOW (2 * NOR_WORKERS)
+
+enum {
+	NOR_PENDING = 0,
+	NOR_READY,
+	NOR_FAILED
+};
+
+struct nor_image {
+	const char* component;
+	char* path;
+	int first;
+	unsigned char* data;
+	unsigned int size;
+	int state;
+};
+
+struct nor_pool {
+	struct idevicerestore_client_t* client;
+	plist_t build_identity;
+	struct nor_image* images;
+	int num_images;
+	int next;
+	int assembled;
+	int failed;
+	mutex_t lock;
+	cond_t cond;
+};
+
+static int restore_prepare_nor_image(struct idevicerestore_client_t* client, plist_t build_identity, struct nor_image* image)
+{
+	unsigned char* component_data = NULL;
+	unsigned int component_size = 0;
+	int component_mapped = 0;
+
+	if (component_stage_take(client->stage, image->component, image->path, &image->data, &image->size) == 0) {
+		return 0;
+	}
+
+	uint64_t charged = 0;
+	if (idevicerestore_reserve_component(client, image->path, &charged) < 0) {
+		return -1;
+	}
+	if (extract_component_cached(client, build_identity, image->component, image->path, &component_data, &component_size, &component_mapped) < 0) {
+		budget_release(&client->memory, charged);
+		error("ERROR: Unable to extract component: %s\n", image->component);
+		return -1;
+	}
+
+	int ret = personalize_component(image->component, component_data, component_size, client->tss, &image->data, &image->size);
+	cache_release(component_data, component_size, component_mapped);
+	if (ret < 0) {
+		budget_release(&client->memory, charged);
+		error("ERROR: Unable to get personalized component: %s\n", image->component);
+		return -1;
+	}
+	// charged like staged data until it's freed
+	if (idevicerestore_reserve_memory(client, &charged, image->size, image->component) < 0) {
+		budget_release(&client->memory, charged);
+		free(image->data);
+		image->data = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void* restore_nor_worker(void* arg)
+{
+	struct nor_pool* pool = (struct nor_pool*)arg;
+
+	mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->failed && pool->next < pool->num_images && pool->next >= pool->assembled + NOR_WORKER_WINDOW) {
+			cond_wait(&pool->cond, &pool->lock);
+		}
+		if (pool->failed || pool->next >= pool->num_images) {
+			break;
+		}
+		struct nor_image* image = &pool->images[pool->next++];
+		mutex_unlock(&pool->lock);
+
+		int ret = restore_prepare_nor_image(pool->client, pool->build_identity, image);
+
+		mutex_lock(&pool->lock);
+		image->state = (ret == 0) ? NOR_READY : NOR_FAILED;
+		if (ret < 0) {
+			pool->failed = 1;
+		}
+		cond_broadcast(&pool->cond);
+	}
+	mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* plist_bytes receives the size of the copies added to norimage_array,
+ * which stay charged to the client until the array is freed */
+static int restore_build_nor_images(struct idevicerestore_client_t* client, plist_t build_identity, plist_t firmware_files, plist_t norimage_array, uint64_t* plist_bytes)
+{
+	struct nor_pool pool;
+	thread_t workers[NOR_WORKERS];
+	int num_workers = 0;
+	int res = 0;
+	uint32_t i;
+
+	memset(&pool, '\0', sizeof(struct nor_pool));
+	pool.client = client;
+	pool.build_identity = build_identity;
+	pool.images = (struct nor_image*)calloc(plist_array_get_size(firmware_files) + 1, sizeof(struct nor_image));
+	if (!pool.images) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < plist_array_get_size(firmware_files); i++) {
+		plist_t pcomp = plist_array_get_item(firmware_files, i);
+		char *comppath = NULL;
+
+		plist_get_string_val(pcomp, &comppath);
+		if (!comppath) continue;
+
+		const char* filename = strrchr(comppath, '/');
+		if (!filename) {
+			free(comppath);
+			continue;
+		}
+		filename++;
+
+		const char* component = get_component_name(filename);
+		if (!strcmp(component, "LLB") || !strcmp(component, "RestoreSEP")) {
+			// skip LLB, it's already passed in LlbImageData
+			// skip RestoreSEP, it's passed in RestoreSEPImageData
+			free(comppath);
+			continue;
+		}
+
+		pool.images[pool.num_images].component = component;
+		pool.images[pool.num_images].path = comppath;
+		pool.images[pool.num_images].first = !strncmp("iBoot", filename, 4);
+		pool.num_images++;
+	}
+
+	mutex_init(&pool.lock);
+	cond_init(&pool.cond);
+	while (num_workers < NOR_WORKERS && num_workers < pool.num_images) {
+		if (thread_new(&workers[num_workers], restore_nor_worker, &pool) != 0) {
+			break;
+		}
+		num_workers++;
+	}
+	for (i = 0; i < (uint32_t)pool.num_images; i++) {
+		struct nor_image* image = &pool.images[i];
+
+		if (num_workers == 0) {
+			// no threads, so personalize each image on this one as it's assembled,
+			// the window would never move for a worker running here
+			image->state = (restore_prepare_nor_image(client, build_identity, image) == 0) ? NOR_READY : NOR_FAILED;
+		}
+
+		mutex_lock(&pool.lock);
+		while (image->state == NOR_PENDING && !pool.failed) {
+			cond_wait(&pool.cond, &pool.lock);
+		}
+		int ready = (image->state == NOR_READY);
+		if (ready) {
+			pool.assembled++;
+			cond_broadcast(&pool.cond);
+		}
+		mutex_unlock(&pool.lock);
+		if (!ready) {
+			res = -1;
+			break;
+		}
+
+		uint64_t copy = 0;
+		if (idevicerestore_reserve_memory(client, &copy, image->size, image->component) < 0) {
+			res = -1;
+			break;
+		}
+		*plist_bytes += image->size;
+		/* make sure iBoot is the first entry in the array */
+		if (image->first) {
+			plist_array_insert_item(norimage_array, plist_new_data((char*)image->data, (uint64_t)image->size), 0);
+		} else {
+			plist_array_append_item(norimage_array, plist_new_data((char*)image->data, (uint64_t)image->size));
+		}
+		free(image->data);
+		image->data = NULL;
+		budget_release(&client->memory, image->size);
+	}
+
+	mutex_lock(&pool.lock);
+	if (res < 0) {
+		pool.failed = 1;
+	}
+	cond_broadcast(&pool.cond);
+	mutex_unlock(&pool.lock);
+	while (num_workers > 0) {
+		num_workers--;
+		thread_join(workers[num_workers]);
+		thread_free(workers[num_workers]);
+	}
+
+	for (i = 0; i < (uint32_t)pool.num_images; i++) {
+		free(pool.images[i].path);
+		if (pool.images[i].data) {
+			free(pool.images[i].data);
+			budget_release(&client->memory, pool.images[i].size);
+		}
+	}
+	free(pool.images);
+	cond_destroy(&pool.cond);
+	mutex_destroy(&pool.lock);
+
+	return res;
+}
+
 int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity) {
 	char* llb_path = NULL;
 	char* llb_filename = NULL;
@@ -902,12 +1351,11 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	unsigned int llb_size = 0;
 	unsigned char* llb_data = NULL;
 	plist_t dict = NULL;
+	/* copies in dict charged to the client */
+	uint64_t dict_bytes = 0;
 	char* filename = NULL;
-	unsigned int nor_size = 0;
-	unsigned char* nor_data = NULL;
 	plist_t norimage_array = NULL;
 	plist_t firmware_files = NULL;
-	uint32_t i;
 
 	info("About to send NORData...\n");
 
@@ -917,7 +1365,7 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 		}
 	}
 	if (llb_path == NULL) {
-		if (build_identity_get_component_path(build_identity, "LLB", &llb_path) < 0) {
+		if (idevicerestore_get_component_path(client, build_identity, "LLB", &llb_path) < 0) {
 			error("ERROR: Unable to get component path for LLB\n");
 			return -1;
 		}
@@ -938,7 +1386,7 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	snprintf(manifest_file, sizeof(manifest_file), "%s/manifest", firmware_path);
 
 	firmware_files = plist_new_array();
-	ipsw_extract_to_memory(client->ipsw, manifest_file, &manifest_data, &manifest_size);
+	ipsw_archive_extract_to_memory(client->archive, manifest_file, &manifest_data, &manifest_size);
 	if (manifest_data && manifest_size > 0) {
 		info("Getting firmware manifest from %s\n", manifest_file);
 		char *manifest_p = (char*)manifest_data;
@@ -989,81 +1437,67 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	const char* component = "LLB";
 	unsigned char* component_data = NULL;
 	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, llb_path, &component_data, &component_size);
-	free(llb_path);
-	if (ret < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
-		return -1;
-	}
-
-	ret = personalize_component(component, component_data, component_size, client->tss, &llb_data, &llb_size);
-	free(component_data);
-	component_data = NULL;
-	component_size = 0;
-	if (ret < 0) {
-		error("ERROR: Unable to get personalized component: %s\n", component);
-		return -1;
-	}
-
-	dict = plist_new_dict();
-	plist_dict_set_item(dict, "LlbImageData", plist_new_data((char*)llb_data, (uint64_t) llb_size));
-	free(llb_data);
-
-	norimage_array = plist_new_array();
-
-	for (i = 0; i < plist_array_get_size(firmware_files); i++) {
-		plist_t pcomp = plist_array_get_item(firmware_files, i);
-		char *comppath = NULL;
-
-		plist_get_string_val(pcomp, &comppath);
-		if (!comppath) continue;
-
-		filename = strrchr(comppath, '/');
-		if (!filename) {
-			free(comppath);
-			continue;
-		}
-		filename++;
-
-		component = get_component_name(filename);
-		if (!strcmp(component, "LLB") || !strcmp(component, "RestoreSEP")) {
-			// skip LLB, it's already passed in LlbImageData
-			// skip RestoreSEP, it's passed in RestoreSEPImageData
-			free(comppath);
-			continue;
+	int component_mapped = 0;
+	int ret = 0;
+	if (component_stage_take(client->stage, component, llb_path, &llb_data, &llb_size) == 0) {
+		free(llb_path);
+	} else {
+		uint64_t charged = 0;
+		if (idevicerestore_reserve_component(client, llb_path, &charged) < 0) {
+			free(llb_path);
+			plist_free(firmware_files);
+			return -1;
 		}
-
-		component_data = NULL;
-		unsigned int component_size = 0;
-
-		if (extract_component(client->ipsw, comppath, &component_data, &component_size) < 0) {
-			free(comppath);
+		ret = extract_component_cached(client, build_identity, component, llb_path, &component_data, &component_size, &component_mapped);
+		free(llb_path);
+		if (ret < 0) {
+			budget_release(&client->memory, charged);
 			plist_free(firmware_files);
 			error("ERROR: Unable to extract component: %s\n", component);
 			return -1;
 		}
-		free(comppath);
 
-		if (personalize_component(component, component_data, component_size, client->tss, &nor_data, &nor_size) < 0) {
-			free(component_data);
+		ret = personalize_component(component, component_data, component_size, client->tss, &llb_data, &llb_size);
+		cache_release(component_data, component_size, component_mapped);
+		component_data = NULL;
+		component_size = 0;
+		if (ret < 0) {
+			budget_release(&client->memory, charged);
 			plist_free(firmware_files);
 			error("ERROR: Unable to get personalized component: %s\n", component);
 			return -1;
 		}
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
-
-		/* make sure iBoot is the first entry in the array */
-		if (!strncmp("iBoot", filename, 4)) {
-			plist_array_insert_item(norimage_array, plist_new_data((char*)nor_data, (uint64_t)nor_size), 0);
-		} else {
-			plist_array_append_item(norimage_array, plist_new_data((char*)nor_data, (uint64_t)nor_size));
+		// what is left is the personalized LLB
+		if (idevicerestore_reserve_memory(client, &charged, llb_size, component) < 0) {
+			budget_release(&client->memory, charged);
+			free(llb_data);
+			plist_free(firmware_files);
+			return -1;
 		}
+	}
+
+	// the staged or personalized LLB is swapped for its plist copy
+	uint64_t llb_copy = 0;
+	if (idevicerestore_reserve_memory(client, &llb_copy, llb_size, component) < 0) {
+		free(llb_data);
+		budget_release(&client->memory, llb_size);
+		plist_free(firmware_files);
+		return -1;
+	}
+	dict = plist_new_dict();
+	plist_dict_set_item(dict, "LlbImageData", plist_new_data((char*)llb_data, (uint64_t) llb_size));
+	free(llb_data);
+	budget_release(&client->memory, llb_size);
+	dict_bytes = llb_copy;
+
+	norimage_array = plist_new_array();
 
-		free(nor_data);
-		nor_data = NULL;
-		nor_size = 0;
+	if (restore_build_nor_images(client, build_identity, firmware_files, norimage_array, &dict_bytes) < 0) {
+		plist_free(norimage_array);
+		plist_free(firmware_files);
+		plist_free(dict);
+		budget_release(&client->memory, dict_bytes);
+		return -1;
 	}
 	plist_free(firmware_files);
 	plist_dict_set_item(dict, "NorImageData", norimage_array);
@@ -1071,13 +1505,22 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	unsigned char* personalized_data = NULL;
 	unsigned int personalized_size = 0;
 
-	if (!build_identity_has_component(build_identity, "RestoreSEP") &&
-	    build_identity_get_component_path(build_identity, "RestoreSEP", &restore_sep_path) == 0) {
+	if (!idevicerestore_has_component(client, build_identity, "RestoreSEP") &&
+	    idevicerestore_get_component_path(client, build_identity, "RestoreSEP", &restore_sep_path) == 0) {
 		component = "RestoreSEP";
-		ret = extract_component(client->ipsw, restore_sep_path, &component_data, &component_size);
+		uint64_t charged = 0;
+		if (idevicerestore_reserve_component(client, restore_sep_path, &charged) < 0) {
+			free(restore_sep_path);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes);
+			return -1;
+		}
+		ret = extract_component(client->archive, restore_sep_path, &component_data, &component_size);
 		free(restore_sep_path);
 		if (ret < 0) {
 			error("ERROR: Unable to extract component: %s\n", component);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes + charged);
 			return -1;
 		}
 
@@ -1087,22 +1530,42 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 		component_size = 0;
 		if (ret < 0) {
 			error("ERROR: Unable to get personalized component: %s\n", component);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes + charged);
 			return -1;
 		}
 
+		// the personalized copy and the one in the plist
+		if (idevicerestore_reserve_memory(client, &charged, 2 * (uint64_t)personalized_size, component) < 0) {
+			free(personalized_data);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes + charged);
+			return -1;
+		}
+		dict_bytes += personalized_size;
 		plist_dict_set_item(dict, "RestoreSEPImageData", plist_new_data((char*)personalized_data, (uint64_t) personalized_size));
 		free(personalized_data);
+		budget_release(&client->memory, charged - personalized_size);
 		personalized_data = NULL;
 		personalized_size = 0;
 	}
 
-	if (!build_identity_has_component(build_identity, "SEP") &&
-	    build_identity_get_component_path(build_identity, "SEP", &sep_path) == 0) {
+	if (!idevicerestore_has_component(client, build_identity, "SEP") &&
+	    idevicerestore_get_component_path(client, build_identity, "SEP", &sep_path) == 0) {
 		component = "SEP";
-		ret = extract_component(client->ipsw, sep_path, &component_data, &component_size);
+		uint64_t charged = 0;
+		if (idevicerestore_reserve_component(client, sep_path, &charged) < 0) {
+			free(sep_path);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes);
+			return -1;
+		}
+		ret = extract_component(client->archive, sep_path, &component_data, &component_size);
 		free(sep_path);
 		if (ret < 0) {
 			error("ERROR: Unable to extract component: %s\n", component);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes + charged);
 			return -1;
 		}
 
@@ -1112,11 +1575,22 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 		component_size = 0;
 		if (ret < 0) {
 			error("ERROR: Unable to get personalized component: %s\n", component);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes + charged);
 			return -1;
 		}
 
+		// the personalized copy and the one in the plist
+		if (idevicerestore_reserve_memory(client, &charged, 2 * (uint64_t)personalized_size, component) < 0) {
+			free(personalized_data);
+			plist_free(dict);
+			budget_release(&client->memory, dict_bytes + charged);
+			return -1;
+		}
+		dict_bytes += personalized_size;
 		plist_dict_set_item(dict, "SEPImageData", plist_new_data((char*)personalized_data, (uint64_t) personalized_size));
 		free(personalized_data);
+		budget_release(&client->memory, charged - personalized_size);
 		personalized_data = NULL;
 		personalized_size = 0;
 	}
@@ -1125,14 +1599,16 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 		debug_plist(dict);
 
 	info("Sending NORData now...\n");
-	if (restored_send(restore, dict) != RESTORE_E_SUCCESS) {
+	if (restore_send_message(client, restore, dict) != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send NORImageData data\n");
 		plist_free(dict);
+		budget_release(&client->memory, dict_bytes);
 		return -1;
 	}
 
 	info("Done sending NORData\n");
 	plist_free(dict);
+	budget_release(&client->memory, dict_bytes);
 	return 0;
 }
 
@@ -1171,11 +1647,52 @@ static const char* restore_get_bbfw_fn_for_element(const char* elem)
 	return NULL;
 }
 
-static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned char* bb_nonce)
+static int restore_sign_bbfw_entry(bbfw_entry* entry, int is_fls, const unsigned char* blob, unsigned int blob_size)
 {
 	int res = -1;
-    
-
+	mbn_file* mbn = NULL;
+	fls_file* fls = NULL;
+
+	// restored asks for BasebandData more than once with the same ticket
+	if (bbfw_entry_is_signed_with(entry, blob, blob_size)) {
+		return 0;
+	}
+
+	if (is_fls) {
+		fls = fls_parse(entry->data, entry->size);
+		if (!fls) {
+			error("ERROR: could not parse fls file\n");
+			return -1;
+		}
+		if (fls_update_sig_blob(fls, blob, blob_size) != 0) {
+			error("ERROR: could not sign %s\n", entry->name);
+			goto leave;
+		}
+		res = bbfw_entry_set_signed(entry, fls->data, fls->size, blob, blob_size);
+	} else {
+		mbn = mbn_parse(entry->data, entry->size);
+		if (!mbn) {
+			error("ERROR: could not parse mbn file\n");
+			return -1;
+		}
+		if (mbn_update_sig_blob(mbn, blob, blob_size) != 0) {
+			error("ERROR: could not sign %s\n", entry->name);
+			goto leave;
+		}
+		res = bbfw_entry_set_signed(entry, mbn->data, mbn->size, blob, blob_size);
+	}
+
+leave:
+	mbn_free(mbn);
+	fls_free(fls);
+
+	return res;
+}
+
+static int restore_sign_bbfw(bbfw_bundle* bundle, plist_t bbtss, const unsigned char* bb_nonce, unsigned char** bbfw_data, size_t* bbfw_size)
+{
+	int res = -1;
+
 	// check for BBTicket in result
 	plist_t bbticket = plist_dict_get_item(bbtss, "BBTicket");
 	if (!bbticket || plist_get_node_type(bbticket) != PLIST_DATA) {
@@ -1189,23 +1706,19 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 		return -1;
 	}
 
-	unsigned char* buffer = NULL;
 	unsigned char* blob = NULL;
-	unsigned char* fdata = NULL;
-	off_t fsize = 0;
+	unsigned char* ticket = NULL;
 	uint64_t blob_size = 0;
-	int zerr = 0;
-	int zindex = -1;
-	struct zip_stat zstat;
-	struct zip_file* zfile = NULL;
-	struct zip* za = NULL;
-	struct zip_source* zs = NULL;
-	mbn_file* mbn = NULL;
+	uint64_t ticket_size = 0;
+	unsigned char* ticketed = NULL;
+	unsigned int ticketed_size = 0;
 	fls_file* fls = NULL;
+	int i;
 
-	za = zip_open(bbfwtmp, 0, &zerr);
-	if (!za) {
-		error("ERROR: Could not open ZIP archive '%s': %d\n", bbfwtmp, zerr);
+	char* is_signed = (char*)calloc(bundle->num_entries + 1, 1);
+	bbfw_output* files = (bbfw_output*)calloc(bundle->num_entries + 1, sizeof(bbfw_output));
+	if (!is_signed || !files) {
+		error("ERROR: Out of memory\n");
 		goto leave;
 	}
 
@@ -1213,12 +1726,10 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 	plist_dict_new_iter(bbfw_dict, &iter);
 	if (!iter) {
 		error("ERROR: Could not create dict iter for BasebandFirmware Dictionary\n");
-		return -1;
+		goto leave;
 	}
 
 	int is_fls = 0;
-	int signed_file_idxs[16];
-	int signed_file_count = 0;
 	char* key = NULL;
 	plist_t node = NULL;
 	while (1) {
@@ -1231,6 +1742,8 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 			const char* signfn = restore_get_bbfw_fn_for_element(key);
 			if (!signfn) {
 				error("ERROR: can't match element name '%s' to baseband firmware file name.\n", key);
+				free(key);
+				free(iter);
 				goto leave;
 			}
 			char* ext = strrchr(signfn, '.');
@@ -1238,277 +1751,317 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 				is_fls = 1;
 			}
 
-			zindex = zip_name_locate(za, signfn, 0);
+			int zindex = bbfw_bundle_locate(bundle, signfn);
 			if (zindex < 0) {
-				error("ERROR: can't locate '%s' in '%s'\n", signfn, bbfwtmp);
-				goto leave;
-			}
-
-			zip_stat_init(&zstat);
-			if (zip_stat_index(za, zindex, 0, &zstat) != 0) {
-				error("ERROR: zip_stat_index failed for index %d\n", zindex);
+				error("ERROR: can't locate '%s' in baseband firmware\n", signfn);
+				free(key);
+				free(iter);
 				goto leave;
 			}
 
-			zfile = zip_fopen_index(za, zindex, 0);
-			if (zfile == NULL) {
-				error("ERROR: zip_fopen_index failed for index %d\n", zindex);
-				goto leave;
-			}
-
-			buffer = (unsigned char*) malloc(zstat.size + 1);
-			if (buffer == NULL) {
-				error("ERROR: Out of memory\n");
-				goto leave;
-			}
-
-			if (zip_fread(zfile, buffer, zstat.size) != zstat.size) {
-				error("ERROR: zip_fread: failed\n");
-				goto leave;
-			}
-			buffer[zstat.size] = '\0';
-
-			zip_fclose(zfile);
-			zfile = NULL;
-
-			if (is_fls) {
-				fls = fls_parse(buffer, zstat.size);
-				if (!fls) {
-					error("ERROR: could not parse fls file\n");
-					goto leave;
-				}
-			} else {
-				mbn = mbn_parse(buffer, zstat.size);
-				if (!mbn) {
-					error("ERROR: could not parse mbn file\n");
-					goto leave;
-				}
-			}
-			free(buffer);
-			buffer = NULL;
-
 			blob = NULL;
 			blob_size = 0;
 			plist_get_data_val(node, (char**)&blob, &blob_size);
 			if (!blob) {
 				error("ERROR: could not get %s-Blob data\n", key);
+				free(key);
+				free(iter);
 				goto leave;
 			}
 
-			if (is_fls) {
-				if (fls_update_sig_blob(fls, blob, (unsigned int)blob_size) != 0) {
-					error("ERROR: could not sign %s\n", signfn);
-					goto leave;
-				}
-			} else {
-				if (mbn_update_sig_blob(mbn, blob, (unsigned int)blob_size) != 0) {
-					error("ERROR: could not sign %s\n", signfn);
-					goto leave;
-				}
+			if (restore_sign_bbfw_entry(&bundle->entries[zindex], is_fls, blob, (unsigned int)blob_size) < 0) {
+				free(key);
+				free(iter);
+				goto leave;
 			}
 			free(blob);
 			blob = NULL;
 
-			fsize = (is_fls ? fls->size : mbn->size);
-			fdata = (unsigned char*)malloc(fsize);
-			if (fdata == NULL)  {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			if (is_fls) {
-				memcpy(fdata, fls->data, fsize);
-				fls_free(fls);
-				fls = NULL;
-			} else {
-				memcpy(fdata, mbn->data, fsize);
-				mbn_free(mbn);
-				mbn = NULL;
-			}
+			is_signed[zindex] = 1;
+		}
+		free(key);
+	}
+	free(iter);
 
-			zs = zip_source_buffer(za, fdata, fsize, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				free(fdata);
+	if (bb_nonce) {
+		ticket = NULL;
+		ticket_size = 0;
+		plist_get_data_val(bbticket, (char**)&ticket, &ticket_size);
+		if (!ticket) {
+			error("ERROR: could not get BBTicket data\n");
+			goto leave;
+		}
+
+		if (is_fls) {
+			// add BBTicket to file ebl.fls
+			int zindex = bbfw_bundle_locate(bundle, "ebl.fls");
+			if (zindex < 0) {
+				error("ERROR: can't locate 'ebl.fls' in baseband firmware\n");
 				goto leave;
 			}
 
-			if (zip_replace(za, zindex, zs) == -1) {
-				error("ERROR: could not update signed '%s' in archive\n", signfn);
+			unsigned int ebl_size = 0;
+			const unsigned char* ebl_data = bbfw_entry_get_data(&bundle->entries[zindex], &ebl_size);
+			fls = fls_parse((unsigned char*)ebl_data, ebl_size);
+			if (!fls) {
+				error("ERROR: could not parse fls file\n");
 				goto leave;
 			}
 
-			if (is_fls && !bb_nonce) {
-				if (strcmp(key, "RamPSI") == 0) {
-					signed_file_idxs[signed_file_count++] = zindex;
-				}
-			} else {
-				signed_file_idxs[signed_file_count++] = zindex;
+			if (fls_insert_ticket(fls, ticket, (unsigned int)ticket_size) != 0) {
+				error("ERROR: could not insert BBTicket to ebl.fls\n");
+				goto leave;
 			}
+			ticketed = (unsigned char*)fls->data;
+			ticketed_size = fls->size;
 		}
-		free(key);
 	}
-	free(iter);
 
-	// remove everything but required files
-	int i, j, keep, numf = zip_get_num_files(za);
-	for (i = 0; i < numf; i++) {
-		keep = 0;
-		// check for signed file index
-		for (j = 0; j < signed_file_count; j++) {
-			if (i == signed_file_idxs[j]) {
+	// with a nonce only the signed images and other firmware files go to the device
+	int num_files = 0;
+	for (i = 0; i < bundle->num_entries; i++) {
+		bbfw_entry* entry = &bundle->entries[i];
+		int keep = (!bb_nonce || is_signed[i]);
+		if (!keep) {
+			char* ext = strrchr(entry->name, '.');
+			if (ext && (!strcmp(ext, ".fls") || !strcmp(ext, ".mbn") || !strcmp(ext, ".elf") || !strcmp(ext, ".bin"))) {
 				keep = 1;
-				break;
 			}
 		}
-		// check for anything but .mbn and .fls if bb_nonce is set
-		if (bb_nonce && !keep) {
-			const char* fn = zip_get_name(za, i, 0);
-			if (fn) {
-				char* ext = strrchr(fn, '.');
-				if (ext && (!strcmp(ext, ".fls") || !strcmp(ext, ".mbn") || !strcmp(ext, ".elf") || !strcmp(ext, ".bin"))) {
-                    //printf("keeping %s\n", fn);
-					keep = 1;
-				}
-			}
+		if (!keep) {
+			continue;
 		}
-		if (!keep && bb_nonce) {
-            //printf("deleting %s\n", zip_get_name(za, i, 0));
-			zip_delete(za, i);
+		files[num_files].name = entry->name;
+		if (ticketed && !strcmp(entry->name, "ebl.fls")) {
+			files[num_files].data = ticketed;
+			files[num_files].size = ticketed_size;
+		} else {
+			files[num_files].data = bbfw_entry_get_data(entry, &files[num_files].size);
 		}
+		num_files++;
+	}
+	if (bb_nonce && !is_fls) {
+		// add BBTicket as bbticket.der
+		files[num_files].name = "bbticket.der";
+		files[num_files].data = ticket;
+		files[num_files].size = (unsigned int)ticket_size;
+		num_files++;
 	}
 
-	if (bb_nonce) {
-		if (is_fls) {
-			// add BBTicket to file ebl.fls
-			zindex = zip_name_locate(za, "ebl.fls", 0);
-			if (zindex < 0) {
-				error("ERROR: can't locate 'ebl.fls' in '%s'\n", bbfwtmp);
-				goto leave;
-			}
+	res = bbfw_write_archive(files, num_files, bbfw_data, bbfw_size);
 
-			zip_stat_init(&zstat);
-			if (zip_stat_index(za, zindex, 0, &zstat) != 0) {
-				error("ERROR: zip_stat_index failed for index %d\n", zindex);
-				goto leave;
-			}
+leave:
+	fls_free(fls);
+	free(blob);
+	free(ticket);
+	free(files);
+	free(is_signed);
 
-			zfile = zip_fopen_index(za, zindex, 0);
-			if (zfile == NULL) {
-				error("ERROR: zip_fopen_index failed for index %d\n", zindex);
-				goto leave;
-			}
+	return res;
+}
 
-			buffer = (unsigned char*) malloc(zstat.size + 1);
-			if (buffer == NULL) {
-				error("ERROR: Out of memory\n");
-				goto leave;
-			}
+/* re-restores take the baseband from the latest firmware, so its build
+ * identity comes from the downloaded OTA manifest. Both are parsed once
+ * per client, the returned identity is owned by the client. NULL if that
+ * manifest has none for the device. */
+static plist_t restore_get_baseband_build_identity(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	if (!(client->flags & FLAG_RERESTORE) || !client->otamanifest) {
+		return build_identity;
+	}
+	if (client->basebandBuildIdentity) {
+		return client->basebandBuildIdentity;
+	}
 
-			if (zip_fread(zfile, buffer, zstat.size) != zstat.size) {
-				error("ERROR: zip_fread: failed\n");
-				goto leave;
-			}
-			buffer[zstat.size] = '\0';
+	plist_t buildmanifest2 = idevicerestore_get_ota_manifest(client);
+	if (!buildmanifest2) {
+		return build_identity;
+	}
+	const char *device = client->device->product_type;
 
-			zip_fclose(zfile);
-			zfile = NULL;
+	int indexCount = -1;
 
-			fls = fls_parse(buffer, zstat.size);
-			free(buffer);
-			buffer = NULL;
-			if (!fls) {
-				error("ERROR: could not parse fls file\n");
-				goto leave;
-			}
+	if (!strcmp(device, "iPhone5,2"))
+		indexCount = 0;
 
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(bbticket, (char**)&blob, &blob_size);
-			if (!blob) {
-				error("ERROR: could not get BBTicket data\n");
-				goto leave;
-			}
+	else if (!strcmp(device, "iPhone5,4"))
+		indexCount = 2;
 
-			if (fls_insert_ticket(fls, blob, (unsigned int)blob_size) != 0) {
-				error("ERROR: could not insert BBTicket to ebl.fls\n");
-				goto leave;
-			}
-			free(blob);
-			blob = NULL;
+	else if (!strcmp(device, "iPhone5,1"))
+		indexCount = 4;
 
-			fsize = fls->size;
-			fdata = (unsigned char*)malloc(fsize);
-			if (!fdata) {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			memcpy(fdata, fls->data, fsize);
-			fls_free(fls);
-			fls = NULL;
-
-			zs = zip_source_buffer(za, fdata, fsize, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				free(fdata);
-				goto leave;
-			}
+	else if (!strcmp(device, "iPhone5,3"))
+		indexCount = 6;
 
-			if (zip_replace(za, zindex, zs) == -1) {
-				error("ERROR: could not update archive with ticketed ebl.fls\n");
-				goto leave;
-			}
-		} else {
-			// add BBTicket as bbticket.der
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(bbticket, (char**)&blob, &blob_size);
-			if (!blob) {
-				error("ERROR: could not get BBTicket data\n");
-				goto leave;
-			}
+	if (indexCount == -1) {
+		if (!strcmp(device, "iPad3,5"))
+			indexCount = 0;
+		else if (!strcmp(device, "iPad3,6"))
+			indexCount = 2;
+		else if (!strcmp(device, "iPad3,4"))
+			indexCount = 4;
+	}
 
-			zs = zip_source_buffer(za, blob, blob_size, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			blob = NULL;
+	plist_t node = NULL;
+	char *build = 0;
+	node = plist_dict_get_item(buildmanifest2, "ProductBuildVersion");
+	plist_get_string_val(node, &build);
 
-            //printf("%p %p\n", za, zs);
-			if (zip_add(za, "bbticket.der", zs) == -1) {
-				error("ERROR: could not add bbticket.der to archive\n");
-				goto leave;
-			}
+	unsigned long major = (build) ? strtoul(build, NULL, 10) : 0;
+	free(build);
+
+	if (major == 14 && indexCount == -1) {
+		error("ERROR: Unable to find the baseband build identity for %s in the BuildManifest of the latest firmware\n", device);
+		return NULL;
+	}
+
+	if (major == 14)
+		client->basebandBuildIdentity = build_manifest_get_build_identity(buildmanifest2, indexCount);
+	else
+		client->basebandBuildIdentity = build_manifest_get_build_identity(buildmanifest2, 0);
+	return client->basebandBuildIdentity;
+}
+
+static plist_t restore_create_baseband_request(struct idevicerestore_client_t* client, plist_t build_identity, uint64_t bb_chip_id, uint64_t bb_cert_id, const unsigned char* bb_snum, uint64_t bb_snum_size, const unsigned char* bb_nonce, uint64_t bb_nonce_size)
+{
+	/* populate parameters */
+	plist_t parameters = plist_new_dict();
+	plist_dict_set_item(parameters, "ApECID", plist_new_uint(client->ecid));
+	if (bb_nonce) {
+		plist_dict_set_item(parameters, "BbNonce", plist_new_data((const char*)bb_nonce, bb_nonce_size));
+	}
+	plist_dict_set_item(parameters, "BbChipID", plist_new_uint(bb_chip_id));
+	plist_dict_set_item(parameters, "BbGoldCertId", plist_new_uint(bb_cert_id));
+	plist_dict_set_item(parameters, "BbSNUM", plist_new_data((const char*)bb_snum, bb_snum_size));
+
+	tss_parameters_add_from_manifest(parameters, build_identity);
+
+	/* create baseband request */
+	plist_t request = tss_request_new(NULL);
+	if (request == NULL) {
+		error("ERROR: Unable to create Baseband TSS request\n");
+		plist_free(parameters);
+		return NULL;
+	}
+
+	/* add baseband parameters */
+	tss_request_add_common_tags(request, parameters, NULL);
+	//tss_request_add_ap_tags(request, parameters, NULL);
+
+	if (client->image4supported)
+		plist_dict_set_item(request, "@ApImg4Ticket", plist_new_bool(0));
+	else
+		plist_dict_set_item(request, "@APTicket", plist_new_bool(0));
+
+	tss_request_add_baseband_tags(request, parameters, NULL);
+	plist_free(parameters);
+
+	plist_t node = plist_access_path(build_identity, 2, "Info", "FDRSupport");
+	if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+		uint8_t b = 0;
+		plist_get_bool_val(node, &b);
+		if (b) {
+			plist_dict_set_item(request, "ApProductionMode", plist_new_bool(1));
+			plist_dict_set_item(request, "ApSecurityMode", plist_new_bool(1));
 		}
 	}
 
-	// this will write out the modified zip
-	if (zip_close(za) == -1) {
-		error("ERROR: could not close and write modified archive: %s\n", zip_strerror(za));
-		res = -1;
-	} else {
-		res = 0;
+	return request;
+}
+
+static int restore_preflight_get_data(plist_t pinfo, const char* key, unsigned char** data, uint64_t* size)
+{
+	plist_t node = plist_dict_get_item(pinfo, key);
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		return -1;
 	}
-	za = NULL;
-	zs = NULL;
+	plist_get_data_val(node, (char**)data, size);
+	return (*data) ? 0 : -1;
+}
 
-leave:
-	if (zfile) {
-		zip_fclose(zfile);
+static int restore_preflight_get_uint(plist_t pinfo, const char* key, uint64_t* value)
+{
+	plist_t node = plist_dict_get_item(pinfo, key);
+	if (!node || plist_get_node_type(node) != PLIST_UINT) {
+		return -1;
 	}
-	if (zs) {
-		zip_source_free(zs);
+	plist_get_uint_val(node, value);
+	return 0;
+}
+
+/* returns 1 if restored asks for a baseband ticket with exactly the values
+ * the prefetched request was built from */
+static int restore_baseband_matches_preflight(struct idevicerestore_client_t* client, uint64_t bb_chip_id, uint64_t bb_cert_id, const unsigned char* bb_snum, uint64_t bb_snum_size, const unsigned char* bb_nonce, uint64_t bb_nonce_size)
+{
+	uint64_t chip_id = 0;
+	uint64_t cert_id = 0;
+	unsigned char* snum = NULL;
+	uint64_t snum_size = 0;
+	unsigned char* nonce = NULL;
+	uint64_t nonce_size = 0;
+	int match = 0;
+
+	if (restore_preflight_get_uint(client->preflight_info, "ChipID", &chip_id) == 0
+	    && restore_preflight_get_uint(client->preflight_info, "CertID", &cert_id) == 0
+	    && restore_preflight_get_data(client->preflight_info, "ChipSerialNo", &snum, &snum_size) == 0
+	    && restore_preflight_get_data(client->preflight_info, "Nonce", &nonce, &nonce_size) == 0) {
+		match = (chip_id == bb_chip_id) && (cert_id == bb_cert_id)
+			&& bb_snum && (snum_size == bb_snum_size) && !memcmp(snum, bb_snum, snum_size)
+			&& bb_nonce && (nonce_size == bb_nonce_size) && !memcmp(nonce, bb_nonce, nonce_size);
+	}
+	free(snum);
+	free(nonce);
+
+	return match;
+}
+
+int restore_prefetch_baseband_tss(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	uint64_t bb_chip_id = 0;
+	uint64_t bb_cert_id = 0;
+	unsigned char* bb_snum = NULL;
+	uint64_t bb_snum_size = 0;
+	unsigned char* bb_nonce = NULL;
+	uint64_t bb_nonce_size = 0;
+
+	if (!client || !client->preflight_info || client->bbtss_pending) {
+		return -1;
 	}
-	if (za) {
-		zip_unchange_all(za);
-		zip_close(za);
+
+	// the AP request already carried the baseband tags
+	if (client->tss && plist_dict_get_item(client->tss, "BBTicket")) {
+		return 0;
 	}
-	mbn_free(mbn);
-	fls_free(fls);
-	free(buffer);
-	free(blob);
 
-	return res;
+	// restored asks with the values the baseband reported in normal mode
+	if (restore_preflight_get_uint(client->preflight_info, "ChipID", &bb_chip_id) < 0
+	    || restore_preflight_get_uint(client->preflight_info, "CertID", &bb_cert_id) < 0
+	    || restore_preflight_get_data(client->preflight_info, "ChipSerialNo", &bb_snum, &bb_snum_size) < 0
+	    || restore_preflight_get_data(client->preflight_info, "Nonce", &bb_nonce, &bb_nonce_size) < 0) {
+		debug("NOTE: Incomplete baseband preflight info, not prefetching Baseband TSS\n");
+		free(bb_snum);
+		free(bb_nonce);
+		return -1;
+	}
+
+	plist_t bb_identity = restore_get_baseband_build_identity(client, build_identity);
+	if (!bb_identity) {
+		free(bb_snum);
+		free(bb_nonce);
+		return -1;
+	}
+	plist_t request = restore_create_baseband_request(client, bb_identity, bb_chip_id, bb_cert_id, bb_snum, bb_snum_size, bb_nonce, bb_nonce_size);
+	free(bb_snum);
+	free(bb_nonce);
+	if (!request) {
+		return -1;
+	}
+
+	info("Prefetching Baseband SHSH blobs...\n");
+	client->bbtss_pending = tss_request_send_async(request, client->tss_url);
+	plist_free(request);
+
+	return (client->bbtss_pending) ? 0 : -1;
 }
 
 int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity2, plist_t message)
@@ -1524,7 +2077,6 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 	char* buffer = NULL;
 	char* bbfwtmp = NULL;
 	plist_t dict = NULL;
-	plist_t buildmanifest2 = NULL;
 
 	info("About to send BasebandData...\n");
 
@@ -1532,69 +2084,9 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 
 	// setup request data
 	plist_t arguments = plist_dict_get_item(message, "Arguments");
-	if (client->flags & FLAG_RERESTORE) {
-		FILE *ofp = fopen(client->otamanifest,"rb");
-		struct stat *ostat = (struct stat*) malloc(sizeof(struct stat));
-		stat(client->otamanifest, ostat);
-		char *opl = (char *)malloc(sizeof(char) *(ostat->st_size +1));
-		fread(opl, sizeof(char), ostat->st_size, ofp);
-		fclose(ofp);
-		
-		if (!memcmp(opl, "bplist00", 8))
-			plist_from_bin(opl, ostat->st_size, &buildmanifest2);
-		else
-			plist_from_xml(opl, ostat->st_size, &buildmanifest2);
-		free(ostat);
-		const char *device = client->device->product_type;
-		
-		int indexCount = -1;
-		
-		if (client->flags & FLAG_RERESTORE) {
-			
-			if (!strcmp(device, "iPhone5,2"))
-				indexCount = 0;
-			
-			else if (!strcmp(device, "iPhone5,4"))
-				indexCount = 2;
-			
-			else if (!strcmp(device, "iPhone5,1"))
-				indexCount = 4;
-			
-			else if (!strcmp(device, "iPhone5,3"))
-				indexCount = 6;
-			
-			if (indexCount == -1) {
-				if (!strcmp(device, "iPad3,5"))
-					indexCount = 0;
-				else if (!strcmp(device, "iPad3,6"))
-					indexCount = 2;
-				else if (!strcmp(device, "iPad3,4"))
-					indexCount = 4;
-			}
-		}
-		
-		plist_t node = NULL;
-		char *version = 0;
-		char *build = 0;
-		node = plist_dict_get_item(buildmanifest2, "ProductVersion");
-		plist_get_string_val(node, &version);
-		
-		node = plist_dict_get_item(buildmanifest2, "ProductBuildVersion");
-		plist_get_string_val(node, &build);
-		
-		unsigned long major = strtoul(build, NULL, 10);
-		
-		if (major == 14 && indexCount == -1) {
-			printf("Error parsing BuildManifest.\n");
-			exit(-1);
-		}
-		else if (major == 14)
-			build_identity2 = build_manifest_get_build_identity(buildmanifest2, indexCount);
-		else build_identity2 = build_manifest_get_build_identity(buildmanifest2, 0);
-		
-		//free(opl);
-		
-		//free(opl);
+	build_identity2 = restore_get_baseband_build_identity(client, build_identity2);
+	if (!build_identity2) {
+		return -1;
 	}
 	if (arguments && plist_get_node_type(arguments) == PLIST_DICT) {
 		plist_t bb_chip_id_node = plist_dict_get_item(arguments, "ChipID");
@@ -1616,176 +2108,43 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 	}
 
 	if ((bb_nonce == NULL) || (client->restore->bbtss == NULL)) {
-		/* populate parameters */
-		plist_t parameters = plist_new_dict();
-		plist_dict_set_item(parameters, "ApECID", plist_new_uint(client->ecid));
-		if (bb_nonce) {
-			plist_dict_set_item(parameters, "BbNonce", plist_new_data((const char*)bb_nonce, bb_nonce_size));
-		}
-		plist_dict_set_item(parameters, "BbChipID", plist_new_uint(bb_chip_id));
-		plist_dict_set_item(parameters, "BbGoldCertId", plist_new_uint(bb_cert_id));
-		plist_dict_set_item(parameters, "BbSNUM", plist_new_data((const char*)bb_snum, bb_snum_size));
-
-		tss_parameters_add_from_manifest(parameters, build_identity2);
-
-		/* create baseband request */
-		plist_t request = tss_request_new(NULL);
-		if (client->flags & FLAG_RERESTORE) {
-			FILE *ofp = fopen(client->otamanifest,"rb");
-			struct stat *ostat = (struct stat*) malloc(sizeof(struct stat));
-			stat(client->otamanifest, ostat);
-			char *opl = (char *)malloc(sizeof(char) *(ostat->st_size +1));
-			fread(opl, sizeof(char), ostat->st_size, ofp);
-			fclose(ofp);
-			
-			if (memcmp(opl, "bplist00", 8) == 0)
-				plist_from_bin(opl, ostat->st_size, &buildmanifest2);
-			else
-				plist_from_xml(opl, ostat->st_size, &buildmanifest2);
-			free(ostat);
-			const char *device = client->device->product_type;
-			
-			int indexCount = -1;
-			
-			if (!strcmp(device, "iPhone5,2"))
-				indexCount = 0;
-			
-			else if (!strcmp(device, "iPhone5,4"))
-				indexCount = 2;
-			
-			else if (!strcmp(device, "iPhone5,1"))
-				indexCount = 4;
-			
-			else if (!strcmp(device, "iPhone5,3"))
-				indexCount = 6;
-			
-			if (indexCount == -1) {
-				if (!strcmp(device, "iPad3,5"))
-					indexCount = 0;
-				else if (!strcmp(device, "iPad3,6"))
-					indexCount = 2;
-				else if (!strcmp(device, "iPad3,4"))
-					indexCount = 4;
+		plist_t request = NULL;
+
+		// a prefetched response only helps if restored asks for the same nonce
+		if (client->bbtss_pending) {
+			int span = trace_begin(client->trace, "tss_wait", "BBTicket");
+			plist_t prefetched = tss_request_wait(client->bbtss_pending);
+			trace_end(client->trace, span, 0, (prefetched) ? 0 : -1);
+			client->bbtss_pending = NULL;
+			if (prefetched && restore_baseband_matches_preflight(client, bb_chip_id, bb_cert_id, bb_snum, bb_snum_size, bb_nonce, bb_nonce_size)) {
+				info("Using prefetched Baseband SHSH blobs\n");
+				response = prefetched;
+			} else if (prefetched) {
+				plist_free(prefetched);
 			}
-			
-			
-			plist_t node = NULL;
-			char *version = 0;
-			char *build = 0;
-			node = plist_dict_get_item(buildmanifest2, "ProductVersion");
-			plist_get_string_val(node, &version);
-			
-			node = plist_dict_get_item(buildmanifest2, "ProductBuildVersion");
-			plist_get_string_val(node, &build);
-			
-			unsigned long major = strtoul(build, NULL, 10);
-			
-			if (major == 14 && indexCount == -1) {
-				printf("Error parsing BuildManifest.\n");
-				exit(-1);
-			}
-			else if (major == 14)
-				build_identity2 = build_manifest_get_build_identity(buildmanifest2, indexCount);
-			else build_identity2 = build_manifest_get_build_identity(buildmanifest2, 0);
-			
-			//free(opl);
-			
-			//free(opl);
-		}
-		
-		if (request == NULL) {
-			error("ERROR: Unable to create Baseband TSS request\n");
-			plist_free(parameters);
-			return -1;
 		}
 
-		/* add baseband parameters */
-		tss_request_add_common_tags(request, parameters, NULL);
-		//tss_request_add_ap_tags(request, parameters, NULL);
-		
-		if (client->image4supported)
-			plist_dict_set_item(request, "@ApImg4Ticket", plist_new_bool(0));
-		else
-			plist_dict_set_item(request, "@APTicket", plist_new_bool(0));
-		
-		tss_request_add_baseband_tags(request, parameters, NULL);
-
-		plist_t node = plist_access_path(build_identity2, 2, "Info", "FDRSupport");
-		if (client->flags & FLAG_RERESTORE) {
-			FILE *ofp = fopen(client->otamanifest,"rb");
-			struct stat *ostat = (struct stat*) malloc(sizeof(struct stat));
-			stat(client->otamanifest, ostat);
-			char *opl = (char *)malloc(sizeof(char) *(ostat->st_size +1));
-			fread(opl, sizeof(char), ostat->st_size, ofp);
-			fclose(ofp);
-			
-			if (memcmp(opl, "bplist00", 8) == 0)
-				plist_from_bin(opl, ostat->st_size, &buildmanifest2);
-			else
-				plist_from_xml(opl, ostat->st_size, &buildmanifest2);
-			free(ostat);
-			
-			const char *device = client->device->product_type;
-			
-			int indexCount = -1;
-			
-			if (client->flags & FLAG_RERESTORE) {
-				
-				if (!strcmp(device, "iPhone5,2") || !strcmp(device, "iPad3,5"))
-					indexCount = 0;
-				
-				else if (!strcmp(device, "iPhone5,4") || !strcmp(device, "iPad3,6"))
-					indexCount = 2;
-				
-				else if (!strcmp(device, "iPhone5,1") || !strcmp(device, "iPad3,4"))
-					indexCount = 4;
-				
-				else if (!strcmp(device, "iPhone5,3"))
-					indexCount = 6;
-			}
-			
-			plist_t node = NULL;
-			char *version = 0;
-			char *build = 0;
-			node = plist_dict_get_item(buildmanifest2, "ProductVersion");
-			plist_get_string_val(node, &version);
-			
-			node = plist_dict_get_item(buildmanifest2, "ProductBuildVersion");
-			plist_get_string_val(node, &build);
-			
-			unsigned long major = strtoul(build, NULL, 10);
-			
-			if (major == 14 && indexCount == -1) {
-				printf("Error parsing BuildManifest.\n");
-				exit(-1);
-			}
-			else if (major == 14)
-				build_identity2 = build_manifest_get_build_identity(buildmanifest2, indexCount);
-			else build_identity2 = build_manifest_get_build_identity(buildmanifest2, 0);
-			
-			//free(opl);
-		}
-		if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
-			uint8_t b = 0;
-			plist_get_bool_val(node, &b);
-			if (b) {
-				plist_dict_set_item(request, "ApProductionMode", plist_new_bool(1));
-				plist_dict_set_item(request, "ApSecurityMode", plist_new_bool(1));
+		if (!response) {
+			request = restore_create_baseband_request(client, build_identity2, bb_chip_id, bb_cert_id, bb_snum, bb_snum_size, bb_nonce, bb_nonce_size);
+			if (request == NULL) {
+				return -1;
 			}
-		}
-		if (idevicerestore_debug)
-			debug_plist(request);
 
-		info("Sending Baseband TSS request...\n");
-        
-		response = tss_request_send(request, client->tss_url);
-		plist_free(request);
-		plist_free(parameters);
-		if (response == NULL) {
-			error("ERROR: Unable to fetch Baseband TSS\n");
-			return -1;
+			if (idevicerestore_debug)
+				debug_plist(request);
+
+			info("Sending Baseband TSS request...\n");
+
+			int span = trace_begin(client->trace, "tss", "BBTicket");
+			response = tss_request_send(request, client->tss_url);
+			trace_end(client->trace, span, 0, (response) ? 0 : -1);
+			plist_free(request);
+			if (response == NULL) {
+				error("ERROR: Unable to fetch Baseband TSS\n");
+				return -1;
+			}
+			info("Received Baseband SHSH blobs\n");
 		}
-		info("Received Baseband SHSH blobs\n");
 
 		if (idevicerestore_debug)
 			debug_plist(response);
@@ -1793,59 +2152,6 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 
 	// get baseband firmware file path from build identity
 	plist_t bbfw_path = plist_access_path(build_identity2, 4, "Manifest", "BasebandFirmware", "Info", "Path");
-	if (client->flags & FLAG_RERESTORE) {
-		FILE *ofp = fopen(client->otamanifest,"rb");
-		struct stat *ostat = (struct stat*) malloc(sizeof(struct stat));
-		stat(client->otamanifest, ostat);
-		char *opl = (char *)malloc(sizeof(char) *(ostat->st_size +1));
-		fread(opl, sizeof(char), ostat->st_size, ofp);
-		fclose(ofp);
-		
-		if (memcmp(opl, "bplist00", 8) == 0)
-			plist_from_bin(opl, ostat->st_size, &buildmanifest2);
-		else
-			plist_from_xml(opl, ostat->st_size, &buildmanifest2);
-		free(ostat);
-		const char *device = client->device->product_type;
-		
-		int indexCount = -1;
-		
-		if (client->flags & FLAG_RERESTORE) {
-			
-			if (!strcmp(device, "iPhone5,2") || !strcmp(device, "iPad3,5"))
-				indexCount = 0;
-			
-			else if (!strcmp(device, "iPhone5,4") || !strcmp(device, "iPad3,6"))
-				indexCount = 2;
-			
-			else if (!strcmp(device, "iPhone5,1") || !strcmp(device, "iPad3,4"))
-				indexCount = 4;
-			
-			else if (!strcmp(device, "iPhone5,3"))
-				indexCount = 6;
-		}
-		
-		plist_t node = NULL;
-		char *version = 0;
-		char *build = 0;
-		node = plist_dict_get_item(buildmanifest2, "ProductVersion");
-		plist_get_string_val(node, &version);
-		
-		node = plist_dict_get_item(buildmanifest2, "ProductBuildVersion");
-		plist_get_string_val(node, &build);
-		
-		unsigned long major = strtoul(build, NULL, 10);
-		
-		if (major == 14 && indexCount == -1) {
-			printf("Error parsing BuildManifest.\n");
-			exit(-1);
-		}
-		else if (major == 14)
-			build_identity2 = build_manifest_get_build_identity(buildmanifest2, indexCount);
-		else build_identity2 = build_manifest_get_build_identity(buildmanifest2, 0);
-        
-	}
-	
 	if (!bbfw_path || plist_get_node_type(bbfw_path) != PLIST_STRING) {
 		error("ERROR: Unable to get BasebandFirmware/Info/Path node\n");
 		plist_free(response);
@@ -1869,31 +2175,24 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 		return -1;
 	}
 	
-    if (client->basebandPath) {
-        
-        plist_t node = NULL;
-        char *version = 0;
-        char *build = 0;
-        node = plist_dict_get_item(buildmanifest2, "ProductVersion");
-        plist_get_string_val(node, &version);
-        
-        node = plist_dict_get_item(buildmanifest2, "ProductBuildVersion");
-        plist_get_string_val(node, &build);
-        
+    // a bundle that is already loaded is signed again without fetching it,
+    // the one prepared before the restore is used if it's still there
+    if (!client->restore->bbfw) {
+        struct stat st;
+        if (!client->basebandPath) {
+            error("ERROR: No baseband firmware was prepared\n");
+            plist_free(response);
+            return -1;
+        }
         debug("bbfwpath: %s, basebandPath: %s\n", bbfwpath, client->basebandPath);
-        partialzip_download_file(fwurl, bbfwpath, client->basebandPath);
-    
-    }
-    
-    FILE *bb = fopen(client->basebandPath, "r");
-    
-    if (!bb) {
-        partialzip_download_file(fwurl, bbfwpath, client->basebandPath);
+        if (stat(client->basebandPath, &st) < 0 || st.st_size == 0) {
+            download_baseband_firmware(client, fwurl, isha1, build_identity2, bbfwpath, client->basebandPath);
+        }
     }
     
 #if 0
 	if (!(client->flags & FLAG_RERESTORE)) {
-		if (ipsw_extract_to_file(client->ipsw, bbfwpath, bbfwtmp) != 0) {
+		if (ipsw_archive_extract_to_file_with_progress(client->archive, bbfwpath, bbfwtmp, 0) != 0) {
 			error("ERROR: Unable to extract baseband firmware from ipsw\n");
 			plist_free(response);
 			return -1;
@@ -1907,19 +2206,25 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 		response = NULL;
 	}
 
-	res = restore_sign_bbfw(client->basebandPath, (client->restore->bbtss) ? client->restore->bbtss : response, bb_nonce);
-	if (res != 0) {
-		goto leave;
+	// the bundle is parsed once, later requests only re-sign what changed
+	if (!client->restore->bbfw) {
+		client->restore->bbfw = bbfw_bundle_open(client->basebandPath);
+		if (!client->restore->bbfw) {
+			error("ERROR: could not read baseband firmware\n");
+			goto leave;
+		}
 	}
 
-	res = -1;
-	
 	size_t sz = 0;
-	if (read_file(client->basebandPath, (void**)&buffer, &sz) < 0) {
-		error("ERROR: could not read updated bbfw archive\n");
+	int sign_span = trace_begin(client->trace, "bbfw_sign", NULL);
+	res = restore_sign_bbfw(client->restore->bbfw, (client->restore->bbtss) ? client->restore->bbtss : response, bb_nonce, (unsigned char**)&buffer, &sz);
+	trace_end(client->trace, sign_span, (res == 0) ? sz : 0, res);
+	if (res != 0) {
 		goto leave;
 	}
 
+	res = -1;
+
 	// send file
 	dict = plist_new_dict();
 	plist_dict_set_item(dict, "BasebandData", plist_new_data(buffer, (uint64_t)sz));
@@ -1927,7 +2232,10 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 	buffer = NULL;
 
 	info("Sending BasebandData now...\n");
-	if (restored_send(restore, dict) != RESTORE_E_SUCCESS) {
+	int span = trace_begin(client->trace, "restore_send", "BasebandData");
+	restored_error_t restore_error = restore_send_message(client, restore, dict);
+	trace_end(client->trace, span, (restore_error == RESTORE_E_SUCCESS) ? sz : 0, restore_error);
+	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send BasebandData data\n");
 		goto leave;
 	}
@@ -1986,9 +2294,9 @@ int restore_send_fud_data(restored_client_t restore, struct idevicerestore_clien
 
 					info("Found FUD component '%s'\n", component);
 
-					build_identity_get_component_path(build_identity, component, &path);
+					idevicerestore_get_component_path(client, build_identity, component, &path);
 					if (path) {
-						ret = extract_component(client->ipsw, path, &component_data, &component_size);
+						ret = extract_component(client->archive, path, &component_data, &component_size);
 					}
 					free(path);
 					path = NULL;
@@ -2017,7 +2325,7 @@ int restore_send_fud_data(restored_client_t restore, struct idevicerestore_clien
 	plist_dict_set_item(dict, "FUDImageData", fud_dict);
 
 	info("Sending FUD data now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: During sending FUD data (%d)\n", restore_error);
@@ -2041,12 +2349,12 @@ plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicere
 	plist_t response = NULL;
 	int ret;
 
-	if (build_identity_get_component_path(build_identity, comp_name, &comp_path) < 0) {
+	if (idevicerestore_get_component_path(client, build_identity, comp_name, &comp_path) < 0) {
 		error("ERROR: Unable get path for '%s' component\n", comp_name);
 		return NULL;
 	}
 
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = extract_component(client->archive, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2076,7 +2384,9 @@ plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicere
 	plist_free(parameters);
 
 	info("Sending SE TSS request...\n");
+	int span = trace_begin(client->trace, "tss", "SE,Ticket");
 	response = tss_request_send(request, client->tss_url);
+	trace_end(client->trace, span, 0, (response) ? 0 : -1);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch SE ticket\n");
@@ -2171,7 +2481,7 @@ int restore_send_firmware_updater_data(restored_client_t restore, struct idevice
 	plist_dict_set_item(dict, "FirmwareResponseData", fwdict);
 
 	info("Sending FirmwareResponse data now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Couldn't send FirmwareResponse data (%d)\n", restore_error);
@@ -2202,7 +2512,7 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 
 		// this request is sent when restored is ready to receive the filesystem
 		if (!strcmp(type, "SystemImageData")) {
-			if(restore_send_filesystem(client, device, filesystem) < 0) {
+			if(restore_send_filesystem(client, device, build_identity, filesystem) < 0) {
 				error("ERROR: Unable to send filesystem\n");
 				return -2;
 			}
@@ -2225,7 +2535,10 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 
 		else if (!strcmp(type, "NORData")) {
 			if((client->flags & FLAG_EXCLUDE) == 0) {
-				if(restore_send_nor(restore, client, build_identity) < 0) {
+				int span = trace_begin(client->trace, "nor", NULL);
+				int res = restore_send_nor(restore, client, build_identity);
+				trace_end(client->trace, span, 0, res);
+				if(res < 0) {
 					error("ERROR: Unable to send NOR data\n");
 					return -1;
 				}
@@ -2236,14 +2549,20 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 		}
 
 		else if (!strcmp(type, "BasebandData")) {
-			if(restore_send_baseband_data(restore, client, (client->basebandBuildIdentity) ? client->basebandBuildIdentity : build_identity, message) < 0) {
+			int span = trace_begin(client->trace, "baseband", NULL);
+			int res = restore_send_baseband_data(restore, client, (client->basebandBuildIdentity) ? client->basebandBuildIdentity : build_identity, message);
+			trace_end(client->trace, span, 0, res);
+			if(res < 0) {
 				error("ERROR: Unable to send baseband data\n");
 				return -1;
 			}
 		}
 
 		else if (!strcmp(type, "FUDData")) {
-			if(restore_send_fud_data(restore, client, build_identity) < 0) {
+			int span = trace_begin(client->trace, "fud", NULL);
+			int res = restore_send_fud_data(restore, client, build_identity);
+			trace_end(client->trace, span, 0, res);
+			if(res < 0) {
 				error("ERROR: Unable to send FUD data\n");
 				return -1;
 			}
@@ -2266,6 +2585,119 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 	return 0;
 }
 
+/* Data requests that take long enough to stall the message loop are
+ * answered from their own thread, so progress and status messages keep
+ * being read while the filesystem or firmware is sent. */
+struct restore_data_job {
+	struct idevicerestore_client_t* client;
+	idevice_t device;
+	restored_client_t restore;
+	plist_t message;
+	plist_t build_identity;
+	const char* filesystem;
+	char* type;
+	char context[64];
+	thread_t thread;
+	int done;
+	int result;
+	struct restore_data_job* next;
+};
+
+static int restore_data_request_is_long(const char* type)
+{
+	return (!strcmp(type, "SystemImageData") || !strcmp(type, "BasebandData") || !strcmp(type, "FirmwareUpdaterData"));
+}
+
+static void* restore_data_job_thread(void* arg)
+{
+	struct restore_data_job* job = (struct restore_data_job*)arg;
+	log_set_context(job->context);
+	job->result = restore_handle_data_request_msg(job->client, job->device, job->restore, job->message, job->build_identity, job->filesystem);
+	log_set_context(NULL);
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void restore_data_job_free(struct restore_data_job* job)
+{
+	plist_free(job->message);
+	free(job->type);
+	free(job);
+}
+
+/* Joins the jobs that have finished, the one answering a request of type
+ * if not NULL, or all of them if wait_all is set. Returns the first
+ * error of the joined jobs or 0. */
+static int restore_data_jobs_reap(struct restore_data_job** jobs, const char* type, int wait_all)
+{
+	int err = 0;
+	struct restore_data_job** p = jobs;
+	while (*p) {
+		struct restore_data_job* job = *p;
+		if (!wait_all && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) && !(type && !strcmp(job->type, type))) {
+			p = &job->next;
+			continue;
+		}
+		thread_join(job->thread);
+		thread_free(job->thread);
+		if (job->result < 0) {
+			error("ERROR: %s request failed\n", job->type);
+			if (err == 0) {
+				err = job->result;
+			}
+		}
+		*p = job->next;
+		restore_data_job_free(job);
+	}
+	return err;
+}
+
+static int restore_dispatch_data_request(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem, struct restore_data_job** jobs)
+{
+	char* type = NULL;
+	plist_t node = plist_dict_get_item(message, "DataType");
+	if (node && PLIST_STRING == plist_get_node_type(node)) {
+		plist_get_string_val(node, &type);
+	}
+	if (!type || !restore_data_request_is_long(type)) {
+		free(type);
+		return restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
+	}
+
+	// restored doesn't ask for the same data twice at once, but if it does
+	// the replies have to go out in order
+	int err = restore_data_jobs_reap(jobs, type, 0);
+	if (err < 0) {
+		free(type);
+		return err;
+	}
+
+	struct restore_data_job* job = (struct restore_data_job*)calloc(1, sizeof(struct restore_data_job));
+	if (!job) {
+		error("ERROR: Out of memory\n");
+		free(type);
+		return -1;
+	}
+	job->client = client;
+	job->device = device;
+	job->restore = restore;
+	job->message = plist_copy(message);
+	job->build_identity = build_identity;
+	job->filesystem = filesystem;
+	job->type = type;
+	snprintf(job->context, sizeof(job->context), "%s", log_get_context());
+
+	if (thread_new(&job->thread, restore_data_job_thread, job) != 0) {
+		debug("Unable to start a thread for %s, handling it inline\n", type);
+		err = restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
+		restore_data_job_free(job);
+		return err;
+	}
+	job->next = *jobs;
+	*jobs = job;
+	return 0;
+}
+
 int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem) {
 	int err = 0;
 	char* type = NULL;
@@ -2275,8 +2707,7 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 	idevice_t device = NULL;
 	restored_client_t restore = NULL;
 	restored_error_t restore_error = RESTORE_E_SUCCESS;
-    
-	restore_finished = 0;
+	struct restore_data_job* jobs = NULL;
 
 	// open our connection to the device and verify we're in restore mode
 	err = restore_open_with_timeout(client);
@@ -2284,6 +2715,8 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		error("ERROR: Unable to open device in restore mode\n");
 		return (err == -2) ? -1: -2;
 	}
+	client->restore->finished = 0;
+	client->restore->last_operation = 0;
 	info("Device %s has successfully entered restore mode\n", client->udid);
 
 	restore = client->restore->client;
@@ -2444,12 +2877,20 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 	plist_free(opts);
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 1.0);
 
+	// the first failed data request job, the handlers overwrite err
+	int job_error = 0;
+
 	// this is the restore process loop, it reads each message in from
 	// restored and passes that data on to it's specific handler
 	while ((client->flags & FLAG_QUIT) == 0) {
+		int job_err = restore_data_jobs_reap(&jobs, NULL, 0);
+		if (job_err < 0 && job_error == 0) {
+			job_error = job_err;
+		}
+
 		// finally, if any of these message handlers returned -1 then we encountered
 		// an unrecoverable error, so we need to bail.
-		if (err < 0) {
+		if (err < 0 || job_error < 0) {
 			error("ERROR: Unable to successfully restore device\n");
 			client->flags |= FLAG_QUIT;
 		}
@@ -2477,7 +2918,7 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		// files sent to the server by the client. these data requests include
 		// SystemImageData, RootTicket, KernelCache, NORData and BasebandData requests
 		if (!strcmp(type, "DataRequestMsg")) {
-			err = restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
+			err = restore_dispatch_data_request(client, device, restore, message, build_identity, filesystem, &jobs);
 		}
 
 		// restore logs are available if a previous restore failed
@@ -2494,8 +2935,8 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		// status messages usually indicate the current state of the restored
 		// process or often to signal an error has been encountered
 		else if (!strcmp(type, "StatusMsg")) {
-			err = restore_handle_status_msg(restore, message);
-			if (restore_finished) {
+			err = restore_handle_status_msg(client, message);
+			if (client->restore->finished) {
 				client->flags |= FLAG_QUIT;
 			}
 		}
@@ -2527,6 +2968,14 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		message = NULL;
 	}
 
+	int job_err = restore_data_jobs_reap(&jobs, NULL, 1);
+	if (job_err < 0 && job_error == 0) {
+		job_error = job_err;
+	}
+	if (job_error < 0) {
+		err = job_error;
+	}
+
 	restore_client_free(client);
 	return err;
 }
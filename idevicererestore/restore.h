@@ -32,16 +32,25 @@ extern "C" {
 #include <libimobiledevice/restore.h>
 #include <libimobiledevice/libimobiledevice.h>
 
+#include "bbfw.h"
+#include "thread.h"
+
 struct restore_client_t {
 	char* bbfwtmp;
 	plist_t tss;
 	plist_t bbtss;
+	bbfw_bundle* bbfw;
 	idevice_t device;
 	char* udid;
 	unsigned int operation;
 	const char* filesystem;
 	uint64_t protocol_version;
 	restored_client_t client;
+	int device_connected;
+	int finished;
+	int last_operation;
+	/* held for every message sent on client */
+	mutex_t send_lock;
 };
 
 int restore_check_mode(struct idevicerestore_client_t* client);
@@ -50,7 +59,7 @@ int restore_client_new(struct idevicerestore_client_t* client);
 void restore_client_free(struct idevicerestore_client_t* client);
 int restore_reboot(struct idevicerestore_client_t* client);
 const char* restore_progress_string(unsigned int operation);
-int restore_handle_status_msg(restored_client_t client, plist_t msg);
+int restore_handle_status_msg(struct idevicerestore_client_t* client, plist_t msg);
 int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t msg);
 int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem);
 int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity);
@@ -58,7 +67,8 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 int restore_send_kernelcache(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity);
 int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem);
 int restore_open_with_timeout(struct idevicerestore_client_t* client);
-int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, const char* filesystem);
+int restore_prefetch_baseband_tss(struct idevicerestore_client_t* client, plist_t build_identity);
+int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, plist_t build_identity, const char* filesystem);
     
 #ifdef __cplusplus
 }
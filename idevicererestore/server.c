@@ -0,0 +1,610 @@
+/*
+ * server.c
+ * Restore jobs submitted to a long running process over a local socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <plist/plist.h>
+
+#include "server.h"
+#include "socket.h"
+#include "thread.h"
+#include "common.h"
+#include "log.h"
+#include "endianness.h"
+
+#define SERVER_MAX_IPSWS 4
+#define SERVER_MAX_MESSAGE (1024 * 1024)
+#define SERVER_REQUEST_TIMEOUT 20000
+
+#ifdef MSG_NOSIGNAL
+#define SERVER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SERVER_SEND_FLAGS 0
+#endif
+
+struct server_ipsw {
+	char* path;
+	off_t size;
+	time_t mtime;
+	struct idevicerestore_shared_t* shared;
+	int refs;
+	/* cleared once the entry is dropped from the table, the last job
+	 * using it frees it then */
+	int cached;
+	/* set while the job that added the entry opens the IPSW */
+	int opening;
+	uint64_t last_used;
+};
+
+struct server {
+	struct idevicerestore_client_t* client;
+	mutex_t lock;
+	/* signalled when an entry finished opening */
+	cond_t cond;
+	struct server_ipsw* ipsws[SERVER_MAX_IPSWS];
+	uint64_t clock;
+};
+
+struct server_job {
+	struct server* server;
+	int fd;
+	thread_t thread;
+	/* progress is reported from the restore thread and its data request
+	 * workers, one frame at a time */
+	mutex_t lock;
+	int step;
+	int percent;
+	int done;
+	struct server_job* next;
+};
+
+static int server_send_all(int fd, const char* data, uint32_t length)
+{
+	while (length > 0) {
+		int sent = send(fd, data, length, SERVER_SEND_FLAGS);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+static int server_receive_all(int fd, char* data, uint32_t length, unsigned int timeout)
+{
+	while (length > 0) {
+		int received = socket_receive_timeout(fd, data, length, 0, timeout);
+		if (received <= 0) {
+			return -1;
+		}
+		data += received;
+		length -= received;
+	}
+	return 0;
+}
+
+static int server_send_message(int fd, plist_t message)
+{
+	char* xml = NULL;
+	uint32_t length = 0;
+
+	plist_to_xml(message, &xml, &length);
+	if (!xml) {
+		return -1;
+	}
+	uint32_t header = htobe32(length);
+	int res = server_send_all(fd, (const char*)&header, sizeof(header));
+	if (res == 0) {
+		res = server_send_all(fd, xml, length);
+	}
+	free(xml);
+	return res;
+}
+
+/* a timeout of 0 waits forever */
+static int server_receive_message(int fd, plist_t* message, unsigned int timeout)
+{
+	uint32_t header = 0;
+
+	*message = NULL;
+	if (server_receive_all(fd, (char*)&header, sizeof(header), timeout) < 0) {
+		return -1;
+	}
+	uint32_t length = be32toh(header);
+	if (length == 0 || length > SERVER_MAX_MESSAGE) {
+		error("ERROR: Invalid message length %u\n", length);
+		return -1;
+	}
+	char* xml = (char*)malloc(length);
+	if (!xml) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	if (server_receive_all(fd, xml, length, timeout) < 0) {
+		free(xml);
+		return -1;
+	}
+	plist_from_xml(xml, length, message);
+	free(xml);
+	if (!*message || plist_get_node_type(*message) != PLIST_DICT) {
+		error("ERROR: Could not parse message\n");
+		plist_free(*message);
+		*message = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void server_ipsw_free(struct server_ipsw* entry)
+{
+	idevicerestore_shared_free(entry->shared);
+	free(entry->path);
+	free(entry);
+}
+
+/* Hands the prepared IPSW of client to it, opening it if it isn't cached
+ * yet or changed on disk. A new IPSW is opened without the lock held, so
+ * other jobs aren't held up by it; jobs for the same IPSW wait for the
+ * entry being opened instead of reading it again. */
+static struct server_ipsw* server_ipsw_acquire(struct server* server, struct idevicerestore_client_t* client)
+{
+	struct server_ipsw* entry = NULL;
+	struct stat st;
+	int i;
+
+	if (stat(client->ipsw, &st) < 0) {
+		error("ERROR: Firmware file %s does not exist.\n", client->ipsw);
+		return NULL;
+	}
+
+	mutex_lock(&server->lock);
+	for (i = 0; i < SERVER_MAX_IPSWS; i++) {
+		struct server_ipsw* cached = server->ipsws[i];
+		if (!cached || strcmp(cached->path, client->ipsw) != 0) {
+			continue;
+		}
+		if (cached->size == st.st_size && cached->mtime == st.st_mtime) {
+			if (cached->opening) {
+				cond_wait(&server->cond, &server->lock);
+				// the table may have changed meanwhile
+				i = -1;
+				continue;
+			}
+			entry = cached;
+			break;
+		}
+		// replaced since it was opened
+		server->ipsws[i] = NULL;
+		cached->cached = 0;
+		if (cached->refs == 0) {
+			server_ipsw_free(cached);
+		}
+	}
+
+	if (!entry) {
+		entry = (struct server_ipsw*)calloc(1, sizeof(struct server_ipsw));
+		if (!entry) {
+			error("ERROR: Out of memory\n");
+			mutex_unlock(&server->lock);
+			return NULL;
+		}
+		entry->path = strdup(client->ipsw);
+		entry->size = st.st_size;
+		entry->mtime = st.st_mtime;
+		entry->opening = 1;
+		entry->refs = 1;
+
+		// take a free slot or the least recently used idle one, if every
+		// slot is busy the IPSW is only kept for this job
+		int slot = -1;
+		for (i = 0; i < SERVER_MAX_IPSWS; i++) {
+			struct server_ipsw* cached = server->ipsws[i];
+			if (!cached) {
+				slot = i;
+				break;
+			}
+			if (cached->refs == 0 && (slot < 0 || cached->last_used < server->ipsws[slot]->last_used)) {
+				slot = i;
+			}
+		}
+		if (slot >= 0) {
+			if (server->ipsws[slot]) {
+				debug("Closing %s\n", server->ipsws[slot]->path);
+				server_ipsw_free(server->ipsws[slot]);
+			}
+			server->ipsws[slot] = entry;
+			entry->cached = 1;
+		}
+		mutex_unlock(&server->lock);
+
+		struct idevicerestore_shared_t* shared = idevicerestore_shared_new(client);
+
+		mutex_lock(&server->lock);
+		entry->shared = shared;
+		entry->opening = 0;
+		entry->refs--;
+		cond_broadcast(&server->cond);
+		if (!shared) {
+			// the jobs that waited for it open it themselves
+			for (i = 0; i < SERVER_MAX_IPSWS; i++) {
+				if (server->ipsws[i] == entry) {
+					server->ipsws[i] = NULL;
+				}
+			}
+			server_ipsw_free(entry);
+			mutex_unlock(&server->lock);
+			return NULL;
+		}
+	} else {
+		info("Using prepared %s\n", entry->path);
+	}
+
+	entry->refs++;
+	entry->last_used = ++server->clock;
+	mutex_unlock(&server->lock);
+
+	idevicerestore_set_shared(client, entry->shared);
+	return entry;
+}
+
+static void server_ipsw_release(struct server* server, struct server_ipsw* entry)
+{
+	mutex_lock(&server->lock);
+	entry->refs--;
+	if (entry->refs == 0 && !entry->cached) {
+		server_ipsw_free(entry);
+	}
+	mutex_unlock(&server->lock);
+}
+
+static void server_job_progress(int step, double step_progress, void* userdata)
+{
+	struct server_job* job = (struct server_job*)userdata;
+	int percent = (int)(step_progress * 100.0);
+
+	mutex_lock(&job->lock);
+	if (step == job->step && percent == job->percent) {
+		mutex_unlock(&job->lock);
+		return;
+	}
+	job->step = step;
+	job->percent = percent;
+
+	plist_t message = plist_new_dict();
+	plist_dict_set_item(message, "MsgType", plist_new_string("Progress"));
+	plist_dict_set_item(message, "Step", plist_new_uint(step));
+	plist_dict_set_item(message, "Progress", plist_new_real(step_progress));
+	// a caller that went away doesn't stop the restore
+	server_send_message(job->fd, message);
+	mutex_unlock(&job->lock);
+	plist_free(message);
+}
+
+static int server_job_run(struct server_job* job, plist_t request)
+{
+	struct idevicerestore_client_t* defaults = job->server->client;
+	char* command = NULL;
+	char* ipsw = NULL;
+	char* udid = NULL;
+	uint64_t ecid = 0;
+	uint64_t flags = 0;
+	int result = -1;
+
+	plist_t node = plist_dict_get_item(request, "Command");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &command);
+	}
+	if (!command || strcmp(command, "Restore") != 0) {
+		error("ERROR: Unknown command '%s'\n", (command) ? command : "");
+		free(command);
+		return -1;
+	}
+	free(command);
+
+	node = plist_dict_get_item(request, "IPSW");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &ipsw);
+	}
+	node = plist_dict_get_item(request, "UDID");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &udid);
+	}
+	node = plist_dict_get_item(request, "ECID");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &ecid);
+	}
+	node = plist_dict_get_item(request, "Flags");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &flags);
+	}
+
+	if (!ipsw) {
+		error("ERROR: Restore job without IPSW\n");
+	} else if (!ecid && !udid) {
+		// jobs run side by side, each has to name its device
+		error("ERROR: Restore job for %s needs an ECID or UDID\n", ipsw);
+	} else if (flags & FLAG_LATEST) {
+		error("ERROR: FLAG_LATEST cannot be used with restore jobs.\n");
+	} else {
+		struct idevicerestore_client_t* client = idevicerestore_client_new();
+		if (client) {
+			char context[64];
+			if (ecid) {
+				snprintf(context, sizeof(context), "%llX", (unsigned long long)ecid);
+			} else {
+				snprintf(context, sizeof(context), "%s", udid);
+			}
+			log_set_context(context);
+
+			idevicerestore_set_flags(client, (int)flags);
+			idevicerestore_set_ipsw(client, ipsw);
+			idevicerestore_set_ecid(client, ecid);
+			idevicerestore_set_udid(client, udid);
+			idevicerestore_set_asr_ring_depth(client, defaults->asr_ring_depth);
+			idevicerestore_set_cache_path(client, defaults->cache_dir);
+			idevicerestore_set_cache_limit(client, defaults->cache_limit);
+			idevicerestore_set_progress_callback(client, server_job_progress, job);
+
+			struct server_ipsw* entry = server_ipsw_acquire(job->server, client);
+			if (entry) {
+				result = idevicerestore_start(client);
+				info("%s (%d)\n", (result == 0) ? "Restore succeeded" : "Restore failed", result);
+			}
+			idevicerestore_client_free(client);
+			if (entry) {
+				server_ipsw_release(job->server, entry);
+			}
+			log_set_context(NULL);
+		}
+	}
+
+	free(ipsw);
+	free(udid);
+	return result;
+}
+
+static void* server_job_thread(void* arg)
+{
+	struct server_job* job = (struct server_job*)arg;
+	plist_t request = NULL;
+
+	if (server_receive_message(job->fd, &request, SERVER_REQUEST_TIMEOUT) == 0) {
+		int result = server_job_run(job, request);
+		plist_free(request);
+
+		plist_t message = plist_new_dict();
+		plist_dict_set_item(message, "MsgType", plist_new_string("Result"));
+		plist_dict_set_item(message, "Status", plist_new_uint((uint64_t)(int64_t)result));
+		mutex_lock(&job->lock);
+		server_send_message(job->fd, message);
+		mutex_unlock(&job->lock);
+		plist_free(message);
+	}
+
+	socket_close(job->fd);
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void server_job_free(struct server_job* job)
+{
+	thread_join(job->thread);
+	thread_free(job->thread);
+	mutex_destroy(&job->lock);
+	free(job);
+}
+
+static void server_jobs_reap(struct server_job** jobs)
+{
+	struct server_job** p = jobs;
+	while (*p) {
+		struct server_job* job = *p;
+		if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+			p = &job->next;
+			continue;
+		}
+		*p = job->next;
+		server_job_free(job);
+	}
+}
+
+int server_run(const char* socket_path, struct idevicerestore_client_t* client)
+{
+#ifdef WIN32
+	error("ERROR: Restore jobs over a local socket are not supported on this platform\n");
+	return -1;
+#else
+	struct server server;
+	struct server_job* jobs = NULL;
+
+	if (!socket_path || !client) {
+		return -1;
+	}
+
+	int fd = socket_create_unix(socket_path);
+	if (fd < 0) {
+		error("ERROR: Unable to listen on %s\n", socket_path);
+		return -1;
+	}
+
+	memset(&server, '\0', sizeof(server));
+	server.client = client;
+	mutex_init(&server.lock);
+	cond_init(&server.cond);
+
+	info("Waiting for restore jobs on %s\n", socket_path);
+	while (1) {
+		int cfd = socket_accept(fd, 0);
+		server_jobs_reap(&jobs);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			error("ERROR: Unable to accept a connection on %s (%d)\n", socket_path, errno);
+			break;
+		}
+#ifdef SO_NOSIGPIPE
+		int nosigpipe = 1;
+		setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+
+		struct server_job* job = (struct server_job*)calloc(1, sizeof(struct server_job));
+		if (!job) {
+			error("ERROR: Out of memory\n");
+			socket_close(cfd);
+			continue;
+		}
+		job->server = &server;
+		job->fd = cfd;
+		job->step = -1;
+		job->percent = -1;
+		mutex_init(&job->lock);
+		if (thread_new(&job->thread, server_job_thread, job) != 0) {
+			error("ERROR: Unable to start a restore job\n");
+			socket_close(cfd);
+			mutex_destroy(&job->lock);
+			free(job);
+			continue;
+		}
+		job->next = jobs;
+		jobs = job;
+	}
+
+	socket_close(fd);
+	unlink(socket_path);
+
+	while (jobs) {
+		struct server_job* job = jobs;
+		jobs = job->next;
+		server_job_free(job);
+	}
+
+	int i;
+	for (i = 0; i < SERVER_MAX_IPSWS; i++) {
+		if (server.ipsws[i]) {
+			server_ipsw_free(server.ipsws[i]);
+		}
+	}
+	cond_destroy(&server.cond);
+	mutex_destroy(&server.lock);
+
+	return -1;
+#endif
+}
+
+int server_submit(const char* socket_path, const char* ipsw, unsigned long long ecid, const char* udid, int flags, idevicerestore_progress_cb_t cbfunc, void* userdata)
+{
+#ifdef WIN32
+	error("ERROR: Restore jobs over a local socket are not supported on this platform\n");
+	return -1;
+#else
+	char path[1024];
+	int result = -1;
+
+	if (!socket_path || !ipsw) {
+		return -1;
+	}
+
+	// the server opens the IPSW itself, relative to its own directory
+	if (ipsw[0] != '/' && strlen(ipsw) < sizeof(path) - 2 && getcwd(path, sizeof(path) - 1 - strlen(ipsw))) {
+		strcat(path, "/");
+		strcat(path, ipsw);
+		ipsw = path;
+	}
+
+	int fd = socket_connect_unix(socket_path);
+	if (fd < 0) {
+		error("ERROR: Unable to connect to the restore server on %s\n", socket_path);
+		return -1;
+	}
+#ifdef SO_NOSIGPIPE
+	int nosigpipe = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+
+	plist_t request = plist_new_dict();
+	plist_dict_set_item(request, "Command", plist_new_string("Restore"));
+	plist_dict_set_item(request, "IPSW", plist_new_string(ipsw));
+	if (ecid) {
+		plist_dict_set_item(request, "ECID", plist_new_uint(ecid));
+	}
+	if (udid) {
+		plist_dict_set_item(request, "UDID", plist_new_string(udid));
+	}
+	plist_dict_set_item(request, "Flags", plist_new_uint((uint64_t)flags));
+	int res = server_send_message(fd, request);
+	plist_free(request);
+	if (res < 0) {
+		error("ERROR: Unable to submit restore job\n");
+		socket_close(fd);
+		return -1;
+	}
+
+	while (1) {
+		plist_t message = NULL;
+		char* type = NULL;
+		if (server_receive_message(fd, &message, 0) < 0) {
+			error("ERROR: Lost connection to the restore server\n");
+			break;
+		}
+		plist_t node = plist_dict_get_item(message, "MsgType");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &type);
+		}
+		if (type && !strcmp(type, "Progress")) {
+			uint64_t step = 0;
+			double progress = 0.0;
+			node = plist_dict_get_item(message, "Step");
+			if (node && plist_get_node_type(node) == PLIST_UINT) {
+				plist_get_uint_val(node, &step);
+			}
+			node = plist_dict_get_item(message, "Progress");
+			if (node && plist_get_node_type(node) == PLIST_REAL) {
+				plist_get_real_val(node, &progress);
+			}
+			if (cbfunc) {
+				cbfunc((int)step, progress, userdata);
+			}
+		} else if (type && !strcmp(type, "Result")) {
+			uint64_t status = (uint64_t)-1;
+			node = plist_dict_get_item(message, "Status");
+			if (node && plist_get_node_type(node) == PLIST_UINT) {
+				plist_get_uint_val(node, &status);
+			}
+			result = (int)(int64_t)status;
+			free(type);
+			plist_free(message);
+			break;
+		}
+		free(type);
+		plist_free(message);
+	}
+
+	socket_close(fd);
+	return result;
+#endif
+}
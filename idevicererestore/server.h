@@ -0,0 +1,52 @@
+/*
+ * server.h
+ * Restore jobs submitted to a long running process over a local socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_SERVER_H
+#define IDEVICERESTORE_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "idevicerestore.h"
+
+/* Every message on the socket is a big endian 32 bit length followed by
+ * an XML plist. A job is a single request
+ *   { Command = "Restore", IPSW, ECID or UDID, Flags }
+ * answered with any number of
+ *   { MsgType = "Progress", Step, Progress }
+ * and one final
+ *   { MsgType = "Result", Status }
+ * after which the server closes the connection. */
+
+/* Accepts jobs on the unix socket at socket_path until the process is
+ * terminated, each restored on its own thread with the cache and ASR
+ * settings of client. The opened IPSWs, their BuildManifest and the
+ * version data are kept between jobs, as are the TSS connections. */
+int server_run(const char* socket_path, struct idevicerestore_client_t* client);
+
+/* Submits a job to the server listening on socket_path and reports its
+ * progress through cbfunc. Returns the result of the restore. */
+int server_submit(const char* socket_path, const char* ipsw, unsigned long long ecid, const char* udid, int flags, idevicerestore_progress_cb_t cbfunc, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
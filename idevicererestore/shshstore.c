@@ -0,0 +1,719 @@
+/*
+ * shshstore.c
+ * Packed on-disk store of saved SHSH blobs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "shshstore.h"
+#include "thread.h"
+#include "locking.h"
+#include "cache.h"
+#include "common.h"
+
+#define SHSH_PACK_NAME "shsh.pack"
+#define SHSH_INDEX_NAME "shsh.idx"
+#define SHSH_LOCK_NAME "shsh.lock"
+
+#define SHSH_PACK_MAGIC "SHSHPAK1"
+#define SHSH_INDEX_MAGIC "SHSHIDX1"
+#define SHSH_RECORD_MAGIC 0x52485348 /* "SHHR" */
+
+/* anything bigger is not a TSS response */
+#define SHSH_MAX_KEY_SIZE 256
+#define SHSH_MAX_DATA_SIZE (8 * 1024 * 1024)
+
+struct shsh_pack_header {
+	char magic[8];
+	uint64_t pack_id;
+};
+
+struct shsh_record_header {
+	uint32_t magic;
+	uint32_t key_size;
+	uint32_t data_size;
+	uint32_t crc;
+	uint64_t ecid;
+};
+
+struct shsh_index_header {
+	char magic[8];
+	uint64_t pack_id;
+	uint64_t pack_size;
+	uint32_t num_entries;
+	uint32_t reserved;
+};
+
+struct shsh_index_entry {
+	uint64_t ecid;
+	uint64_t offset;
+	uint32_t key_hash;
+	uint32_t key_size;
+};
+
+struct shsh_entry {
+	uint64_t ecid;
+	uint64_t offset;
+	uint32_t key_hash;
+	uint32_t key_size;
+	int next;
+	/* set once the record was prefetched */
+	unsigned char* data;
+	uint32_t data_size;
+};
+
+struct shsh_store {
+	char* pack_path;
+	char* index_path;
+	char* lock_path;
+	FILE* pack;
+	uint64_t pack_id;
+	/* all records before this offset are in entries */
+	uint64_t pack_end;
+	struct shsh_entry* entries;
+	int num_entries;
+	int max_entries;
+	int* buckets;
+	int num_buckets;
+	int dirty;
+	mutex_t lock;
+	thread_t prefetch_thread;
+	int prefetching;
+	int abort;
+	uint64_t* prefetch_ecids;
+	int num_prefetch_ecids;
+};
+
+static uint32_t shsh_key_hash(const char* key, uint32_t size)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int shsh_bucket(struct shsh_store* store, uint64_t ecid)
+{
+	uint32_t h = (uint32_t)(ecid ^ (ecid >> 32)) * 2654435761u;
+	return (int)(h & (uint32_t)(store->num_buckets - 1));
+}
+
+static char* shsh_path(const char* dir, const char* name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char* path = (char*)malloc(len);
+	if (path) {
+		snprintf(path, len, "%s/%s", dir, name);
+	}
+	return path;
+}
+
+static int shsh_make_key(char* key, size_t key_size, const char* product, const char* version, const char* build)
+{
+	int len = snprintf(key, key_size, "%s-%s-%s", product, version, build);
+	if (len <= 0 || len >= (int)key_size) {
+		return -1;
+	}
+	return len;
+}
+
+static int shsh_rehash(struct shsh_store* store, int num_buckets)
+{
+	int* buckets = (int*)malloc(sizeof(int) * num_buckets);
+	int i;
+
+	if (!buckets) {
+		return -1;
+	}
+	for (i = 0; i < num_buckets; i++) {
+		buckets[i] = -1;
+	}
+	free(store->buckets);
+	store->buckets = buckets;
+	store->num_buckets = num_buckets;
+	for (i = 0; i < store->num_entries; i++) {
+		int b = shsh_bucket(store, store->entries[i].ecid);
+		store->entries[i].next = buckets[b];
+		buckets[b] = i;
+	}
+	return 0;
+}
+
+static int shsh_add_entry(struct shsh_store* store, uint64_t ecid, uint64_t offset, uint32_t key_hash, uint32_t key_size)
+{
+	if (store->num_entries >= store->max_entries) {
+		int max_entries = (store->max_entries > 0) ? store->max_entries * 2 : 256;
+		struct shsh_entry* entries = (struct shsh_entry*)realloc(store->entries, sizeof(struct shsh_entry) * max_entries);
+		if (!entries) {
+			return -1;
+		}
+		store->entries = entries;
+		store->max_entries = max_entries;
+	}
+
+	struct shsh_entry* entry = &store->entries[store->num_entries];
+	memset(entry, '\0', sizeof(struct shsh_entry));
+	entry->ecid = ecid;
+	entry->offset = offset;
+	entry->key_hash = key_hash;
+	entry->key_size = key_size;
+	store->num_entries++;
+
+	if (store->num_entries > store->num_buckets) {
+		/* relinks every entry, including the new one */
+		if (shsh_rehash(store, store->num_buckets * 2) < 0) {
+			store->num_entries--;
+			return -1;
+		}
+		return 0;
+	}
+	int b = shsh_bucket(store, ecid);
+	entry->next = store->buckets[b];
+	store->buckets[b] = store->num_entries - 1;
+	return 0;
+}
+
+/* reads the record at offset, data is only read when asked for and then
+ * checked against the record's checksum */
+static int shsh_read_record(struct shsh_store* store, uint64_t offset, struct shsh_record_header* header, char* key, unsigned char** data)
+{
+	if (fseeko(store->pack, (off_t)offset, SEEK_SET) != 0) {
+		return -1;
+	}
+	if (fread(header, 1, sizeof(struct shsh_record_header), store->pack) != sizeof(struct shsh_record_header)) {
+		return -1;
+	}
+	if (header->magic != SHSH_RECORD_MAGIC || header->key_size == 0 || header->key_size >= SHSH_MAX_KEY_SIZE || header->data_size == 0 || header->data_size > SHSH_MAX_DATA_SIZE) {
+		return -1;
+	}
+	if (fread(key, 1, header->key_size, store->pack) != header->key_size) {
+		return -1;
+	}
+	key[header->key_size] = '\0';
+	if (!data) {
+		return 0;
+	}
+
+	unsigned char* buf = (unsigned char*)malloc(header->data_size);
+	if (!buf) {
+		return -1;
+	}
+	if (fread(buf, 1, header->data_size, store->pack) != header->data_size) {
+		free(buf);
+		return -1;
+	}
+	if ((uint32_t)crc32(crc32(0L, Z_NULL, 0), buf, header->data_size) != header->crc) {
+		error("ERROR: SHSH blob at offset " FMT_qu " of %s is corrupt\n", (long long unsigned int)offset, store->pack_path);
+		free(buf);
+		return -1;
+	}
+	*data = buf;
+	return 0;
+}
+
+/* adds the records after pack_end, stopping at the first torn record so
+ * the next append overwrites it */
+static void shsh_scan_tail(struct shsh_store* store)
+{
+	struct shsh_record_header header;
+	char key[SHSH_MAX_KEY_SIZE];
+	int found = 0;
+
+	while (shsh_read_record(store, store->pack_end, &header, key, NULL) == 0) {
+		uint64_t next = store->pack_end + sizeof(struct shsh_record_header) + header.key_size + header.data_size;
+		if (fseeko(store->pack, (off_t)(next - 1), SEEK_SET) != 0 || fgetc(store->pack) == EOF) {
+			break;
+		}
+		if (shsh_add_entry(store, header.ecid, store->pack_end, shsh_key_hash(key, header.key_size), header.key_size) < 0) {
+			break;
+		}
+		store->pack_end = next;
+		found++;
+	}
+	if (found > 0) {
+		debug("Added %d SHSH blobs from %s\n", found, store->pack_path);
+		store->dirty = 1;
+	}
+}
+
+static int shsh_find(struct shsh_store* store, uint64_t ecid, const char* key, uint32_t key_size)
+{
+	struct shsh_record_header header;
+	char rkey[SHSH_MAX_KEY_SIZE];
+	uint32_t key_hash = shsh_key_hash(key, key_size);
+	int i;
+
+	for (i = store->buckets[shsh_bucket(store, ecid)]; i >= 0; i = store->entries[i].next) {
+		struct shsh_entry* entry = &store->entries[i];
+		if (entry->ecid != ecid || entry->key_hash != key_hash || entry->key_size != key_size) {
+			continue;
+		}
+		if (shsh_read_record(store, entry->offset, &header, rkey, NULL) == 0 && header.ecid == ecid && memcmp(rkey, key, key_size) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void shsh_load_index(struct shsh_store* store, uint64_t pack_size)
+{
+	unsigned char* data = NULL;
+	size_t size = 0;
+
+	if (read_file(store->index_path, (void**)&data, &size) < 0) {
+		return;
+	}
+
+	struct shsh_index_header* header = (struct shsh_index_header*)data;
+	if (size < sizeof(struct shsh_index_header)
+	    || memcmp(header->magic, SHSH_INDEX_MAGIC, 8) != 0
+	    || header->pack_id != store->pack_id
+	    || header->pack_size > pack_size
+	    || size != sizeof(struct shsh_index_header) + (size_t)header->num_entries * sizeof(struct shsh_index_entry)) {
+		debug("Ignoring stale SHSH index %s\n", store->index_path);
+		free(data);
+		return;
+	}
+
+	struct shsh_index_entry* ie = (struct shsh_index_entry*)(data + sizeof(struct shsh_index_header));
+	uint32_t i;
+	for (i = 0; i < header->num_entries; i++) {
+		if (shsh_add_entry(store, ie[i].ecid, ie[i].offset, ie[i].key_hash, ie[i].key_size) < 0) {
+			break;
+		}
+	}
+	if (i == header->num_entries) {
+		store->pack_end = header->pack_size;
+	} else {
+		store->num_entries = 0;
+		shsh_rehash(store, store->num_buckets);
+	}
+	free(data);
+}
+
+static void shsh_write_index(struct shsh_store* store)
+{
+	size_t size = sizeof(struct shsh_index_header) + (size_t)store->num_entries * sizeof(struct shsh_index_entry);
+	unsigned char* data = (unsigned char*)malloc(size);
+	int i;
+
+	if (!data) {
+		return;
+	}
+	struct shsh_index_header* header = (struct shsh_index_header*)data;
+	memset(header, '\0', sizeof(struct shsh_index_header));
+	memcpy(header->magic, SHSH_INDEX_MAGIC, 8);
+	header->pack_id = store->pack_id;
+	header->pack_size = store->pack_end;
+	header->num_entries = (uint32_t)store->num_entries;
+
+	struct shsh_index_entry* ie = (struct shsh_index_entry*)(data + sizeof(struct shsh_index_header));
+	for (i = 0; i < store->num_entries; i++) {
+		ie[i].ecid = store->entries[i].ecid;
+		ie[i].offset = store->entries[i].offset;
+		ie[i].key_hash = store->entries[i].key_hash;
+		ie[i].key_size = store->entries[i].key_size;
+	}
+	if (cache_publish(store->index_path, data, (unsigned int)size) == 0) {
+		store->dirty = 0;
+	}
+	free(data);
+}
+
+static FILE* shsh_open_pack(struct shsh_store* store)
+{
+	struct shsh_pack_header header;
+	lock_info_t lockinfo;
+
+	FILE* f = fopen(store->pack_path, "r+b");
+	if (!f) {
+		if (lock_file(store->lock_path, &lockinfo) != 0) {
+			error("WARNING: Could not lock file '%s'\n", store->lock_path);
+		}
+		f = fopen(store->pack_path, "r+b");
+		if (!f) {
+			f = fopen(store->pack_path, "w+b");
+			if (f) {
+				memset(&header, '\0', sizeof(header));
+				memcpy(header.magic, SHSH_PACK_MAGIC, 8);
+				header.pack_id = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^ (uint64_t)(uintptr_t)store;
+				fwrite(&header, 1, sizeof(header), f);
+				fflush(f);
+			}
+		}
+		unlock_file(&lockinfo);
+		if (!f) {
+			error("ERROR: Unable to create %s\n", store->pack_path);
+			return NULL;
+		}
+	}
+
+	rewind(f);
+	if (fread(&header, 1, sizeof(header), f) != sizeof(header) || memcmp(header.magic, SHSH_PACK_MAGIC, 8) != 0) {
+		error("ERROR: %s is not a SHSH store\n", store->pack_path);
+		fclose(f);
+		return NULL;
+	}
+	store->pack_id = header.pack_id;
+	return f;
+}
+
+struct shsh_store* shsh_store_open(const char* dir)
+{
+	struct stat fst;
+
+	if (!dir) {
+		return NULL;
+	}
+	if (stat(dir, &fst) < 0) {
+		mkdir_with_parents(dir, 0755);
+	}
+
+	struct shsh_store* store = (struct shsh_store*)malloc(sizeof(struct shsh_store));
+	if (!store) {
+		return NULL;
+	}
+	memset(store, '\0', sizeof(struct shsh_store));
+	store->pack_path = shsh_path(dir, SHSH_PACK_NAME);
+	store->index_path = shsh_path(dir, SHSH_INDEX_NAME);
+	store->lock_path = shsh_path(dir, SHSH_LOCK_NAME);
+	if (!store->pack_path || !store->index_path || !store->lock_path || shsh_rehash(store, 256) < 0) {
+		shsh_store_close(store);
+		return NULL;
+	}
+
+	store->pack = shsh_open_pack(store);
+	if (!store->pack) {
+		shsh_store_close(store);
+		return NULL;
+	}
+	store->pack_end = sizeof(struct shsh_pack_header);
+
+	fseeko(store->pack, 0, SEEK_END);
+	shsh_load_index(store, (uint64_t)ftello(store->pack));
+	shsh_scan_tail(store);
+	mutex_init(&store->lock);
+
+	debug("Opened SHSH store %s with %d blobs\n", store->pack_path, store->num_entries);
+	return store;
+}
+
+void shsh_store_close(struct shsh_store* store)
+{
+	int i;
+
+	if (!store) {
+		return;
+	}
+	if (store->pack) {
+		mutex_lock(&store->lock);
+		store->abort = 1;
+		mutex_unlock(&store->lock);
+		if (store->prefetching) {
+			thread_join(store->prefetch_thread);
+			thread_free(store->prefetch_thread);
+		}
+		if (store->dirty) {
+			shsh_write_index(store);
+		}
+		fclose(store->pack);
+		mutex_destroy(&store->lock);
+	}
+	for (i = 0; i < store->num_entries; i++) {
+		free(store->entries[i].data);
+	}
+	free(store->entries);
+	free(store->buckets);
+	free(store->prefetch_ecids);
+	free(store->pack_path);
+	free(store->index_path);
+	free(store->lock_path);
+	free(store);
+}
+
+int shsh_store_get(struct shsh_store* store, uint64_t ecid, const char* product, const char* version, const char* build, plist_t* tss)
+{
+	struct shsh_record_header header;
+	char key[SHSH_MAX_KEY_SIZE];
+	unsigned char* data = NULL;
+	uint32_t size = 0;
+
+	*tss = NULL;
+	if (!store || !product || !version || !build) {
+		return -1;
+	}
+	int key_size = shsh_make_key(key, sizeof(key), product, version, build);
+	if (key_size < 0) {
+		return -1;
+	}
+
+	mutex_lock(&store->lock);
+	int i = shsh_find(store, ecid, key, (uint32_t)key_size);
+	if (i >= 0) {
+		struct shsh_entry* entry = &store->entries[i];
+		if (entry->data) {
+			data = (unsigned char*)malloc(entry->data_size);
+			if (data) {
+				memcpy(data, entry->data, entry->data_size);
+				size = entry->data_size;
+			}
+		} else {
+			char rkey[SHSH_MAX_KEY_SIZE];
+			if (shsh_read_record(store, entry->offset, &header, rkey, &data) == 0) {
+				size = header.data_size;
+			}
+		}
+	}
+	mutex_unlock(&store->lock);
+
+	if (!data) {
+		return -1;
+	}
+	if (size >= 8 && memcmp(data, "bplist00", 8) == 0) {
+		plist_from_bin((char*)data, size, tss);
+	} else {
+		plist_from_xml((char*)data, size, tss);
+	}
+	free(data);
+
+	return (*tss) ? 0 : -1;
+}
+
+int shsh_store_put(struct shsh_store* store, uint64_t ecid, const char* product, const char* version, const char* build, plist_t tss)
+{
+	struct shsh_record_header header;
+	lock_info_t lockinfo;
+	char key[SHSH_MAX_KEY_SIZE];
+	char* bin = NULL;
+	uint32_t blen = 0;
+	int res = -1;
+
+	if (!store || !tss || !product || !version || !build) {
+		return -1;
+	}
+	int key_size = shsh_make_key(key, sizeof(key), product, version, build);
+	if (key_size < 0) {
+		return -1;
+	}
+	plist_to_bin(tss, &bin, &blen);
+	if (!bin || blen == 0 || blen > SHSH_MAX_DATA_SIZE) {
+		free(bin);
+		return -1;
+	}
+
+	memset(&header, '\0', sizeof(header));
+	header.magic = SHSH_RECORD_MAGIC;
+	header.key_size = (uint32_t)key_size;
+	header.data_size = blen;
+	header.crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const unsigned char*)bin, blen);
+	header.ecid = ecid;
+
+	mutex_lock(&store->lock);
+	if (lock_file(store->lock_path, &lockinfo) != 0) {
+		error("WARNING: Could not lock file '%s'\n", store->lock_path);
+	}
+	/* another process may have appended since we last looked */
+	shsh_scan_tail(store);
+	if (shsh_find(store, ecid, key, (uint32_t)key_size) >= 0) {
+		res = 1;
+	} else if (fseeko(store->pack, (off_t)store->pack_end, SEEK_SET) == 0
+	    && fwrite(&header, 1, sizeof(header), store->pack) == sizeof(header)
+	    && fwrite(key, 1, key_size, store->pack) == (size_t)key_size
+	    && fwrite(bin, 1, blen, store->pack) == blen
+	    && fflush(store->pack) == 0) {
+		if (shsh_add_entry(store, ecid, store->pack_end, shsh_key_hash(key, key_size), key_size) == 0) {
+			store->pack_end += sizeof(header) + key_size + blen;
+			store->dirty = 1;
+			res = 0;
+		}
+	} else {
+		error("ERROR: Unable to write SHSH blob to %s\n", store->pack_path);
+	}
+	unlock_file(&lockinfo);
+	mutex_unlock(&store->lock);
+
+	free(bin);
+	return res;
+}
+
+int shsh_store_read_legacy(const char* path, plist_t* tss)
+{
+	*tss = NULL;
+
+	gzFile zf = gzopen(path, "rb");
+	if (!zf) {
+		return -1;
+	}
+
+	int blen = 0;
+	int bufsize = 16384;
+	char* bin = (char*)malloc(bufsize);
+	while (bin) {
+		int bytes_read = gzread(zf, bin + blen, bufsize - blen);
+		if (bytes_read < 0) {
+			error("ERROR: Error reading gz compressed data from %s\n", path);
+			free(bin);
+			bin = NULL;
+			break;
+		}
+		blen += bytes_read;
+		if (bytes_read == 0 || gzeof(zf)) {
+			break;
+		}
+		if (blen == bufsize) {
+			char* nbin = (char*)realloc(bin, bufsize * 2);
+			if (!nbin) {
+				free(bin);
+				bin = NULL;
+				break;
+			}
+			bin = nbin;
+			bufsize *= 2;
+		}
+	}
+	gzclose(zf);
+
+	if (bin && blen > 0) {
+		if (blen >= 8 && memcmp(bin, "bplist00", 8) == 0) {
+			plist_from_bin(bin, blen, tss);
+		} else {
+			plist_from_xml(bin, blen, tss);
+		}
+	}
+	free(bin);
+
+	return (*tss) ? 0 : -1;
+}
+
+int shsh_store_import_dir(struct shsh_store* store, const char* dir)
+{
+	struct dirent* ent;
+	int imported = 0;
+
+	DIR* d = opendir(dir);
+	if (!d) {
+		error("ERROR: Unable to open directory %s\n", dir);
+		return -1;
+	}
+	while ((ent = readdir(d)) != NULL) {
+		/* ECID-product-version-build.shsh */
+		char name[256];
+		size_t len = strlen(ent->d_name);
+		if (len <= 5 || len >= sizeof(name) || strcmp(ent->d_name + len - 5, ".shsh") != 0) {
+			continue;
+		}
+		strcpy(name, ent->d_name);
+		name[len - 5] = '\0';
+
+		char* product = strchr(name, '-');
+		char* version = (product) ? strchr(product + 1, '-') : NULL;
+		char* build = (version) ? strchr(version + 1, '-') : NULL;
+		if (!build) {
+			continue;
+		}
+		*product++ = '\0';
+		*version++ = '\0';
+		*build++ = '\0';
+		uint64_t ecid = strtoull(name, NULL, 10);
+		if (ecid == 0) {
+			continue;
+		}
+
+		char path[1024];
+		plist_t tss = NULL;
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (shsh_store_read_legacy(path, &tss) < 0) {
+			error("WARNING: Skipping unreadable SHSH blob %s\n", path);
+			continue;
+		}
+		if (shsh_store_put(store, ecid, product, version, build, tss) == 0) {
+			imported++;
+		}
+		plist_free(tss);
+	}
+	closedir(d);
+
+	return imported;
+}
+
+static void* shsh_prefetch_thread(void* arg)
+{
+	struct shsh_store* store = (struct shsh_store*)arg;
+	struct shsh_record_header header;
+	char key[SHSH_MAX_KEY_SIZE];
+	int loaded = 0;
+	int n;
+
+	for (n = 0; n < store->num_prefetch_ecids; n++) {
+		uint64_t ecid = store->prefetch_ecids[n];
+		mutex_lock(&store->lock);
+		int i = store->buckets[shsh_bucket(store, ecid)];
+		while (i >= 0 && !store->abort) {
+			struct shsh_entry* entry = &store->entries[i];
+			if (entry->ecid == ecid && !entry->data) {
+				unsigned char* data = NULL;
+				if (shsh_read_record(store, entry->offset, &header, key, &data) == 0 && header.ecid == ecid) {
+					entry->data = data;
+					entry->data_size = header.data_size;
+					loaded++;
+				} else {
+					free(data);
+				}
+			}
+			i = entry->next;
+		}
+		int abort = store->abort;
+		mutex_unlock(&store->lock);
+		if (abort) {
+			break;
+		}
+	}
+	debug("Prefetched %d SHSH blobs\n", loaded);
+
+	return NULL;
+}
+
+int shsh_store_prefetch(struct shsh_store* store, const uint64_t* ecids, int num_ecids)
+{
+	if (!store || !ecids || num_ecids <= 0 || store->prefetching) {
+		return -1;
+	}
+	store->prefetch_ecids = (uint64_t*)malloc(sizeof(uint64_t) * num_ecids);
+	if (!store->prefetch_ecids) {
+		return -1;
+	}
+	memcpy(store->prefetch_ecids, ecids, sizeof(uint64_t) * num_ecids);
+	store->num_prefetch_ecids = num_ecids;
+	if (thread_new(&store->prefetch_thread, shsh_prefetch_thread, store) != 0) {
+		free(store->prefetch_ecids);
+		store->prefetch_ecids = NULL;
+		return -1;
+	}
+	store->prefetching = 1;
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * shshstore.h
+ * Packed on-disk store of saved SHSH blobs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_SHSHSTORE_H
+#define IDEVICERESTORE_SHSHSTORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+struct shsh_store;
+
+/* Blobs are appended to <dir>/shsh.pack as checksummed records keyed by
+ * ECID and "product-version-build". <dir>/shsh.idx maps every ECID to its
+ * record offsets so opening the store doesn't have to read the pack;
+ * records appended after the index was written are picked up by scanning
+ * just the tail. Appends are serialized between processes with a lock
+ * file, a store handle may be shared between threads. */
+struct shsh_store* shsh_store_open(const char* dir);
+void shsh_store_close(struct shsh_store* store);
+
+/* Returns 0 and the TSS response in tss if a valid record exists, -1 if
+ * it doesn't or its checksum doesn't match. */
+int shsh_store_get(struct shsh_store* store, uint64_t ecid, const char* product, const char* version, const char* build, plist_t* tss);
+
+/* Returns 0 if the blob was added, 1 if one was already present. */
+int shsh_store_put(struct shsh_store* store, uint64_t ecid, const char* product, const char* version, const char* build, plist_t tss);
+
+/* reads a gzipped blob file as written by earlier versions */
+int shsh_store_read_legacy(const char* path, plist_t* tss);
+
+/* Adds every gzipped ECID-product-version-build.shsh file in dir, as
+ * written by earlier versions, and returns the number of blobs added. */
+int shsh_store_import_dir(struct shsh_store* store, const char* dir);
+
+/* Reads and verifies all blobs of the given devices on a background
+ * thread so that shsh_store_get() for them is served from memory. */
+int shsh_store_prefetch(struct shsh_store* store, const uint64_t* ecids, int num_ecids);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
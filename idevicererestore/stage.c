@@ -0,0 +1,406 @@
+/*
+ * stage.c
+ * Background extraction and personalization of firmware components
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stage.h"
+#include "thread.h"
+#include "cache.h"
+#include "trace.h"
+#include "tss.h"
+#include "common.h"
+#include "idevicerestore.h"
+#include "manifest.h"
+#include "budget.h"
+#include "ipsw.h"
+#include "journal.h"
+
+/* staged components stay in memory until they are sent, anything past
+ * this is left for the sender to prepare itself */
+#define COMPONENT_STAGE_MAX_BYTES (256 * 1024 * 1024)
+
+enum {
+	STAGE_PENDING = 0,
+	STAGE_READY,
+	STAGE_FAILED,
+	STAGE_TAKEN
+};
+
+struct stage_entry {
+	char* component;
+	char* path;
+	unsigned char* data;
+	unsigned int size;
+	int state;
+	/* set once a sender waits for the entry */
+	int wanted;
+};
+
+struct component_stage {
+	struct idevicerestore_client_t* client;
+	plist_t build_identity;
+	const struct manifest_identity* identity;
+	plist_t tss;
+	struct stage_entry* entries;
+	int num_entries;
+	uint64_t staged_bytes;
+	int abort;
+	int running;
+	thread_t thread;
+	mutex_t lock;
+	cond_t cond;
+};
+
+/* the order components are sent in, everything else follows */
+static const char* stage_order[] = {
+	"iBSS",
+	"iBEC",
+	"AppleLogo",
+	"RestoreDeviceTree",
+	"DeviceTree",
+	"RestoreRamDisk",
+	"RestoreKernelCache",
+	"KernelCache",
+	"LLB",
+	"iBoot",
+	NULL
+};
+
+static int stage_skip_component(const char* component)
+{
+	/* the filesystem is streamed by ASR and the baseband is flashed from its own bundle */
+	return (!strcmp(component, "OS") || !strcmp(component, "BasebandFirmware"));
+}
+
+static int stage_find_entry(struct component_stage* stage, const char* component)
+{
+	int i;
+	for (i = 0; i < stage->num_entries; i++) {
+		if (!strcmp(stage->entries[i].component, component)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void stage_add_entry(struct component_stage* stage, const char* component)
+{
+	char* path = NULL;
+
+	if (stage_skip_component(component) || stage_find_entry(stage, component) >= 0) {
+		return;
+	}
+
+	/* resolve the path the same way the senders do */
+	if (stage->tss && tss_response_get_path_by_entry(stage->tss, component, &path) < 0) {
+		path = NULL;
+	}
+	if (!path) {
+		int res = (stage->identity)
+			? manifest_identity_get_component_path(stage->identity, component, &path)
+			: build_identity_get_component_path(stage->build_identity, component, &path);
+		if (res < 0) {
+			free(path);
+			return;
+		}
+	}
+
+	struct stage_entry* entries = (struct stage_entry*)realloc(stage->entries, sizeof(struct stage_entry) * (stage->num_entries + 1));
+	if (!entries) {
+		free(path);
+		return;
+	}
+	stage->entries = entries;
+	memset(&entries[stage->num_entries], '\0', sizeof(struct stage_entry));
+	entries[stage->num_entries].component = strdup(component);
+	entries[stage->num_entries].path = path;
+	stage->num_entries++;
+}
+
+/* a stage stops waiting for memory once the restore needs the entry */
+struct stage_wait {
+	struct component_stage* stage;
+	struct stage_entry* entry;
+};
+
+static int stage_wait_interrupted(void* arg)
+{
+	struct stage_wait* wait = (struct stage_wait*)arg;
+	return __atomic_load_n(&wait->stage->abort, __ATOMIC_ACQUIRE) || __atomic_load_n(&wait->entry->wanted, __ATOMIC_ACQUIRE);
+}
+
+static int stage_no_wait(void* arg)
+{
+	(void)arg;
+	return 1;
+}
+
+/* the sender prepares an entry that isn't staged */
+static void stage_skip_entry(struct component_stage* stage, struct stage_entry* entry)
+{
+	mutex_lock(&stage->lock);
+	entry->state = STAGE_FAILED;
+	cond_broadcast(&stage->cond);
+	mutex_unlock(&stage->lock);
+}
+
+static void* stage_thread(void* arg)
+{
+	struct component_stage* stage = (struct component_stage*)arg;
+	struct idevicerestore_client_t* client = stage->client;
+	int i;
+
+	for (i = 0; i < stage->num_entries; i++) {
+		struct stage_entry* entry = &stage->entries[i];
+		unsigned char* component_data = NULL;
+		unsigned int component_size = 0;
+		int component_mapped = 0;
+		unsigned char* data = NULL;
+		unsigned int size = 0;
+		int res = -1;
+
+		mutex_lock(&stage->lock);
+		int abort = stage->abort;
+		uint64_t staged_bytes = stage->staged_bytes;
+		mutex_unlock(&stage->lock);
+		if (abort) {
+			break;
+		}
+
+		/* room for the extracted and the personalized copy; an entry that
+		 * doesn't get it is left to its sender instead of going over the budget */
+		off_t estimate = 0;
+		uint64_t reserved = 0;
+		if (ipsw_archive_get_file_size(client->archive, entry->path, &estimate) < 0 || estimate <= 0) {
+			stage_skip_entry(stage, entry);
+			continue;
+		}
+		struct stage_wait wait = { stage, entry };
+		reserved = 2 * (uint64_t)estimate;
+		if (budget_reserve(&client->memory, reserved, stage_wait_interrupted, &wait) < 0) {
+			if (__atomic_load_n(&stage->abort, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			debug("NOTE: Not staging %s, the memory budget is exhausted\n", entry->component);
+			stage_skip_entry(stage, entry);
+			continue;
+		}
+
+		int span = trace_begin(client->trace, "stage", entry->component);
+		if (staged_bytes < COMPONENT_STAGE_MAX_BYTES
+		    && journal_get_component(client->journal, stage->tss, entry->component, &data, &size) == 0) {
+			debug("Using %s personalized by an earlier attempt\n", entry->component);
+			res = 0;
+		} else if (staged_bytes < COMPONENT_STAGE_MAX_BYTES
+		    && extract_component_cached(client, stage->build_identity, entry->component, entry->path, &component_data, &component_size, &component_mapped) == 0) {
+			if (staged_bytes + component_size <= COMPONENT_STAGE_MAX_BYTES) {
+				int pspan = trace_begin(client->trace, "personalize", entry->component);
+				res = personalize_component(entry->component, component_data, component_size, stage->tss, &data, &size);
+				trace_end(client->trace, pspan, (res == 0) ? component_size : 0, res);
+			}
+			cache_release(component_data, component_size, component_mapped);
+			if (res == 0) {
+				journal_put_component(client->journal, stage->tss, entry->component, data, size);
+			}
+		}
+		trace_end(client->trace, span, (res == 0) ? size : 0, res);
+
+		// only the staged data stays charged, until it's taken
+		if (res == 0 && size > reserved && budget_reserve(&client->memory, size - reserved, stage_no_wait, NULL) == 0) {
+			reserved = size;
+		}
+		if (res == 0 && size > reserved) {
+			debug("NOTE: Not staging %s, the memory budget is exhausted\n", entry->component);
+			free(data);
+			data = NULL;
+			res = -1;
+		}
+		budget_release(&client->memory, reserved - ((res == 0) ? size : 0));
+
+		mutex_lock(&stage->lock);
+		if (res == 0) {
+			entry->data = data;
+			entry->size = size;
+			entry->state = STAGE_READY;
+			stage->staged_bytes += size;
+		} else {
+			entry->state = STAGE_FAILED;
+		}
+		cond_broadcast(&stage->cond);
+		mutex_unlock(&stage->lock);
+	}
+
+	/* anything left over is prepared by its sender */
+	mutex_lock(&stage->lock);
+	for (; i < stage->num_entries; i++) {
+		if (stage->entries[i].state == STAGE_PENDING) {
+			stage->entries[i].state = STAGE_FAILED;
+		}
+	}
+	cond_broadcast(&stage->cond);
+	mutex_unlock(&stage->lock);
+
+	return NULL;
+}
+
+struct component_stage* component_stage_start(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	plist_t manifest = NULL;
+	int i;
+
+	if (!client || !build_identity || !client->archive) {
+		return NULL;
+	}
+
+	struct component_stage* stage = (struct component_stage*)malloc(sizeof(struct component_stage));
+	if (!stage) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(stage, '\0', sizeof(struct component_stage));
+	stage->client = client;
+	stage->build_identity = plist_copy(build_identity);
+	if (build_identity == client->identity_plist) {
+		stage->identity = client->identity;
+	}
+	if (client->tss) {
+		stage->tss = plist_copy(client->tss);
+	}
+	mutex_init(&stage->lock);
+	cond_init(&stage->cond);
+
+	for (i = 0; stage_order[i]; i++) {
+		if (plist_access_path(stage->build_identity, 2, "Manifest", stage_order[i])) {
+			stage_add_entry(stage, stage_order[i]);
+		}
+	}
+	manifest = plist_dict_get_item(stage->build_identity, "Manifest");
+	if (manifest && plist_get_node_type(manifest) == PLIST_DICT) {
+		plist_dict_iter iter = NULL;
+		char* key = NULL;
+		plist_t node = NULL;
+		plist_dict_new_iter(manifest, &iter);
+		do {
+			key = NULL;
+			plist_dict_next_item(manifest, iter, &key, &node);
+			if (key) {
+				stage_add_entry(stage, key);
+				free(key);
+			}
+		} while (key);
+		free(iter);
+	}
+
+	if (stage->num_entries == 0 || thread_new(&stage->thread, stage_thread, stage) != 0) {
+		debug("NOTE: Components will be prepared as they are sent\n");
+		component_stage_free(stage);
+		return NULL;
+	}
+	stage->running = 1;
+
+	debug("Staging %d components in the background\n", stage->num_entries);
+	return stage;
+}
+
+int component_stage_take(struct component_stage* stage, const char* component, const char* path, unsigned char** data, unsigned int* size)
+{
+	int res = -1;
+
+	if (!stage || !component || !data || !size) {
+		return -1;
+	}
+
+	mutex_lock(&stage->lock);
+	int i = stage_find_entry(stage, component);
+	if (i >= 0 && (!path || !strcmp(stage->entries[i].path, path))) {
+		struct stage_entry* entry = &stage->entries[i];
+		__atomic_store_n(&entry->wanted, 1, __ATOMIC_RELEASE);
+		while (entry->state == STAGE_PENDING) {
+			cond_wait(&stage->cond, &stage->lock);
+		}
+		if (entry->state == STAGE_READY) {
+			*data = entry->data;
+			*size = entry->size;
+			entry->data = NULL;
+			entry->state = STAGE_TAKEN;
+			stage->staged_bytes -= entry->size;
+			res = 0;
+		}
+	}
+	mutex_unlock(&stage->lock);
+
+	if (res == 0) {
+		debug("Using staged %s (%u bytes)\n", component, *size);
+	}
+
+	return res;
+}
+
+int component_stage_take_segments(struct component_stage* stage, const char* component, const char* path, struct component_segments* segs)
+{
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+
+	if (component_stage_take(stage, component, path, &data, &size) < 0) {
+		return -1;
+	}
+	component_segments_init(segs);
+	component_segments_add(segs, data, size);
+	segs->owned = data;
+
+	return 0;
+}
+
+void component_stage_free(struct component_stage* stage)
+{
+	int i;
+
+	if (!stage) {
+		return;
+	}
+
+	if (stage->running) {
+		mutex_lock(&stage->lock);
+		__atomic_store_n(&stage->abort, 1, __ATOMIC_RELEASE);
+		mutex_unlock(&stage->lock);
+		thread_join(stage->thread);
+		thread_free(stage->thread);
+	}
+
+	for (i = 0; i < stage->num_entries; i++) {
+		free(stage->entries[i].component);
+		free(stage->entries[i].path);
+		if (stage->entries[i].data) {
+			free(stage->entries[i].data);
+			budget_release(&stage->client->memory, stage->entries[i].size);
+		}
+	}
+	free(stage->entries);
+	if (stage->build_identity) {
+		plist_free(stage->build_identity);
+	}
+	if (stage->tss) {
+		plist_free(stage->tss);
+	}
+	cond_destroy(&stage->cond);
+	mutex_destroy(&stage->lock);
+	free(stage);
+}
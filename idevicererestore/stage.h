@@ -0,0 +1,57 @@
+/*
+ * stage.h
+ * Background extraction and personalization of firmware components
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_STAGE_H
+#define IDEVICERESTORE_STAGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+struct idevicerestore_client_t;
+struct component_stage;
+struct component_segments;
+
+/* Extracts and personalizes the components of build_identity on a
+ * background thread, in the order the restore sends them, while the
+ * device is busy rebooting between modes. The stage works on its own
+ * copies of the build identity and TSS response; it has to be restarted
+ * whenever client->tss is replaced. */
+struct component_stage* component_stage_start(struct idevicerestore_client_t* client, plist_t build_identity);
+
+/* Waits for component to be staged and hands over its personalized data,
+ * which the caller frees. The data stays charged to client->memory, the
+ * caller releases size bytes once it freed it. Returns -1 if the stage is NULL, doesn't know
+ * the component under path, or failed to prepare it; the caller then
+ * prepares the component itself. Each component can be taken once. */
+int component_stage_take(struct component_stage* stage, const char* component, const char* path, unsigned char** data, unsigned int* size);
+
+/* same as component_stage_take, with the data owned by segs */
+int component_stage_take_segments(struct component_stage* stage, const char* component, const char* path, struct component_segments* segs);
+
+/* stops the background thread and frees whatever wasn't taken */
+void component_stage_free(struct component_stage* stage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,6 +19,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef WIN32
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
 #include "thread.h"
 
 int thread_new(thread_t *thread, thread_func_t thread_func, void* data)
@@ -89,6 +94,75 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifndef WIN32
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
+/* returns 0 when signaled, 1 on timeout, -1 on error */
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	if (!SleepConditionVariableCS(cond, mutex, timeout_ms)) {
+		return (GetLastError() == ERROR_TIMEOUT) ? 1 : -1;
+	}
+	return 0;
+#else
+	struct timeval now;
+	struct timespec ts;
+	gettimeofday(&now, NULL);
+	ts.tv_sec = now.tv_sec + timeout_ms / 1000;
+	ts.tv_nsec = (now.tv_usec + (timeout_ms % 1000) * 1000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	int res = pthread_cond_timedwait(cond, mutex, &ts);
+	if (res == ETIMEDOUT) {
+		return 1;
+	}
+	return (res == 0) ? 0 : -1;
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
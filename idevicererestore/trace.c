@@ -0,0 +1,218 @@
+/*
+ * trace.c
+ * Functions for recording restore phase timings
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+#include "trace.h"
+#include "thread.h"
+#include "common.h"
+
+struct trace_span {
+	const char* phase;
+	char* name;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+	int result;
+};
+
+struct trace {
+	mutex_t lock;
+	struct trace_span* spans;
+	int num_spans;
+	int max_spans;
+};
+
+static uint64_t trace_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct trace* trace_new(void)
+{
+	struct trace* trace = (struct trace*)malloc(sizeof(struct trace));
+	if (!trace) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(trace, '\0', sizeof(struct trace));
+	mutex_init(&trace->lock);
+	return trace;
+}
+
+void trace_free(struct trace* trace)
+{
+	int i;
+
+	if (!trace) {
+		return;
+	}
+	for (i = 0; i < trace->num_spans; i++) {
+		free(trace->spans[i].name);
+	}
+	free(trace->spans);
+	mutex_destroy(&trace->lock);
+	free(trace);
+}
+
+int trace_begin(struct trace* trace, const char* phase, const char* name)
+{
+	int span = -1;
+
+	if (!trace || !phase) {
+		return -1;
+	}
+
+	mutex_lock(&trace->lock);
+	if (trace->num_spans == trace->max_spans) {
+		int max_spans = (trace->max_spans) ? trace->max_spans * 2 : 32;
+		struct trace_span* spans = (struct trace_span*)realloc(trace->spans, max_spans * sizeof(struct trace_span));
+		if (!spans) {
+			mutex_unlock(&trace->lock);
+			return -1;
+		}
+		trace->spans = spans;
+		trace->max_spans = max_spans;
+	}
+	span = trace->num_spans++;
+	memset(&trace->spans[span], '\0', sizeof(struct trace_span));
+	trace->spans[span].phase = phase;
+	trace->spans[span].name = (name) ? strdup(name) : NULL;
+	trace->spans[span].start = trace_time_us();
+	mutex_unlock(&trace->lock);
+
+	return span;
+}
+
+void trace_end(struct trace* trace, int span, uint64_t bytes, int result)
+{
+	if (!trace || span < 0) {
+		return;
+	}
+
+	mutex_lock(&trace->lock);
+	if (span < trace->num_spans) {
+		trace->spans[span].end = trace_time_us();
+		trace->spans[span].bytes = bytes;
+		trace->spans[span].result = result;
+	}
+	mutex_unlock(&trace->lock);
+}
+
+static void trace_write_csv_string(FILE* f, const char* str)
+{
+	fputc('"', f);
+	for (; str && *str; str++) {
+		if (*str == '"') {
+			fputc('"', f);
+		}
+		fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/* bytes per second, 0 for spans that didn't transfer anything */
+static uint64_t trace_span_throughput(const struct trace_span* s)
+{
+	uint64_t duration = s->end - s->start;
+	if (s->bytes == 0 || s->end == 0 || duration == 0) {
+		return 0;
+	}
+	return (s->bytes * 1000000) / duration;
+}
+
+/* names are component or file names, so only escape what JSON requires */
+static void trace_write_json_string(FILE* f, const char* str)
+{
+	if (!str) {
+		fputs("null", f);
+		return;
+	}
+	fputc('"', f);
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fputc('\\', f);
+			fputc(*str, f);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+int trace_write(struct trace* trace, const char* path, uint64_t ecid)
+{
+	FILE* f = NULL;
+	int csv = 0;
+	int i;
+
+	if (!trace || !path) {
+		return -1;
+	}
+
+	size_t len = strlen(path);
+	if (len > 4 && strcasecmp(path + len - 4, ".csv") == 0) {
+		csv = 1;
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		error("ERROR: Unable to open trace file %s\n", path);
+		return -1;
+	}
+
+	mutex_lock(&trace->lock);
+	if (csv) {
+		fprintf(f, "ecid,phase,name,start_us,end_us,duration_us,bytes,bytes_per_sec,result\n");
+	} else {
+		fprintf(f, "{\"ecid\":\"0x%llx\",\"spans\":[", (long long unsigned int)ecid);
+	}
+	for (i = 0; i < trace->num_spans; i++) {
+		const struct trace_span* s = &trace->spans[i];
+		uint64_t duration = (s->end) ? s->end - s->start : 0;
+		if (csv) {
+			fprintf(f, "0x%llx,%s,", (long long unsigned int)ecid, s->phase);
+			trace_write_csv_string(f, s->name);
+			fprintf(f, "," FMT_qu "," FMT_qu "," FMT_qu "," FMT_qu "," FMT_qu ",%d\n",
+				(long long unsigned int)s->start, (long long unsigned int)s->end, (long long unsigned int)duration,
+				(long long unsigned int)s->bytes, (long long unsigned int)trace_span_throughput(s), s->result);
+		} else {
+			fprintf(f, "%s{\"phase\":\"%s\",\"name\":", (i > 0) ? "," : "", s->phase);
+			trace_write_json_string(f, s->name);
+			fprintf(f, ",\"start_us\":" FMT_qu ",\"end_us\":" FMT_qu ",\"duration_us\":" FMT_qu ",\"bytes\":" FMT_qu ",\"bytes_per_sec\":" FMT_qu ",\"result\":%d}",
+				(long long unsigned int)s->start, (long long unsigned int)s->end, (long long unsigned int)duration,
+				(long long unsigned int)s->bytes, (long long unsigned int)trace_span_throughput(s), s->result);
+		}
+	}
+	if (!csv) {
+		fprintf(f, "]}\n");
+	}
+	mutex_unlock(&trace->lock);
+
+	fclose(f);
+	return 0;
+}
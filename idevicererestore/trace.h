@@ -0,0 +1,49 @@
+/*
+ * trace.h
+ * Functions for recording restore phase timings
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_TRACE_H
+#define IDEVICERESTORE_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct trace;
+
+/* A trace records one span per restore phase or component with its wall
+ * clock start and end and, for transfers and personalization, the number
+ * of bytes processed. All functions accept a NULL trace and do nothing, so call sites don't need
+ * to check whether tracing was requested. */
+struct trace* trace_new(void);
+void trace_free(struct trace* trace);
+
+/* phase must be a string literal, name may be NULL and is copied */
+int trace_begin(struct trace* trace, const char* phase, const char* name);
+void trace_end(struct trace* trace, int span, uint64_t bytes, int result);
+
+/* writes CSV if path ends in .csv and JSON otherwise */
+int trace_write(struct trace* trace, const char* path, uint64_t ecid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,12 +25,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <curl/curl.h>
 #include <plist/plist.h>
+#include <openssl/sha.h>
 
 #include "tss.h"
 #include "img3.h"
 #include "common.h"
+#include "thread.h"
+#include "net.h"
 #include "idevicerestore.h"
 
 #define TSS_CLIENT_VERSION_STRING "libauthinstall-293.1.16"
@@ -144,6 +148,7 @@ int tss_parameters_add_from_manifest(plist_t parameters, plist_t build_identity)
 		plist_get_string_val(node, &bb_chip_id_string);
 		sscanf(bb_chip_id_string, "%x", &bb_chip_id);
 		plist_dict_set_item(parameters, "BbChipID", plist_new_uint(bb_chip_id));
+		free(bb_chip_id_string);
 	} else {
 		error("WARNING: Unable to find BbChipID node\n");
 	}
@@ -327,18 +332,10 @@ int tss_request_add_ap_img3_tags(plist_t request, plist_t parameters) {
 	return 0;
 }
 
-int tss_request_add_common_tags(plist_t request, plist_t parameters, plist_t overrides) {
+/* the common tags that only depend on the build identity */
+static void tss_request_add_build_tags(plist_t request, plist_t parameters) {
 	plist_t node = NULL;
 
-	/* ApECID */
-	node = plist_dict_get_item(parameters, "ApECID");
-	if (!node || plist_get_node_type(node) != PLIST_UINT) {
-		error("ERROR: Unable to find required ApECID in parameters\n");
-		return -1;
-	}
-	plist_dict_set_item(request, "ApECID", plist_copy(node));
-	node = NULL;
-
 	/* UniqueBuildID */
 	node = plist_dict_get_item(parameters, "UniqueBuildID");
 	if (node) {
@@ -365,8 +362,22 @@ int tss_request_add_common_tags(plist_t request, plist_t parameters, plist_t ove
 	if (node) {
 		plist_dict_set_item(request, "ApSecurityDomain", plist_copy(node));
 	}
+}
+
+int tss_request_add_common_tags(plist_t request, plist_t parameters, plist_t overrides) {
+	plist_t node = NULL;
+
+	/* ApECID */
+	node = plist_dict_get_item(parameters, "ApECID");
+	if (!node || plist_get_node_type(node) != PLIST_UINT) {
+		error("ERROR: Unable to find required ApECID in parameters\n");
+		return -1;
+	}
+	plist_dict_set_item(request, "ApECID", plist_copy(node));
 	node = NULL;
 
+	tss_request_add_build_tags(request, parameters);
+
 	/* apply overrides */
 	if (overrides) {
 		plist_dict_merge(&request, overrides);
@@ -449,6 +460,8 @@ static void tss_entry_apply_restore_request_rules(plist_t tss_entry, plist_t par
 			}
 			free(key);
 		}
+		free(iter);
+		iter = NULL;
 	}
 }
 
@@ -735,6 +748,225 @@ int tss_request_add_se_tags(plist_t request, plist_t parameters, plist_t overrid
 	return 0;
 }
 
+#define TSS_TEMPLATE_CACHE_SIZE 8
+
+struct tss_template {
+	int refs;
+	unsigned char* build_id;
+	uint64_t build_id_size;
+	/* Erase and Update identities share a UniqueBuildID but not their
+	 * Manifest, so templates are told apart by a digest of it as well */
+	unsigned char manifest_digest[SHA_DIGEST_LENGTH];
+	char* hardware_model;
+	int image4;
+	/* everything taken from the build identity, with the Manifest reduced
+	 * to the BasebandFirmware entry needed by baseband requests */
+	plist_t parameters;
+	/* common and AP tags, without any per-device field */
+	plist_t request;
+};
+
+static struct tss_template* tss_templates[TSS_TEMPLATE_CACHE_SIZE];
+static int tss_templates_next = 0;
+static thread_once_t tss_templates_once = THREAD_ONCE_INIT;
+static mutex_t tss_templates_lock;
+
+static void tss_templates_init(void)
+{
+	mutex_init(&tss_templates_lock);
+}
+
+void tss_template_free(tss_template_t tmpl)
+{
+	if (!tmpl || __atomic_sub_fetch(&tmpl->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	free(tmpl->build_id);
+	free(tmpl->hardware_model);
+	plist_free(tmpl->parameters);
+	plist_free(tmpl->request);
+	free(tmpl);
+}
+
+static int tss_template_manifest_digest(plist_t build_identity, unsigned char* digest)
+{
+	char* bin = NULL;
+	uint32_t binlen = 0;
+
+	plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+	if (!manifest || plist_get_node_type(manifest) != PLIST_DICT) {
+		error("ERROR: Unable to find Manifest node\n");
+		return -1;
+	}
+	plist_to_bin(manifest, &bin, &binlen);
+	if (!bin) {
+		return -1;
+	}
+	SHA1((const unsigned char*)bin, binlen, digest);
+	free(bin);
+
+	return 0;
+}
+
+/* takes over build_id */
+static struct tss_template* tss_template_new(plist_t build_identity, char* build_id, uint64_t build_id_size, const unsigned char* manifest_digest, const char* hardware_model, int image4)
+{
+	struct tss_template* tmpl = (struct tss_template*)malloc(sizeof(struct tss_template));
+	if (tmpl == NULL) {
+		error("ERROR: Out of memory\n");
+		free(build_id);
+		return NULL;
+	}
+	memset(tmpl, '\0', sizeof(struct tss_template));
+	tmpl->refs = 1;
+	tmpl->image4 = image4;
+	tmpl->hardware_model = strdup(hardware_model);
+
+	tmpl->build_id = (unsigned char*)build_id;
+	tmpl->build_id_size = build_id_size;
+	memcpy(tmpl->manifest_digest, manifest_digest, SHA_DIGEST_LENGTH);
+
+	tmpl->parameters = plist_new_dict();
+	plist_dict_set_item(tmpl->parameters, "ApProductionMode", plist_new_bool(1));
+	if (image4) {
+		plist_dict_set_item(tmpl->parameters, "ApSecurityMode", plist_new_bool(1));
+		plist_dict_set_item(tmpl->parameters, "ApSupportsImg4", plist_new_bool(1));
+	} else {
+		plist_dict_set_item(tmpl->parameters, "ApSupportsImg4", plist_new_bool(0));
+	}
+	if (tss_parameters_add_from_manifest(tmpl->parameters, build_identity) < 0) {
+		tss_template_free(tmpl);
+		return NULL;
+	}
+
+	tmpl->request = plist_new_dict();
+	tss_request_add_build_tags(tmpl->request, tmpl->parameters);
+	if (tss_request_add_ap_tags(tmpl->request, tmpl->parameters, NULL) < 0) {
+		error("ERROR: Unable to add AP tags to TSS request template\n");
+		tss_template_free(tmpl);
+		return NULL;
+	}
+
+	/* the AP entries are evaluated, only keep what baseband requests need */
+	plist_t manifest = plist_new_dict();
+	plist_t node = plist_access_path(tmpl->parameters, 2, "Manifest", "BasebandFirmware");
+	if (node) {
+		plist_dict_set_item(manifest, "BasebandFirmware", plist_copy(node));
+	}
+	plist_dict_set_item(tmpl->parameters, "Manifest", manifest);
+
+	return tmpl;
+}
+
+tss_template_t tss_template_get(plist_t build_identity, const char* hardware_model, int image4)
+{
+	struct tss_template* tmpl = NULL;
+	char* build_id = NULL;
+	uint64_t build_id_size = 0;
+	unsigned char manifest_digest[SHA_DIGEST_LENGTH];
+	int i;
+
+	if (!build_identity || !hardware_model) {
+		return NULL;
+	}
+	if (tss_template_manifest_digest(build_identity, manifest_digest) < 0) {
+		return NULL;
+	}
+
+	plist_t node = plist_dict_get_item(build_identity, "UniqueBuildID");
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		error("ERROR: Unable to find UniqueBuildID node\n");
+		return NULL;
+	}
+	plist_get_data_val(node, &build_id, &build_id_size);
+
+	thread_once(&tss_templates_once, tss_templates_init);
+	mutex_lock(&tss_templates_lock);
+	for (i = 0; i < TSS_TEMPLATE_CACHE_SIZE; i++) {
+		struct tss_template* entry = tss_templates[i];
+		if (entry && entry->image4 == image4 && entry->build_id_size == build_id_size
+		    && memcmp(entry->build_id, build_id, build_id_size) == 0
+		    && memcmp(entry->manifest_digest, manifest_digest, SHA_DIGEST_LENGTH) == 0
+		    && strcasecmp(entry->hardware_model, hardware_model) == 0) {
+			tmpl = entry;
+			break;
+		}
+	}
+	if (tmpl) {
+		debug("DEBUG: Using cached TSS request template for %s\n", hardware_model);
+	} else {
+		// built under the lock so concurrent clients wait for one template
+		tmpl = tss_template_new(build_identity, build_id, build_id_size, manifest_digest, hardware_model, image4);
+		build_id = NULL;
+		if (tmpl) {
+			tss_template_free(tss_templates[tss_templates_next]);
+			tss_templates[tss_templates_next] = tmpl;
+			tss_templates_next = (tss_templates_next + 1) % TSS_TEMPLATE_CACHE_SIZE;
+		}
+	}
+	if (tmpl) {
+		__atomic_add_fetch(&tmpl->refs, 1, __ATOMIC_ACQ_REL);
+	}
+	mutex_unlock(&tss_templates_lock);
+	free(build_id);
+
+	return tmpl;
+}
+
+plist_t tss_template_create_request(tss_template_t tmpl, plist_t parameters, int baseband)
+{
+	if (!tmpl || !parameters) {
+		return NULL;
+	}
+
+	plist_t request = tss_request_new(NULL);
+	plist_dict_merge(&request, tmpl->request);
+
+	/* only ApECID is taken from the device parameters */
+	if (tss_request_add_common_tags(request, parameters, NULL) < 0) {
+		plist_free(request);
+		return NULL;
+	}
+
+	/* the per-device fields on top of the small identity parameters */
+	plist_t merged = plist_copy(tmpl->parameters);
+	plist_dict_merge(&merged, parameters);
+
+	int res;
+	if (tmpl->image4) {
+		res = tss_request_add_ap_img4_tags(request, merged);
+	} else {
+		res = tss_request_add_ap_img3_tags(request, merged);
+	}
+	if (res < 0) {
+		error("ERROR: Unable to add %s tags to TSS request\n", (tmpl->image4) ? "img4" : "img3");
+		plist_free(merged);
+		plist_free(request);
+		return NULL;
+	}
+
+	if (baseband) {
+		tss_request_add_baseband_tags(request, merged, NULL);
+	}
+	plist_free(merged);
+
+	return request;
+}
+
+void tss_template_cache_clear(void)
+{
+	int i;
+
+	thread_once(&tss_templates_once, tss_templates_init);
+	mutex_lock(&tss_templates_lock);
+	for (i = 0; i < TSS_TEMPLATE_CACHE_SIZE; i++) {
+		tss_template_free(tss_templates[i]);
+		tss_templates[i] = NULL;
+	}
+	tss_templates_next = 0;
+	mutex_unlock(&tss_templates_lock);
+}
+
 static size_t tss_write_callback(char* data, size_t size, size_t nmemb, tss_response* response) {
 	size_t total = size * nmemb;
 	if (total != 0) {
@@ -747,6 +979,198 @@ static size_t tss_write_callback(char* data, size_t size, size_t nmemb, tss_resp
 	return total;
 }
 
+#define TSS_NUM_ENDPOINTS 6
+#define TSS_HEDGE_DELAY_MS 1500
+#define TSS_FAILURE_PENALTY 5.0
+
+/* The Apple TSS hosts are raced against each other. Every endpoint keeps a
+ * smoothed latency so the fastest host is started first; connections and TLS
+ * sessions are reused through the handles of the net pool. */
+struct tss_endpoint {
+	const char* url;
+	double latency;
+};
+
+static struct tss_endpoint tss_endpoints[TSS_NUM_ENDPOINTS] = {
+	{ "https://gs.apple.com/TSS/controller?action=2", 0 },
+	{ "https://17.171.36.30/TSS/controller?action=2", 0 },
+	{ "https://17.151.36.30/TSS/controller?action=2", 0 },
+	{ "http://gs.apple.com/TSS/controller?action=2", 0 },
+	{ "http://17.171.36.30/TSS/controller?action=2", 0 },
+	{ "http://17.151.36.30/TSS/controller?action=2", 0 }
+};
+
+static thread_once_t tss_endpoints_once = THREAD_ONCE_INIT;
+static mutex_t tss_endpoints_lock;
+
+struct tss_transfer {
+	struct tss_endpoint* endpoint;
+	const char* url;
+	CURL* handle;
+	tss_response response;
+	char error_message[CURL_ERROR_SIZE];
+	/* MESSAGE= of a failed response, it tells why the server refused */
+	char server_message[256];
+	int status_code;
+};
+
+static void tss_endpoints_init(void)
+{
+	mutex_init(&tss_endpoints_lock);
+}
+
+static uint64_t tss_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* orders the endpoints by their recorded latency, unknown ones keep their
+ * place behind the ones that have answered before */
+static int tss_endpoints_sort(struct tss_endpoint** order)
+{
+	int i, j;
+
+	mutex_lock(&tss_endpoints_lock);
+	for (i = 0; i < TSS_NUM_ENDPOINTS; i++) {
+		struct tss_endpoint* endpoint = &tss_endpoints[i];
+		for (j = i; j > 0; j--) {
+			double prev = order[j-1]->latency;
+			if (endpoint->latency <= 0 || (prev > 0 && prev <= endpoint->latency)) {
+				break;
+			}
+			order[j] = order[j-1];
+		}
+		order[j] = endpoint;
+	}
+	mutex_unlock(&tss_endpoints_lock);
+
+	return TSS_NUM_ENDPOINTS;
+}
+
+static void tss_endpoint_update_latency(struct tss_endpoint* endpoint, double seconds)
+{
+	if (!endpoint) {
+		return;
+	}
+	mutex_lock(&tss_endpoints_lock);
+	if (endpoint->latency <= 0) {
+		endpoint->latency = seconds;
+	} else {
+		endpoint->latency = 0.7 * endpoint->latency + 0.3 * seconds;
+	}
+	mutex_unlock(&tss_endpoints_lock);
+}
+
+static int tss_transfer_start(CURLM* multi, struct tss_transfer* transfer, struct curl_slist* header, const char* request, int attempt)
+{
+	transfer->handle = net_handle_acquire();
+	if (transfer->handle == NULL) {
+		return -1;
+	}
+
+	transfer->response.length = 0;
+	transfer->response.content = malloc(1);
+	if (transfer->response.content == NULL) {
+		error("ERROR: Out of memory\n");
+		net_handle_release(transfer->handle);
+		transfer->handle = NULL;
+		return -1;
+	}
+	transfer->response.content[0] = '\0';
+	transfer->status_code = -1;
+	memset(transfer->error_message, '\0', CURL_ERROR_SIZE);
+	transfer->server_message[0] = '\0';
+
+	/* disable SSL verification to allow download from untrusted https locations */
+	curl_easy_setopt(transfer->handle, CURLOPT_SSL_VERIFYPEER, 0);
+
+	curl_easy_setopt(transfer->handle, CURLOPT_ERRORBUFFER, transfer->error_message);
+	curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, (curl_write_callback)&tss_write_callback);
+	curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, &transfer->response);
+	curl_easy_setopt(transfer->handle, CURLOPT_HTTPHEADER, header);
+	curl_easy_setopt(transfer->handle, CURLOPT_POSTFIELDS, request);
+	curl_easy_setopt(transfer->handle, CURLOPT_USERAGENT, "InetURL/1.0");
+	curl_easy_setopt(transfer->handle, CURLOPT_POSTFIELDSIZE, strlen(request));
+	curl_easy_setopt(transfer->handle, CURLOPT_URL, transfer->url);
+	curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, transfer);
+
+	info("Sending TSS request attempt %d to %s\n", attempt, transfer->url);
+
+	if (curl_multi_add_handle(multi, transfer->handle) != CURLM_OK) {
+		net_handle_release(transfer->handle);
+		transfer->handle = NULL;
+		free(transfer->response.content);
+		transfer->response.content = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tss_transfer_finish(CURLM* multi, struct tss_transfer* transfer)
+{
+	if (!transfer->handle) {
+		return;
+	}
+	// removing a handle that is still busy cancels its transfer
+	curl_multi_remove_handle(multi, transfer->handle);
+	net_handle_release(transfer->handle);
+	transfer->handle = NULL;
+}
+
+/* returns 1 for a successful response, -1 if the server refused the
+ * request for good and 0 if another attempt could still succeed */
+static int tss_transfer_check(struct tss_transfer* transfer)
+{
+	tss_response* response = &transfer->response;
+
+	if (strstr(response->content, "MESSAGE=SUCCESS")) {
+		transfer->status_code = 0;
+		return 1;
+	}
+
+	if (response->length > 0) {
+		error("TSS server returned: %s\n", response->content);
+	}
+
+	char* status = strstr(response->content, "STATUS=");
+	if (status) {
+		sscanf(status+7, "%d&%*s", &transfer->status_code);
+	}
+	char* message = strstr(response->content, "MESSAGE=");
+	if (message) {
+		size_t len = strcspn(message+8, "&\r\n");
+		if (len >= sizeof(transfer->server_message)) {
+			len = sizeof(transfer->server_message) - 1;
+		}
+		memcpy(transfer->server_message, message+8, len);
+		transfer->server_message[len] = '\0';
+	}
+	switch (transfer->status_code) {
+	case -1:
+		// no status code in response. retry
+		error("%s\n", transfer->error_message);
+		return 0;
+	case 8:
+		// server error (invalid bb request?)
+	case 49:
+		// server error (invalid bb data, e.g. BbSNUM?)
+	case 69:
+	case 94:
+		// This device isn't eligible for the requested build.
+	case 100:
+		// server error, most likely the request was malformed
+	case 126:
+		// An internal error occured, most likely the request was malformed
+		return -1;
+	default:
+		error("ERROR: tss_send_request: Unhandled status code %d\n", transfer->status_code);
+		return 0;
+	}
+}
+
 plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 
 	if (idevicerestore_debug) {
@@ -755,130 +1179,161 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 
 	char* request = NULL;
 	int status_code = -1;
-	int retry = 0;
+	int attempt = 0;
 	int max_retries = 15;
+	int num_transfers = 0;
+	int i = 0;
 	unsigned int size = 0;
 	char curl_error_message[CURL_ERROR_SIZE];
-
-	const char* urls[6] = {
-		"https://gs.apple.com/TSS/controller?action=2",
-		"https://17.171.36.30/TSS/controller?action=2",
-		"https://17.151.36.30/TSS/controller?action=2",
-		"http://gs.apple.com/TSS/controller?action=2",
-		"http://17.171.36.30/TSS/controller?action=2",
-		"http://17.151.36.30/TSS/controller?action=2"
-	};
+	char server_message[256];
+	struct tss_endpoint* order[TSS_NUM_ENDPOINTS];
+	struct tss_transfer transfers[TSS_NUM_ENDPOINTS];
+	struct tss_transfer* winner = NULL;
+
+	thread_once(&tss_endpoints_once, tss_endpoints_init);
+
+	// a custom server is used as it is, the Apple servers are raced
+	if (server_url_string) {
+		for (i = 0; i < TSS_NUM_ENDPOINTS; i++) {
+			if (strcmp(server_url_string, tss_endpoints[i].url) == 0) {
+				server_url_string = NULL;
+				break;
+			}
+		}
+	}
 
 	plist_to_xml(tss_request, &request, &size);
 
-	tss_response* response = NULL;
-	memset(curl_error_message, '\0', CURL_ERROR_SIZE);
+	struct curl_slist* header = NULL;
+	header = curl_slist_append(header, "Cache-Control: no-cache");
+	header = curl_slist_append(header, "Content-type: text/xml; charset=\"utf-8\"");
+	header = curl_slist_append(header, "Expect:");
 
-	while (retry++ < max_retries) {
-		response = NULL;
-		CURL* handle = curl_easy_init();
-		if (handle == NULL) {
-			break;
-		}
-		struct curl_slist* header = NULL;
-		header = curl_slist_append(header, "Cache-Control: no-cache");
-		header = curl_slist_append(header, "Content-type: text/xml; charset=\"utf-8\"");
-		header = curl_slist_append(header, "Expect:");
-
-		response = malloc(sizeof(tss_response));
-		if (response == NULL) {
-			fprintf(stderr, "Unable to allocate sufficent memory\n");
-			return NULL;
-		}
-
-		response->length = 0;
-		response->content = malloc(1);
-		response->content[0] = '\0';
-
-		/* disable SSL verification to allow download from untrusted https locations */
-		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
+	memset(curl_error_message, '\0', CURL_ERROR_SIZE);
+	server_message[0] = '\0';
 
-		curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, curl_error_message);
-		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, (curl_write_callback)&tss_write_callback);
-		curl_easy_setopt(handle, CURLOPT_WRITEDATA, response);
-		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, header);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request);
-		curl_easy_setopt(handle, CURLOPT_USERAGENT, "InetURL/1.0");
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, strlen(request));
+	while (attempt < max_retries && !winner && status_code == -1) {
+		memset(transfers, '\0', sizeof(transfers));
 		if (server_url_string) {
-			curl_easy_setopt(handle, CURLOPT_URL, server_url_string);
+			num_transfers = 1;
+			transfers[0].url = server_url_string;
 		} else {
-			int url_index = (retry - 1) % 6;
-			curl_easy_setopt(handle, CURLOPT_URL, urls[url_index]);
-			info("Request URL set to %s\n", urls[url_index]);
+			num_transfers = tss_endpoints_sort(order);
+			for (i = 0; i < num_transfers; i++) {
+				transfers[i].endpoint = order[i];
+				transfers[i].url = order[i]->url;
+			}
 		}
 
-		info("Sending TSS request attempt %d... ", retry);
-
-		curl_easy_perform(handle);
-		curl_slist_free_all(header);
-		curl_easy_cleanup(handle);
-	
-		if (strstr(response->content, "MESSAGE=SUCCESS")) {
-			status_code = 0;
-			info("response successfully received\n");
+		CURLM* multi = curl_multi_init();
+		if (multi == NULL) {
 			break;
 		}
 
-		if (response->length > 0) {
-			error("TSS server returned: %s\n", response->content);
+		int next = 0;
+		int running = 0;
+		int refused = 0;
+		uint64_t last_start = 0;
+		while (!winner && !refused) {
+			// give the running requests a head start before racing the next endpoint against them
+			uint64_t now = tss_time_ms();
+			if (next < num_transfers && attempt < max_retries && (running == 0 || now - last_start >= TSS_HEDGE_DELAY_MS)) {
+				if (tss_transfer_start(multi, &transfers[next], header, request, ++attempt) == 0) {
+					running++;
+				}
+				next++;
+				last_start = now;
+			}
+			if (running == 0) {
+				if (next >= num_transfers || attempt >= max_retries) {
+					break;
+				}
+				continue;
+			}
+
+			int still_running = 0;
+			curl_multi_perform(multi, &still_running);
+
+			CURLMsg* msg = NULL;
+			int msgs_left = 0;
+			while (!winner && !refused && (msg = curl_multi_info_read(multi, &msgs_left))) {
+				if (msg->msg != CURLMSG_DONE) {
+					continue;
+				}
+				struct tss_transfer* transfer = NULL;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+				running--;
+
+				double total_time = 0;
+				curl_easy_getinfo(transfer->handle, CURLINFO_TOTAL_TIME, &total_time);
+				int res = tss_transfer_check(transfer);
+				if (res > 0) {
+					info("response successfully received from %s\n", transfer->url);
+					tss_endpoint_update_latency(transfer->endpoint, total_time);
+					winner = transfer;
+				} else {
+					status_code = transfer->status_code;
+					strcpy(curl_error_message, transfer->error_message);
+					// a later failure without an answer must not hide why the server refused
+					if (transfer->server_message[0]) {
+						strcpy(server_message, transfer->server_message);
+					}
+					if (res < 0) {
+						refused = 1;
+					} else {
+						status_code = -1;
+						tss_endpoint_update_latency(transfer->endpoint, total_time + TSS_FAILURE_PENALTY);
+						// nothing left to wait for from this one, race the next endpoint right away
+						last_start = 0;
+					}
+				}
+				tss_transfer_finish(multi, transfer);
+				if (transfer != winner) {
+					free(transfer->response.content);
+					transfer->response.content = NULL;
+				}
+			}
+
+			if (!winner && !refused && running > 0) {
+				curl_multi_wait(multi, NULL, 0, 100, NULL);
+			}
 		}
 
-		char* status = strstr(response->content, "STATUS=");
-		if (status) {
-			sscanf(status+7, "%d&%*s", &status_code);
+		// cancel the requests that lost the race
+		for (i = 0; i < num_transfers; i++) {
+			if (&transfers[i] == winner) {
+				continue;
+			}
+			tss_transfer_finish(multi, &transfers[i]);
+			free(transfers[i].response.content);
+			transfers[i].response.content = NULL;
 		}
-		if (status_code == -1) {
-			error("%s\n", curl_error_message);
-			// no status code in response. retry
-			free(response->content);
-			free(response);
+		curl_multi_cleanup(multi);
+
+		if (winner) {
+			status_code = 0;
+		} else if (status_code == -1 && attempt < max_retries) {
 			sleep(2);
-			continue;
-		} else if (status_code == 8) {
-			// server error (invalid bb request?)
-			break;
-		} else if (status_code == 49) {
-			// server error (invalid bb data, e.g. BbSNUM?)
-			break;
-		} else if (status_code == 69 || status_code == 94) {
-			// This device isn't eligible for the requested build.
-			break;
-		} else if (status_code == 100) {
-			// server error, most likely the request was malformed
-			break;
-		} else if (status_code == 126) {
-			// An internal error occured, most likely the request was malformed
-			break;
-		} else {
-			error("ERROR: tss_send_request: Unhandled status code %d\n", status_code);
 		}
 	}
+	curl_slist_free_all(header);
 
-	if (status_code != 0) {
-		if (strstr(response->content, "MESSAGE=") != NULL) {
-			char* message = strstr(response->content, "MESSAGE=") + strlen("MESSAGE=");
-			error("ERROR: TSS request failed (status=%d, message=%s)\n", status_code, message);
+	if (!winner) {
+		if (server_message[0]) {
+			error("ERROR: TSS request failed: %s (status=%d, message=%s)\n", curl_error_message, status_code, server_message);
 		} else {
 			error("ERROR: TSS request failed: %s (status=%d)\n", curl_error_message, status_code);
 		}
 		free(request);
-		free(response->content);
-		free(response);
 		return NULL;
 	}
 
+	tss_response* response = &winner->response;
 	char* tss_data = strstr(response->content, "<?xml");
 	if (tss_data == NULL) {
 		error("ERROR: Incorrectly formatted TSS response\n");
 		free(request);
 		free(response->content);
-		free(response);
 		return NULL;
 	}
 
@@ -887,7 +1342,6 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 	tss_size = (uint32_t)(response->length - (tss_data - response->content));
 	plist_from_xml(tss_data, tss_size, &tss_response);
 	free(response->content);
-	free(response);
 
 	if (idevicerestore_debug) {
 		debug_plist(tss_response);
@@ -898,6 +1352,62 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 	return tss_response;
 }
 
+struct tss_pending {
+	thread_t thread;
+	plist_t request;
+	char* server_url;
+	plist_t response;
+};
+
+static void* tss_pending_thread(void* data)
+{
+	struct tss_pending* pending = (struct tss_pending*)data;
+	pending->response = tss_request_send(pending->request, pending->server_url);
+	return NULL;
+}
+
+tss_pending_t tss_request_send_async(plist_t request, const char* server_url_string) {
+	struct tss_pending* pending = (struct tss_pending*)malloc(sizeof(struct tss_pending));
+	if (pending == NULL) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(pending, '\0', sizeof(struct tss_pending));
+
+	pending->request = plist_copy(request);
+	if (server_url_string) {
+		pending->server_url = strdup(server_url_string);
+	}
+
+	if (thread_new(&pending->thread, tss_pending_thread, pending) != 0) {
+		error("ERROR: Unable to start TSS request thread\n");
+		plist_free(pending->request);
+		free(pending->server_url);
+		free(pending);
+		return NULL;
+	}
+
+	return pending;
+}
+
+plist_t tss_request_wait(tss_pending_t pending) {
+	plist_t response = NULL;
+
+	if (pending == NULL) {
+		return NULL;
+	}
+
+	thread_join(pending->thread);
+	thread_free(pending->thread);
+
+	response = pending->response;
+	plist_free(pending->request);
+	free(pending->server_url);
+	free(pending);
+
+	return response;
+}
+
 static int tss_response_get_data_by_key(plist_t response, const char* name, unsigned char** buffer, unsigned int* length) {
 
 	plist_t node = plist_dict_get_item(response, name);
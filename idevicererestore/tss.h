@@ -44,9 +44,25 @@ int tss_request_add_se_tags(plist_t request, plist_t parameters, plist_t overrid
 int tss_request_add_ap_img4_tags(plist_t request, plist_t parameters);
 int tss_request_add_ap_img3_tags(plist_t request, plist_t parameters);
 
+/* Request templates compiled once per build identity and hardware model,
+ * holding everything that is the same for every device so only ApECID,
+ * the nonces and the baseband fields are added per request. Templates are
+ * cached until tss_template_cache_clear() and reference counted. */
+typedef struct tss_template* tss_template_t;
+tss_template_t tss_template_get(plist_t build_identity, const char* hardware_model, int image4);
+void tss_template_free(tss_template_t tmpl);
+plist_t tss_template_create_request(tss_template_t tmpl, plist_t parameters, int baseband);
+void tss_template_cache_clear(void);
+
 /* i/o */
 plist_t tss_request_send(plist_t request, const char* server_url_string);
 
+/* sends a copy of the request from a worker thread, the response is picked
+ * up with tss_request_wait() which also releases the pending request */
+typedef struct tss_pending* tss_pending_t;
+tss_pending_t tss_request_send_async(plist_t request, const char* server_url_string);
+plist_t tss_request_wait(tss_pending_t pending);
+
 /* response */
 int tss_response_get_ap_img4_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
 int tss_response_get_ap_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
@@ -0,0 +1,381 @@
+/*
+ * verify.c
+ * Pre-flight check of the firmware components against their manifest digests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "verify.h"
+#include "thread.h"
+#include "trace.h"
+#include "common.h"
+#include "ipsw.h"
+
+/* reading the IPSW is the limit past this */
+#define VERIFY_MAX_WORKERS 8
+#define VERIFY_BUFSIZE 0x100000
+/* Image3 digests leave out the magic and the two size fields, which
+ * change when the image is personalized */
+#define VERIFY_IMAGE3_SKIP 0xC
+
+struct verify_entry {
+	char* component;
+	char* path;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	uint64_t size;
+};
+
+struct component_verify {
+	struct idevicerestore_client_t* client;
+	ipsw_archive* archive;
+	char* ipsw;
+	struct verify_entry* entries;
+	int num_entries;
+	/* next entry to hand to a worker */
+	int next;
+	int checked;
+	uint64_t checked_bytes;
+	int failed;
+	int abort;
+	mutex_t lock;
+	thread_t workers[VERIFY_MAX_WORKERS];
+	int num_workers;
+};
+
+static int verify_num_cpus(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+#endif
+}
+
+static int verify_stopped(struct component_verify* verify)
+{
+	return __atomic_load_n(&verify->abort, __ATOMIC_ACQUIRE) || __atomic_load_n(&verify->failed, __ATOMIC_ACQUIRE);
+}
+
+static int verify_entry(struct component_verify* verify, ipsw_archive* archive, struct verify_entry* entry, unsigned char* buffer)
+{
+	EVP_MD_CTX* fullctx = NULL;
+	EVP_MD_CTX* bodyctx = NULL;
+	unsigned char full[SHA_DIGEST_LENGTH];
+	unsigned char body[SHA_DIGEST_LENGTH];
+	uint64_t total = 0;
+
+	fullctx = EVP_MD_CTX_new();
+	bodyctx = EVP_MD_CTX_new();
+	if (fullctx == NULL || bodyctx == NULL
+	    || EVP_DigestInit_ex(fullctx, EVP_sha1(), NULL) != 1 || EVP_DigestInit_ex(bodyctx, EVP_sha1(), NULL) != 1) {
+		error("ERROR: Unable to set up SHA1 to verify %s\n", entry->path);
+		EVP_MD_CTX_free(fullctx);
+		EVP_MD_CTX_free(bodyctx);
+		return -1;
+	}
+
+	ipsw_file_handle_t handle = ipsw_file_open(archive, entry->path);
+	if (handle == NULL) {
+		error("ERROR: Unable to open %s to verify it\n", entry->path);
+		EVP_MD_CTX_free(fullctx);
+		EVP_MD_CTX_free(bodyctx);
+		return -1;
+	}
+	int span = trace_begin(verify->client->trace, "verify", entry->component);
+	uint64_t size = ipsw_file_size(handle);
+
+	/* hash both ways in one pass, the manifest digest of anything but an
+	 * Image3 covers the whole file */
+	while (total < size && !verify_stopped(verify)) {
+		int64_t count = ipsw_file_read(handle, buffer, VERIFY_BUFSIZE);
+		if (count <= 0) {
+			break;
+		}
+		EVP_DigestUpdate(fullctx, buffer, (size_t)count);
+		if (total + count > VERIFY_IMAGE3_SKIP) {
+			uint64_t skip = (total < VERIFY_IMAGE3_SKIP) ? VERIFY_IMAGE3_SKIP - total : 0;
+			EVP_DigestUpdate(bodyctx, buffer + skip, (size_t)(count - skip));
+		}
+		total += count;
+	}
+	EVP_DigestFinal_ex(fullctx, full, NULL);
+	EVP_DigestFinal_ex(bodyctx, body, NULL);
+	EVP_MD_CTX_free(fullctx);
+	EVP_MD_CTX_free(bodyctx);
+	ipsw_file_close(handle);
+
+	if (total != size) {
+		trace_end(verify->client->trace, span, total, -1);
+		if (!verify_stopped(verify)) {
+			error("ERROR: Unable to read %s\n", entry->path);
+		}
+		return -1;
+	}
+
+	int res = (memcmp(full, entry->digest, SHA_DIGEST_LENGTH) == 0 || memcmp(body, entry->digest, SHA_DIGEST_LENGTH) == 0) ? 0 : -1;
+	trace_end(verify->client->trace, span, total, res);
+	if (res < 0) {
+		error("ERROR: %s (%s) does not match its digest in the BuildManifest\n", entry->component, entry->path);
+	} else {
+		debug("Verified %s (%s)\n", entry->component, entry->path);
+	}
+
+	return res;
+}
+
+static void* verify_worker(void* arg)
+{
+	struct component_verify* verify = (struct component_verify*)arg;
+
+	// a zip handle of its own, every block inflated through the shared one takes its lock
+	ipsw_archive* archive = ipsw_open(verify->ipsw);
+	if (archive == NULL) {
+		archive = ipsw_archive_ref(verify->archive);
+	}
+	unsigned char* buffer = (unsigned char*)malloc(VERIFY_BUFSIZE);
+	if (buffer == NULL) {
+		error("ERROR: Out of memory\n");
+	}
+
+	mutex_lock(&verify->lock);
+	while (buffer && !verify->failed && !verify->abort && verify->next < verify->num_entries) {
+		struct verify_entry* entry = &verify->entries[verify->next++];
+		mutex_unlock(&verify->lock);
+
+		int res = verify_entry(verify, archive, entry, buffer);
+
+		mutex_lock(&verify->lock);
+		if (res == 0) {
+			verify->checked++;
+			verify->checked_bytes += entry->size;
+		} else {
+			__atomic_store_n(&verify->failed, 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (buffer == NULL) {
+		__atomic_store_n(&verify->failed, 1, __ATOMIC_RELEASE);
+	}
+	mutex_unlock(&verify->lock);
+
+	free(buffer);
+	ipsw_close(archive);
+
+	return NULL;
+}
+
+/* biggest first, so the last ones to finish are small */
+static int verify_entry_compare(const void* a, const void* b)
+{
+	const struct verify_entry* ea = (const struct verify_entry*)a;
+	const struct verify_entry* eb = (const struct verify_entry*)b;
+	if (ea->size != eb->size) {
+		return (ea->size > eb->size) ? -1 : 1;
+	}
+	return strcmp(ea->component, eb->component);
+}
+
+static int verify_add_entry(struct component_verify* verify, const char* component, plist_t node)
+{
+	char* path = NULL;
+	char* digest = NULL;
+	uint64_t digest_size = 0;
+	off_t size = 0;
+	int i;
+
+	plist_t path_node = plist_access_path(node, 2, "Info", "Path");
+	plist_t digest_node = plist_dict_get_item(node, "Digest");
+	if (!path_node || plist_get_node_type(path_node) != PLIST_STRING || !digest_node || plist_get_node_type(digest_node) != PLIST_DATA) {
+		return 0;
+	}
+	plist_get_data_val(digest_node, &digest, &digest_size);
+	if (!digest || digest_size != SHA_DIGEST_LENGTH) {
+		debug("NOTE: Not verifying %s, its digest is not a SHA1\n", component);
+		free(digest);
+		return 0;
+	}
+	// a digest of zeroes means none is known
+	for (i = 0; i < SHA_DIGEST_LENGTH && digest[i] == 0; i++);
+	if (i == SHA_DIGEST_LENGTH) {
+		free(digest);
+		return 0;
+	}
+
+	plist_get_string_val(path_node, &path);
+	if (!path || ipsw_archive_file_exists(verify->archive, path) != 0 || ipsw_archive_get_file_size(verify->archive, path, &size) < 0) {
+		debug("NOTE: Not verifying %s, it is not in the IPSW\n", component);
+		free(path);
+		free(digest);
+		return 0;
+	}
+
+	// several components can name the same file
+	for (i = 0; i < verify->num_entries; i++) {
+		if (!strcmp(verify->entries[i].path, path) && !memcmp(verify->entries[i].digest, digest, SHA_DIGEST_LENGTH)) {
+			free(path);
+			free(digest);
+			return 0;
+		}
+	}
+
+	struct verify_entry* entries = (struct verify_entry*)realloc(verify->entries, (verify->num_entries + 1) * sizeof(struct verify_entry));
+	if (!entries) {
+		error("ERROR: Out of memory\n");
+		free(path);
+		free(digest);
+		return -1;
+	}
+	verify->entries = entries;
+	struct verify_entry* entry = &verify->entries[verify->num_entries++];
+	entry->component = strdup(component);
+	entry->path = path;
+	memcpy(entry->digest, digest, SHA_DIGEST_LENGTH);
+	entry->size = (uint64_t)size;
+	free(digest);
+
+	return 0;
+}
+
+static void verify_join(struct component_verify* verify)
+{
+	while (verify->num_workers > 0) {
+		verify->num_workers--;
+		thread_join(verify->workers[verify->num_workers]);
+		thread_free(verify->workers[verify->num_workers]);
+	}
+}
+
+struct component_verify* component_verify_start(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	uint64_t total = 0;
+	int i;
+
+	if (!client || !build_identity || !client->archive || !client->ipsw) {
+		return NULL;
+	}
+	plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+	if (!manifest || plist_get_node_type(manifest) != PLIST_DICT) {
+		return NULL;
+	}
+
+	struct component_verify* verify = (struct component_verify*)malloc(sizeof(struct component_verify));
+	if (!verify) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(verify, '\0', sizeof(struct component_verify));
+	verify->client = client;
+	verify->archive = ipsw_archive_ref(client->archive);
+	verify->ipsw = strdup(client->ipsw);
+	mutex_init(&verify->lock);
+
+	plist_dict_iter iter = NULL;
+	char* key = NULL;
+	plist_t node = NULL;
+	plist_dict_new_iter(manifest, &iter);
+	do {
+		key = NULL;
+		plist_dict_next_item(manifest, iter, &key, &node);
+		if (key) {
+			int res = verify_add_entry(verify, key, node);
+			free(key);
+			if (res < 0) {
+				free(iter);
+				component_verify_free(verify);
+				return NULL;
+			}
+		}
+	} while (key);
+	free(iter);
+
+	if (verify->num_entries == 0) {
+		component_verify_free(verify);
+		return NULL;
+	}
+	qsort(verify->entries, verify->num_entries, sizeof(struct verify_entry), verify_entry_compare);
+	for (i = 0; i < verify->num_entries; i++) {
+		total += verify->entries[i].size;
+	}
+
+	int num_workers = verify_num_cpus();
+	if (num_workers > VERIFY_MAX_WORKERS) {
+		num_workers = VERIFY_MAX_WORKERS;
+	}
+	if (num_workers > verify->num_entries) {
+		num_workers = verify->num_entries;
+	}
+	while (verify->num_workers < num_workers) {
+		if (thread_new(&verify->workers[verify->num_workers], verify_worker, verify) != 0) {
+			break;
+		}
+		verify->num_workers++;
+	}
+	info("Verifying %d components (%llu KB) against the BuildManifest\n", verify->num_entries, (unsigned long long)(total / 1024));
+	if (verify->num_workers == 0) {
+		// no threads, so check everything on this one
+		verify_worker(verify);
+	}
+
+	return verify;
+}
+
+int component_verify_finish(struct component_verify* verify)
+{
+	if (!verify) {
+		return 0;
+	}
+
+	verify_join(verify);
+	int res = (verify->failed || verify->checked < verify->num_entries) ? -1 : 0;
+	if (res == 0) {
+		info("Verified %d components (%llu KB)\n", verify->checked, (unsigned long long)(verify->checked_bytes / 1024));
+	}
+	component_verify_free(verify);
+
+	return res;
+}
+
+void component_verify_free(struct component_verify* verify)
+{
+	int i;
+
+	if (!verify) {
+		return;
+	}
+
+	__atomic_store_n(&verify->abort, 1, __ATOMIC_RELEASE);
+	verify_join(verify);
+
+	for (i = 0; i < verify->num_entries; i++) {
+		free(verify->entries[i].component);
+		free(verify->entries[i].path);
+	}
+	free(verify->entries);
+	ipsw_close(verify->archive);
+	free(verify->ipsw);
+	mutex_destroy(&verify->lock);
+	free(verify);
+}
@@ -0,0 +1,51 @@
+/*
+ * verify.h
+ * Pre-flight check of the firmware components against their manifest digests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_VERIFY_H
+#define IDEVICERESTORE_VERIFY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+struct idevicerestore_client_t;
+struct component_verify;
+
+/* Hashes every component of build_identity that has a path and a Digest
+ * in the BuildManifest, streamed from the IPSW on one thread per core,
+ * while the filesystem is prepared and before the device is touched. The
+ * check works on its own copy of what it needs from the build identity,
+ * without threads it is done before this returns. Returns NULL if there
+ * is nothing to check. */
+struct component_verify* component_verify_start(struct idevicerestore_client_t* client, plist_t build_identity);
+
+/* Waits for the check and frees it. Returns 0 if every digest matched, a
+ * NULL check counts as passed, and -1 as soon as one did not. */
+int component_verify_finish(struct component_verify* verify);
+
+/* stops the check without waiting for its result */
+void component_verify_free(struct component_verify* verify);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif